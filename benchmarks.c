@@ -0,0 +1,1539 @@
+/* Archives are searched with memmem() */
+#define _GNU_SOURCE
+#define TOILETLINE_IMPLEMENTATION
+/* Large enough for megabyte lines */
+#define TL_LINE_MAX_SIZE (2 * 1024 * 1024)
+/* Large enough for a long-lived shell history */
+#define TL_HISTORY_MAX_SIZE (1 << 17)
+/* Archives are parsed on up to this many threads */
+#define TL_HISTORY_THREADS 8
+#include "toiletline.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_PRINTF(...)                                                      \
+  do {                                                                         \
+    fputs(__func__, stdout);                                                   \
+    printf(": "__VA_ARGS__);                                                   \
+  } while (0)
+
+#define countof(a) (sizeof(a) / sizeof((a)[0]))
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* Replaces stdin with a pipe that contains `size` bytes of `data`. */
+static bool
+pipe_into_stdin(const char *data, size_t size)
+{
+  int fds[2];
+
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  if (write(fds[1], data, size) != (ssize_t) size) {
+    return false;
+  }
+
+  close(fds[1]);
+  dup2(fds[0], STDIN_FILENO);
+  close(fds[0]);
+
+  return true;
+}
+
+static char paste[16 * 1024];
+
+static char out_buffer[ITL_STRING_MAX_LEN];
+
+/* Replaces stdin with a pipe, and writes `size` bytes of a paste into it. */
+static bool
+pipe_paste_into_stdin(size_t size)
+{
+  size_t i;
+
+  if (size > sizeof(paste)) {
+    return false;
+  }
+
+  for (i = 0; i < size; ++i) {
+    paste[i] = (char) ('a' + i % 26);
+  }
+
+  return pipe_into_stdin(paste, size);
+}
+
+/* Terminal output is not what is measured. Returns fd of the original stdout,
+   or -1. */
+static int
+silence_stdout(void)
+{
+  int null_fd, stdout_fd;
+
+  fflush(stdout);
+  stdout_fd = dup(STDOUT_FILENO);
+  null_fd = open("/dev/null", O_WRONLY);
+  if (stdout_fd < 0 || null_fd < 0) {
+    return -1;
+  }
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+
+  return stdout_fd;
+}
+
+static void
+restore_stdout(int stdout_fd)
+{
+  dup2(stdout_fd, STDOUT_FILENO);
+  close(stdout_fd);
+}
+
+static bool
+bench_input_syscalls(void)
+{
+  size_t  i, k, syscalls_before, syscalls_after;
+  uint8_t byte = 0;
+
+  const size_t paste_sizes[] = {1024, 2 * 1024, 10 * 1024};
+
+  for (i = 0; i < countof(paste_sizes); ++i) {
+    /* What `ITL_READ_BYTE_RAW()` did before: one `read()` per byte. */
+    if (!pipe_paste_into_stdin(paste_sizes[i])) {
+      return false;
+    }
+    syscalls_before = 0;
+    while (read(STDIN_FILENO, &byte, 1) == 1) {
+      syscalls_before += 1;
+    }
+
+    /* Buffered reader. */
+    if (!pipe_paste_into_stdin(paste_sizes[i])) {
+      return false;
+    }
+    syscalls_after = 0;
+    for (k = 0; k < paste_sizes[i]; ++k) {
+      if (ITL_INPUT_BUF_PENDING(&itl_g_input_buf) == 0) {
+        if (itl_input_buf_fill(&itl_g_input_buf) <= 0) {
+          return false;
+        }
+        syscalls_after += 1;
+      }
+      ITL_READ_BYTE(&byte);
+    }
+
+    BENCH_PRINTF("paste of %5zu bytes: %5zu -> %zu read() calls, "
+                 "%.1f -> %.2f per KB\n",
+                 paste_sizes[i], syscalls_before, syscalls_after,
+                 (double) syscalls_before * 1024 / (double) paste_sizes[i],
+                 (double) syscalls_after * 1024 / (double) paste_sizes[i]);
+  }
+
+  return true;
+}
+
+static bool
+bench_paste(void)
+{
+  int      stdout_fd;
+  size_t   i, k, paste_size;
+  double    start, per_key, bracketed;
+  itl_key_t key;
+  itl_le_t  le;
+
+  const size_t paste_sizes[] = {1024, 2 * 1024, 4 * 1024 - 8};
+
+  itl_string_init(&itl_g_line_buffer);
+  itl_char_buf_init(&itl_g_char_buffer);
+
+  for (i = 0; i < countof(paste_sizes); ++i) {
+    paste_size = paste_sizes[i];
+
+    /* Every byte goes through parse, insert and refresh. */
+    if (!pipe_paste_into_stdin(paste_size) ||
+        (stdout_fd = silence_stdout()) < 0)
+    {
+      return false;
+    }
+    itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+    start = now_seconds();
+    for (k = 0; k < paste_size; ++k) {
+      itl_read_key(&key);
+      if (key.key == TL_KEY_CHAR) {
+        itl_le_insert(&le, key.ch);
+      }
+      itl_le_tty_refresh(&le);
+    }
+    per_key = now_seconds() - start;
+    restore_stdout(stdout_fd);
+    itl_le_clear_line(&le);
+
+    /* Bracketed paste. */
+    memmove(paste + 6, paste, paste_size);
+    memcpy(paste, "\x1b[200~", 6);
+    memcpy(paste + 6 + paste_size, "\x1b[201~", 6);
+    if (!pipe_into_stdin(paste, paste_size + 12) ||
+        (stdout_fd = silence_stdout()) < 0)
+    {
+      return false;
+    }
+    itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+    start = now_seconds();
+    if (!itl_read_key(&key) || key.key != TL_KEY_PASTE) {
+      restore_stdout(stdout_fd);
+      return false;
+    }
+    itl_le_key_handle(&le, key.key);
+    itl_le_tty_refresh(&le);
+    bracketed = now_seconds() - start;
+    restore_stdout(stdout_fd);
+
+    if (le.line->length != paste_size) {
+      BENCH_PRINTF("pasted %zu chars, should be %zu\n", le.line->length,
+                   paste_size);
+      return false;
+    }
+    itl_le_clear_line(&le);
+
+    BENCH_PRINTF("paste of %4zu bytes: per key %8.3fms, bracketed %.3fms\n",
+                 paste_size, per_key * 1e3, bracketed * 1e3);
+  }
+
+  ITL_FREE(itl_g_line_buffer.data);
+  ITL_FREE(itl_g_char_buffer.data);
+  ITL_FREE(itl_g_decoder.paste.data);
+  itl_g_decoder.paste.data = NULL;
+
+  return true;
+}
+
+static bool
+bench_midline_typing(void)
+{
+  size_t   i, k, line_length;
+  double   start, elapsed;
+  itl_le_t le;
+
+  const size_t     line_lengths[] = {100, 1000, 4000};
+  const size_t     keys = 100000;
+  const itl_utf8_t ch = {{'x'}, 1};
+
+  itl_string_init(&itl_g_line_buffer);
+
+  for (i = 0; i < countof(line_lengths); ++i) {
+    line_length = line_lengths[i];
+
+    itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+    for (k = 0; k < line_length; ++k) {
+      itl_le_insert(&le, ch);
+    }
+    itl_le_move_left(&le, line_length / 2);
+
+    /* Type a character and erase it, in the middle of the line */
+    start = now_seconds();
+    for (k = 0; k < keys; ++k) {
+      itl_le_insert(&le, ch);
+      ITL_LE_ERASE_BACKWARD(&le, 1);
+    }
+    elapsed = now_seconds() - start;
+
+    BENCH_PRINTF("line of %4zu chars: %6.1fns per key\n", line_length,
+                 elapsed * 1e9 / (double) (keys * 2));
+    itl_le_clear_line(&le);
+  }
+
+  ITL_FREE(itl_g_line_buffer.data);
+
+  return true;
+}
+
+static bool
+bench_large_lines(void)
+{
+  int      fd;
+  size_t   i, k, size;
+  double   start, paste_time, typing_time, jump_time, history_time;
+  char    *text;
+  itl_le_t le;
+  char     history_path[] = "/tmp/toiletline_history_XXXXXX";
+
+  const size_t     sizes[] = {64 * 1024, 256 * 1024, 1024 * 1024};
+  const size_t     keys = 10000, jumps = 100;
+  const itl_utf8_t ch = {{'x'}, 1};
+
+  /* Something that looks like generated JSON */
+  text = (char *) malloc(sizes[countof(sizes) - 1]);
+  for (i = 0, k = 0; i < sizes[countof(sizes) - 1]; ++i, ++k) {
+    const char record[] = "{\"id\": 1234, \"name\": \"Иван\", \"ok\": true}, ";
+    if (k == sizeof(record) - 1) {
+      k = 0;
+    }
+    text[i] = record[k];
+  }
+
+  if ((fd = mkstemp(history_path)) < 0) {
+    free(text);
+    return false;
+  }
+  close(fd);
+
+  itl_string_init(&itl_g_line_buffer);
+  itl_g_is_active = true;
+
+  for (i = 0; i < countof(sizes); ++i) {
+    /* Don't cut a character in half */
+    size = sizes[i];
+    while ((text[size - 1] & 0x80) != 0) {
+      size -= 1;
+    }
+
+    itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+
+    start = now_seconds();
+    itl_le_paste(&le, text, size);
+    paste_time = now_seconds() - start;
+
+    /* Type in the middle */
+    itl_le_move_left(&le, le.line->length / 2);
+    start = now_seconds();
+    for (k = 0; k < keys; ++k) {
+      itl_le_insert(&le, ch);
+    }
+    typing_time = now_seconds() - start;
+
+    /* Home and End, typing after each jump */
+    start = now_seconds();
+    for (k = 0; k < jumps; ++k) {
+      le.cursor_position = (k % 2 == 0) ? 0 : le.line->length;
+      itl_le_insert(&le, ch);
+    }
+    jump_time = now_seconds() - start;
+
+    /* Save and load it back */
+    start = now_seconds();
+    itl_g_history_append(le.line);
+    if (itl_history_dump_to_file(history_path) != TL_SUCCESS ||
+        itl_history_load_from_file(history_path) != TL_SUCCESS ||
+        itl_g_history.length != 1 ||
+        !itl_g_history_equal(ITL_HISTORY_LAST(), le.line))
+    {
+      BENCH_PRINTF("line of %zu bytes did not survive history\n",
+                   le.line->size);
+      break;
+    }
+    history_time = now_seconds() - start;
+
+    BENCH_PRINTF("line of %7zu bytes: paste %7.3fms, typing %5.1fns per key, "
+                 "jump %7.1fus, history round trip %7.3fms\n",
+                 le.line->size, paste_time * 1e3,
+                 typing_time * 1e9 / (double) keys,
+                 jump_time * 1e6 / (double) jumps, history_time * 1e3);
+
+    itl_g_history_free();
+    itl_le_clear_line(&le);
+  }
+
+  itl_g_is_active = false;
+  itl_g_history_free();
+  ITL_FREE(itl_g_line_buffer.data);
+  unlink(history_path);
+  free(text);
+
+  return i == countof(sizes);
+}
+
+static bool
+bench_decoder(void)
+{
+  size_t        i, k, input_size, key_count = 0;
+  double        start, elapsed;
+  itl_key_t     key;
+  itl_decoder_t d = ITL_ZERO_INIT;
+
+  /* Typing, arrows with modifiers, unknown sequences and multibyte text */
+  const char input[] = "ls -la\x1b[D\x1b[1;5C\x1b[3~\x1bOH\x1b[?1;2c"
+                       "привет\x1b" "b\x7f";
+  const size_t rounds = 200000;
+
+  input_size = sizeof(input) - 1;
+
+  start = now_seconds();
+  for (i = 0; i < rounds; ++i) {
+    for (k = 0; k < input_size; ++k) {
+      itl_decoder_feed(&d, (uint8_t) input[k]);
+      while (itl_decoder_pop(&d, &key)) {
+        key_count += 1;
+      }
+    }
+  }
+  elapsed = now_seconds() - start;
+
+  BENCH_PRINTF("%zu bytes, %zu keys, %.2fns per byte\n", input_size * rounds,
+               key_count, elapsed * 1e9 / (double) (input_size * rounds));
+
+  return true;
+}
+
+static bool
+bench_history_jumps(void)
+{
+  size_t   i;
+  double   start, elapsed;
+  itl_le_t le;
+
+  const size_t jumps = 100000;
+
+  itl_string_init(&itl_g_line_buffer);
+  itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+
+  /* Fill the whole history with long commands */
+  for (i = 0; i < TL_HISTORY_MAX_SIZE; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer),
+             "cc -O2 -Wall -Wextra -o build/%zu src/%zu.c -lm -lpthread", i, i);
+    ITL_STRING_FROM_CSTR(le.line, out_buffer);
+    itl_g_history_append(le.line);
+  }
+
+  start = now_seconds();
+  for (i = 0; i < jumps; ++i) {
+    itl_le_key_handle(&le, (i % 2 == 0) ? TL_KEY_HISTORY_BEGINNING
+                                        : TL_KEY_HISTORY_END);
+  }
+  elapsed = now_seconds() - start;
+
+  BENCH_PRINTF("%d entries: %.1fns per jump to either end\n",
+               TL_HISTORY_MAX_SIZE, elapsed * 1e9 / (double) jumps);
+
+  itl_g_history_free();
+  ITL_FREE(itl_g_line_buffer.data);
+
+  return true;
+}
+
+static bool
+bench_history_load(void)
+{
+  size_t i, alloc_count;
+  double start, load_time, free_time, megabytes;
+  FILE  *file;
+  int    fd;
+  char   history_path[] = "/tmp/toiletline_history_XXXXXX";
+
+  const size_t entries = 1000000;
+
+  if ((fd = mkstemp(history_path)) < 0 ||
+      (file = fdopen(fd, "w")) == NULL)
+  {
+    return false;
+  }
+  for (i = 0; i < entries; ++i) {
+    fprintf(file, "git commit -m 'change number %zu' && echo готово\n", i);
+  }
+  megabytes = (double) ftell(file) / (1024 * 1024);
+  fclose(file);
+
+  itl_g_is_active = true;
+  tl_history_set_limits(entries, 0);
+  alloc_count = itl_g_alloc_count;
+
+  start = now_seconds();
+  if (itl_history_load_from_file(history_path) != TL_SUCCESS ||
+      tl_history_length() != entries)
+  {
+    BENCH_PRINTF("loaded %zu lines, should be: %zu\n", tl_history_length(),
+                 entries);
+    tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+    itl_g_is_active = false;
+    unlink(history_path);
+    return false;
+  }
+  load_time = now_seconds() - start;
+
+  BENCH_PRINTF("%zu lines, %.1f MB: load %.3fms, %zu allocations held\n",
+               entries, megabytes, load_time * 1e3,
+               itl_g_alloc_count - alloc_count);
+
+  start = now_seconds();
+  itl_g_history_free();
+  free_time = now_seconds() - start;
+
+  BENCH_PRINTF("%zu lines: free %.3fus\n", entries, free_time * 1e6);
+
+  /* With the default limits, only the end of the file is read */
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  start = now_seconds();
+  if (itl_history_load_from_file(history_path) != TL_SUCCESS) {
+    itl_g_is_active = false;
+    unlink(history_path);
+    return false;
+  }
+  load_time = now_seconds() - start;
+
+  BENCH_PRINTF("%.1f MB, keeping %zu lines: load %.3fms\n", megabytes,
+               tl_history_length(), load_time * 1e3);
+
+  itl_g_history_free();
+  itl_g_is_active = false;
+  unlink(history_path);
+
+  return true;
+}
+
+static bool
+bench_history_archive(void)
+{
+  size_t k, lines;
+  double start, elapsed, megabytes, single = 0;
+  FILE  *file;
+  int    fd;
+  bool   result = true;
+  char   history_path[] = "/tmp/toiletline_history_XXXXXX";
+
+  const size_t size = (size_t) 1 << 30;
+  const size_t threads[] = {1, 2, 4, 8};
+
+  if ((fd = mkstemp(history_path)) < 0 ||
+      (file = fdopen(fd, "w")) == NULL)
+  {
+    return false;
+  }
+  for (lines = 0; (size_t) ftell(file) < size; ++lines) {
+    fprintf(file, "git commit -m 'change number %zu' && echo готово\n", lines);
+  }
+  megabytes = (double) ftell(file) / (1024 * 1024);
+  fclose(file);
+
+  itl_g_is_active = true;
+  tl_history_set_limits(lines, 0);
+
+  /* An unbounded archive is parsed whole */
+  for (k = 0; k < countof(threads); ++k) {
+    itl_g_history_threads = threads[k];
+
+    start = now_seconds();
+    if (itl_history_load_from_file(history_path) != TL_SUCCESS ||
+        tl_history_length() != lines)
+    {
+      BENCH_PRINTF("loaded %zu lines, should be: %zu\n", tl_history_length(),
+                   lines);
+      result = false;
+      break;
+    }
+    elapsed = now_seconds() - start;
+    if (k == 0) {
+      single = elapsed;
+    }
+
+    BENCH_PRINTF("%.1f MB on %zu threads: load %.3fs, %.2fx\n", megabytes,
+                 threads[k], elapsed, single / elapsed);
+    itl_g_history_free();
+  }
+
+  itl_g_history_threads = TL_HISTORY_THREADS;
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_g_history_free();
+  itl_g_is_active = false;
+  unlink(history_path);
+
+  return result;
+}
+
+static bool
+bench_history_open(void)
+{
+  size_t i, k;
+  double start, elapsed;
+  int    fd;
+  char   history_path[] = "/tmp/toiletline_history_XXXXXX";
+
+  const size_t lines = 20000;
+  const size_t syncs[] = {0, 100, 1};
+  const char  *labels[] = {"never synced", "synced every 100 lines",
+                           "synced every line"};
+
+  if ((fd = mkstemp(history_path)) < 0) {
+    return false;
+  }
+  close(fd);
+
+  itl_g_is_active = true;
+  itl_string_init(&itl_g_line_buffer);
+
+  /* Every entered line is written and sometimes synced, and the file is
+     compacted from time to time */
+  for (k = 0; k < countof(syncs); ++k) {
+    tl_history_set_sync(syncs[k]);
+    if (tl_history_open(history_path) != TL_SUCCESS) {
+      break;
+    }
+
+    start = now_seconds();
+    for (i = 0; i < lines / (syncs[k] == 1 ? 10 : 1); ++i) {
+      snprintf(out_buffer, sizeof(out_buffer),
+               "./deploy %zu --env=stage-%zu --verbose", i, i % 1000);
+      ITL_STRING_FROM_CSTR(&itl_g_line_buffer, out_buffer);
+      itl_g_history_append(&itl_g_line_buffer);
+      itl_history_file_append(&itl_g_line_buffer);
+    }
+    elapsed = now_seconds() - start;
+
+    BENCH_PRINTF("%s: %.2fus per line\n", labels[k],
+                 elapsed * 1e6 / (double) i);
+  }
+
+  tl_history_set_sync(0);
+  itl_history_file_close();
+  itl_g_history_free();
+  ITL_FREE(itl_g_line_buffer.data);
+  itl_g_is_active = false;
+  unlink(history_path);
+
+  return k == countof(syncs);
+}
+
+#if defined ITL_SHARED_HISTORY
+static bool
+bench_history_share(void)
+{
+  size_t       i;
+  double       start, elapsed;
+  int          fd;
+  bool         result;
+  char         history_path[] = "/tmp/toiletline_history_XXXXXX";
+  uint32_t     session;
+  itl_string_t view;
+
+  const size_t lines = ITL_SHARED_SLOT_COUNT;
+
+  if ((fd = mkstemp(history_path)) < 0) {
+    return false;
+  }
+  close(fd);
+
+  itl_g_is_active = true;
+  if (tl_history_share(history_path) != TL_SUCCESS) {
+    itl_g_is_active = false;
+    unlink(history_path);
+    return false;
+  }
+  session = itl_g_shared.session;
+
+  /* Lines are put in as if they came from another process */
+  itl_g_shared.session = session + 1;
+  start = now_seconds();
+  for (i = 0; i < lines; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer),
+             "./deploy %zu --env=stage-%zu --verbose", i, i % 1000);
+    itl_string_view(&view, out_buffer, strlen(out_buffer), strlen(out_buffer));
+    itl_shared_append(&view);
+  }
+  elapsed = now_seconds() - start;
+  itl_g_shared.session = session;
+
+  BENCH_PRINTF("%zu lines: append %.1fns per line\n", lines,
+               elapsed * 1e9 / (double) lines);
+
+  start = now_seconds();
+  itl_shared_pick_up();
+  elapsed = now_seconds() - start;
+
+  result = tl_history_length() == lines;
+  BENCH_PRINTF("%zu foreign lines: picked up in %.3fms\n", tl_history_length(),
+               elapsed * 1e3);
+
+  start = now_seconds();
+  for (i = 0; i < 100000; ++i) {
+    itl_shared_pick_up();
+  }
+  elapsed = now_seconds() - start;
+
+  BENCH_PRINTF("nothing new: %.1fns per pick up\n", elapsed * 1e9 / 1e5);
+
+  itl_shared_close();
+  itl_g_history_free();
+  itl_g_is_active = false;
+  unlink(history_path);
+
+  return result;
+}
+#endif /* ITL_SHARED_HISTORY */
+
+static bool
+bench_history_budget(void)
+{
+  size_t        i;
+  double        start, elapsed;
+  itl_string_t *str = itl_string_alloc();
+
+  const size_t max_entries = 4 * 1024 * 1024, max_bytes = 64 * 1024 * 1024;
+  const size_t appends = 2 * max_entries;
+
+  tl_history_set_limits(max_entries, max_bytes);
+
+  start = now_seconds();
+  for (i = 0; i < appends; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer),
+             "make -C build/%zu -j8 && ./build/%zu/run --quiet", i, i);
+    ITL_STRING_FROM_CSTR(str, out_buffer);
+    itl_g_history_append(str);
+  }
+  elapsed = now_seconds() - start;
+
+  BENCH_PRINTF("%zu appends: %.1fns each, %zu lines kept in %zu bytes, arena "
+               "of %zu bytes\n",
+               appends, elapsed * 1e9 / (double) appends, tl_history_length(),
+               itl_g_history_size(), itl_g_history.text_capacity);
+
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_g_history_free();
+  ITL_STRING_FREE(str);
+
+  return itl_g_history_size() <= max_bytes;
+}
+
+static bool
+bench_history_duplicates(void)
+{
+  size_t i, k;
+  double start, elapsed;
+  FILE  *file;
+  int    fd;
+  char   history_path[] = "/tmp/toiletline_history_XXXXXX";
+
+  const size_t lines = 1000000, distinct = 10000;
+
+  if ((fd = mkstemp(history_path)) < 0 ||
+      (file = fdopen(fd, "w")) == NULL)
+  {
+    return false;
+  }
+  for (i = 0; i < lines; ++i) {
+    fprintf(file, "ssh build-%zu.example.com 'uptime'\n",
+            (i * 7919) % distinct);
+  }
+  fclose(file);
+
+  itl_g_is_active = true;
+  tl_history_set_limits(lines, 0);
+
+  for (k = 0; k < 2; ++k) {
+    tl_history_set_erase_duplicates(k == 1);
+
+    start = now_seconds();
+    if (itl_history_load_from_file(history_path) != TL_SUCCESS) {
+      break;
+    }
+    elapsed = now_seconds() - start;
+
+    BENCH_PRINTF("%zu lines, erasing duplicates %s: load %.3fms, %zu lines "
+                 "kept\n",
+                 lines, (k == 1) ? "on" : "off", elapsed * 1e3,
+                 tl_history_length());
+  }
+
+  tl_history_set_erase_duplicates(0);
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_g_history_free();
+  itl_g_is_active = false;
+  unlink(history_path);
+
+  return k == 2 && tl_history_length() == 0;
+}
+
+static bool
+bench_history_search(void)
+{
+  size_t    i, k, keys = 0;
+  double    start, elapsed, build_time, total = 0, slowest = 0;
+  itl_le_t  le;
+  itl_key_t key = ITL_ZERO_INIT;
+
+  const size_t entries = 1000000;
+  const char  *queries[] = {"git", "deploy 123456", "--env=stage-77",
+                            "no such command", "x", "zq"};
+
+  tl_history_set_limits(entries, 0);
+  itl_string_init(&itl_g_line_buffer);
+  for (i = 0; i < entries; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer),
+             (i % 3 == 0) ? "git commit -m 'change %zu'"
+                          : "./deploy %zu --env=stage-%zu --verbose",
+             i, i % 1000);
+    ITL_STRING_FROM_CSTR(&itl_g_line_buffer, out_buffer);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+  itl_string_clear(&itl_g_line_buffer);
+  itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+
+  /* Index is built by the first search */
+  start = now_seconds();
+  itl_le_key_handle(&le, TL_KEY_SEARCH_BACKWARD);
+  build_time = now_seconds() - start;
+  key.key = TL_KEY_ESCAPE;
+  itl_le_key_apply(&le, &key);
+
+  /* Type every query, then look for a few older matches */
+  for (i = 0; i < countof(queries); ++i) {
+    itl_le_key_handle(&le, TL_KEY_SEARCH_BACKWARD);
+    for (k = 0; k < strlen(queries[i]) + 5; ++k) {
+      if (k < strlen(queries[i])) {
+        key.key = TL_KEY_CHAR;
+        key.ch.bytes[0] = (uint8_t) queries[i][k];
+        key.ch.size = 1;
+      } else {
+        key.key = TL_KEY_SEARCH_BACKWARD;
+      }
+
+      start = now_seconds();
+      itl_le_key_apply(&le, &key);
+      elapsed = now_seconds() - start;
+
+      total += elapsed;
+      slowest = ITL_MAX(slowest, elapsed);
+      keys += 1;
+    }
+    key.key = TL_KEY_ESCAPE;
+    itl_le_key_apply(&le, &key);
+  }
+
+  BENCH_PRINTF("%zu entries: index built in %.1fms, %.1fus per key, slowest "
+               "%.1fus\n",
+               entries, build_time * 1e3, total * 1e6 / (double) keys,
+               slowest * 1e6);
+
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_search_free();
+  itl_g_history_free();
+  ITL_FREE(itl_g_line_buffer.data);
+
+  return true;
+}
+
+static bool
+bench_history_prefix(void)
+{
+  size_t   i, k, keys = 0;
+  double   start, elapsed, build_time, total = 0, slowest = 0;
+  itl_le_t le;
+
+  const size_t entries = 1000000;
+  const char  *prefixes[] = {"git", "./deploy 12345", "./deploy 999999",
+                             "no such command", "g"};
+
+  tl_history_set_limits(entries, 0);
+  tl_history_set_prefix_navigation(1);
+  itl_string_init(&itl_g_line_buffer);
+  for (i = 0; i < entries; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer),
+             (i % 3 == 0) ? "git commit -m 'change %zu'"
+                          : "./deploy %zu --env=stage-%zu --verbose",
+             i, i % 1000);
+    ITL_STRING_FROM_CSTR(&itl_g_line_buffer, out_buffer);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+
+  /* Entries are sorted by the first Up */
+  itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+  ITL_STRING_FROM_CSTR(&itl_g_line_buffer, "ls");
+  start = now_seconds();
+  itl_le_key_handle(&le, TL_KEY_UP);
+  build_time = now_seconds() - start;
+
+  /* A line is entered between navigations, and then merged in */
+  for (i = 0; i < countof(prefixes); ++i) {
+    ITL_STRING_FROM_CSTR(&itl_g_line_buffer, "echo entered");
+    itl_g_history_append(&itl_g_line_buffer);
+
+    itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer),
+                "$ ");
+    ITL_STRING_FROM_CSTR(&itl_g_line_buffer, prefixes[i]);
+    for (k = 0; k < 10; ++k) {
+      start = now_seconds();
+      itl_le_key_handle(&le, (k < 5) ? TL_KEY_UP : TL_KEY_DOWN);
+      elapsed = now_seconds() - start;
+
+      total += elapsed;
+      slowest = ITL_MAX(slowest, elapsed);
+      keys += 1;
+    }
+  }
+
+  BENCH_PRINTF("%zu entries: sorted in %.1fms, %.1fus per key, slowest "
+               "%.1fus\n",
+               entries, build_time * 1e3, total * 1e6 / (double) keys,
+               slowest * 1e6);
+
+  tl_history_set_prefix_navigation(0);
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_prefix_free();
+  itl_g_history_free();
+  ITL_FREE(itl_g_line_buffer.data);
+
+  return true;
+}
+
+static bool
+bench_history_cold(void)
+{
+  size_t    i, k, size;
+  double    start, spill_time, read_time, search_time, prefix_time;
+  int       fd;
+  int64_t   read_amount;
+  char      archive_path[] = "/tmp/toiletline_archive_XXXXXX";
+  char     *block;
+  itl_le_t  le;
+  itl_key_t key = ITL_ZERO_INIT;
+
+  const size_t hot = 1000, lines = 1000000;
+  const char  *query = "--env=stage-oldest";
+#if defined ITL_MEMMEM
+  const char *finder = "memmem";
+#else  /* ITL_MEMMEM */
+  const char *finder = "itl_find_bytes";
+#endif /* ITL_MEMMEM */
+
+  if ((fd = mkstemp(archive_path)) < 0) {
+    return false;
+  }
+  close(fd);
+
+  itl_string_init(&itl_g_line_buffer);
+  tl_history_set_limits(hot, 0);
+  if (tl_history_archive(archive_path) != TL_SUCCESS) {
+    ITL_FREE(itl_g_line_buffer.data);
+    unlink(archive_path);
+    return false;
+  }
+
+  /* Everything but the newest lines is spilled as it is dropped */
+  start = now_seconds();
+  for (i = 0; i < lines + hot; ++i) {
+    if (i == 0) {
+      snprintf(out_buffer, sizeof(out_buffer), "./deploy 0 %s --verbose",
+               query);
+    } else {
+      snprintf(out_buffer, sizeof(out_buffer),
+               "./deploy %zu --env=stage-%zu --verbose", i, i % 1000);
+    }
+    ITL_STRING_FROM_CSTR(&itl_g_line_buffer, out_buffer);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+  spill_time = now_seconds() - start;
+  size = (size_t) ITL_FILE_SIZE(itl_g_history_archive.read_file);
+
+  /* Reading the archive alone, as a reference */
+  block = (char *) malloc(ITL_HISTORY_FILE_BUFFER_SIZE);
+  start = now_seconds();
+  for (i = 0; i < size; i += ITL_HISTORY_FILE_BUFFER_SIZE) {
+    read_amount = (int64_t) ITL_FILE_READ_AT(
+        itl_g_history_archive.read_file, block,
+        ITL_MIN(size - i, ITL_HISTORY_FILE_BUFFER_SIZE), i);
+    if (read_amount <= 0) {
+      break;
+    }
+  }
+  read_time = now_seconds() - start;
+  free(block);
+
+  /* The only match is the oldest line, so the whole archive is searched */
+  itl_string_clear(&itl_g_line_buffer);
+  itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+  start = now_seconds();
+  itl_le_key_handle(&le, TL_KEY_SEARCH_BACKWARD);
+  for (k = 0; k < strlen(query); ++k) {
+    key.key = TL_KEY_CHAR;
+    key.ch.bytes[0] = (uint8_t) query[k];
+    key.ch.size = 1;
+    itl_le_key_apply(&le, &key);
+  }
+  search_time = now_seconds() - start;
+  if (itl_g_search.is_failed) {
+    BENCH_PRINTF("Oldest line was not found\n");
+  }
+  key.key = TL_KEY_ESCAPE;
+  itl_le_key_apply(&le, &key);
+
+  /* Every line has the prefix in the middle, and none starts with it */
+  tl_history_set_prefix_navigation(1);
+  ITL_STRING_FROM_CSTR(&itl_g_line_buffer, "--verbose");
+  le.cursor_position = le.line->length;
+  start = now_seconds();
+  itl_le_key_handle(&le, TL_KEY_UP);
+  prefix_time = now_seconds() - start;
+  tl_history_set_prefix_navigation(0);
+
+  BENCH_PRINTF("%zu lines spilled at %.2fus per line, %.1fMB read in "
+               "%.1fms\n",
+               lines, spill_time * 1e6 / (double) (lines + hot),
+               (double) size / 1e6, read_time * 1e3);
+  BENCH_PRINTF("search to the oldest line: %.1fms, %.0fMB/s (%s)\n",
+               search_time * 1e3, (double) size / 1e6 / search_time,
+               finder);
+  BENCH_PRINTF("prefix that is never at the start: %.1fms, %.0fMB/s\n",
+               prefix_time * 1e3, (double) size / 1e6 / prefix_time);
+
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_search_free();
+  itl_prefix_free();
+  itl_history_archive_close();
+  itl_g_history_free();
+  ITL_FREE(itl_g_line_buffer.data);
+  unlink(archive_path);
+
+  return true;
+}
+
+static bool
+bench_history_fuzzy(void)
+{
+  size_t    i, k, keys = 0;
+  double    start, elapsed, total = 0, slowest = 0;
+  itl_key_t key = ITL_ZERO_INIT;
+  itl_le_t  le;
+
+  const size_t entries = 100000;
+  const char  *queries[] = {"gcm", "deploy stage-42", "Verbose", "xyz"};
+
+  tl_history_set_limits(entries, 0);
+  itl_string_init(&itl_g_line_buffer);
+  for (i = 0; i < entries; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer),
+             (i % 3 == 0) ? "git commit -m 'change %zu'"
+                          : "./deploy %zu --env=stage-%zu --verbose",
+             i, i % 1000);
+    ITL_STRING_FROM_CSTR(&itl_g_line_buffer, out_buffer);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+
+  /* Every key scores entries again, and the first one scores all of them */
+  for (i = 0; i < countof(queries); ++i) {
+    itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer),
+                "$ ");
+    itl_string_clear(&itl_g_line_buffer);
+    start = now_seconds();
+    itl_le_key_handle(&le, TL_KEY_FUZZY_FIND);
+    for (k = 0; queries[i][k] != '\0'; ++k) {
+      key.key = TL_KEY_CHAR;
+      key.ch.bytes[0] = (uint8_t) queries[i][k];
+      key.ch.size = 1;
+      itl_le_key_apply(&le, &key);
+
+      elapsed = now_seconds() - start;
+      total += elapsed;
+      slowest = ITL_MAX(slowest, elapsed);
+      keys += 1;
+      start = now_seconds();
+    }
+    key.key = TL_KEY_ESCAPE;
+    itl_le_key_apply(&le, &key);
+  }
+
+  BENCH_PRINTF("%zu entries: %.1fms per key, slowest %.1fms\n", entries,
+               total * 1e3 / (double) keys, slowest * 1e3);
+
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_fuzzy_free();
+  itl_g_history_free();
+  ITL_FREE(itl_g_line_buffer.data);
+
+  return true;
+}
+
+/* Shell-like lines, which share long prefixes, and each has a new number */
+static void
+numbered_line(char *out, size_t size, size_t i)
+{
+  switch (i % 5) {
+  case 0:
+    snprintf(out, size, "kubectl --context prod-eu get pods -n team-%zu",
+             i % 40);
+    break;
+  case 1:
+    snprintf(out, size,
+             "kubectl --context prod-us describe deployment api-%zu -n "
+             "team-%zu",
+             i % 300, i % 40);
+    break;
+  case 2:
+    snprintf(out, size, "git commit -m 'change %zu'", i);
+    break;
+  case 3:
+    snprintf(out, size, "./deploy %zu --env=stage-%zu --verbose", i,
+             i % 1000);
+    break;
+  default:
+    snprintf(out, size, "cd /home/user/src/project-%zu/build && make -j8",
+             i % 100);
+    break;
+  }
+}
+
+/* Lines of the same few commands, which are typed for one task after
+   another */
+static void
+session_line(char *out, size_t size, size_t i)
+{
+  static const char *const commands[] = {
+      "vim src/module_%zu.c",
+      "make -j8",
+      "./build/tests --filter=module_%zu",
+      "git diff src/module_%zu.c",
+      "git add src/module_%zu.c",
+      "git commit -m 'Fix module %zu'",
+      "kubectl --context prod-eu get pods -n team-%zu",
+      "ls -la"};
+
+  snprintf(out, size, commands[i % countof(commands)],
+           (i / countof(commands)) % 300);
+}
+
+typedef void (*line_func)(char *, size_t, size_t);
+
+static bool
+bench_history_compact(void)
+{
+  size_t    i, k, c, n, text_size, raw_size = 0, sum = 0;
+  double    start, append_time, up_time, random_time, search_time;
+  double    sort_time;
+  itl_le_t  le;
+  itl_key_t key = ITL_ZERO_INIT;
+  const itl_history_entry_t *entry;
+
+  const size_t entries = 1000000, steps = 100000;
+  const char  *modes[] = {"plain", "compact"};
+  const char  *corpora[] = {"numbered", "sessions"};
+  line_func    lines[] = {numbered_line, session_line};
+
+  tl_history_set_limits(entries, 0);
+  itl_string_init(&itl_g_line_buffer);
+  for (c = 0; c < countof(corpora); ++c) {
+    for (k = 0; k < countof(modes); ++k) {
+      tl_history_set_compact((int) k);
+
+      start = now_seconds();
+      for (i = 0; i < entries; ++i) {
+        lines[c](out_buffer, sizeof(out_buffer), i);
+        ITL_STRING_FROM_CSTR(&itl_g_line_buffer, out_buffer);
+        itl_g_history_append(&itl_g_line_buffer);
+      }
+      append_time = now_seconds() - start;
+      text_size = itl_g_history.text_end - itl_g_history_text_kept();
+      if (k == 0) {
+        raw_size = text_size;
+      }
+      itl_string_clear(&itl_g_line_buffer);
+
+      /* Up from the newest line */
+      itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer),
+                  "$ ");
+      start = now_seconds();
+      for (i = 0; i < steps; ++i) {
+        itl_le_key_handle(&le, TL_KEY_UP);
+      }
+      up_time = now_seconds() - start;
+      itl_string_clear(&itl_g_line_buffer);
+
+      /* Lines all over history, each in a block that is not decoded */
+      start = now_seconds();
+      for (i = 0; i < steps; ++i) {
+        n = itl_g_history.first + (i * 2654435761u) % itl_g_history.length;
+        entry = ITL_HISTORY_AT(n);
+        sum += (uint8_t) ITL_HISTORY_TEXT(entry)[entry->size - 1];
+      }
+      random_time = now_seconds() - start;
+
+      /* Search decodes every line once to build its index */
+      itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer),
+                  "$ ");
+      start = now_seconds();
+      itl_le_key_handle(&le, TL_KEY_SEARCH_BACKWARD);
+      for (i = 0; i < strlen("module_123"); ++i) {
+        key.key = TL_KEY_CHAR;
+        key.ch.bytes[0] = (uint8_t) "module_123"[i];
+        key.ch.size = 1;
+        itl_le_key_apply(&le, &key);
+      }
+      search_time = now_seconds() - start;
+      key.key = TL_KEY_ESCAPE;
+      itl_le_key_apply(&le, &key);
+      itl_string_clear(&itl_g_line_buffer);
+
+      /* Prefix navigation sorts lines by text */
+      tl_history_set_prefix_navigation(1);
+      itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer),
+                  "$ ");
+      ITL_STRING_FROM_CSTR(&itl_g_line_buffer, "git");
+      start = now_seconds();
+      itl_le_key_handle(&le, TL_KEY_UP);
+      sort_time = now_seconds() - start;
+      tl_history_set_prefix_navigation(0);
+      itl_string_clear(&itl_g_line_buffer);
+
+      BENCH_PRINTF("%s, %7s: %zu lines, %.1fMB of text (%.2fx less) in "
+                   "%.1fMB arena, %.1fMB with entries\n",
+                   corpora[c], modes[k], entries, (double) text_size / 1e6,
+                   (double) raw_size / (double) text_size,
+                   (double) itl_g_history.text_capacity / 1e6,
+                   (double) (itl_g_history.text_capacity +
+                             itl_g_history.capacity *
+                                 sizeof(itl_history_entry_t)) /
+                       1e6);
+      BENCH_PRINTF("%s, %7s: append %.0fns, Up %.0fns, random line %.0fns, "
+                   "search %.1fms, sort %.1fms\n",
+                   corpora[c], modes[k], append_time * 1e9 / (double) entries,
+                   up_time * 1e9 / (double) steps,
+                   random_time * 1e9 / (double) steps, search_time * 1e3,
+                   sort_time * 1e3);
+
+      itl_search_free();
+      itl_prefix_free();
+      itl_g_history_free();
+    }
+  }
+
+  tl_history_set_compact(0);
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  ITL_FREE(itl_g_line_buffer.data);
+
+  return sum > 0;
+}
+
+typedef size_t (*count_func)(const char *, size_t);
+typedef bool (*validate_func)(const char *, size_t);
+
+static bool
+bench_utf8(void)
+{
+  size_t i, k, count, expected = 0;
+  double start, elapsed;
+  char  *text;
+  bool   is_valid;
+
+  struct
+  {
+    const char   *name;
+    count_func    count;
+    validate_func validate;
+  } kernels[3];
+  size_t kernel_count = 0;
+
+  const size_t      size = 1024 * 1024, rounds = 100;
+  const char *const kinds[] = {"ascii", "mixed"};
+  const char *const lines[] = {"git log --oneline | head -n 20\n",
+                               "echo 'привет, мир' > файл.txt\n"};
+
+  kernels[kernel_count].name = "scalar";
+  kernels[kernel_count].count = itl_utf8_count_scalar;
+  kernels[kernel_count++].validate = itl_utf8_validate_scalar;
+#if defined ITL_SSE2
+  kernels[kernel_count].name = "sse2";
+  kernels[kernel_count].count = itl_utf8_count_sse2;
+  kernels[kernel_count++].validate = itl_utf8_validate_sse2;
+#endif
+#if defined ITL_AVX2
+  if (ITL_CPU_HAS_AVX2()) {
+    kernels[kernel_count].name = "avx2";
+    kernels[kernel_count].count = itl_utf8_count_avx2;
+    kernels[kernel_count++].validate = itl_utf8_validate_avx2;
+  }
+#endif
+
+  text = (char *) malloc(size);
+
+  for (i = 0; i < countof(kinds); ++i) {
+    for (k = 0; k < size; ++k) {
+      text[k] = lines[i][k % strlen(lines[i])];
+    }
+    /* Don't cut the last character */
+    k = size;
+    while ((text[k - 1] & 0x80) != 0) {
+      text[--k] = '\n';
+    }
+
+    for (k = 0; k < kernel_count; ++k) {
+      /* Don't let the compiler call them only once */
+      volatile count_func    count_kernel = kernels[k].count;
+      volatile validate_func validate_kernel = kernels[k].validate;
+
+      start = now_seconds();
+      for (count = 0; count < rounds; ++count) {
+        expected = count_kernel(text, size);
+      }
+      elapsed = now_seconds() - start;
+
+      if (expected != itl_utf8_count_scalar(text, size)) {
+        BENCH_PRINTF("%s count is wrong\n", kernels[k].name);
+        free(text);
+        return false;
+      }
+
+      BENCH_PRINTF("%s count, %6s: %6.2f GB/s\n", kinds[i], kernels[k].name,
+                   (double) (size * rounds) / elapsed / 1e9);
+
+      start = now_seconds();
+      for (count = 0, is_valid = true; count < rounds; ++count) {
+        is_valid = is_valid && validate_kernel(text, size);
+      }
+      elapsed = now_seconds() - start;
+
+      if (!is_valid) {
+        BENCH_PRINTF("%s text is not valid for %s\n", kinds[i],
+                     kernels[k].name);
+        free(text);
+        return false;
+      }
+
+      BENCH_PRINTF("%s validation, %6s: %6.2f GB/s\n", kinds[i],
+                   kernels[k].name, (double) (size * rounds) / elapsed / 1e9);
+    }
+  }
+
+  free(text);
+
+  return true;
+}
+
+/* How lines of history files used to be split, with a pass for control
+   bytes, and then memchr() and a count for each line */
+static size_t
+scan_bytewise(const char *data, size_t size)
+{
+  size_t      i, lines = 0, chars = 0;
+  uint8_t     c;
+  const char *end = data + size, *newline;
+
+  for (i = 0; i < size; ++i) {
+    c = (uint8_t) data[i];
+    if ((c < 0x20 && !isspace(c)) || c == 0x7F) {
+      return 0;
+    }
+  }
+  for (; data < end; data = newline + 1) {
+    newline = (const char *) memchr(data, '\n', (size_t) (end - data));
+    chars += itl_utf8_count(
+        data, itl_history_line_size(data, (size_t) (newline - data)));
+    lines += 1;
+  }
+  return (chars > 0) ? lines : 0;
+}
+
+static bool
+scan_with_scalar(itl_history_scan_t *scan)
+{
+  scan->line_count = 0;
+  return itl_history_scan_scalar(scan, scan->line);
+}
+
+#if defined ITL_SSE2
+static bool
+scan_with_sse2(itl_history_scan_t *scan)
+{
+  scan->line_count = 0;
+  return itl_history_scan_sse2(scan);
+}
+#endif
+
+#if defined ITL_AVX2
+static bool
+scan_with_avx2(itl_history_scan_t *scan)
+{
+  scan->line_count = 0;
+  return itl_history_scan_avx2(scan);
+}
+#endif
+
+typedef bool (*scan_func)(itl_history_scan_t *);
+
+static bool
+bench_history_scan(void)
+{
+  size_t              i, k, count, lines = 0;
+  double              start, elapsed;
+  char               *text, *copy;
+  itl_history_scan_t  scan;
+  itl_history_entry_t entries[ITL_HISTORY_SCAN_LINES];
+
+  struct
+  {
+    const char *name;
+    scan_func   func;
+  } scanners[3];
+  size_t scanner_count = 0;
+
+  const size_t      size = 64 * 1024 * 1024, rounds = 5;
+  const char *const line = "git commit -m 'change number 42' && echo готово\n";
+
+  scanners[scanner_count].name = "scalar";
+  scanners[scanner_count++].func = scan_with_scalar;
+#if defined ITL_SSE2
+  scanners[scanner_count].name = "sse2";
+  scanners[scanner_count++].func = scan_with_sse2;
+#endif
+#if defined ITL_AVX2
+  if (ITL_CPU_HAS_AVX2()) {
+    scanners[scanner_count].name = "avx2";
+    scanners[scanner_count++].func = scan_with_avx2;
+  }
+#endif
+
+  text = (char *) malloc(size);
+  copy = (char *) malloc(size);
+  for (i = 0; i < size; ++i) {
+    text[i] = line[i % strlen(line)];
+  }
+  /* Don't cut the last line */
+  for (i = size; text[i - 1] != '\n'; --i) {
+    text[i - 1] = '\n';
+  }
+
+  /* Loading can't be faster than reading memory */
+  start = now_seconds();
+  for (count = 0; count < rounds; ++count) {
+    memcpy(copy, text, size);
+  }
+  elapsed = now_seconds() - start;
+  BENCH_PRINTF("memcpy: %6.2f GB/s\n",
+               (double) (size * rounds) / elapsed / 1e9);
+
+  start = now_seconds();
+  for (count = 0; count < rounds; ++count) {
+    lines = scan_bytewise(text, size);
+  }
+  elapsed = now_seconds() - start;
+  BENCH_PRINTF("%zu lines, bytewise: %6.2f GB/s\n", lines,
+               (double) (size * rounds) / elapsed / 1e9);
+
+  for (k = 0; k < scanner_count; ++k) {
+    /* Don't let the compiler call it only once */
+    volatile scan_func func = scanners[k].func;
+
+    start = now_seconds();
+    for (count = 0; count < rounds; ++count) {
+      itl_history_scan_init(&scan, text, text + size, entries,
+                            ITL_HISTORY_SCAN_LINES);
+      for (i = 0; scan.line < scan.end; i += scan.line_count) {
+        if (!func(&scan)) {
+          break;
+        }
+      }
+    }
+    elapsed = now_seconds() - start;
+
+    if (i != lines) {
+      BENCH_PRINTF("%s split %zu lines, should be: %zu\n", scanners[k].name,
+                   i, lines);
+      free(text);
+      free(copy);
+      return false;
+    }
+    BENCH_PRINTF("%zu lines, %6s: %6.2f GB/s\n", i, scanners[k].name,
+                 (double) (size * rounds) / elapsed / 1e9);
+  }
+
+  free(text);
+  free(copy);
+
+  return true;
+}
+
+static bool
+bench_sessions(void)
+{
+  size_t              i, output_size = 0;
+  double              start, elapsed;
+  tl_memory_backend_t mb;
+
+  /* Type a command, edit it, walk the history, and submit */
+  const char input[] = "git commti -m 'fix'\x1b[H\x1b[1;5C\x1b[1;5C"
+                       "\x7f\x7f\x7fmit\x1b[A\x1b[B\x1b[F\r";
+  const size_t sessions = 20000;
+
+  start = now_seconds();
+  for (i = 0; i < sessions; ++i) {
+    tl_memory_backend_init(&mb, input, sizeof(input) - 1, NULL, 0);
+    tl_set_backend(&mb.backend);
+    if (tl_init() != TL_SUCCESS ||
+        tl_get_input(out_buffer, sizeof(out_buffer), "$ ") != TL_PRESSED_ENTER)
+    {
+      tl_set_backend(NULL);
+      return false;
+    }
+    tl_exit();
+    output_size += mb.output_size;
+  }
+  elapsed = now_seconds() - start;
+  tl_set_backend(NULL);
+
+  BENCH_PRINTF("%zu sessions, %.0f sessions/s, %zu bytes of output each: "
+               "'%s'\n",
+               sessions, (double) sessions / elapsed, output_size / sessions,
+               out_buffer);
+
+  return true;
+}
+
+typedef bool (*bench_func)(void);
+
+typedef struct bench_case bench_case_t;
+
+struct bench_case
+{
+  const char *name;
+  bench_func  func;
+};
+
+#define DEFINE_BENCH_CASE(fn)                                                  \
+  {                                                                            \
+    .name = #fn, .func = fn,                                                   \
+  }
+
+static bench_case_t bench_cases[] = {DEFINE_BENCH_CASE(bench_input_syscalls),
+                                     DEFINE_BENCH_CASE(bench_paste),
+                                     DEFINE_BENCH_CASE(bench_midline_typing),
+                                     DEFINE_BENCH_CASE(bench_large_lines),
+                                     DEFINE_BENCH_CASE(bench_decoder),
+                                     DEFINE_BENCH_CASE(bench_utf8),
+                                     DEFINE_BENCH_CASE(bench_history_scan),
+                                     DEFINE_BENCH_CASE(bench_history_jumps),
+                                     DEFINE_BENCH_CASE(bench_history_load),
+                                     DEFINE_BENCH_CASE(bench_history_archive),
+                                     DEFINE_BENCH_CASE(bench_history_open),
+#if defined ITL_SHARED_HISTORY
+                                     DEFINE_BENCH_CASE(bench_history_share),
+#endif /* ITL_SHARED_HISTORY */
+                                     DEFINE_BENCH_CASE(bench_history_budget),
+                                     DEFINE_BENCH_CASE(
+                                         bench_history_duplicates),
+                                     DEFINE_BENCH_CASE(bench_history_search),
+                                     DEFINE_BENCH_CASE(bench_history_prefix),
+                                     DEFINE_BENCH_CASE(bench_history_cold),
+                                     DEFINE_BENCH_CASE(bench_history_fuzzy),
+                                     DEFINE_BENCH_CASE(bench_history_compact),
+                                     DEFINE_BENCH_CASE(bench_sessions)};
+
+int
+main(void)
+{
+  size_t i;
+  double start;
+  bool   result;
+
+  for (i = 0; i < countof(bench_cases); ++i) {
+    start = now_seconds();
+    result = bench_cases[i].func();
+    if (!result) {
+      printf("%s: *** FAIL.\n", bench_cases[i].name);
+    } else {
+      printf("%s: done in %.3fs.\n", bench_cases[i].name,
+             now_seconds() - start);
+    }
+  }
+
+  return 0;
+}
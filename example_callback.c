@@ -0,0 +1,96 @@
+#define TOILETLINE_IMPLEMENTATION
+#include "toiletline.h"
+
+#include <stdio.h>
+
+#if defined _WIN32
+#include <windows.h>
+#else
+#include <poll.h>
+#endif
+
+#define TICK_MS 1000
+
+static bool is_running = true;
+
+static void
+on_line(TL_STATUS_CODE code, const char *line)
+{
+  tl_emit_newlines(line);
+
+  if (code == TL_PRESSED_INTERRUPT || code == TL_PRESSED_EOF || code < 0 ||
+      strcmp(line, "quit") == 0)
+  {
+    is_running = false;
+    return;
+  }
+
+  printf("Received line: '%s'\n", line);
+  fflush(stdout);
+
+  tl_begin_input("$ ", on_line);
+}
+
+int
+main(void)
+{
+  int    timeout;
+  size_t ticks = 0;
+
+  if (tl_init() != TL_SUCCESS) {
+    printf("Failed to enter raw mode!\n");
+    return 1;
+  }
+
+  printf("Welcome to callback example!\n"
+         "Input is read by an event loop, which also counts seconds.\n"
+         "Type \"quit\" or press Ctrl-C to exit.\n");
+  fflush(stdout);
+
+  tl_begin_input("$ ", on_line);
+
+  while (is_running) {
+    timeout = tl_input_timeout();
+    if (timeout < 0 || timeout > TICK_MS) {
+      timeout = TICK_MS;
+    }
+
+#if defined _WIN32
+    Sleep(10);
+    if (tl_on_readable() != TL_SUCCESS) {
+      break;
+    }
+#else
+    {
+      struct pollfd fd;
+      int           ready;
+
+      fd.fd = tl_input_fd();
+      fd.events = POLLIN;
+      fd.revents = 0;
+
+      ready = poll(&fd, 1, timeout);
+      if (ready > 0) {
+        if (tl_on_readable() != TL_SUCCESS) {
+          break;
+        }
+      } else if (ready == 0) {
+        if (tl_input_timeout() >= 0) {
+          tl_on_timeout();
+        }
+        if (timeout == TICK_MS) {
+          ticks += 1;
+        }
+      }
+    }
+#endif
+  }
+
+  tl_end_input();
+  printf("Exiting after %zu seconds of waiting.\n", ticks);
+  fflush(stdout);
+
+  tl_exit();
+
+  return 0;
+}
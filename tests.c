@@ -1,7 +1,10 @@
 #define TOILETLINE_IMPLEMENTATION
+/* Big history files are parsed on threads */
+#define TL_HISTORY_THREADS 4
 #include "toiletline.h"
 
 #include <stdio.h>
+#include <sys/wait.h>
 
 #define BUFFER_SIZE 128
 
@@ -225,6 +228,139 @@ test_string_insert(void)
   return true;
 }
 
+static bool
+test_string_gap(void)
+{
+  size_t        i, k, position, count, model_length = 0;
+  uint32_t      seed = 1;
+  bool          backwards;
+  itl_utf8_t    model[BUFFER_SIZE];
+  char          out_buffer[BUFFER_SIZE * 4];
+  itl_string_t *str = itl_string_alloc();
+
+  const itl_utf8_t chars[] = {
+      {{'a'}, 1},
+      {{0xD0, 0xAF}, 2},
+      {{0xE4, 0xBD, 0xA0}, 3},
+  };
+
+  /* Insert and erase around a wandering cursor, and compare with a plain
+     array */
+  for (i = 0; i < 4000; ++i) {
+    seed = seed * 1103515245 + 12345;
+    position = (seed >> 8) % (model_length + 1);
+
+    if ((seed >> 4) % 3 != 0 && model_length < BUFFER_SIZE) {
+      const itl_utf8_t ch = chars[(seed >> 16) % countof(chars)];
+      itl_string_insert(str, position, ch);
+      memmove(&model[position + 1], &model[position],
+              (model_length - position) * sizeof(itl_utf8_t));
+      model[position] = ch;
+      model_length += 1;
+    } else {
+      count = (seed >> 20) % 4;
+      backwards = (seed >> 2) & 1;
+      itl_string_erase(str, position, count, backwards);
+      if (backwards) {
+        count = ITL_MIN(count, position);
+        position -= count;
+      } else {
+        count = ITL_MIN(count, model_length - position);
+      }
+      memmove(&model[position], &model[position + count],
+              (model_length - position - count) * sizeof(itl_utf8_t));
+      model_length -= count;
+    }
+
+    itl_string_to_cstr(str, out_buffer, sizeof(out_buffer));
+    for (k = 0, position = 0; k < model_length; ++k) {
+      if (memcmp(out_buffer + position, model[k].bytes, model[k].size) != 0) {
+        break;
+      }
+      position += model[k].size;
+    }
+
+    if (str->length != model_length || k != model_length ||
+        str->size != position || out_buffer[position] != '\0')
+    {
+      TEST_PRINTF("Step %zu: length %zu, size %zu, should be %zu, %zu\n", i,
+                  str->length, str->size, model_length, position);
+      ITL_STRING_FREE(str);
+      return false;
+    }
+  }
+
+  ITL_STRING_FREE(str);
+
+  return true;
+}
+
+static bool
+test_string_offset(void)
+{
+  size_t        i, index;
+  size_t        offsets[BUFFER_SIZE];
+  uint32_t      seed = 1;
+  bool          result = true;
+  char          out_buffer[8];
+  itl_utf8_t    ch;
+  itl_string_t *str = itl_string_alloc();
+
+  const char text[] = "ls ~/мои документы/你好 | grep 'é'";
+
+  ITL_STRING_FROM_CSTR(str, text);
+  for (i = 0, index = 0; i < sizeof(text) - 1; ++i) {
+    if ((text[i] & 0xC0) != 0x80) {
+      offsets[index++] = i;
+    }
+  }
+  offsets[index] = sizeof(text) - 1;
+
+  /* Put the gap in the middle */
+  itl_string_move_gap(str, 12);
+
+  /* Look up characters in random order */
+  for (i = 0; i < 200 && result; ++i) {
+    seed = seed * 1103515245 + 12345;
+    index = (seed >> 8) % (str->length + 1);
+
+    if (itl_string_offset(str, index) != offsets[index]) {
+      TEST_PRINTF("Offset of %zu: %zu, should be: %zu\n", index,
+                  itl_string_offset(str, index), offsets[index]);
+      result = false;
+    } else if (index < str->length) {
+      ch = itl_string_at(str, index);
+      if (ch.size != offsets[index + 1] - offsets[index] ||
+          memcmp(ch.bytes, text + offsets[index], ch.size) != 0)
+      {
+        TEST_PRINTF("Character %zu has wrong bytes\n", index);
+        result = false;
+      }
+    }
+  }
+
+  /* Truncated string does not end in the middle of a character */
+  if (itl_string_to_cstr(str, out_buffer, 7) != TL_ERROR_SIZE ||
+      strcmp(out_buffer, "ls ~/") != 0)
+  {
+    TEST_PRINTF("Truncated: '%s', should be: 'ls ~/'\n", out_buffer);
+    result = false;
+  }
+
+  /* Invalid UTF-8 is rejected */
+  if (itl_string_from_bytes(str, "\xD0", 1) ||
+      itl_string_from_bytes(str, "\xD0" "A", 2) ||
+      itl_string_from_bytes(str, "\xBF", 1))
+  {
+    TEST_PRINTF("Invalid UTF-8 was accepted\n");
+    result = false;
+  }
+
+  ITL_STRING_FREE(str);
+
+  return result;
+}
+
 typedef struct split_test_case split_test_case_t;
 
 struct split_test_case
@@ -237,15 +373,16 @@ static bool
 test_char_buf(void)
 {
   itl_string_t   *str = itl_string_alloc();
-  itl_char_buf_t *cb = itl_char_buf_alloc();
+  itl_char_buf_t  buffer, *cb = &buffer;
 
   const char *should_be = "привет, мир help me3912033312 ЛОЛ";
 
+  itl_char_buf_init(cb);
   ITL_STRING_FROM_CSTR(str, "привет, ");
-  itl_char_buf_append_string(cb, str);
+  itl_char_buf_append_string_bytes(cb, str, 0, str->size);
   itl_char_buf_append_cstr(cb, "мир ");
   ITL_STRING_FROM_CSTR(str, "help");
-  itl_char_buf_append_string(cb, str);
+  itl_char_buf_append_string_bytes(cb, str, 0, str->size);
   itl_char_buf_append_byte(cb, ' ');
   itl_char_buf_append_byte(cb, 'm');
   itl_char_buf_append_byte(cb, 'e');
@@ -262,12 +399,12 @@ test_char_buf(void)
     TEST_PRINTF("Result: '%s', should be: '%s', len: %zu/%zu\n", cb->data,
                 should_be, cb->size, strlen(should_be));
     ITL_STRING_FREE(str);
-    ITL_CHAR_BUF_FREE(cb);
+    ITL_FREE(cb->data);
     return false;
   }
 
   ITL_STRING_FREE(str);
-  ITL_CHAR_BUF_FREE(cb);
+  ITL_FREE(cb->data);
 
   return true;
 }
@@ -320,6 +457,2354 @@ test_utf8_strlen(void)
   return true;
 }
 
+typedef struct utf8_test_case utf8_test_case_t;
+
+struct utf8_test_case
+{
+  const char *tail;
+  bool        is_valid;
+};
+
+static bool
+test_utf8_validate(void)
+{
+  size_t      i, size, round, length;
+  char        text[256];
+  const char *piece;
+  static char continuation[9000];
+
+  const char *const pieces[] = {"a",         "ls -la ",      "\xD0\xBF",
+                                "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xED\x9F\xBF",
+                                "\xEF\xBF\xBD"};
+
+  /* clang-format off */
+  const utf8_test_case_t tests[] = {
+  /* tail,             is_valid */
+      {"ok",             true },
+      {"\xD0\xBF",       true },
+      {"\xD0",           false},
+      {"\xBF",           false},
+      {"\xD0" "A",        false},
+      {"\xED\x9F\xBF",   true },
+      {"\xED\xA0\x80",   false},
+      {"\xF0\x9F\x98",    false},
+      {"\xF0\x9F\x98\x80", true },
+      {"\xE2\x82\xAC\x80", false},
+      {"\xF8",           false}
+  };
+  /* clang-format on */
+
+  /* Long enough for a few vector blocks, with the interesting part last */
+  for (i = 0; i < countof(tests); ++i) {
+    memset(text, 'a', 100);
+    strcpy(text + 100, tests[i].tail);
+    size = strlen(text);
+
+    if (itl_utf8_validate(text, size) != tests[i].is_valid) {
+      TEST_PRINTF("Validation %zu should be: %d\n", i, tests[i].is_valid);
+      return false;
+    }
+  }
+
+  /* Every length and alignment, to hit the tails of vector loops */
+  for (i = 0; i < sizeof(text); ++i) {
+    text[i] = (i % 3 == 0) ? 'a' : (char) (0x80 + i % 64);
+  }
+  for (i = 0; i < 64; ++i) {
+    for (size = 0; size + i <= sizeof(text); size += 7) {
+      if (itl_utf8_count(text + i, size) !=
+          itl_utf8_count_scalar(text + i, size))
+      {
+        TEST_PRINTF("Count at %zu of %zu bytes: %zu, should be: %zu\n", i,
+                    size, itl_utf8_count(text + i, size),
+                    itl_utf8_count_scalar(text + i, size));
+        return false;
+      }
+    }
+  }
+
+  /* Vectors agree with characters checked one by one, across blocks and at
+     their ends, for text with and without a byte that was changed */
+  srand(3);
+  for (round = 0; round < 200; ++round) {
+    for (length = 0; length < 200;) {
+      piece = pieces[(size_t) rand() % countof(pieces)];
+      memcpy(text + length, piece, strlen(piece));
+      length += strlen(piece);
+    }
+    if (round % 2 == 1) {
+      text[(size_t) rand() % length] = (char) rand();
+    }
+    for (i = 0; i < 8; ++i) {
+      for (size = 0; size + i <= length; ++size) {
+        if (itl_utf8_validate(text + i, size) !=
+            itl_utf8_validate_scalar(text + i, size))
+        {
+          TEST_PRINTF("Validation at %zu of %zu bytes in round %zu\n", i,
+                      size, round);
+          return false;
+        }
+      }
+    }
+  }
+
+  /* Counters of continuation bytes should not overflow */
+  memset(continuation, 0x80, sizeof(continuation));
+  if (itl_utf8_count(continuation, sizeof(continuation)) != 0) {
+    TEST_PRINTF("Count of continuation bytes: %zu, should be: 0\n",
+                itl_utf8_count(continuation, sizeof(continuation)));
+    return false;
+  }
+
+  return true;
+}
+
+/* Replaces stdin with a pipe that contains `input`. */
+static bool
+pipe_into_stdin(const char *input)
+{
+  int fds[2];
+
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  if (write(fds[1], input, strlen(input)) != (ssize_t) strlen(input)) {
+    return false;
+  }
+  close(fds[1]);
+  dup2(fds[0], STDIN_FILENO);
+  close(fds[0]);
+
+  return true;
+}
+
+static bool
+test_input_buf(void)
+{
+  size_t      i;
+  uint8_t     byte;
+  itl_key_t   key;
+  const char *input = "привет";
+
+  if (!pipe_into_stdin(input)) {
+    TEST_PRINTF("Could not pipe input\n");
+    return false;
+  }
+
+  /* Whole input should arrive with one read */
+  if (itl_input_buf_fill(&itl_g_input_buf) != (int) strlen(input)) {
+    TEST_PRINTF("Pending: %zu, should be: %zu\n",
+                ITL_INPUT_BUF_PENDING(&itl_g_input_buf), strlen(input));
+    return false;
+  }
+
+  for (i = 0; i < tl_utf8_strlen(input); ++i) {
+    itl_read_key(&key);
+    if (key.key != TL_KEY_CHAR || key.ch.size != 2 ||
+        memcmp(key.ch.bytes, input + i * 2, 2) != 0)
+    {
+      TEST_PRINTF("Character %zu was decoded incorrectly\n", i);
+      return false;
+    }
+  }
+
+  if (ITL_INPUT_BUF_PENDING(&itl_g_input_buf) != 0 || ITL_READ_BYTE(&byte)) {
+    TEST_PRINTF("Input should be drained\n");
+    return false;
+  }
+
+  return true;
+}
+
+static bool
+test_paste(void)
+{
+  itl_key_t     key;
+  itl_le_t      le;
+  char          out_buffer[BUFFER_SIZE];
+  itl_string_t *str = itl_string_alloc();
+
+  const char *should_be = "aпривет world ok[20b";
+
+  if (!pipe_into_stdin("\x1b[200~привет\r\nworld\tok\x1b[20\x1b[201~")) {
+    TEST_PRINTF("Could not pipe input\n");
+    ITL_STRING_FREE(str);
+    return false;
+  }
+
+  ITL_STRING_FROM_CSTR(str, "ab");
+  itl_le_init(&le, str, out_buffer, BUFFER_SIZE, NULL);
+  le.cursor_position = 1;
+
+  itl_read_key(&key);
+  if (key.key != TL_KEY_PASTE) {
+    TEST_PRINTF("Key: %d, should be: %d\n", key.key, TL_KEY_PASTE);
+    ITL_STRING_FREE(str);
+    return false;
+  }
+
+  itl_le_key_handle(&le, key.key);
+  itl_string_to_cstr(str, out_buffer, BUFFER_SIZE);
+
+  if (strcmp(out_buffer, should_be) != 0 ||
+      le.cursor_position != str->length - 1)
+  {
+    TEST_PRINTF("Result: '%s', should be: '%s', cursor: %zu/%zu\n",
+                out_buffer, should_be, le.cursor_position, str->length - 1);
+    ITL_STRING_FREE(str);
+    return false;
+  }
+
+  ITL_STRING_FREE(str);
+
+  return true;
+}
+
+typedef struct decoder_test_case decoder_test_case_t;
+
+struct decoder_test_case
+{
+  const char *input;
+  int         keys[3];
+  size_t      key_count;
+};
+
+static bool
+test_decoder(void)
+{
+  size_t              i, k, key_count;
+  itl_key_t           key;
+  decoder_test_case_t test;
+  itl_decoder_t       d = ITL_ZERO_INIT;
+
+  /* Input is flushed after the last byte, like after the timeout. */
+  /* clang-format off */
+  const decoder_test_case_t tests[] = {
+  /*  input,            keys,                                        count */
+      {"\x1b[A",        {TL_KEY_UP},                                 1},
+      {"\x1b[1;5C",     {TL_KEY_RIGHT | TL_MOD_CTRL},                1},
+      {"\x1b[3;5~",     {TL_KEY_DELETE | TL_MOD_CTRL},               1},
+      {"\x1bOH",        {TL_KEY_HOME},                               1},
+      {"\x1b[Z",        {TL_KEY_TAB | TL_MOD_SHIFT},                 1},
+      {"\x1b" "b",     {TL_KEY_LEFT | TL_MOD_CTRL},                 1},
+      {"\x1b\x7f",      {TL_KEY_BACKSPACE | TL_MOD_CTRL},            1},
+      {"\x1b\x08",      {TL_KEY_BACKSPACE | TL_MOD_CTRL},            1},
+      {"\x1b\r",        {TL_KEY_ESCAPE, TL_KEY_ENTER},               2},
+      {"\x1b",          {TL_KEY_ESCAPE},                             1},
+      {"\x1b[1;5",      {TL_KEY_UNKN},                               1},
+      {"\x1b[?1;2cq",   {TL_KEY_UNKN, TL_KEY_CHAR},                  2},
+      {"a\x1b\x1b[B",   {TL_KEY_CHAR, TL_KEY_ESCAPE, TL_KEY_DOWN},   3},
+      {"\x1b[1\x03",    {TL_KEY_UNKN, TL_KEY_INTERRUPT},             2},
+      {"\xd0\xbf\xd0",  {TL_KEY_CHAR, TL_KEY_CHAR},                  2},
+  };
+  /* clang-format on */
+
+  for (i = 0; i < countof(tests); ++i) {
+    test = tests[i];
+
+    for (k = 0; test.input[k] != '\0'; ++k) {
+      itl_decoder_feed(&d, (uint8_t) test.input[k]);
+    }
+    itl_decoder_flush(&d);
+
+    for (key_count = 0; itl_decoder_pop(&d, &key); ++key_count) {
+      if (key_count >= test.key_count || key.key != test.keys[key_count]) {
+        TEST_PRINTF("Result %zu: key %zu is %d, should be: %d\n", i,
+                    key_count, key.key,
+                    (key_count < test.key_count) ? test.keys[key_count] : -1);
+        return false;
+      }
+    }
+    if (key_count != test.key_count) {
+      TEST_PRINTF("Result %zu: %zu keys, should be: %zu\n", i, key_count,
+                  test.key_count);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Redirects stdout into a pipe. Returns read end of the pipe, or -1. */
+static int
+capture_stdout(int *saved_stdout)
+{
+  int fds[2];
+
+  fflush(stdout);
+  if (pipe(fds) != 0 || (*saved_stdout = dup(STDOUT_FILENO)) < 0) {
+    return -1;
+  }
+  dup2(fds[1], STDOUT_FILENO);
+  close(fds[1]);
+
+  return fds[0];
+}
+
+/* Restores stdout and reads everything that was captured. */
+static size_t
+restore_stdout(int saved_stdout, int capture_fd, char *buffer, size_t size)
+{
+  ssize_t read_amount, total = 0;
+
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+
+  while ((size_t) total < size - 1 &&
+         (read_amount = read(capture_fd, buffer + total,
+                             size - 1 - (size_t) total)) > 0)
+  {
+    total += read_amount;
+  }
+  buffer[total] = '\0';
+  close(capture_fd);
+
+  return (size_t) total;
+}
+
+static bool
+test_get_input_coalescing(void)
+{
+  int         saved_stdout, capture_fd, code;
+  size_t      frames;
+  char        out_buffer[BUFFER_SIZE], captured[4096];
+  const char *p;
+
+  if (!pipe_into_stdin("hello\x1b[D\x1b[D!\r") ||
+      (capture_fd = capture_stdout(&saved_stdout)) < 0)
+  {
+    TEST_PRINTF("Could not redirect input or output\n");
+    return false;
+  }
+
+  itl_string_init(&itl_g_line_buffer);
+  itl_char_buf_init(&itl_g_char_buffer);
+  itl_g_is_active = true;
+
+  code = tl_get_input(out_buffer, BUFFER_SIZE, "$ ");
+
+  itl_g_is_active = false;
+  ITL_FREE(itl_g_line_buffer.data);
+  ITL_FREE(itl_g_char_buffer.data);
+
+  restore_stdout(saved_stdout, capture_fd, captured, sizeof(captured));
+
+  /* Each frame hides the cursor first */
+  for (frames = 0, p = captured; (p = strstr(p, "\x1b[?25l")) != NULL; ++p) {
+    frames += 1;
+  }
+
+  /* Prompt, and everything that was typed ahead */
+  if (code != TL_PRESSED_ENTER || strcmp(out_buffer, "hel!lo") != 0 ||
+      frames != 2)
+  {
+    TEST_PRINTF("Result: '%s', code: %d, frames: %zu, should be: 'hel!lo', "
+                "%d, 2\n",
+                out_buffer, code, frames, TL_PRESSED_ENTER);
+    return false;
+  }
+
+  return true;
+}
+
+static char   callback_lines[3][BUFFER_SIZE];
+static size_t callback_count;
+
+static void
+record_line(TL_STATUS_CODE code, const char *line)
+{
+  if (code == TL_PRESSED_ENTER && callback_count < countof(callback_lines)) {
+    strcpy(callback_lines[callback_count], line);
+  }
+  callback_count += 1;
+  tl_begin_input("$ ", record_line);
+}
+
+static bool
+test_callback_input(void)
+{
+  int  saved_stdout, capture_fd, timeout;
+  char captured[4096];
+
+  if (!pipe_into_stdin("ok\r") ||
+      (capture_fd = capture_stdout(&saved_stdout)) < 0)
+  {
+    TEST_PRINTF("Could not redirect input or output\n");
+    return false;
+  }
+
+  itl_string_init(&itl_g_line_buffer);
+  itl_char_buf_init(&itl_g_char_buffer);
+  itl_g_is_active = true;
+  callback_count = 0;
+
+  tl_begin_input("$ ", record_line);
+  /* A line arrives in pieces, and the next one has a lone Esc */
+  tl_feed_bytes("hel", 3);
+  tl_feed_bytes("lo\rwor\x1b", 7);
+  timeout = tl_input_timeout();
+  tl_on_timeout();
+  tl_feed_bytes("ld\r", 3);
+  /* Last one is read from stdin */
+  tl_on_readable();
+  tl_end_input();
+
+  itl_g_is_active = false;
+  ITL_FREE(itl_g_line_buffer.data);
+  ITL_FREE(itl_g_char_buffer.data);
+  ITL_FREE(itl_g_on_line_buffer);
+  itl_g_on_line_buffer = NULL;
+
+  restore_stdout(saved_stdout, capture_fd, captured, sizeof(captured));
+
+  if (callback_count != 3 || timeout != itl_g_esc_timeout ||
+      strcmp(callback_lines[0], "hello") != 0 ||
+      strcmp(callback_lines[1], "world") != 0 ||
+      strcmp(callback_lines[2], "ok") != 0)
+  {
+    TEST_PRINTF("Lines: %zu, timeout: %d, should be: 3, %d\n", callback_count,
+                timeout, itl_g_esc_timeout);
+    return false;
+  }
+
+  return true;
+}
+
+static bool
+test_memory_backend(void)
+{
+  int                 first_code, second_code;
+  char                out_buffer[BUFFER_SIZE], output[4096];
+  tl_memory_backend_t mb;
+
+  /* Fix a typo in the middle, without a terminal */
+  const char input[] = "wrold\x1b[D\x1b[D\x1b[D\x7f\x1b[Cr\r";
+
+  tl_memory_backend_init(&mb, input, sizeof(input) - 1, output,
+                         sizeof(output) - 1);
+  tl_set_backend(&mb.backend);
+
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+  first_code = tl_get_input(out_buffer, BUFFER_SIZE, "$ ");
+  /* Input has ended */
+  second_code = tl_get_input(out_buffer + 6, BUFFER_SIZE - 6, "$ ");
+  tl_exit();
+  tl_set_backend(NULL);
+
+  output[ITL_MIN(mb.output_size, sizeof(output) - 1)] = '\0';
+
+  if (first_code != TL_PRESSED_ENTER || second_code != TL_ERROR ||
+      strcmp(out_buffer, "world") != 0 || strstr(output, "$ world") == NULL ||
+      mb.input_pos != mb.input_size)
+  {
+    TEST_PRINTF("Result: '%s', codes: %d, %d, should be: 'world', %d, %d\n",
+                out_buffer, first_code, second_code, TL_PRESSED_ENTER,
+                TL_ERROR);
+    return false;
+  }
+
+  return true;
+}
+
+static bool
+test_history_long_lines(void)
+{
+  int           fd;
+  size_t        i;
+  bool          result = true;
+  char          path[] = "/tmp/toiletline_test_XXXXXX";
+  char         *text;
+  itl_string_t *long_line, *short_line, *huge_line;
+
+  /* Longer than the file buffer of the loader, and than a line may be */
+  const size_t long_size = 3000, huge_size = ITL_STRING_MAX_LEN + 3;
+
+  text = (char *) malloc(huge_size + 1);
+  for (i = 0; i + 2 < huge_size; i += 2) {
+    memcpy(text + i, "ы", 2);
+  }
+  for (; i < huge_size; ++i) {
+    text[i] = '!';
+  }
+  text[huge_size] = '\0';
+
+  if ((fd = mkstemp(path)) < 0) {
+    free(text);
+    return false;
+  }
+  close(fd);
+
+  itl_g_is_active = true;
+
+  long_line = itl_string_alloc();
+  short_line = itl_string_alloc();
+  huge_line = itl_string_alloc();
+  itl_string_from_bytes(long_line, text, long_size);
+  ITL_STRING_FROM_CSTR(short_line, "ls -la");
+  ITL_STRING_FROM_CSTR(huge_line, text);
+
+  itl_g_history_append(long_line);
+  itl_g_history_append(short_line);
+  itl_g_history_append(huge_line);
+
+  if (itl_history_dump_to_file(path) != TL_SUCCESS ||
+      itl_history_load_from_file(path) != TL_SUCCESS)
+  {
+    TEST_PRINTF("Could not save and load history\n");
+    result = false;
+    goto end;
+  }
+
+  /* Huge line is truncated on a character boundary */
+  i = ITL_STRING_MAX_LEN;
+  while ((text[i] & 0xC0) == 0x80) {
+    i -= 1;
+  }
+  itl_string_from_bytes(huge_line, text, i);
+
+  if (itl_g_history.length != 3 ||
+      !itl_g_history_equal(0, long_line) ||
+      !itl_g_history_equal(1, short_line) ||
+      !itl_g_history_equal(2, huge_line))
+  {
+    TEST_PRINTF("Loaded history does not match the saved one\n");
+    result = false;
+  }
+
+end:
+  itl_g_history_free();
+  ITL_STRING_FREE(long_line);
+  ITL_STRING_FREE(short_line);
+  ITL_STRING_FREE(huge_line);
+  itl_g_is_active = false;
+  unlink(path);
+  free(text);
+
+  return result;
+}
+
+/* Splits all lines of `text` with `scan`, a few at a time. Returns false if
+   it's not text */
+static bool
+scan_all(itl_history_scan_t *scan, bool is_scalar, itl_history_entry_t *out,
+         size_t *out_count)
+{
+  size_t i;
+
+  *out_count = 0;
+  while (scan->line < scan->end) {
+    if (is_scalar) {
+      scan->line_count = 0;
+      if (!itl_history_scan_scalar(scan, scan->line)) {
+        return false;
+      }
+    } else if (!itl_history_scan(scan)) {
+      return false;
+    }
+    for (i = 0; i < scan->line_count; ++i) {
+      out[(*out_count)++] = scan->lines[i];
+    }
+  }
+  return true;
+}
+
+static bool
+test_history_scan(void)
+{
+  size_t              i, k, round, size, scalar_count, simd_count;
+  bool                scalar_result, simd_result;
+  char                text[16 * 1024];
+  itl_history_scan_t  scan;
+  itl_history_entry_t lines[3];
+
+  static itl_history_entry_t scalar[sizeof(text)], simd[sizeof(text)];
+
+  /* Newlines, CR, spaces and characters at every offset of a block, with
+     control bytes and lines that are truncated once in a while */
+  const char *const pieces[] = {"a", "\n", "\r\n", "\t", "я", "€", " "};
+
+  srand(3);
+  for (round = 0; round < 2000; ++round) {
+    for (size = 0; size + 8 < sizeof(text);) {
+      if (round % 50 == 0 && rand() % 200 == 0) {
+        for (k = 0; k < 3000 && size + 8 < sizeof(text); ++k) {
+          size += (size_t) sprintf(text + size, "я");
+        }
+      }
+      size += (size_t) sprintf(text + size, "%s",
+                               pieces[(size_t) rand() % countof(pieces)]);
+      if (rand() % 64 == 0) {
+        break;
+      }
+    }
+    if (round % 4 == 0) {
+      text[(size_t) rand() % size] = (rand() % 2 == 0) ? '\x01' : '\x7f';
+    }
+    text[size++] = '\n';
+
+    for (i = 0; i < 40 && i < size; i += 7) {
+      itl_history_scan_init(&scan, text + i, text + size, lines,
+                            countof(lines));
+      scalar_result = scan_all(&scan, true, scalar, &scalar_count);
+      itl_history_scan_init(&scan, text + i, text + size, lines,
+                            countof(lines));
+      simd_result = scan_all(&scan, false, simd, &simd_count);
+
+      if (scalar_result != simd_result ||
+          (scalar_result &&
+           (scalar_count != simd_count ||
+            memcmp(scalar, simd, scalar_count * sizeof(*scalar)) != 0)))
+      {
+        TEST_PRINTF("Round %zu at %zu: %d with %zu lines, should be: %d with "
+                    "%zu lines\n",
+                    round, i, simd_result, simd_count, scalar_result,
+                    scalar_count);
+        return false;
+      }
+    }
+  }
+
+  /* Lengths come from the count of continuation bytes */
+  strcpy(text, "мир\r\n\n€uro\n");
+  itl_history_scan_init(&scan, text, text + strlen(text), lines,
+                        countof(lines));
+  if (!itl_history_scan(&scan) || scan.line_count != 3 ||
+      lines[0].size != 6 || lines[0].length != 3 || lines[1].size != 0 ||
+      lines[2].offset != 9 || lines[2].length != 4)
+  {
+    TEST_PRINTF("Lines were split wrong\n");
+    return false;
+  }
+
+  return true;
+}
+
+static bool
+test_history_load(void)
+{
+  int           fd;
+  size_t        i, k, round, size, start, count;
+  bool          result = true;
+  char          path[] = "/tmp/toiletline_test_XXXXXX";
+  char          out_buffer[BUFFER_SIZE], random_text[4096];
+  char          expected[20][BUFFER_SIZE];
+  itl_string_t *str;
+
+  /* Lines may end with CRLF, and an unfinished line is left out */
+  const char text[] = "ls -la\r\n\ngit status\nмир\r\nunfinished";
+  const char *const lines[] = {"ls -la", "", "git status", "мир"};
+
+  const char *const bad_texts[] = {"ls\n\x01\n", "ls\n\xd1\n", "\x7f\n"};
+  const char *const bad_prefixes[] = {"\x01\x02\n", "\xff\n"};
+
+  if ((fd = mkstemp(path)) < 0) {
+    return false;
+  }
+
+  itl_g_is_active = true;
+
+  if (write(fd, text, sizeof(text) - 1) != (ssize_t) sizeof(text) - 1 ||
+      itl_history_load_from_file(path) != TL_SUCCESS ||
+      tl_history_length() != countof(lines))
+  {
+    TEST_PRINTF("Loaded %zu lines, should be: %zu\n", tl_history_length(),
+                countof(lines));
+    result = false;
+    goto end;
+  }
+  for (i = 0; i < countof(lines); ++i) {
+    if (tl_history_get(i, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+        strcmp(out_buffer, lines[i]) != 0)
+    {
+      TEST_PRINTF("Line %zu: '%s', should be: '%s'\n", i, out_buffer,
+                  lines[i]);
+      result = false;
+    }
+  }
+
+  /* An empty file has no lines */
+  if (ftruncate(fd, 0) != 0 || itl_history_load_from_file(path) != TL_SUCCESS ||
+      tl_history_length() != 0)
+  {
+    TEST_PRINTF("Empty file was not loaded\n");
+    result = false;
+  }
+
+  /* Files that are not text are not loaded, and not overwritten */
+  for (i = 0; i < countof(bad_texts); ++i) {
+    if (ftruncate(fd, 0) != 0 ||
+        pwrite(fd, bad_texts[i], strlen(bad_texts[i]), 0) < 0)
+    {
+      result = false;
+      break;
+    }
+    errno = 0;
+    if (itl_history_load_from_file(path) != TL_ERROR || errno != EINVAL ||
+        tl_history_length() != 0 || !itl_g_history_file_is_bad)
+    {
+      TEST_PRINTF("File %zu was loaded\n", i);
+      result = false;
+    }
+  }
+  itl_g_history_file_is_bad = false;
+
+  /* Lines that would be dropped are checked too */
+  tl_history_set_limits(100, 0);
+  for (i = 0; i < countof(bad_prefixes); ++i) {
+    size = strlen(bad_prefixes[i]);
+    memcpy(random_text, bad_prefixes[i], size);
+    for (k = 0; k < 400; ++k) {
+      size += (size_t) snprintf(random_text + size, sizeof(random_text) - size,
+                                "ls %zu\n", k);
+    }
+    errno = 0;
+    if (itl_history_load_from_bytes(random_text, size) != TL_ERROR ||
+        errno != EINVAL)
+    {
+      TEST_PRINTF("Text after %zu was loaded\n", i);
+      result = false;
+    }
+  }
+  itl_g_history_free();
+
+  /* Only lines that would be kept are read, and they are the same as if all
+     of them were appended */
+  str = itl_string_alloc();
+  srand(2);
+  for (round = 0; round < 500; ++round) {
+    /* Copies that follow each other, lines over the budget, and CRLF */
+    for (k = 0, size = 0; k < 50; ++k) {
+      size += (size_t) snprintf(
+          random_text + size, sizeof(random_text) - size, "%s%d%s\n",
+          (rand() % 4 == 0) ? "0123456789012345678901234567890123456789" : "",
+          rand() % 5, (rand() % 3 == 0) ? "\r" : "");
+    }
+    tl_history_set_limits((size_t) (1 + rand() % 20),
+                          (size_t) (rand() % 2 * (rand() % 200)));
+
+    itl_g_history_free();
+    for (i = 0, start = 0; i < size; ++i) {
+      if (random_text[i] == '\n') {
+        itl_string_from_bytes(
+            str, random_text + start,
+            itl_history_line_size(random_text + start, i - start));
+        itl_g_history_append(str);
+        start = i + 1;
+      }
+    }
+    count = tl_history_length();
+    for (i = 0; i < count; ++i) {
+      tl_history_get(i, expected[i], sizeof(expected[i]));
+    }
+
+    itl_g_history_free();
+    itl_history_load_from_bytes(random_text, size);
+    if (tl_history_length() != count) {
+      TEST_PRINTF("Loaded %zu lines, should be: %zu\n", tl_history_length(),
+                  count);
+      result = false;
+      break;
+    }
+    for (i = 0; i < count; ++i) {
+      tl_history_get(i, out_buffer, sizeof(out_buffer));
+      if (strcmp(out_buffer, expected[i]) != 0) {
+        TEST_PRINTF("Line %zu: '%s', should be: '%s'\n", i, out_buffer,
+                    expected[i]);
+        result = false;
+        break;
+      }
+    }
+  }
+  ITL_STRING_FREE(str);
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+
+end:
+  itl_g_history_free();
+  itl_g_is_active = false;
+  close(fd);
+  unlink(path);
+
+  return result;
+}
+
+/* Hashes texts of all lines in history */
+static uint64_t
+hash_history(void)
+{
+  size_t   i;
+  uint64_t hash = ITL_HASH_INIT;
+  char     out_buffer[BUFFER_SIZE];
+
+  for (i = 0; i < tl_history_length(); ++i) {
+    tl_history_get(i, out_buffer, sizeof(out_buffer));
+    hash = itl_hash_bytes(hash, out_buffer, strlen(out_buffer) + 1);
+  }
+  return hash;
+}
+
+static bool
+test_history_load_chunks(void)
+{
+  int      fd;
+  size_t   i, k, length;
+  uint64_t hash;
+  bool     result = true;
+  char     path[] = "/tmp/toiletline_test_XXXXXX";
+  FILE    *file;
+
+  if ((fd = mkstemp(path)) < 0 || (file = fdopen(fd, "w")) == NULL) {
+    return false;
+  }
+
+  /* Chunks with more lines than fit at once, with long lines, copies and
+     CRLF */
+  for (i = 0; i < 200000; ++i) {
+    fprintf(file, "echo %zu готово\n", i % 5000);
+  }
+  for (i = 0; i < 700000; ++i) {
+    fputs((i % 3 == 0) ? "a\r\n" : (i % 3 == 1) ? "b\n" : "b\n", file);
+  }
+  for (i = 0; i < 3000; ++i) {
+    fprintf(file, "%0*zu\n", (int) (i % 3000), i);
+  }
+  fclose(file);
+
+  itl_g_is_active = true;
+  tl_history_set_limits(1 << 20, 0);
+
+  /* Lines are the same as when the file is parsed on one thread */
+  for (k = 0; k < 2; ++k) {
+    tl_history_set_erase_duplicates((int) k);
+
+    itl_g_history_threads = 1;
+    if (itl_history_load_from_file(path) != TL_SUCCESS) {
+      TEST_PRINTF("Could not load history file\n");
+      result = false;
+      break;
+    }
+    length = tl_history_length();
+    hash = hash_history();
+
+    itl_g_history_threads = TL_HISTORY_THREADS;
+    if (itl_history_load_from_file(path) != TL_SUCCESS ||
+        tl_history_length() != length || hash_history() != hash)
+    {
+      TEST_PRINTF("Loaded %zu lines on threads, should be: %zu\n",
+                  tl_history_length(), length);
+      result = false;
+    }
+  }
+  tl_history_set_erase_duplicates(0);
+
+  /* A binary byte in the last chunk */
+  file = fopen(path, "a");
+  fputs("ls\n\x01\n", file);
+  fclose(file);
+  if (itl_history_load_from_file(path) != TL_ERROR || errno != EINVAL ||
+      !itl_g_history_file_is_bad || tl_history_length() != 0)
+  {
+    TEST_PRINTF("Loaded a binary file\n");
+    result = false;
+  }
+
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_g_history_free();
+  itl_g_is_active = false;
+  unlink(path);
+
+  return result;
+}
+
+/* Returns contents of the file at `path`, which should be freed */
+static char *
+read_whole_file(const char *path, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+  char *data = (char *) malloc(1024 * 1024);
+
+  *size = fread(data, 1, 1024 * 1024 - 1, file);
+  data[*size] = '\0';
+  fclose(file);
+
+  return data;
+}
+
+static bool
+test_history_open(void)
+{
+  int                 fd;
+  size_t              i, size;
+  bool                result = true;
+  char                path[] = "/tmp/toiletline_test_XXXXXX";
+  char                out_buffer[BUFFER_SIZE], output[4096], input[8192];
+  char               *text;
+  tl_memory_backend_t mb;
+
+  const char initial[] = "ls -la\ngit status\n";
+
+  if ((fd = mkstemp(path)) < 0) {
+    return false;
+  }
+  if (write(fd, initial, sizeof(initial) - 1) !=
+      (ssize_t) sizeof(initial) - 1)
+  {
+    close(fd);
+    unlink(path);
+    return false;
+  }
+  close(fd);
+
+  /* Lines are appended as soon as they are entered, each in one piece */
+  snprintf(input, sizeof(input), "make\rx\rmake test\r");
+  tl_memory_backend_init(&mb, input, strlen(input), output, sizeof(output));
+  tl_set_backend(&mb.backend);
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    unlink(path);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+  tl_history_set_limits(8, 0);
+  tl_history_set_sync(1);
+
+  if (tl_history_open(path) != TL_SUCCESS || tl_history_length() != 2) {
+    TEST_PRINTF("Could not open history file\n");
+    result = false;
+    goto end;
+  }
+  for (i = 0; i < 3; ++i) {
+    tl_get_input(out_buffer, sizeof(out_buffer), "$ ");
+  }
+  text = read_whole_file(path, &size);
+  if (strcmp(text, "ls -la\ngit status\nmake\nmake test\n") != 0) {
+    TEST_PRINTF("File has '%s'\n", text);
+    result = false;
+  }
+  free(text);
+
+  /* Once dropped lines take more than half of it, it is rewritten with
+     lines that are kept */
+  for (i = 0, size = 0; i < 200; ++i) {
+    size += (size_t) snprintf(input + size, sizeof(input) - size,
+                              "echo line number %zu\r", i);
+  }
+  tl_memory_backend_init(&mb, input, size, output, sizeof(output));
+  for (i = 0; i < 200; ++i) {
+    tl_get_input(out_buffer, sizeof(out_buffer), "$ ");
+  }
+  text = read_whole_file(path, &size);
+  if (size > ITL_HISTORY_COMPACT_MIN_SIZE ||
+      strstr(text, "echo line number 199\n") == NULL ||
+      strstr(text, "ls -la") != NULL)
+  {
+    TEST_PRINTF("File has %zu bytes\n", size);
+    result = false;
+  }
+  free(text);
+
+  /* And it has the same lines */
+  tl_history_open(path);
+  if (tl_history_length() != 8 ||
+      tl_history_get(7, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "echo line number 199") != 0)
+  {
+    TEST_PRINTF("Loaded %zu lines\n", tl_history_length());
+    result = false;
+  }
+
+end:
+  tl_history_set_sync(0);
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  tl_exit();
+  tl_set_backend(NULL);
+  unlink(path);
+
+  return result;
+}
+
+static bool
+test_history_share(void)
+{
+#if defined ITL_SHARED_HISTORY
+  int                 fd, status;
+  size_t              i, length;
+  bool                result = true;
+  char                path[] = "/tmp/toiletline_test_XXXXXX";
+  char                out_buffer[BUFFER_SIZE * 4], output[4096];
+  uint32_t            session;
+  pid_t               child;
+  itl_string_t        view;
+  tl_memory_backend_t mb;
+
+  /* Pick up lines of others right before going up */
+  const char input[] = "\x1b[A\rmy line\r";
+
+/* Puts a line into the ring as another process would */
+#define FOREIGN_APPEND(text)                                                   \
+  do {                                                                         \
+    itl_g_shared.session = session + 1;                                        \
+    itl_string_view(&view, (text), strlen(text), strlen(text));                \
+    itl_shared_append(&view);                                                  \
+    itl_g_shared.session = session;                                            \
+  } while (0)
+
+  if ((fd = mkstemp(path)) < 0) {
+    return false;
+  }
+  close(fd);
+
+  tl_memory_backend_init(&mb, input, sizeof(input) - 1, output,
+                         sizeof(output));
+  tl_set_backend(&mb.backend);
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    unlink(path);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+  tl_history_set_limits(16384, 0);
+
+  if (tl_history_share(path) != TL_SUCCESS || tl_history_length() != 0) {
+    TEST_PRINTF("Could not share history\n");
+    result = false;
+    goto end;
+  }
+  session = itl_g_shared.session;
+
+  FOREIGN_APPEND("echo foreign");
+  memset(out_buffer, 'x', 300);
+  out_buffer[300] = '\0';
+  FOREIGN_APPEND(out_buffer);
+  FOREIGN_APPEND("make foreign");
+
+  tl_get_input(out_buffer, sizeof(out_buffer), "$ ");
+  if (strcmp(out_buffer, "make foreign") != 0 || tl_history_length() != 3 ||
+      tl_history_get(1, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strlen(out_buffer) != 300)
+  {
+    TEST_PRINTF("Got '%s' with %zu lines\n", out_buffer, tl_history_length());
+    result = false;
+  }
+
+  /* Own lines are not picked up again */
+  tl_get_input(out_buffer, sizeof(out_buffer), "$ ");
+  length = tl_history_length();
+  itl_shared_pick_up();
+  if (tl_history_length() != length) {
+    TEST_PRINTF("Own line was picked up\n");
+    result = false;
+  }
+
+  /* A line that is never written is skipped on the second try */
+  __atomic_fetch_add(&itl_g_shared.header->head, 1, __ATOMIC_RELAXED);
+  FOREIGN_APPEND("after a dead one");
+  itl_shared_pick_up();
+  itl_shared_pick_up();
+  if (tl_history_get(length, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "after a dead one") != 0)
+  {
+    TEST_PRINTF("Did not skip an unwritten line\n");
+    result = false;
+  }
+  length += 1;
+
+  /* Lines that were overwritten before they were read are lost */
+  for (i = 0; i < ITL_SHARED_SLOT_COUNT + 100; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer), "lapped %zu", i);
+    FOREIGN_APPEND(out_buffer);
+  }
+  itl_shared_pick_up();
+  if (tl_history_length() != length + ITL_SHARED_SLOT_COUNT ||
+      tl_history_get(length, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "lapped 100") != 0)
+  {
+    TEST_PRINTF("Got '%s' with %zu lines\n", out_buffer, tl_history_length());
+    result = false;
+  }
+
+  /* Processes append at the same time without losing lines */
+  itl_g_history_free();
+  fflush(stdout);
+  child = fork();
+  if (child == 0) {
+    /* Mapping is inherited, but the session should be different */
+    tl_history_share(path);
+    for (i = 0; i < 2000; ++i) {
+      snprintf(out_buffer, sizeof(out_buffer), "child %zu", i);
+      itl_string_view(&view, out_buffer, strlen(out_buffer),
+                      strlen(out_buffer));
+      itl_shared_append(&view);
+    }
+    _exit(0);
+  }
+  for (i = 0; i < 2000; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer), "parent %zu", i);
+    itl_string_view(&view, out_buffer, strlen(out_buffer), strlen(out_buffer));
+    itl_shared_append(&view);
+  }
+  if (child < 0 || waitpid(child, &status, 0) != child) {
+    TEST_PRINTF("Could not fork\n");
+    result = false;
+    goto end;
+  }
+  itl_shared_pick_up();
+  for (i = 0, length = 0; i < tl_history_length(); ++i) {
+    tl_history_get(i, out_buffer, sizeof(out_buffer));
+    snprintf(out_buffer + BUFFER_SIZE, BUFFER_SIZE, "child %zu", length);
+    if (strcmp(out_buffer, out_buffer + BUFFER_SIZE) == 0) {
+      length += 1;
+    }
+  }
+  if (length != 2000 || tl_history_length() != 2000) {
+    TEST_PRINTF("Got %zu of 2000 lines in order, %zu in total\n", length,
+                tl_history_length());
+    result = false;
+  }
+
+#undef FOREIGN_APPEND
+
+end:
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  tl_exit();
+  tl_set_backend(NULL);
+  unlink(path);
+
+  return result;
+#else  /* ITL_SHARED_HISTORY */
+  return tl_history_share("/tmp/toiletline_test") == TL_ERROR &&
+         errno == ENOSYS;
+#endif /* ITL_SHARED_HISTORY */
+}
+
+static bool
+test_history_ring(void)
+{
+  size_t              i;
+  bool                result = true;
+  char                out_buffer[BUFFER_SIZE], output[4096];
+  tl_memory_backend_t mb;
+
+  /* Jump to the oldest line, then walk forward once */
+  const char input[] = "\x1b<\x1b[B\r";
+
+  tl_memory_backend_init(&mb, input, sizeof(input) - 1, output,
+                         sizeof(output));
+  tl_set_backend(&mb.backend);
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+
+  /* Oldest lines are overwritten */
+  for (i = 0; i < TL_HISTORY_MAX_SIZE + 10; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer), "line %zu", i);
+    tl_set_predefined_input(out_buffer);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+  itl_string_clear(&itl_g_line_buffer);
+
+  if (tl_history_length() != TL_HISTORY_MAX_SIZE ||
+      tl_history_get(0, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "line 10") != 0 ||
+      tl_history_get(TL_HISTORY_MAX_SIZE, out_buffer, sizeof(out_buffer)) !=
+          TL_ERROR)
+  {
+    TEST_PRINTF("History has %zu lines, should be: %d\n", tl_history_length(),
+                TL_HISTORY_MAX_SIZE);
+    result = false;
+  }
+
+  if (tl_get_input(out_buffer, sizeof(out_buffer), "$ ") != TL_PRESSED_ENTER ||
+      strcmp(out_buffer, "line 11") != 0)
+  {
+    TEST_PRINTF("Result: '%s', should be: 'line 11'\n", out_buffer);
+    result = false;
+  }
+
+  tl_exit();
+  tl_set_backend(NULL);
+
+  return result;
+}
+
+static bool
+test_history_arena(void)
+{
+  size_t       i, n, alloc_count;
+  bool         result = true;
+  char         text[64], out_buffer[64];
+  itl_string_t *str = itl_string_alloc();
+
+  alloc_count = itl_g_alloc_count;
+
+  /* Overwrite the ring a few times, so that the arena has to be compacted */
+  for (i = 0; i < TL_HISTORY_MAX_SIZE * 4; ++i) {
+    snprintf(text, sizeof(text), "%zu %.*s", i, (int) (i % 40),
+             "----------------------------------------");
+    itl_string_from_bytes(str, text, strlen(text));
+    itl_g_history_append(str);
+  }
+
+  if (itl_g_alloc_count - alloc_count != 2) {
+    TEST_PRINTF("History took %zu allocations, should be: 2\n",
+                itl_g_alloc_count - alloc_count);
+    result = false;
+  }
+  if (itl_g_history.text_capacity > (TL_HISTORY_MAX_SIZE * 48) * 4 &&
+      itl_g_history.text_capacity > ITL_HISTORY_TEXT_INIT_SIZE)
+  {
+    TEST_PRINTF("Arena grew to %zu bytes\n", itl_g_history.text_capacity);
+    result = false;
+  }
+
+  for (n = 0; n < tl_history_length(); ++n) {
+    i = TL_HISTORY_MAX_SIZE * 3 + n;
+    snprintf(text, sizeof(text), "%zu %.*s", i, (int) (i % 40),
+             "----------------------------------------");
+    if (tl_history_get(n, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+        strcmp(out_buffer, text) != 0)
+    {
+      TEST_PRINTF("Entry %zu: '%s', should be: '%s'\n", n, out_buffer, text);
+      result = false;
+      break;
+    }
+  }
+
+  /* The newest entry is edited in place */
+  itl_string_from_bytes(str, "edited", 6);
+  itl_g_history_replace_last(str);
+  itl_string_from_bytes(str, "next", 4);
+  itl_g_history_append(str);
+  if (tl_history_get(tl_history_length() - 2, out_buffer,
+                     sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "edited") != 0 ||
+      tl_history_get(tl_history_length() - 1, out_buffer,
+                     sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "next") != 0)
+  {
+    TEST_PRINTF("Replaced entry was lost\n");
+    result = false;
+  }
+
+  /* Empty lines have text too */
+  itl_g_history_free();
+  itl_string_clear(str);
+  itl_g_history_append(str);
+  if (itl_g_history.text == NULL ||
+      tl_history_get(0, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "") != 0 || !itl_g_history_equal(0, str))
+  {
+    TEST_PRINTF("Empty line has no text\n");
+    result = false;
+  }
+
+  itl_g_history_free();
+  ITL_STRING_FREE(str);
+
+  return result;
+}
+
+static bool
+test_history_limits(void)
+{
+  size_t        i;
+  int           prefix;
+  bool          result = true;
+  char          text[128], out_buffer[128];
+  itl_string_t *str = itl_string_alloc();
+  itl_string_t *line = itl_string_alloc();
+  itl_le_t      le;
+
+  if (tl_history_set_limits(0, 0) != TL_ERROR) {
+    TEST_PRINTF("Limit of 0 entries was accepted\n");
+    result = false;
+  }
+
+  /* Lines of 10 bytes, 3 of which fit */
+  tl_history_set_limits(1000, 35);
+  for (i = 0; i < 10; ++i) {
+    snprintf(text, sizeof(text), "line %05zu", i);
+    ITL_STRING_FROM_CSTR(str, text);
+    itl_g_history_append(str);
+  }
+  if (tl_history_length() != 3 ||
+      tl_history_get(0, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "line 00007") != 0)
+  {
+    TEST_PRINTF("History has %zu lines, should be: 3\n", tl_history_length());
+    result = false;
+  }
+
+  /* A line over the budget is not kept, and doesn't push others out */
+  memset(text, 'x', 100);
+  text[100] = '\0';
+  ITL_STRING_FROM_CSTR(str, text);
+  if (itl_g_history_append(str) || tl_history_length() != 3) {
+    TEST_PRINTF("Line over the budget was appended\n");
+    result = false;
+  }
+
+  /* Up with a line over the budget browses from the newest entry, and an
+     edited entry is not replaced by what was typed */
+  for (prefix = 0; prefix < 2; ++prefix) {
+    tl_history_set_limits(10, 16);
+    tl_history_set_prefix_navigation(prefix);
+    itl_g_history_free();
+    ITL_STRING_FROM_CSTR(str, "ls");
+    itl_g_history_append(str);
+
+    itl_le_init(&le, line, out_buffer, sizeof(out_buffer), "$ ");
+    ITL_STRING_FROM_CSTR(line, "ls -la /usr/share/doc/toiletline");
+    le.cursor_position = line->length;
+    itl_le_key_handle(&le, TL_KEY_UP);
+    if (!itl_string_equal(line, str)) {
+      TEST_PRINTF("Up did not show the newest entry, prefix navigation %d\n",
+                  prefix);
+      result = false;
+    }
+
+    itl_string_to_cstr(line, text, sizeof(text));
+    strcat(text, "x");
+    ITL_STRING_FROM_CSTR(line, text);
+    le.cursor_position = line->length;
+    itl_le_key_handle(&le, TL_KEY_UP);
+    if (tl_history_get(0, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+        strcmp(out_buffer, "ls") != 0 || itl_g_history_size() > 16)
+    {
+      TEST_PRINTF("Entry was replaced by '%s', prefix navigation %d\n",
+                  out_buffer, prefix);
+      result = false;
+    }
+  }
+  tl_history_set_prefix_navigation(0);
+  tl_history_set_limits(1000, 35);
+  itl_g_history_free();
+  for (i = 7; i < 10; ++i) {
+    snprintf(text, sizeof(text), "line %05zu", i);
+    ITL_STRING_FROM_CSTR(str, text);
+    itl_g_history_append(str);
+  }
+
+  /* Lowering the limits drops the oldest lines right away */
+  tl_history_set_limits(2, 0);
+  if (tl_history_length() != 2 ||
+      tl_history_get(0, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "line 00008") != 0)
+  {
+    TEST_PRINTF("History has %zu lines, should be: 2\n", tl_history_length());
+    result = false;
+  }
+
+  /* Any amount that is not a power of 2 */
+  tl_history_set_limits(1000, 0);
+  for (i = 0; i < 2500; ++i) {
+    snprintf(text, sizeof(text), "line %05zu", i);
+    ITL_STRING_FROM_CSTR(str, text);
+    itl_g_history_append(str);
+  }
+  if (tl_history_length() != 1000 ||
+      tl_history_get(0, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "line 01500") != 0 ||
+      tl_history_get(999, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+      strcmp(out_buffer, "line 02499") != 0)
+  {
+    TEST_PRINTF("History has %zu lines, should be: 1000\n",
+                tl_history_length());
+    result = false;
+  }
+
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_g_history_free();
+  ITL_STRING_FREE(str);
+  ITL_STRING_FREE(line);
+
+  return result;
+}
+
+/* Whether history has exactly `count` of `lines`, oldest first */
+static bool
+history_is(const char *const *lines, size_t count)
+{
+  size_t i;
+  char   out_buffer[BUFFER_SIZE];
+
+  if (tl_history_length() != count) {
+    return false;
+  }
+  for (i = 0; i < count; ++i) {
+    if (tl_history_get(i, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+        strcmp(out_buffer, lines[i]) != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool
+test_history_erase_duplicates(void)
+{
+  size_t              i;
+  int                 fd, first_code, second_code;
+  bool                result = true;
+  char                path[] = "/tmp/toiletline_test_XXXXXX";
+  char                out_buffer[BUFFER_SIZE], output[4096];
+  itl_string_t       *str = itl_string_alloc();
+  tl_memory_backend_t mb;
+
+  const char *const appended[] = {"a", "b", "c", "a", "b", "d", "c"};
+  const char *const unique[] = {"a", "b", "d", "c"};
+  const char *const browsed[] = {"a", "b", "c", "d"};
+  const char *const loaded[] = {"x", "z", "y"};
+  const char *const merged[] = {"x", "z", "y", "a", "b", "d", "c"};
+  const char *const commands[] = {"make", "ls", "cd ..", "git status", "vim"};
+  const char *const shifted[] = {"a0", "a1", "b", "c", "d", "b"};
+
+  /* Up twice to "d", then Up thrice and Down once to "c" */
+  const char input[] = "\x1b[A\x1b[A\r\x1b[A\x1b[A\x1b[A\x1b[B\r";
+
+  tl_history_set_limits(100, 0);
+  tl_history_set_erase_duplicates(1);
+
+  for (i = 0; i < countof(appended); ++i) {
+    ITL_STRING_FROM_CSTR(str, appended[i]);
+    itl_g_history_append(str);
+  }
+  if (!history_is(unique, countof(unique))) {
+    TEST_PRINTF("Duplicates were not erased\n");
+    result = false;
+  }
+
+  /* Erased entries are skipped while browsing. Nothing should be allocated
+     before tl_init() */
+  itl_g_history_free();
+  ITL_STRING_FREE(str);
+  tl_memory_backend_init(&mb, input, sizeof(input) - 1, output,
+                         sizeof(output));
+  tl_set_backend(&mb.backend);
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+  for (i = 0; i < countof(appended); ++i) {
+    tl_set_predefined_input(appended[i]);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+  itl_string_clear(&itl_g_line_buffer);
+  first_code = tl_get_input(out_buffer, sizeof(out_buffer), "$ ");
+  if (first_code != TL_PRESSED_ENTER || strcmp(out_buffer, "d") != 0 ||
+      !history_is(browsed, countof(browsed)))
+  {
+    TEST_PRINTF("Result: '%s', should be: 'd'\n", out_buffer);
+    result = false;
+  }
+  second_code = tl_get_input(out_buffer, sizeof(out_buffer), "$ ");
+  if (second_code != TL_PRESSED_ENTER || strcmp(out_buffer, "c") != 0) {
+    TEST_PRINTF("Result: '%s', should be: 'c'\n", out_buffer);
+    result = false;
+  }
+
+  /* Reading history while browsing it doesn't move the selection. Up four
+     times to "a1", then Down to "c" */
+  itl_g_history_free();
+  for (i = 0; i < countof(shifted); ++i) {
+    tl_set_predefined_input(shifted[i]);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+  itl_string_clear(&itl_g_line_buffer);
+  callback_count = 0;
+  tl_begin_input("$ ", record_line);
+  tl_feed_bytes("\x1b[A\x1b[A\x1b[A\x1b[A", 12);
+  tl_history_get(0, out_buffer, sizeof(out_buffer));
+  tl_feed_bytes("\x1b[B\r", 4);
+  tl_end_input();
+  ITL_FREE(itl_g_on_line_buffer);
+  itl_g_on_line_buffer = NULL;
+  if (callback_count != 1 || strcmp(callback_lines[0], "c") != 0) {
+    TEST_PRINTF("Lines: %zu, result: '%s', should be: 1, 'c'\n",
+                callback_count, callback_lines[0]);
+    result = false;
+  }
+  tl_exit();
+  tl_set_backend(NULL);
+
+  /* Repeated commands don't pile up */
+  str = itl_string_alloc();
+  itl_g_is_active = true;
+  for (i = 0; i < 1000; ++i) {
+    ITL_STRING_FROM_CSTR(str, commands[i % countof(commands)]);
+    itl_g_history_append(str);
+  }
+  if (tl_history_length() != countof(commands) ||
+      itl_g_history.length > countof(commands) * 2 + 1)
+  {
+    TEST_PRINTF("History has %zu lines in %zu entries, should be: %zu\n",
+                tl_history_length(), itl_g_history.length, countof(commands));
+    result = false;
+  }
+
+  /* Lines are erased while loading as well */
+  if ((fd = mkstemp(path)) < 0) {
+    ITL_STRING_FREE(str);
+    return false;
+  }
+  if (write(fd, "x\ny\nx\nz\ny\n", 10) != 10 ||
+      tl_history_load(path) != TL_SUCCESS ||
+      !history_is(loaded, countof(loaded)))
+  {
+    TEST_PRINTF("Loaded history has %zu lines, should be: 3\n",
+                tl_history_length());
+    result = false;
+  }
+  close(fd);
+  unlink(path);
+
+  /* Enabling it erases duplicates that were already there */
+  tl_history_set_erase_duplicates(0);
+  for (i = 0; i < countof(appended); ++i) {
+    ITL_STRING_FROM_CSTR(str, appended[i]);
+    itl_g_history_append(str);
+  }
+  tl_history_set_erase_duplicates(1);
+  if (!history_is(merged, countof(merged))) {
+    TEST_PRINTF("Duplicates were not erased after enabling\n");
+    result = false;
+  }
+
+  tl_history_set_erase_duplicates(0);
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_g_history_free();
+  itl_g_is_active = false;
+  ITL_STRING_FREE(str);
+
+  return result;
+}
+
+static bool
+test_history_search(void)
+{
+  size_t              i, k, n, expected;
+  bool                result = true;
+  char                out_buffer[BUFFER_SIZE], output[4096];
+  itl_key_t           key = ITL_ZERO_INIT;
+  itl_le_t            le;
+  tl_memory_backend_t mb;
+
+  const char *const history[] = {"git status", "make test",
+                                 "git commit -m 'fix'", "ls -la", "git push"};
+
+  /* Ctrl-R and Ctrl-S, each line is a separate input */
+  const char input[] = "\x12git\r"
+                       "\x12git\x12\r"
+                       "\x12git\x12\x12\x13\r"
+                       "\x12git s\r"
+                       "\x12make\x12\r"
+                       "\x12ls\x05!\r"
+                       "\x12gitx\x7f\r";
+  const char *const results[] = {"git push",   "git commit -m 'fix'",
+                                 "git commit -m 'fix'", "git status",
+                                 "make test",  "ls -la!", "git push"};
+
+  const char *const queries[] = {"echo 12", "99", "echo 2999", "1234", "o 5",
+                                 "nothing", "7", "x", "0e"};
+
+  tl_history_set_limits(100, 0);
+  tl_memory_backend_init(&mb, input, sizeof(input) - 1, output,
+                         sizeof(output));
+  tl_set_backend(&mb.backend);
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+
+  for (i = 0; i < countof(results); ++i) {
+    /* Lines that were entered are appended, so keep history the same */
+    itl_g_history_free();
+    for (k = 0; k < countof(history); ++k) {
+      tl_set_predefined_input(history[k]);
+      itl_g_history_append(&itl_g_line_buffer);
+    }
+    itl_string_clear(&itl_g_line_buffer);
+
+    if (tl_get_input(out_buffer, sizeof(out_buffer), "$ ") !=
+            TL_PRESSED_ENTER ||
+        strcmp(out_buffer, results[i]) != 0)
+    {
+      TEST_PRINTF("Result: '%s', should be: '%s'\n", out_buffer, results[i]);
+      result = false;
+    }
+  }
+
+  /* Query is shown instead of the prompt, with the cursor at the match */
+  itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+  itl_le_key_handle(&le, TL_KEY_SEARCH_BACKWARD);
+  for (i = 0; i < 3; ++i) {
+    key.ch.bytes[0] = (uint8_t) "mit"[i];
+    key.ch.size = 1;
+    itl_le_key_apply(&le, &key);
+  }
+  if (strcmp(le.prompt, "(reverse-i-search)`mit': ") != 0 ||
+      le.prompt_size != 25 || le.cursor_position != 7)
+  {
+    TEST_PRINTF("Prompt: '%s', cursor: %zu\n", le.prompt, le.cursor_position);
+    result = false;
+  }
+  key.key = TL_KEY_SEARCH_FORWARD;
+  itl_le_key_apply(&le, &key);
+  if (strcmp(le.prompt, "(failed i-search)`mit': ") != 0) {
+    TEST_PRINTF("Prompt: '%s'\n", le.prompt);
+    result = false;
+  }
+  key.key = TL_KEY_ESCAPE;
+  itl_le_key_apply(&le, &key);
+  if (strcmp(le.prompt, "$ ") != 0 || le.line->length != 0) {
+    TEST_PRINTF("Prompt: '%s', line length: %zu\n", le.prompt,
+                le.line->length);
+    result = false;
+  }
+
+  /* Trigram lists and sets of groups are kept up to date while entries are
+     overwritten */
+  itl_g_history_free();
+  tl_history_set_limits(1000, 0);
+  for (i = 0; i < 3000; ++i) {
+    snprintf(out_buffer, sizeof(out_buffer), "echo %zu", i);
+    tl_set_predefined_input(out_buffer);
+    itl_g_history_append(&itl_g_line_buffer);
+    if (i == 10) {
+      itl_g_history_trigrams_build();
+    }
+  }
+  itl_string_clear(&itl_g_line_buffer);
+
+  for (i = 0; i < countof(queries); ++i) {
+    expected = ITL_HISTORY_NOT_SELECTED;
+    for (n = ITL_HISTORY_LAST() + 1; n > itl_g_history.first; --n) {
+      if (itl_g_history_find(n - 1, queries[i], strlen(queries[i])) !=
+          ITL_HISTORY_AT(n - 1)->size)
+      {
+        expected = n - 1;
+        break;
+      }
+    }
+    n = itl_g_history_search(queries[i], strlen(queries[i]),
+                             ITL_HISTORY_LAST() + 1);
+    if (n != expected) {
+      TEST_PRINTF("Query '%s' found %zu, should be: %zu\n", queries[i], n,
+                  expected);
+      result = false;
+    }
+  }
+
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  tl_exit();
+  tl_set_backend(NULL);
+
+  return result;
+}
+
+static bool
+history_entries_equal(size_t a, size_t b)
+{
+  const itl_history_entry_t *entry = ITL_HISTORY_AT(b);
+  return ITL_HISTORY_AT(a)->size == entry->size &&
+         itl_g_history_compare_prefix(a, ITL_HISTORY_TEXT(entry),
+                                      entry->size) == 0;
+}
+
+static bool
+test_history_prefix(void)
+{
+  size_t              i, k, n, round, expected, previous;
+  bool                result = true;
+  char                out_buffer[BUFFER_SIZE], output[4096];
+  itl_le_t            le;
+  tl_memory_backend_t mb;
+
+  const char *const history[] = {"git status", "make test", "git commit",
+                                 "git push",   "ls",        "git push"};
+
+  /* Up and Down with a line typed, each line is a separate input */
+  const char input[] = "git\x1b[A\r"
+                       "git\x1b[A\x1b[A\r"
+                       "git\x1b[A\x1b[A\x1b[A\x1b[A\r"
+                       "git\x1b[A\x1b[A\x1b[B\r"
+                       "git\x1b[A\x1b[B\x1b[B\r"
+                       "make\x1b[A\r"
+                       "xyz\x1b[A\r"
+                       "\x1b[A\x1b[A\r"
+                       "m\x1b[A\x1b[B\x7fl\x1b[A\r"
+                       "\x1b[Agit\x1b[A\r";
+  const char *const results[] = {"git push", "git commit", "git status",
+                                 "git push", "git",        "make test",
+                                 "xyz",      "ls",         "ls"};
+
+  const char *const prefixes[] = {"echo 1", "echo 29", "echo", "echo 3999",
+                                  "nothing"};
+
+  tl_history_set_limits(100, 0);
+  tl_history_set_prefix_navigation(1);
+  tl_memory_backend_init(&mb, input, sizeof(input) - 1, output,
+                         sizeof(output));
+  tl_set_backend(&mb.backend);
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+
+  for (i = 0; i < countof(results); ++i) {
+    /* Lines that were entered are appended, so keep history the same */
+    itl_g_history_free();
+    for (k = 0; k < countof(history); ++k) {
+      tl_set_predefined_input(history[k]);
+      itl_g_history_append(&itl_g_line_buffer);
+    }
+    itl_string_clear(&itl_g_line_buffer);
+
+    if (tl_get_input(out_buffer, sizeof(out_buffer), "$ ") !=
+            TL_PRESSED_ENTER ||
+        strcmp(out_buffer, results[i]) != 0)
+    {
+      TEST_PRINTF("Result: '%s', should be: '%s'\n", out_buffer, results[i]);
+      result = false;
+    }
+  }
+
+  /* Up on an empty line in empty history appends nothing, so the line typed
+     afterwards is appended, not replaced */
+  itl_g_history_free();
+  itl_string_clear(&itl_g_line_buffer);
+  if (tl_get_input(out_buffer, sizeof(out_buffer), "$ ") != TL_PRESSED_ENTER ||
+      strcmp(out_buffer, "git") != 0 || itl_g_history.length != 1)
+  {
+    TEST_PRINTF("Result: '%s' with %zu entries, should be: 'git' with 1\n",
+                out_buffer, itl_g_history.length);
+    result = false;
+  }
+
+  /* Sorted entries are kept up to date while entries are appended and
+     overwritten */
+  itl_g_history_free();
+  tl_history_set_limits(1000, 0);
+  for (round = 0, n = 0; round < 4; ++round) {
+    for (; n < (round + 1) * 1000; ++n) {
+      snprintf(out_buffer, sizeof(out_buffer), "echo %zu", n);
+      tl_set_predefined_input(out_buffer);
+      itl_g_history_append(&itl_g_line_buffer);
+    }
+
+    for (i = 0; i < countof(prefixes); ++i) {
+      itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer),
+                  "$ ");
+      tl_set_predefined_input(prefixes[i]);
+      le.cursor_position = le.line->length;
+      itl_le_key_handle(&le, TL_KEY_UP);
+
+      /* Typed line is the newest entry now, and copies of the shown line are
+         skipped */
+      previous = ITL_HISTORY_LAST();
+      for (k = ITL_HISTORY_LAST(); k > itl_g_history.first; --k) {
+        expected = k - 1;
+        if (ITL_HISTORY_IS_ERASED(expected) ||
+            itl_g_history_compare_prefix(expected, prefixes[i],
+                                         strlen(prefixes[i])) != 0 ||
+            history_entries_equal(expected, previous))
+        {
+          continue;
+        }
+        if (le.history_selected != expected) {
+          TEST_PRINTF("Prefix '%s' selected %zu, should be: %zu\n",
+                      prefixes[i], le.history_selected, expected);
+          result = false;
+          break;
+        }
+        previous = expected;
+        itl_le_key_handle(&le, TL_KEY_UP);
+      }
+      if (le.history_selected != previous) {
+        TEST_PRINTF("Prefix '%s' went past the oldest match\n", prefixes[i]);
+        result = false;
+      }
+    }
+  }
+  itl_string_clear(&itl_g_line_buffer);
+
+  tl_history_set_prefix_navigation(0);
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  tl_exit();
+  tl_set_backend(NULL);
+
+  return result;
+}
+
+static bool
+test_history_fuzzy(void)
+{
+  size_t              i, k;
+  bool                result = true;
+  char                out_buffer[BUFFER_SIZE], output[4096];
+  int                 a, b;
+  itl_key_t           key = ITL_ZERO_INIT;
+  itl_char_buf_t      render;
+  itl_le_t            le;
+  tl_memory_backend_t mb;
+
+  const char *const history[] = {"git status", "make test",
+                                 "git commit -m fix", "ls -la",
+                                 "grep main src"};
+
+  /* Ctrl-T, each line is a separate input */
+  const char input[] = "\x14gcm\r\r"
+                       "\x14mt\r\r"
+                       "\x14s\x1b[B\r\r"
+                       "\x14gi\x7f\x7fls\r\r"
+                       "x\x14make\x01\r";
+  const char *const results[] = {"git commit -m fix", "make test",
+                                 "git status", "ls -la", "x"};
+
+  const char expected_render[] = "\n\r\x1b[0K  5/5"
+                                 "\n\r\x1b[0K> grep ma"
+                                 "\n\r\x1b[0K  ls -la"
+                                 "\x1b[J\x1b[3A";
+
+  tl_history_set_limits(100, 0);
+  tl_memory_backend_init(&mb, input, sizeof(input) - 1, output,
+                         sizeof(output));
+  tl_set_backend(&mb.backend);
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+
+  for (i = 0; i < countof(results); ++i) {
+    /* Lines that were entered are appended, so keep history the same */
+    itl_g_history_free();
+    for (k = 0; k < countof(history); ++k) {
+      tl_set_predefined_input(history[k]);
+      itl_g_history_append(&itl_g_line_buffer);
+    }
+    itl_string_clear(&itl_g_line_buffer);
+
+    if (tl_get_input(out_buffer, sizeof(out_buffer), "$ ") !=
+            TL_PRESSED_ENTER ||
+        strcmp(out_buffer, results[i]) != 0)
+    {
+      TEST_PRINTF("Result: '%s', should be: '%s'\n", out_buffer, results[i]);
+      result = false;
+    }
+  }
+
+  /* Best entries are listed below the line, cut to the width */
+  itl_g_history_free();
+  for (k = 0; k < countof(history); ++k) {
+    tl_set_predefined_input(history[k]);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+  itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+  tl_set_predefined_input("abc");
+  itl_le_key_handle(&le, TL_KEY_FUZZY_FIND);
+  itl_char_buf_init(&render);
+  itl_fuzzy_render(&render, 3, 10);
+  if (render.size != sizeof(expected_render) - 1 ||
+      memcmp(render.data, expected_render, render.size) != 0 ||
+      strcmp(le.prompt, "> ") != 0 || le.line->length != 0)
+  {
+    TEST_PRINTF("Unexpected list of %zu bytes\n", render.size);
+    result = false;
+  }
+  ITL_FREE(render.data);
+  key.key = TL_KEY_ESCAPE;
+  itl_le_key_apply(&le, &key);
+  if (strcmp(le.prompt, "$ ") != 0 || le.line->length != 3) {
+    TEST_PRINTF("Prompt: '%s', line length: %zu\n", le.prompt,
+                le.line->length);
+    result = false;
+  }
+
+  /* Starts of words and consecutive characters are better, and upper case
+     in the query makes it case sensitive */
+  if (!itl_fuzzy_score("make test", 9, "mt", 2, true, &a) ||
+      !itl_fuzzy_score("git commit", 10, "mt", 2, true, &b) || a <= b ||
+      !itl_fuzzy_score("abcd", 4, "bc", 2, true, &a) ||
+      !itl_fuzzy_score("abxc", 4, "bc", 2, true, &b) || a <= b ||
+      !itl_fuzzy_score("Make", 4, "ma", 2, true, &a) ||
+      itl_fuzzy_score("make", 4, "Ma", 2, false, &a) ||
+      itl_fuzzy_score("make", 4, "km", 2, true, &a) ||
+      !itl_fuzzy_score("\xd1\x8f \xd1\x8b", 5, "\xd1\x8b", 2, true, &a))
+  {
+    TEST_PRINTF("Unexpected fuzzy scores\n");
+    result = false;
+  }
+
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  tl_exit();
+  tl_set_backend(NULL);
+
+  return result;
+}
+
+/* Number `n` is shown by the line of `le` */
+static bool
+line_is_echo(const itl_le_t *le, size_t n)
+{
+  char text[32];
+  snprintf(text, sizeof(text), "echo %zu", n);
+  return itl_string_equal_bytes(le->line, text, strlen(text));
+}
+
+/* Whether decimal digits of `n` start with `prefix` */
+static bool
+number_starts_with(size_t n, const char *prefix)
+{
+  char text[32];
+  snprintf(text, sizeof(text), "%zu", n);
+  return strncmp(text, prefix, strlen(prefix)) == 0;
+}
+
+static bool
+test_history_archive(void)
+{
+  int                 fd, loaded_fd;
+  size_t              i, k, n, size;
+  bool                result = true;
+  char                path[] = "/tmp/toiletline_test_XXXXXX";
+  char                loaded_path[] = "/tmp/toiletline_test_XXXXXX";
+  char                out_buffer[BUFFER_SIZE], output[4096], expected[1024];
+  char               *text, *big;
+  itl_key_t           key = ITL_ZERO_INIT;
+  itl_le_t            le;
+  tl_memory_backend_t mb;
+
+  const char *const history[] = {"make old-target", "x", "make all",
+                                 "cd make", "make old-target"};
+
+  /* History keeps 4 newest lines, older ones are in the archive */
+  const char input[] = "\x12make\r"
+                       "\x12line\x12\x12\x12\x12\x12\x12\x12\x12\x12\x12 1\r"
+                       "\x12line 1\x12\x12\x12\x12\x12\x12\r"
+                       "make\x1b[A\x1b[A\r"
+                       "make\x1b[A\x1b[A\x1b[A\x1b[A\x1b[B\r"
+                       "echo\x1b[A\x1b[A\x1b[A\x1b[A\x1b[A\x1b[A\x1b[B\r";
+  const char *const results[] = {"make old-target", "echo line 1",
+                                 "echo line 13",    "make all",
+                                 "make all",        "echo line 15"};
+
+  if ((fd = mkstemp(path)) < 0) {
+    return false;
+  }
+  if ((loaded_fd = mkstemp(loaded_path)) < 0) {
+    close(fd);
+    unlink(path);
+    return false;
+  }
+
+  tl_memory_backend_init(&mb, input, sizeof(input) - 1, output,
+                         sizeof(output));
+  tl_set_backend(&mb.backend);
+  if (tl_init() != TL_SUCCESS) {
+    tl_set_backend(NULL);
+    close(fd);
+    close(loaded_fd);
+    unlink(path);
+    unlink(loaded_path);
+    TEST_PRINTF("Could not initialize with a memory backend\n");
+    return false;
+  }
+  tl_history_set_limits(4, 0);
+  tl_history_set_prefix_navigation(1);
+  if (tl_history_archive(path) != TL_SUCCESS) {
+    TEST_PRINTF("Could not open archive\n");
+    result = false;
+    goto end;
+  }
+
+  for (i = 0; i < countof(results); ++i) {
+    /* Lines that were entered are appended, so keep both tiers the same */
+    if (ftruncate(fd, 0) != 0) {
+      result = false;
+      goto end;
+    }
+    itl_g_history_free();
+    for (k = 0; k < countof(history) + 20; ++k) {
+      if (k < countof(history)) {
+        tl_set_predefined_input(history[k]);
+      } else {
+        snprintf(out_buffer, sizeof(out_buffer), "echo line %zu",
+                 k - countof(history));
+        tl_set_predefined_input(out_buffer);
+      }
+      itl_g_history_append(&itl_g_line_buffer);
+    }
+    itl_string_clear(&itl_g_line_buffer);
+
+    /* Dropped lines are spilled in order, except ones that are not dumped */
+    if (i == 0) {
+      strcpy(expected,
+             "make old-target\nmake all\ncd make\nmake old-target\n");
+      for (k = 0; k < 16; ++k) {
+        size = strlen(expected);
+        snprintf(expected + size, sizeof(expected) - size, "echo line %zu\n",
+                 k);
+      }
+      text = read_whole_file(path, &size);
+      if (strcmp(text, expected) != 0) {
+        TEST_PRINTF("Archive has '%s'\n", text);
+        result = false;
+      }
+      free(text);
+    }
+
+    if (tl_get_input(out_buffer, sizeof(out_buffer), "$ ") !=
+            TL_PRESSED_ENTER ||
+        strcmp(out_buffer, results[i]) != 0)
+    {
+      TEST_PRINTF("Result: '%s', should be: '%s'\n", out_buffer, results[i]);
+      result = false;
+    }
+  }
+
+  /* Matches are found newest first across blocks, and a line that is longer
+     than a block is read whole */
+  big = (char *) malloc(200001);
+  memset(big, 'a', 200000);
+  memcpy(big, "echo 7", 6);
+  big[200000] = '\n';
+  if (ftruncate(fd, 0) != 0 || write(fd, big, 200001) != 200001) {
+    free(big);
+    result = false;
+    goto end;
+  }
+  free(big);
+
+  itl_g_history_free();
+  for (n = 0; n < 30000; ++n) {
+    snprintf(out_buffer, sizeof(out_buffer), "echo %zu", n);
+    tl_set_predefined_input(out_buffer);
+    itl_g_history_append(&itl_g_line_buffer);
+  }
+  itl_string_clear(&itl_g_line_buffer);
+
+  itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+  itl_le_key_handle(&le, TL_KEY_SEARCH_BACKWARD);
+  for (i = 0; i < 6; ++i) {
+    key.key = TL_KEY_CHAR;
+    key.ch.bytes[0] = (uint8_t) "echo 7"[i];
+    key.ch.size = 1;
+    itl_le_key_apply(&le, &key);
+  }
+  key.key = TL_KEY_SEARCH_BACKWARD;
+  for (n = 30000; n > 0; --n) {
+    if (!number_starts_with(n - 1, "7")) {
+      continue;
+    }
+    if (!line_is_echo(&le, n - 1)) {
+      TEST_PRINTF("Search skipped 'echo %zu'\n", n - 1);
+      result = false;
+      break;
+    }
+    itl_le_key_apply(&le, &key);
+  }
+  if (le.line->size != ITL_STRING_MAX_LEN) {
+    TEST_PRINTF("Long line has %zu bytes\n", le.line->size);
+    result = false;
+  }
+  itl_le_key_apply(&le, &key);
+  if (strncmp(le.prompt, "(failed", 7) != 0) {
+    TEST_PRINTF("Prompt: '%s'\n", le.prompt);
+    result = false;
+  }
+  key.key = TL_KEY_ESCAPE;
+  itl_le_key_apply(&le, &key);
+
+  /* Prefix navigation goes through the same lines */
+  itl_le_init(&le, &itl_g_line_buffer, out_buffer, sizeof(out_buffer), "$ ");
+  tl_set_predefined_input("echo 12");
+  le.cursor_position = le.line->length;
+  itl_le_key_handle(&le, TL_KEY_UP);
+  for (n = 30000; n > 0; --n) {
+    if (!number_starts_with(n - 1, "12")) {
+      continue;
+    }
+    if (!line_is_echo(&le, n - 1)) {
+      TEST_PRINTF("Prefix skipped 'echo %zu'\n", n - 1);
+      result = false;
+      break;
+    }
+    itl_le_key_handle(&le, TL_KEY_UP);
+  }
+  if (!line_is_echo(&le, 12)) {
+    TEST_PRINTF("Prefix went past the oldest match\n");
+    result = false;
+  }
+  itl_string_clear(&itl_g_line_buffer);
+
+  /* Lines that don't fit into history when it's loaded stay in the file.
+     Copies are erased, so all of them are appended */
+  size = (size_t) lseek(fd, 0, SEEK_END);
+  tl_history_set_erase_duplicates(1);
+  if (write(loaded_fd, "ls\nmake\ngit\npwd\ntop\nvim\n", 25) != 25 ||
+      tl_history_load(loaded_path) != TL_SUCCESS ||
+      tl_history_length() != 4 || (size_t) lseek(fd, 0, SEEK_END) != size)
+  {
+    TEST_PRINTF("Archive was written while loading\n");
+    result = false;
+  }
+  tl_history_set_erase_duplicates(0);
+
+  /* Lines that don't fit when history is opened are moved to the archive */
+  if (ftruncate(fd, 0) != 0 || ftruncate(loaded_fd, 0) != 0 ||
+      lseek(loaded_fd, 0, SEEK_SET) != 0)
+  {
+    result = false;
+    goto end;
+  }
+  for (n = 0; n < 10; ++n) {
+    size = (size_t) snprintf(out_buffer, sizeof(out_buffer), "echo %zu\n", n);
+    if (write(loaded_fd, out_buffer, size) != (ssize_t) size) {
+      result = false;
+      goto end;
+    }
+  }
+  if (tl_history_open(loaded_path) != TL_SUCCESS || tl_history_length() != 4) {
+    TEST_PRINTF("Could not open history\n");
+    result = false;
+  }
+  text = read_whole_file(path, &size);
+  if (strcmp(text, "echo 0\necho 1\necho 2\necho 3\necho 4\necho 5\n") != 0) {
+    TEST_PRINTF("Archive has '%s'\n", text);
+    result = false;
+  }
+  free(text);
+  text = read_whole_file(loaded_path, &size);
+  if (strcmp(text, "echo 6\necho 7\necho 8\necho 9\n") != 0) {
+    TEST_PRINTF("History file has '%s'\n", text);
+    result = false;
+  }
+  free(text);
+
+end:
+  tl_history_set_prefix_navigation(0);
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  tl_exit();
+  tl_set_backend(NULL);
+  close(fd);
+  close(loaded_fd);
+  unlink(path);
+  unlink(loaded_path);
+
+  return result;
+}
+
+/* Text of line number `i` in test_history_compact */
+static void
+compact_line(char *out, size_t size, size_t i)
+{
+  if (i % 5 == 0) {
+    snprintf(out, size, "git commit -m 'fix %zu'", i);
+  } else if (i % 7 == 0) {
+    /* Sizes above 127 take more than one byte */
+    snprintf(out, size, "kubectl --context prod-eu logs %0*d -n team-%zu", 300,
+             0, i);
+  } else {
+    snprintf(out, size, "kubectl --context prod-eu get pods -n team-%zu",
+             i % 13);
+  }
+}
+
+/* Whether history has lines with numbers in `lines`, oldest first */
+static bool
+history_has_compact_lines(const size_t *lines, size_t count)
+{
+  size_t n;
+  char   text[512], out_buffer[512];
+
+  if (tl_history_length() != count) {
+    TEST_PRINTF("History has %zu lines, should be: %zu\n",
+                tl_history_length(), count);
+    return false;
+  }
+  for (n = 0; n < count; ++n) {
+    compact_line(text, sizeof(text), lines[n]);
+    if (tl_history_get(n, out_buffer, sizeof(out_buffer)) != TL_SUCCESS ||
+        strcmp(out_buffer, text) != 0)
+    {
+      TEST_PRINTF("Entry %zu: '%s', should be: '%s'\n", n, out_buffer, text);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool
+test_history_compact(void)
+{
+  size_t        i, k, n, count = 0, raw_size = 0, lines[200];
+  size_t        file_size, rewrites = 0;
+  int           fd;
+  bool          result = true;
+  char          text[512], other[512], out_buffer[512];
+  char          path[] = "/tmp/toiletline_test_XXXXXX";
+  itl_string_t *str = itl_string_alloc(), *line = itl_string_alloc();
+  itl_key_t     key = ITL_ZERO_INIT;
+  itl_le_t      le;
+  struct stat   file_stat;
+  ino_t         inode;
+
+  /* Overwrite the ring a few times, so that blocks are dropped */
+  tl_history_set_limits(countof(lines), 0);
+  tl_history_set_compact(1);
+  for (i = 0; i < countof(lines) * 3; ++i) {
+    compact_line(text, sizeof(text), i);
+    itl_string_from_bytes(str, text, strlen(text));
+    itl_g_history_append(str);
+    if (i >= countof(lines) * 2) {
+      lines[count++] = i;
+      raw_size += strlen(text);
+    }
+  }
+  if (!history_has_compact_lines(lines, count)) {
+    result = false;
+  }
+  if ((itl_g_history.text_end - itl_g_history_text_kept()) * 2 > raw_size) {
+    TEST_PRINTF("Text took %zu bytes out of %zu\n",
+                itl_g_history.text_end - itl_g_history_text_kept(), raw_size);
+    result = false;
+  }
+
+  /* The newest line is written anew when it's replaced */
+  itl_string_from_bytes(str, "edited", 6);
+  itl_g_history_replace_last(str);
+  if (tl_history_get(count - 1, out_buffer, sizeof(out_buffer)) !=
+          TL_SUCCESS ||
+      strcmp(out_buffer, "edited") != 0)
+  {
+    TEST_PRINTF("Replaced line: '%s'\n", out_buffer);
+    result = false;
+  }
+  compact_line(text, sizeof(text), lines[count - 1]);
+  itl_string_from_bytes(str, text, strlen(text));
+  itl_g_history_replace_last(str);
+  if (!history_has_compact_lines(lines, count)) {
+    result = false;
+  }
+
+  /* Lines are decoded when they are shown */
+  itl_le_init(&le, line, out_buffer, sizeof(out_buffer), "$ ");
+  for (n = count; n > count - 40; --n) {
+    itl_le_key_handle(&le, TL_KEY_UP);
+    compact_line(text, sizeof(text), lines[n - 1]);
+    if (!itl_string_equal_bytes(le.line, text, strlen(text))) {
+      TEST_PRINTF("Up showed a wrong line for %zu\n", lines[n - 1]);
+      result = false;
+      break;
+    }
+  }
+  itl_string_clear(line);
+
+  itl_le_init(&le, line, out_buffer, sizeof(out_buffer), "$ ");
+  itl_le_key_handle(&le, TL_KEY_SEARCH_BACKWARD);
+  for (i = 0; i < 7; ++i) {
+    key.key = TL_KEY_CHAR;
+    key.ch.bytes[0] = (uint8_t) "team-12"[i];
+    key.ch.size = 1;
+    itl_le_key_apply(&le, &key);
+  }
+  for (n = count; n > 0; --n) {
+    compact_line(text, sizeof(text), lines[n - 1]);
+    if (strstr(text, "team-12") != NULL) {
+      break;
+    }
+  }
+  if (!itl_string_equal_bytes(le.line, text, strlen(text))) {
+    TEST_PRINTF("Search found a wrong line\n");
+    result = false;
+  }
+  key.key = TL_KEY_ESCAPE;
+  itl_le_key_apply(&le, &key);
+  itl_string_clear(line);
+
+  /* Erased copies are dropped by writing the rest anew */
+  tl_history_set_erase_duplicates(1);
+  for (n = count, count = 0; n > 0; --n) {
+    compact_line(text, sizeof(text), lines[n - 1]);
+    for (k = 0; k < count; ++k) {
+      compact_line(other, sizeof(other), lines[countof(lines) - 1 - k]);
+      if (strcmp(text, other) == 0) {
+        break;
+      }
+    }
+    if (k == count) {
+      lines[countof(lines) - 1 - count++] = lines[n - 1];
+    }
+  }
+  if (!history_has_compact_lines(lines + countof(lines) - count, count)) {
+    result = false;
+  }
+
+  /* Text is the same in either form */
+  tl_history_set_compact(0);
+  if (!history_has_compact_lines(lines + countof(lines) - count, count)) {
+    result = false;
+  }
+
+  tl_history_set_erase_duplicates(0);
+
+  /* Entered lines are appended to an open file, which is not rewritten while
+     every line in it is kept, even though their text takes less memory */
+  if ((fd = mkstemp(path)) < 0) {
+    result = false;
+    goto end;
+  }
+  close(fd);
+  itl_g_history_free();
+  tl_history_set_limits(1000, 0);
+  tl_history_set_compact(1);
+  itl_g_is_active = true;
+  if (tl_history_open(path) != TL_SUCCESS || stat(path, &file_stat) != 0) {
+    TEST_PRINTF("Could not open history file\n");
+    result = false;
+  } else {
+    inode = file_stat.st_ino;
+    for (i = 0, file_size = 0; i < countof(lines); ++i) {
+      compact_line(text, sizeof(text), i);
+      itl_string_from_bytes(str, text, strlen(text));
+      itl_g_history_append(str);
+      itl_history_file_append(str);
+      file_size += strlen(text) + 1;
+      if (stat(path, &file_stat) == 0 && file_stat.st_ino != inode) {
+        inode = file_stat.st_ino;
+        rewrites += 1;
+      }
+    }
+    if (rewrites != 0 || (size_t) file_stat.st_size != file_size) {
+      TEST_PRINTF("File of %zu bytes was rewritten %zu times\n",
+                  (size_t) file_stat.st_size, rewrites);
+      result = false;
+    }
+  }
+  itl_history_file_close();
+  itl_g_is_active = false;
+  tl_history_set_compact(0);
+  unlink(path);
+
+end:
+  tl_history_set_limits(TL_HISTORY_MAX_SIZE, TL_HISTORY_MAX_BYTES);
+  itl_g_history_free();
+  ITL_STRING_FREE(str);
+  ITL_STRING_FREE(line);
+
+  return result;
+}
+
 typedef bool (*test_func)(void);
 
 typedef struct test_case test_case_t;
@@ -339,9 +2824,34 @@ static test_case_t test_cases[] = {DEFINE_TEST_CASE(test_string_from_cstr),
                                    DEFINE_TEST_CASE(test_string_shift),
                                    DEFINE_TEST_CASE(test_string_erase),
                                    DEFINE_TEST_CASE(test_string_insert),
+                                   DEFINE_TEST_CASE(test_string_gap),
+                                   DEFINE_TEST_CASE(test_string_offset),
                                    DEFINE_TEST_CASE(test_char_buf),
                                    DEFINE_TEST_CASE(test_parse_size),
-                                   DEFINE_TEST_CASE(test_utf8_strlen)};
+                                   DEFINE_TEST_CASE(test_utf8_strlen),
+                                   DEFINE_TEST_CASE(test_utf8_validate),
+                                   DEFINE_TEST_CASE(test_input_buf),
+                                   DEFINE_TEST_CASE(test_paste),
+                                   DEFINE_TEST_CASE(test_decoder),
+                                   DEFINE_TEST_CASE(test_get_input_coalescing),
+                                   DEFINE_TEST_CASE(test_callback_input),
+                                   DEFINE_TEST_CASE(test_memory_backend),
+                                   DEFINE_TEST_CASE(test_history_long_lines),
+                                   DEFINE_TEST_CASE(test_history_scan),
+                                   DEFINE_TEST_CASE(test_history_load),
+                                   DEFINE_TEST_CASE(test_history_load_chunks),
+                                   DEFINE_TEST_CASE(test_history_open),
+                                   DEFINE_TEST_CASE(test_history_share),
+                                   DEFINE_TEST_CASE(test_history_ring),
+                                   DEFINE_TEST_CASE(test_history_arena),
+                                   DEFINE_TEST_CASE(test_history_limits),
+                                   DEFINE_TEST_CASE(
+                                       test_history_erase_duplicates),
+                                   DEFINE_TEST_CASE(test_history_search),
+                                   DEFINE_TEST_CASE(test_history_prefix),
+                                   DEFINE_TEST_CASE(test_history_fuzzy),
+                                   DEFINE_TEST_CASE(test_history_archive),
+                                   DEFINE_TEST_CASE(test_history_compact)};
 
 int
 main(void)
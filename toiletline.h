@@ -53,6 +53,18 @@ extern "C"
 #define ITL_SUSPEND
 #endif /* !TL_NO_SUSPEND */
 
+/* If not defined, the line will not be redrawn while more input is already
+ * waiting to be read, so a burst of typeahead is drawn as a single frame. */
+#if !defined TL_NO_RENDER_COALESCING
+#define ITL_RENDER_COALESCING
+#endif /* !TL_NO_RENDER_COALESCING */
+
+/* If not defined, bracketed paste mode will be enabled in raw mode, and pasted
+ * text will be inserted at once instead of being processed key by key. */
+#if !defined TL_NO_BRACKETED_PASTE
+#define ITL_BRACKETED_PASTE
+#endif /* !TL_NO_BRACKETED_PASTE */
+
 /* To use custom assertions or to disable them, you can define `TL_ASSERT` to
  * some other function or nothing before including. */
 #if !defined TL_ASSERT
@@ -80,11 +92,22 @@ extern "C"
 #define ITL_DEF static
 #endif /* !ITL_DEF */
 
-/* Max size of in-memory history, must be a power of 2. */
+/* Max number of lines in in-memory history. */
 #if !defined TL_HISTORY_MAX_SIZE
 #define TL_HISTORY_MAX_SIZE 256
 #endif /* TL_HISTORY_MAX_SIZE */
 
+/* Max number of bytes taken by lines in in-memory history, 0 for no limit. */
+#if !defined TL_HISTORY_MAX_BYTES
+#define TL_HISTORY_MAX_BYTES 0
+#endif /* TL_HISTORY_MAX_BYTES */
+
+/* If defined, big history files are split and parsed on this many threads.
+ * Requires pthreads on POSIX. */
+#if defined TL_HISTORY_THREADS
+#define ITL_HISTORY_THREADS
+#endif /* TL_HISTORY_THREADS */
+
 /**
  * Codes which may be returned from reading functions.
  */
@@ -138,7 +161,14 @@ typedef enum
 
   TL_KEY_SUSPEND,
   TL_KEY_EOF,
-  TL_KEY_INTERRUPT
+  TL_KEY_INTERRUPT,
+
+  TL_KEY_PASTE,
+  TL_KEY_ESCAPE,
+
+  TL_KEY_SEARCH_BACKWARD,
+  TL_KEY_SEARCH_FORWARD,
+  TL_KEY_FUZZY_FIND
 } TL_KEY_KIND;
 
 #define TL_MOD_CTRL  (1 << 24)
@@ -184,6 +214,99 @@ TL_DEF void tl_set_predefined_input(const char *str);
 TL_DEF TL_STATUS_CODE tl_get_character(char *char_buffer,
                                        size_t char_buffer_size,
                                        const char *prompt);
+/**
+ * Receives a finished line. `code` is what `tl_get_input()` would have
+ * returned, and `line` stays valid until the next line is started.
+ */
+typedef void (*tl_line_callback)(TL_STATUS_CODE code, const char *line);
+/**
+ * Start reading a line without blocking. Input is handled as it is pushed with
+ * `tl_on_readable()` or `tl_feed_bytes()`, and `on_line` is called once the
+ * line is finished. Call this from `on_line` to read the next line.
+ */
+TL_DEF void tl_begin_input(const char *prompt, tl_line_callback on_line);
+/**
+ * Stop reading the line started by `tl_begin_input()` without calling back.
+ */
+TL_DEF void tl_end_input(void);
+/**
+ * Read what is available from `tl_input_fd()` without blocking and handle it.
+ */
+TL_DEF TL_STATUS_CODE tl_on_readable(void);
+/**
+ * Handle input that was read by the caller.
+ */
+TL_DEF TL_STATUS_CODE tl_feed_bytes(const char *bytes, size_t size);
+/**
+ * Milliseconds to wait for input before calling `tl_on_timeout()`, or -1 to
+ * wait until `tl_input_fd()` is readable.
+ */
+TL_DEF int tl_input_timeout(void);
+/**
+ * Handle Esc or other unfinished input after `tl_input_timeout()` has passed.
+ */
+TL_DEF void tl_on_timeout(void);
+/**
+ * File descriptor that input is read from.
+ */
+TL_DEF int tl_input_fd(void);
+/**
+ * Terminal I/O hooks. Each one receives `data` as the first argument.
+ */
+typedef struct tl_backend tl_backend_t;
+
+struct tl_backend
+{
+  /* Blocks until at least one byte is read. Returns amount of read bytes, or -1
+     on errors and end of input. */
+  int (*read)(void *data, char *buffer, size_t size);
+  /* Returns 1 if input can be read within `timeout` milliseconds, or 0.
+     Waits forever if `timeout` is below 0. */
+  int (*wait)(void *data, int timeout);
+  /* Returns -1 on errors. */
+  int (*write)(void *data, const char *buffer, size_t size);
+  TL_STATUS_CODE (*get_size)(void *data, size_t *rows, size_t *cols);
+  TL_STATUS_CODE (*enter_raw_mode)(void *data);
+  TL_STATUS_CODE (*exit_raw_mode)(void *data);
+  void *data;
+};
+
+/**
+ * Backend that reads input from memory and records output, to use the line
+ * editor without a terminal.
+ */
+typedef struct tl_memory_backend tl_memory_backend_t;
+
+struct tl_memory_backend
+{
+  tl_backend_t backend;
+  const char *input;
+  size_t input_size;
+  size_t input_pos;
+  /* Output past the capacity is counted, but not stored. */
+  char *output;
+  size_t output_capacity;
+  size_t output_size;
+  size_t rows;
+  size_t cols;
+};
+
+/**
+ * Use `backend` for all terminal I/O. NULL restores the terminal.
+ */
+TL_DEF void tl_set_backend(const tl_backend_t *backend);
+/**
+ * Initialize an in-memory backend of 24 rows and 80 columns. `output` can be
+ * NULL.
+ */
+TL_DEF void tl_memory_backend_init(tl_memory_backend_t *mb, const char *input,
+                                   size_t input_size, char *output,
+                                   size_t output_capacity);
+/**
+ * Set how long to wait for the rest of an escape sequence, in milliseconds.
+ * Below 0 waits forever.
+ */
+TL_DEF void tl_set_escape_timeout(int milliseconds);
 /**
  * Load history from a file.
  *
@@ -198,6 +321,83 @@ TL_DEF TL_STATUS_CODE tl_history_load(const char *file_path);
  * failures.
  */
 TL_DEF TL_STATUS_CODE tl_history_dump(const char *file_path);
+/**
+ * Load history from a file, and keep it open to append every entered line to
+ * it right away. The file is rewritten with lines that are kept once it gets
+ * twice as big, and it is closed by `tl_exit()`.
+ *
+ * Returns `TL_SUCCESS`, `-EINVAL` if file is invalid or `-errno` on other
+ * failures.
+ */
+TL_DEF TL_STATUS_CODE tl_history_open(const char *file_path);
+/**
+ * Sync the file opened by `tl_history_open()` to disk after every `lines`
+ * appended lines, and before it is replaced or closed. If 0, it is never
+ * synced, which is the default.
+ */
+TL_DEF void tl_history_set_sync(size_t lines);
+/**
+ * Share history with other processes through a ring file of about 1 MB,
+ * which is created if it does not exist. Entered lines are put into it, and
+ * lines that other processes put there are appended to history before it is
+ * browsed. It is closed by `tl_exit()`.
+ *
+ * Returns `TL_SUCCESS`, `-EINVAL` if file is not a ring, `-ENOSYS` if it is
+ * not supported, or `-errno` on other failures.
+ */
+TL_DEF TL_STATUS_CODE tl_history_share(const char *file_path);
+/**
+ * Append lines that history limits drop to an archive file, which is created
+ * if it does not exist. When history runs out of matches, reverse search and
+ * prefix navigation go on through the archive from its newest lines. It is
+ * read from the disk as it is searched, and never loaded. Lines that don't fit
+ * when history is opened with `tl_history_open()` afterwards are moved from
+ * the history file to the archive. It is closed by `tl_exit()`.
+ *
+ * Returns `TL_SUCCESS`, or `-errno` on failures.
+ */
+TL_DEF TL_STATUS_CODE tl_history_archive(const char *file_path);
+/**
+ * Returns the number of lines in history.
+ */
+TL_DEF size_t tl_history_length(void);
+/**
+ * Copy a line from history into `buffer`. Index 0 is the oldest line, and
+ * `tl_history_length() - 1` is the newest one.
+ *
+ * Returns `TL_SUCCESS`, `TL_ERROR` if there is no such line, or
+ * `TL_ERROR_SIZE` if the line was cut to fit into `buffer`.
+ */
+TL_DEF TL_STATUS_CODE tl_history_get(size_t index, char *buffer,
+                                     size_t buffer_size);
+/**
+ * Limit history to `max_entries` lines that take at most `max_bytes` bytes,
+ * or any amount of bytes if it's 0. The oldest lines are dropped to fit.
+ *
+ * Returns `TL_SUCCESS`, or `TL_ERROR` if `max_entries` is 0.
+ */
+TL_DEF TL_STATUS_CODE tl_history_set_limits(size_t max_entries,
+                                            size_t max_bytes);
+/**
+ * If `erase_duplicates` is not 0, keep only the newest copy of every line in
+ * history, including lines that are already there or will be loaded.
+ * Disabled by default.
+ */
+TL_DEF void tl_history_set_erase_duplicates(int erase_duplicates);
+/**
+ * If `prefix_navigation` is not 0, Up and Down go only through lines in
+ * history that start with the typed line, if it's not empty. Copies of the
+ * shown line are skipped. Disabled by default.
+ */
+TL_DEF void tl_history_set_prefix_navigation(int prefix_navigation);
+/**
+ * If `compact` is not 0, keep history in a compact form, where bytes that
+ * repeat ones of lines shortly before are kept as references to them. Lines
+ * are decoded when they are shown or searched. The limit on bytes applies to
+ * the compact form, where short lines with little in common can take more
+ * bytes, so changing the form can drop the oldest lines. Disabled by default.
+ */
+TL_DEF void tl_history_set_compact(int compact);
 /**
  * Returns the number of UTF-8 characters.
  *
@@ -264,16 +464,27 @@ TL_DEF TL_STATUS_CODE tl_set_title(const char *title);
 #define ITL_FILE_OPEN_FOR_READ(path) _open(path, O_RDONLY)
 #define ITL_FILE_OPEN_FOR_WRITE(path)                                          \
   _open(path, O_WRONLY | O_CREAT | O_TRUNC, _S_IREAD | _S_IWRITE)
+#define ITL_FILE_OPEN_FOR_APPEND(path)                                         \
+  _open(path, O_WRONLY | O_CREAT | O_APPEND, _S_IREAD | _S_IWRITE)
 #define ITL_FILE_IS_BAD(file) (file < 0)
 #define ITL_FILE_CLOSE        _close
+#define ITL_FILE_SYNC         _commit
 
 #define ITL_WRITE(fd, buf, size) _write(fd, buf, (unsigned long) size)
 #define ITL_READ(fd, buf, size)  _read(fd, buf, (unsigned long) size)
+#define ITL_FILE_READ_AT(fd, buf, size, offset)                                \
+  (_lseeki64(fd, (__int64) (offset), SEEK_SET) < 0                             \
+       ? -1                                                                    \
+       : _read(fd, buf, (unsigned long) size))
+#define ITL_FILE_SIZE(fd) _lseeki64(fd, 0, SEEK_END)
 #endif /* !ITL_USE_STDIO */
 
+#define ITL_FILE_REPLACE(from, to)                                             \
+  (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1)
+
 /* <https://learn.microsoft.com/en-US/troubleshoot/windows-client/shell-experience/command-line-string-limitation>
  */
-#define ITL_STRING_MAX_LEN 8191
+#define ITL_STRING_DEFAULT_MAX_LEN 8191
 
 #define ITL_TTY_IS_TTY() ITL_ISATTY(STDIN_FILENO)
 
@@ -282,6 +493,7 @@ TL_DEF TL_STATUS_CODE tl_set_title(const char *title);
 #define _DEFAULT_SOURCE
 #endif
 
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -298,6 +510,12 @@ TL_DEF TL_STATUS_CODE tl_set_title(const char *title);
 #endif /* TL_SIZE_USE_ESCAPES */
 
 #if !defined TL_USE_STDIO
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* History files are mapped instead of read */
+#define ITL_MMAP
+
 #define ITL_STDIN  0
 #define ITL_STDOUT 1
 #define ITL_STDERR 2
@@ -308,15 +526,26 @@ TL_DEF TL_STATUS_CODE tl_set_title(const char *title);
 #define ITL_FILE_OPEN_FOR_READ(path) open(path, O_RDONLY)
 #define ITL_FILE_OPEN_FOR_WRITE(path)                                          \
   open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)
+#define ITL_FILE_OPEN_FOR_APPEND(path)                                         \
+  open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)
 #define ITL_FILE_IS_BAD(file) (file < 0)
 #define ITL_FILE_CLOSE        close
+#define ITL_FILE_SYNC         fsync
 
 #define ITL_WRITE(fd, buf, size) write(fd, buf, (unsigned long) size)
 #define ITL_READ(fd, buf, size)  read(fd, buf, (unsigned long) size)
+#define ITL_FILE_READ_AT(fd, buf, size, offset)                                \
+  pread(fd, buf, (unsigned long) size, (off_t) (offset))
+#define ITL_FILE_SIZE(fd) lseek(fd, 0, SEEK_END)
 #endif /* !ITL_USE_STDIO */
 
+/* For rename() */
+#include <stdio.h>
+
+#define ITL_FILE_REPLACE rename
+
 /* <https://man7.org/linux/man-pages/man3/termios.3.html> */
-#define ITL_STRING_MAX_LEN 4095
+#define ITL_STRING_DEFAULT_MAX_LEN 4095
 
 #define ITL_TTY_IS_TTY() ITL_ISATTY(STDIN_FILENO)
 #endif /* ITL_POSIX */
@@ -325,6 +554,35 @@ TL_DEF TL_STATUS_CODE tl_set_title(const char *title);
 #include <stdio.h>
 #endif /* TL_DEBUG */
 
+#if defined ITL_HISTORY_THREADS
+#if defined ITL_WIN32
+#define ITL_THREAD          HANDLE
+#define ITL_THREAD_FN(name) DWORD WINAPI name(LPVOID arg)
+#define ITL_THREAD_RETURN   0
+#define ITL_THREAD_START(thread, fn, arg)                                      \
+  ((*(thread) = CreateThread(NULL, 0, fn, arg, 0, NULL)) != NULL)
+#define ITL_THREAD_JOIN(thread)                                                \
+  (WaitForSingleObject(thread, INFINITE), CloseHandle(thread))
+#else /* ITL_WIN32 */
+#include <pthread.h>
+
+#define ITL_THREAD          pthread_t
+#define ITL_THREAD_FN(name) void *name(void *arg)
+#define ITL_THREAD_RETURN   NULL
+#define ITL_THREAD_START(thread, fn, arg)                                      \
+  (pthread_create(thread, NULL, fn, arg) == 0)
+#define ITL_THREAD_JOIN(thread) pthread_join(thread, NULL)
+#endif /* ITL_WIN32 */
+#endif /* ITL_HISTORY_THREADS */
+
+/* Lines may be made longer than the platform's limit of command length, to
+   edit large pasted texts. */
+#if defined TL_LINE_MAX_SIZE
+#define ITL_STRING_MAX_LEN TL_LINE_MAX_SIZE
+#else /* TL_LINE_MAX_SIZE */
+#define ITL_STRING_MAX_LEN ITL_STRING_DEFAULT_MAX_LEN
+#endif
+
 /* This is almost everything that this library requires for IO. If a different
    underlying API is desired, this may easily be extended. Please note that
    `errno` is required to be set appropriately for errors. Since `stdio` sucks,
@@ -336,10 +594,11 @@ TL_DEF TL_STATUS_CODE tl_set_title(const char *title);
 #define ITL_STDERR stderr
 #define ITL_FILE   FILE *
 
-#define ITL_FILE_OPEN_FOR_READ(path)  fopen(path, "rb")
-#define ITL_FILE_OPEN_FOR_WRITE(path) fopen(path, "wb")
-#define ITL_FILE_IS_BAD(file)         (file == NULL)
-#define ITL_FILE_CLOSE                fclose
+#define ITL_FILE_OPEN_FOR_READ(path)   fopen(path, "rb")
+#define ITL_FILE_OPEN_FOR_WRITE(path)  fopen(path, "wb")
+#define ITL_FILE_OPEN_FOR_APPEND(path) fopen(path, "ab")
+#define ITL_FILE_IS_BAD(file)          (file == NULL)
+#define ITL_FILE_CLOSE                 fclose
 
 ITL_DEF int
 itl_write_impl(FILE *f, const void *buf, size_t size)
@@ -349,21 +608,47 @@ itl_write_impl(FILE *f, const void *buf, size_t size)
   return ferror(f) ? -1 : (int) written_count;
 }
 
-#define ITL_WRITE(file, buf, size) itl_write_impl(file, buf, size)
-#define ITL_READ(file, buf, size)  fread(buf, size, 1, file)
-#endif /* ITL_USE_STDIO */
-
+ITL_DEF int
+itl_sync_impl(FILE *f)
+{
+  if (fflush(f) != 0) {
+    return -1;
+  }
 #if defined ITL_WIN32
-/* Windows can't read arrow keys otherwise */
-#define ITL_READ_BYTE_RAW _getch
-#else /* ITL_WIN32 */
+  return _commit(_fileno(f));
+#else  /* ITL_WIN32 */
+  return fsync(fileno(f));
+#endif /* ITL_WIN32 */
+}
+
 ITL_DEF int
-ITL_READ_BYTE_RAW(void)
+itl_read_at_impl(FILE *f, void *buf, size_t size, size_t offset)
 {
-  int buf[1];
-  return (ITL_READ(ITL_STDIN, buf, 1) != 1) ? -1 : *buf;
+  size_t read_amount;
+
+  if (fseek(f, (long) offset, SEEK_SET) != 0) {
+    return -1;
+  }
+  read_amount = fread(buf, 1, size, f);
+  return ferror(f) ? -1 : (int) read_amount;
 }
-#endif
+
+ITL_DEF long
+itl_file_size_impl(FILE *f)
+{
+  if (fseek(f, 0, SEEK_END) != 0) {
+    return -1;
+  }
+  return ftell(f);
+}
+
+#define ITL_WRITE(file, buf, size) itl_write_impl(file, buf, size)
+#define ITL_READ(file, buf, size)  fread(buf, size, 1, file)
+#define ITL_FILE_SYNC(file)        itl_sync_impl(file)
+#define ITL_FILE_READ_AT(file, buf, size, offset)                              \
+  itl_read_at_impl(file, buf, size, offset)
+#define ITL_FILE_SIZE(file) itl_file_size_impl(file)
+#endif /* ITL_USE_STDIO */
 
 #if defined ITL_DEFAULT_ASSERT
 #if defined TL_DEBUG
@@ -444,6 +729,33 @@ typedef unsigned char bool;
 #define itl_debug_trap() ITL_UNREACHABLE_INTRIN()
 #endif
 
+/* Text is scanned 16 bytes at a time with SSE2, which every x86-64 CPU has,
+   or 32 bytes at a time with AVX2, if the CPU supports it. */
+#if !defined TL_NO_SIMD
+#if defined __SSE2__ || defined _M_X64
+#define ITL_SSE2
+#include <emmintrin.h>
+#if (defined __GNUC__ || defined __clang__) && defined __x86_64__
+#define ITL_AVX2
+#include <immintrin.h>
+#define ITL_TARGET_AVX2      __attribute__((target("avx2")))
+#define ITL_CPU_HAS_AVX2()   __builtin_cpu_supports("avx2")
+#endif /* __GNUC__ || __clang__ */
+#endif /* __SSE2__ || _M_X64 */
+#endif /* !TL_NO_SIMD */
+
+/* History is shared between processes through a mapped file, where space for
+   entries is reserved with atomic additions. */
+#if defined ITL_MMAP && (defined __GNUC__ || defined __clang__)
+#define ITL_SHARED_HISTORY
+#endif /* ITL_MMAP && (__GNUC__ || __clang__) */
+
+/* The archive is scanned with memmem(), which glibc declares only for
+   _GNU_SOURCE. Elsewhere it is declared by default. */
+#if defined ITL_POSIX && (defined __USE_GNU || !defined __GLIBC__)
+#define ITL_MEMMEM
+#endif /* ITL_POSIX && (__USE_GNU || !__GLIBC__) */
+
 #if defined TL_DEBUG
 ITL_NO_RETURN ITL_DEF void
 itl_unreachable_impl(const char *file, int line, const char *message)
@@ -553,6 +865,10 @@ itl_enter_raw_mode_impl(void)
   term.c_oflag = OPOST | ONLCR;
 
   ITL_TRY(tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) == 0, return false);
+
+#if defined ITL_BRACKETED_PASTE
+  ITL_TRY(ITL_WRITE(ITL_STDOUT, "\x1b[?2004h", 8) != -1, return false);
+#endif /* ITL_BRACKETED_PASTE */
 #endif /* ITL_POSIX */
   return true;
 }
@@ -591,6 +907,10 @@ itl_exit_raw_mode_impl(void)
 #elif defined ITL_POSIX
   struct termios zeroed_termios = ITL_ZERO_INIT;
 
+#if defined ITL_BRACKETED_PASTE
+  ITL_TRY(ITL_WRITE(ITL_STDOUT, "\x1b[?2004l", 8) != -1, return false);
+#endif /* ITL_BRACKETED_PASTE */
+
   if (memcmp(&itl_g_original_tty_mode, &zeroed_termios,
              sizeof(struct termios)) != 0)
   {
@@ -602,1618 +922,7111 @@ itl_exit_raw_mode_impl(void)
 #endif /* ITL_POSIX */
 }
 
-TL_DEF TL_STATUS_CODE
-tl_enter_raw_mode(void)
+ITL_DEF TL_STATUS_CODE
+itl_terminal_enter_raw_mode(void *data)
 {
-  ITL_TRY(!itl_g_entered_raw_mode, return TL_SUCCESS);
-
+  (void) data;
   ITL_TRY(ITL_TTY_IS_TTY(), return TL_ERROR);
-
-  /* If raw mode failed, restore terminal's state */
-  ITL_TRY(itl_enter_raw_mode_impl(), {
-    tl_exit_raw_mode();
-    return TL_ERROR;
-  });
-
-  itl_g_entered_raw_mode = true;
-
+  ITL_TRY(itl_enter_raw_mode_impl(), return TL_ERROR);
   return TL_SUCCESS;
 }
 
-TL_DEF TL_STATUS_CODE
-tl_exit_raw_mode(void)
+ITL_DEF TL_STATUS_CODE
+itl_terminal_exit_raw_mode(void *data)
 {
-  ITL_TRY(itl_g_entered_raw_mode, return TL_SUCCESS);
-
+  (void) data;
   ITL_TRY(ITL_TTY_IS_TTY(), return TL_ERROR);
   ITL_TRY(itl_exit_raw_mode_impl(), return TL_ERROR);
-
-  itl_g_entered_raw_mode = false;
-
   return TL_SUCCESS;
 }
 
-ITL_DEF bool
-ITL_READ_BYTE(uint8_t *buffer)
+ITL_DEF int
+itl_terminal_read(void *data, char *buffer, size_t size)
 {
-  int byte = ITL_READ_BYTE_RAW();
-#if defined ITL_POSIX
-  /* Catch `read()` errors. `_getch()` on Windows does not have error
-     returns */
-  ITL_TRY(byte != -1, return false);
-#endif /* ITL_POSIX */
-  ITL_PTR_ASSIGN(buffer, (uint8_t) byte);
-  return true;
-}
+  int read_amount;
 
-#define ITL_TRY_READ_BYTE(buffer, expr) ITL_TRY(ITL_READ_BYTE(buffer), expr)
+  (void) data;
+#if defined ITL_WIN32
+  /* Windows can't read arrow keys otherwise */
+  (void) size;
+  *buffer = (char) _getch();
+  read_amount = 1;
+#elif defined TL_USE_STDIO
+  /* `fread()` blocks until the whole size is read, and stdio is buffered
+     anyway. */
+  (void) size;
+  read_amount = (ITL_READ(ITL_STDIN, buffer, 1) != 1) ? -1 : 1;
+#else /* TL_USE_STDIO */
+  read_amount = (int) ITL_READ(ITL_STDIN, buffer, size);
+#endif
+  if (read_amount <= 0) {
+    return -1;
+  }
 
-#if defined ITL_SUSPEND
-#if defined ITL_POSIX
-ITL_DEF void
-itl_handle_sigcont(int signal_number)
-{
-  (void) signal_number;
-  tl_enter_raw_mode();
+  return read_amount;
 }
 
-ITL_DEF void
-itl_raise_suspend(void)
+ITL_DEF int
+itl_terminal_wait(void *data, int timeout)
 {
-  tl_exit_raw_mode();
-  signal(SIGCONT, itl_handle_sigcont);
-  raise(SIGTSTP);
+#if defined ITL_WIN32
+  (void) data;
+  if (_kbhit()) {
+    return 1;
+  } else if (timeout == 0) {
+    return 0;
+  }
+  return WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE),
+                             (timeout < 0) ? INFINITE : (DWORD) timeout) ==
+             WAIT_OBJECT_0 &&
+         _kbhit() != 0;
+#else /* ITL_WIN32 */
+  struct pollfd fd;
+  int ready;
+
+  (void) data;
+#if defined TL_USE_STDIO
+  /* Input may be hidden in stdio's own buffer. Only say that nothing is there
+     when it's a hint, and not a wait. */
+  if (timeout != 0) {
+    return 1;
+  }
+#endif /* TL_USE_STDIO */
+
+  fd.fd = STDIN_FILENO;
+  fd.events = POLLIN;
+  fd.revents = 0;
+
+  do {
+    ready = poll(&fd, 1, timeout);
+  } while (ready < 0 && errno == EINTR);
+
+  return ready > 0 && (fd.revents & POLLIN);
+#endif
 }
 
-#else /* ITL_POSIX */
-ITL_NO_RETURN ITL_DEF void
-itl_raise_suspend(void)
+ITL_DEF int
+itl_terminal_write(void *data, const char *buffer, size_t size)
 {
-  tl_exit();
-  exit(0);
+  (void) data;
+  return (int) ITL_WRITE(ITL_STDOUT, buffer, size);
 }
-#endif
-#endif /* ITL_SUSPEND */
 
-ITL_DEF bool itl_g_tty_changed_size = true;
+ITL_DEF TL_STATUS_CODE
+itl_terminal_get_size(void *data, size_t *rows, size_t *cols)
+{
+#if defined ITL_VT_SIZE
+  /* Asked with escapes by `itl_tty_get_size()` instead */
+  (void) data;
+  (void) rows;
+  (void) cols;
+  return TL_ERROR;
+#elif defined ITL_WIN32
+  CONSOLE_SCREEN_BUFFER_INFO buffer_info;
 
-ITL_DEF ITL_THREAD_LOCAL size_t itl_g_alloc_count = 0;
+  (void) data;
+  ITL_TRY(
+      GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &buffer_info),
+      return TL_ERROR);
 
-ITL_DEF void *
-itl_malloc(size_t size)
-{
-  void *allocated;
+  ITL_PTR_ASSIGN(cols, (size_t) (buffer_info.srWindow.Right -
+                                 buffer_info.srWindow.Left + 1));
+  ITL_PTR_ASSIGN(rows, (size_t) (buffer_info.srWindow.Bottom -
+                                 buffer_info.srWindow.Top + 1));
 
-  TL_ASSERT(size > 0);
+  return TL_SUCCESS;
+#else
+  struct winsize window;
 
-  allocated = TL_MALLOC(size);
-  itl_g_alloc_count += 1;
+  (void) data;
+  ITL_TRY(ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0, return TL_ERROR);
 
-#if !defined TL_NO_ABORT
-  ITL_TRY(allocated != NULL, TL_ABORT());
-#endif /* !TL_NO_ABORT */
+  ITL_PTR_ASSIGN(rows, (size_t) window.ws_row);
+  ITL_PTR_ASSIGN(cols, (size_t) window.ws_col);
 
-  return allocated;
+  return TL_SUCCESS;
+#endif
 }
 
-ITL_DEF void *
-itl_realloc(void *block, size_t size)
-{
-  void *allocated;
+ITL_DEF const tl_backend_t itl_terminal_backend = {
+    itl_terminal_read,          itl_terminal_wait,
+    itl_terminal_write,         itl_terminal_get_size,
+    itl_terminal_enter_raw_mode, itl_terminal_exit_raw_mode,
+    NULL};
 
-  TL_ASSERT(size > 0);
+ITL_DEF ITL_THREAD_LOCAL const tl_backend_t *itl_g_backend =
+    &itl_terminal_backend;
 
-  if (block == NULL) {
-    allocated = TL_MALLOC(size);
-    itl_g_alloc_count += 1;
-  } else {
-    allocated = TL_REALLOC(block, size);
-  }
+#define ITL_BACKEND_CALL(hook, ...)                                            \
+  itl_g_backend->hook(itl_g_backend->data, __VA_ARGS__)
 
-#if !defined TL_NO_ABORT
-  ITL_TRY(allocated != NULL, TL_ABORT());
-#endif /* !TL_NO_ABORT */
+#define ITL_TTY_WRITE(buffer, size) ITL_BACKEND_CALL(write, buffer, size)
 
-  return allocated;
-}
+ITL_DEF int
+itl_memory_read(void *data, char *buffer, size_t size)
+{
+  tl_memory_backend_t *mb = (tl_memory_backend_t *) data;
 
-#if defined TL_DEBUG
-#define ITL_FREE(ptr)                                                          \
-  do {                                                                         \
-    TL_ASSERT((ptr) != NULL);                                                  \
-    memset(ptr, 0x7F, sizeof(*ptr));                                           \
-    TL_FREE(ptr);                                                              \
-    itl_g_alloc_count -= 1;                                                    \
-  } while (0)
-#else /* TL_DEBUG */
-#define ITL_FREE(ptr)                                                          \
-  do {                                                                         \
-    itl_g_alloc_count -= 1;                                                    \
-    TL_FREE(ptr);                                                              \
-  } while (0)
-#endif
+  size = ITL_MIN(size, mb->input_size - mb->input_pos);
+  ITL_TRY(size > 0, return -1);
 
-typedef struct itl_utf8 itl_utf8_t;
+  memcpy(buffer, mb->input + mb->input_pos, size);
+  mb->input_pos += size;
 
-struct itl_utf8
+  return (int) size;
+}
+
+ITL_DEF int
+itl_memory_wait(void *data, int timeout)
 {
-  uint8_t bytes[4];
-  uint8_t size;
-};
+  tl_memory_backend_t *mb = (tl_memory_backend_t *) data;
+  (void) timeout;
+  return mb->input_pos < mb->input_size;
+}
 
-ITL_DEF itl_utf8_t
-itl_utf8_new(const uint8_t *bytes, uint8_t size)
+ITL_DEF int
+itl_memory_write(void *data, const char *buffer, size_t size)
 {
-  itl_utf8_t ch;
+  tl_memory_backend_t *mb = (tl_memory_backend_t *) data;
+  size_t stored_size;
 
-  TL_ASSERT(size <= 4);
+  if (mb->output_size < mb->output_capacity) {
+    stored_size = ITL_MIN(size, mb->output_capacity - mb->output_size);
+    memcpy(mb->output + mb->output_size, buffer, stored_size);
+  }
+  mb->output_size += size;
 
-  memcpy(ch.bytes, bytes, size);
-  ch.size = size;
-
-  return ch;
+  return (int) size;
 }
 
-#define ITL_UTF8_COPY(dst, src) memcpy(dst, src, sizeof(itl_utf8_t))
-
-ITL_DEF bool
-itl_utf8_equal(itl_utf8_t ch1, itl_utf8_t ch2)
+ITL_DEF TL_STATUS_CODE
+itl_memory_get_size(void *data, size_t *rows, size_t *cols)
 {
-  TL_ASSERT(ch1.size <= 4 && ch2.size <= 4);
-
-  if (ch1.size != ch2.size ||
-      memcmp(ch1.bytes, ch2.bytes, ch1.size * sizeof(uint8_t)) != 0)
-  {
-    return false;
-  }
-
-  return true;
+  tl_memory_backend_t *mb = (tl_memory_backend_t *) data;
+  ITL_PTR_ASSIGN(rows, mb->rows);
+  ITL_PTR_ASSIGN(cols, mb->cols);
+  return TL_SUCCESS;
 }
 
-ITL_DEF uint8_t
-itl_utf8_width(int byte)
+ITL_DEF TL_STATUS_CODE
+itl_memory_raw_mode(void *data)
 {
-  if ((byte & 0x80) == 0)
-    return 1;
-  else if ((byte & 0xE0) == 0xC0)
-    return 2;
-  else if ((byte & 0xF0) == 0xE0)
-    return 3;
-  else if ((byte & 0xF8) == 0xF0)
-    return 4;
-  else
-    return 0; /* invalid character */
+  (void) data;
+  return TL_SUCCESS;
 }
 
-#define ITL_UTF8_IS_SURROGATE(first_byte, second_byte)                         \
-  (((first_byte) == 0xED) && ((second_byte) >= 0xA0 && (second_byte) <= 0xBF))
+TL_DEF void
+tl_memory_backend_init(tl_memory_backend_t *mb, const char *input,
+                       size_t input_size, char *output, size_t output_capacity)
+{
+  TL_ASSERT(mb != NULL);
+  TL_ASSERT(input != NULL || input_size == 0);
+  TL_ASSERT(output != NULL || output_capacity == 0);
+
+  mb->backend.read = itl_memory_read;
+  mb->backend.wait = itl_memory_wait;
+  mb->backend.write = itl_memory_write;
+  mb->backend.get_size = itl_memory_get_size;
+  mb->backend.enter_raw_mode = itl_memory_raw_mode;
+  mb->backend.exit_raw_mode = itl_memory_raw_mode;
+  mb->backend.data = mb;
+
+  mb->input = input;
+  mb->input_size = input_size;
+  mb->input_pos = 0;
+  mb->output = output;
+  mb->output_capacity = output_capacity;
+  mb->output_size = 0;
+  mb->rows = 24;
+  mb->cols = 80;
+}
 
-ITL_DEF const itl_utf8_t itl_replacement_character = {
-    {0xEF, 0xBF, 0xBD},
-    3
-};
+TL_DEF void
+tl_set_backend(const tl_backend_t *backend)
+{
+  itl_g_backend = (backend != NULL) ? backend : &itl_terminal_backend;
+}
 
-ITL_DEF itl_utf8_t
-itl_utf8_parse(uint8_t first_byte)
+TL_DEF TL_STATUS_CODE
+tl_enter_raw_mode(void)
 {
-  uint8_t i, size;
-  uint8_t bytes[4];
+  ITL_TRY(!itl_g_entered_raw_mode, return TL_SUCCESS);
 
-  if ((size = itl_utf8_width(first_byte)) == 0) { /* invalid character */
-    ITL_TRACELN("Invalid UTF-8 sequence '%d'\n", (uint8_t) first_byte);
-    return itl_replacement_character;
-  }
+  /* If raw mode failed, restore terminal's state */
+  ITL_TRY(itl_g_backend->enter_raw_mode(itl_g_backend->data) == TL_SUCCESS, {
+    tl_exit_raw_mode();
+    return TL_ERROR;
+  });
 
-  bytes[0] = first_byte;
+  itl_g_entered_raw_mode = true;
 
-  /* Consequent bytes. */
-  for (i = 1; i < size; ++i) {
-    ITL_TRY_READ_BYTE(&bytes[i], return itl_replacement_character);
-  }
+  return TL_SUCCESS;
+}
 
-  /* Codepoints U+D800 to U+DFFF (known as UTF-16 surrogates) are invalid. */
-  if (size > 1 && ITL_UTF8_IS_SURROGATE(first_byte, bytes[1])) {
-    ITL_TRACELN("Invalid UTF-16 surrogate: '%02X %02X'\n", first_byte,
-                bytes[1]);
-    return itl_replacement_character;
-  }
+TL_DEF TL_STATUS_CODE
+tl_exit_raw_mode(void)
+{
+  ITL_TRY(itl_g_entered_raw_mode, return TL_SUCCESS);
 
-#if defined TL_DEBUG
-  ITL_TRACELN("utf8 char size: %u\n", size);
-  ITL_TRACELN("utf8 char bytes: '");
+  ITL_TRY(itl_g_backend->exit_raw_mode(itl_g_backend->data) == TL_SUCCESS,
+          return TL_ERROR);
 
-  for (i = 0; i < size; ++i) {
-    ITL_TRACELN("%02X ", bytes[i]);
-  }
-#endif /* TL_DEBUG */
+  itl_g_entered_raw_mode = false;
 
-  return itl_utf8_new(bytes, size);
+  return TL_SUCCESS;
 }
 
-#define ITL_UTF8_FREE(c) itl_free(c)
-
-#define ITL_STRING_INIT_SIZE                      64
-#define ITL_STRING_REALLOC_CAPACITY(old_capacity) (((old_capacity) * 3) >> 1)
+/* Must be a power of 2. */
+#define ITL_INPUT_BUF_SIZE 4096
 
-typedef struct itl_string itl_string_t;
+typedef struct itl_input_buf itl_input_buf_t;
 
-struct itl_string
+/* Ring buffer of bytes that were already read from the terminal, but were not
+   decoded yet. This allows to drain everything that is available with a single
+   `read()`, instead of doing a syscall for each byte of a paste. */
+struct itl_input_buf
 {
-  itl_utf8_t *chars;
-  size_t length;   /* N of chars in the string */
-  size_t size;     /* N of bytes in all chars, size >= length */
-  size_t capacity; /* N of chars this string can store */
+  uint8_t data[ITL_INPUT_BUF_SIZE];
+  /* Free-running positions, masked on access */
+  size_t read_pos;
+  size_t write_pos;
 };
 
-ITL_DEF void
-itl_string_init(itl_string_t *str)
-{
-  str->length = 0;
-  str->size = 0;
-
-  str->capacity = ITL_STRING_INIT_SIZE;
-  str->chars = (itl_utf8_t *) itl_malloc(str->capacity * sizeof(itl_utf8_t));
-}
-
-ITL_DEF itl_string_t *
-itl_string_alloc(void)
-{
-  itl_string_t *ptr = (itl_string_t *) itl_malloc(sizeof(itl_string_t));
-  itl_string_init(ptr);
-  return ptr;
-}
-
-ITL_DEF void
-itl_string_extend(itl_string_t *str)
-{
-  str->capacity = ITL_STRING_REALLOC_CAPACITY(str->capacity);
-  str->chars = (itl_utf8_t *) itl_realloc(str->chars,
-                                          str->capacity * sizeof(itl_utf8_t));
-}
-
-/* Returns length of the matching prefix */
-ITL_DEF size_t
-itl_string_prefix_with_offset(const itl_string_t *str1, size_t start,
-                              size_t end, const itl_string_t *str2)
-{
-  size_t i, k, actual_end = ITL_MIN(end, str1->length);
+#define ITL_INPUT_BUF_MASK(pos) ((pos) & (ITL_INPUT_BUF_SIZE - 1))
 
-  TL_ASSERT(start <= actual_end);
+#define ITL_INPUT_BUF_PENDING(ib) ((ib)->write_pos - (ib)->read_pos)
 
-  for (i = start, k = 0; i < actual_end && k < str2->length; ++i, ++k) {
-    if (!itl_utf8_equal(str1->chars[i], str2->chars[k])) {
-      break;
-    }
-  }
-  return k;
-}
+ITL_DEF ITL_THREAD_LOCAL itl_input_buf_t itl_g_input_buf = ITL_ZERO_INIT;
 
 ITL_DEF bool
-itl_string_equal(const itl_string_t *str1, const itl_string_t *str2)
+itl_input_buf_pop(itl_input_buf_t *ib, uint8_t *byte)
 {
-  if (str1->size != str2->size) {
+  if (ITL_INPUT_BUF_PENDING(ib) == 0) {
     return false;
   }
-  if (str1->size == 0) {
-    return true;
-  }
-  return itl_string_prefix_with_offset(str1, 0, str1->length, str2) ==
-         str1->length;
+
+  *byte = ib->data[ITL_INPUT_BUF_MASK(ib->read_pos)];
+  ib->read_pos += 1;
+
+  return true;
 }
 
-ITL_DEF void
-itl_string_copy(itl_string_t *dst, const itl_string_t *src)
+/* Appends as much of `data` as fits, returns amount of appended bytes. */
+ITL_DEF size_t
+itl_input_buf_push(itl_input_buf_t *ib, const uint8_t *data, size_t size)
 {
   size_t i;
 
-  TL_ASSERT(dst != NULL);
-  TL_ASSERT(src != NULL);
-
-  while (dst->capacity < src->capacity) {
-    itl_string_extend(dst);
-  }
-  for (i = 0; i < src->length; ++i) {
-    ITL_UTF8_COPY(&dst->chars[i], &src->chars[i]);
+  size = ITL_MIN(size, ITL_INPUT_BUF_SIZE - ITL_INPUT_BUF_PENDING(ib));
+  for (i = 0; i < size; ++i) {
+    ib->data[ITL_INPUT_BUF_MASK(ib->write_pos)] = data[i];
+    ib->write_pos += 1;
   }
 
-  dst->length = src->length;
-  dst->size = src->size;
+  return size;
 }
 
-ITL_DEF void
-itl_string_recalc_size(itl_string_t *str)
+/* Does one read of everything that is available, but not more than free space
+   in the buffer. Blocks until at least one byte is read. Returns amount of read
+   bytes, or -1 on errors and end of file. */
+ITL_DEF int
+itl_input_buf_fill(itl_input_buf_t *ib)
 {
-  size_t i;
-  str->size = 0;
+  size_t offset, free_size;
+  int read_amount;
+
+  /* Start from the beginning when drained to get the most contiguous space */
+  if (ITL_INPUT_BUF_PENDING(ib) == 0) {
+    ib->read_pos = 0;
+    ib->write_pos = 0;
+  }
 
-  TL_ASSERT(str->length <= ITL_STRING_MAX_LEN);
+  /* Read only into contiguous free space. */
+  offset = ITL_INPUT_BUF_MASK(ib->write_pos);
+  free_size = ITL_MIN(ITL_INPUT_BUF_SIZE - ITL_INPUT_BUF_PENDING(ib),
+                      ITL_INPUT_BUF_SIZE - offset);
+  ITL_TRY(free_size > 0, return -1);
 
-  for (i = 0; i < str->length; ++i) {
-    TL_ASSERT(str->chars[i].size > 0);
-    TL_ASSERT(str->chars[i].size <= 4);
-    str->size += str->chars[i].size;
+  read_amount =
+      ITL_BACKEND_CALL(read, (char *) ib->data + offset, free_size);
+  if (read_amount <= 0) {
+    return -1;
   }
+
+  ib->write_pos += (size_t) read_amount;
+
+  return read_amount;
 }
 
-/* Shrinks string to capacity of ITL_STRING_INIT_SIZE */
-ITL_DEF void
-itl_string_shrink(itl_string_t *str)
+ITL_DEF int
+ITL_READ_BYTE_RAW(void)
 {
-  str->capacity = ITL_STRING_INIT_SIZE;
-  str->chars = (itl_utf8_t *) itl_realloc(str->chars,
-                                          str->capacity * sizeof(itl_utf8_t));
+  uint8_t byte = 0;
 
-  if (str->length > str->capacity) {
-    str->length = str->capacity;
+  if (!itl_input_buf_pop(&itl_g_input_buf, &byte)) {
+    ITL_TRY(itl_input_buf_fill(&itl_g_input_buf) > 0, return -1);
+    ITL_TRY(itl_input_buf_pop(&itl_g_input_buf, &byte), return -1);
   }
 
-  itl_string_recalc_size(str);
+  return byte;
 }
 
-ITL_DEF void
-itl_string_clear(itl_string_t *str)
+ITL_DEF bool
+ITL_READ_BYTE(uint8_t *buffer)
 {
-  str->size = 0;
-  str->length = 0;
-  itl_string_shrink(str);
+  int byte = ITL_READ_BYTE_RAW();
+  /* Catch `read()` errors */
+  ITL_TRY(byte != -1, return false);
+  ITL_PTR_ASSIGN(buffer, (uint8_t) byte);
+  return true;
 }
 
-/* Shifts all characters after `position`. When shifting forward, character on
-   `position` is duplicated `shift_by` times. Does not recalculate the size */
+#define ITL_TRY_READ_BYTE(buffer, expr) ITL_TRY(ITL_READ_BYTE(buffer), expr)
+
+#if defined ITL_SUSPEND
+#if defined ITL_POSIX
 ITL_DEF void
-itl_string_shift(itl_string_t *str, size_t position, size_t shift_by,
-                 bool backwards)
+itl_handle_sigcont(int signal_number)
 {
-  size_t i;
+  (void) signal_number;
+  tl_enter_raw_mode();
+}
 
-  TL_ASSERT(position <= str->length);
+ITL_DEF void
+itl_raise_suspend(void)
+{
+  tl_exit_raw_mode();
+  signal(SIGCONT, itl_handle_sigcont);
+  raise(SIGTSTP);
+}
 
-  /* When shifting back, loop from the specified position towards end and move
-     characters back by shift_by. If shifting forward, loop from the end back
-     to the position. */
-  if (backwards) {
-    for (i = position; i < str->length; ++i) {
-      str->chars[i - shift_by] = str->chars[i];
-    }
+#else /* ITL_POSIX */
+ITL_NO_RETURN ITL_DEF void
+itl_raise_suspend(void)
+{
+  tl_exit();
+  exit(0);
+}
+#endif
+#endif /* ITL_SUSPEND */
 
-    TL_ASSERT(str->length >= shift_by);
-    str->length -= shift_by;
-  } else {
-    str->length += shift_by;
-    while (str->capacity < str->length) {
-      itl_string_extend(str);
-    }
+ITL_DEF bool itl_g_tty_changed_size = true;
 
-    TL_ASSERT(str->length >= shift_by + 1);
-    for (i = str->length - shift_by - 1; i >= position; --i) {
-      str->chars[i + shift_by] = str->chars[i];
-      if (i == 0) {
-        break; /* avoid wrapping */
-      }
-    }
-  }
-}
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_alloc_count = 0;
 
-ITL_DEF void
-itl_string_erase(itl_string_t *str, size_t position, size_t count,
-                 bool backwards)
+ITL_DEF void *
+itl_malloc(size_t size)
 {
-  ITL_TRACELN("string_erase: pos: %zu, count: %zu, backwards: %d, len %zu\n",
-              position, count, backwards, str->length);
+  void *allocated;
 
-  if (count > str->length) {
-    count = str->length;
-  }
+  TL_ASSERT(size > 0);
 
-  if (backwards) {
-    /* Deleting at the start or at the end */
-    if (position >= str->length) {
-      str->length -= count;
-      itl_string_recalc_size(str);
-      return;
-    }
-  } else {
-    if (position >= str->length) {
-      return;
-    }
-    position += count;
-  }
+  allocated = TL_MALLOC(size);
+  itl_g_alloc_count += 1;
 
-  /* Erase the characters by shifting */
-  itl_string_shift(str, position, count, true);
-  itl_string_recalc_size(str);
+#if !defined TL_NO_ABORT
+  ITL_TRY(allocated != NULL, TL_ABORT());
+#endif /* !TL_NO_ABORT */
+
+  return allocated;
 }
 
-ITL_DEF void
-itl_string_insert(itl_string_t *str, size_t position, itl_utf8_t ch)
+ITL_DEF void *
+itl_realloc(void *block, size_t size)
 {
-  TL_ASSERT(ch.size > 0);
-  TL_ASSERT(ch.size <= 4);
+  void *allocated;
 
-  while (str->capacity < str->length + 1) {
-    itl_string_extend(str);
-  }
+  TL_ASSERT(size > 0);
 
-  if (position == str->length) {
-    str->length += 1;
+  if (block == NULL) {
+    allocated = TL_MALLOC(size);
+    itl_g_alloc_count += 1;
   } else {
-    itl_string_shift(str, position, 1, false);
+    allocated = TL_REALLOC(block, size);
   }
 
-  str->chars[position] = ch;
-  itl_string_recalc_size(str);
+#if !defined TL_NO_ABORT
+  ITL_TRY(allocated != NULL, TL_ABORT());
+#endif /* !TL_NO_ABORT */
+
+  return allocated;
 }
 
-#define ITL_STRING_FREE(str)                                                   \
+#if defined TL_DEBUG
+#define ITL_FREE(ptr)                                                          \
   do {                                                                         \
-    ITL_FREE((str)->chars);                                                    \
-    ITL_FREE(str);                                                             \
+    TL_ASSERT((ptr) != NULL);                                                  \
+    memset(ptr, 0x7F, sizeof(*ptr));                                           \
+    TL_FREE(ptr);                                                              \
+    itl_g_alloc_count -= 1;                                                    \
+  } while (0)
+#else /* TL_DEBUG */
+#define ITL_FREE(ptr)                                                          \
+  do {                                                                         \
+    itl_g_alloc_count -= 1;                                                    \
+    TL_FREE(ptr);                                                              \
   } while (0)
+#endif
 
-#if defined ITL_WIN32
-#define ITL_LF     "\r\n"
-#define ITL_LF_LEN 2
-#elif defined ITL_POSIX
-#define ITL_LF     "\n"
-#define ITL_LF_LEN 1
-#endif /* ITL_POSIX */
+typedef struct itl_utf8 itl_utf8_t;
 
-ITL_DEF TL_STATUS_CODE
-itl_string_to_cstr(const itl_string_t *str, char *cstr, size_t cstr_size)
+struct itl_utf8
 {
-  size_t i, j, k;
-
-  for (i = 0, k = 0; i < str->length; ++i) {
-    /* FIXME: This sometimes explodes. */
-    if (k + 1 >= cstr_size || cstr_size - k - 1 < str->chars[i].size) {
-      break;
-    }
-    for (j = 0; j < str->chars[i].size; ++j, ++k) {
-      cstr[k] = (char) str->chars[i].bytes[j];
+  uint8_t bytes[4];
+  uint8_t size;
+};
+
+ITL_DEF itl_utf8_t
+itl_utf8_new(const uint8_t *bytes, uint8_t size)
+{
+  itl_utf8_t ch;
+
+  TL_ASSERT(size <= 4);
+
+  memcpy(ch.bytes, bytes, size);
+  ch.size = size;
+
+  return ch;
+}
+
+#define ITL_UTF8_COPY(dst, src) memcpy(dst, src, sizeof(itl_utf8_t))
+
+ITL_DEF uint8_t
+itl_utf8_width(int byte)
+{
+  if ((byte & 0x80) == 0)
+    return 1;
+  else if ((byte & 0xE0) == 0xC0)
+    return 2;
+  else if ((byte & 0xF0) == 0xE0)
+    return 3;
+  else if ((byte & 0xF8) == 0xF0)
+    return 4;
+  else
+    return 0; /* invalid character */
+}
+
+#define ITL_UTF8_IS_SURROGATE(first_byte, second_byte)                         \
+  (((first_byte) == 0xED) && ((second_byte) >= 0xA0 && (second_byte) <= 0xBF))
+
+/* Returns N of characters, which are bytes that are not continuation bytes */
+ITL_DEF size_t
+itl_utf8_count_scalar(const char *data, size_t size)
+{
+  size_t i, count = 0;
+  for (i = 0; i < size; ++i) {
+    count += ((data[i] & 0xC0) != 0x80);
+  }
+  return count;
+}
+
+#if defined ITL_SSE2
+/* Continuation bytes are 0x80 to 0xBF, which is below -64 as signed. They are
+   counted in 8 bit lanes, which are summed up before they can overflow. */
+ITL_DEF size_t
+itl_utf8_count_sse2(const char *data, size_t size)
+{
+  size_t i = 0, k, continuation = 0;
+  __m128i v, lanes, sums;
+
+  const __m128i limit = _mm_set1_epi8(-64);
+  const __m128i zero = _mm_setzero_si128();
+
+  while (i + 16 <= size) {
+    lanes = zero;
+    for (k = 0; k < 255 && i + 16 <= size; ++k, i += 16) {
+      v = _mm_loadu_si128((const __m128i *) (data + i));
+      lanes = _mm_sub_epi8(lanes, _mm_cmplt_epi8(v, limit));
     }
+    sums = _mm_sad_epu8(lanes, zero);
+    continuation += (size_t) _mm_cvtsi128_si32(sums) +
+                    (size_t) _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
   }
-  cstr[k] = '\0';
+  return i - continuation + itl_utf8_count_scalar(data + i, size - i);
+}
+#endif /* ITL_SSE2 */
 
-  if (k != str->size) {
-    return TL_ERROR_SIZE;
+#if defined ITL_AVX2
+ITL_TARGET_AVX2 ITL_DEF size_t
+itl_utf8_count_avx2(const char *data, size_t size)
+{
+  size_t i = 0, k, continuation = 0;
+  __m256i v, lanes;
+  __m128i sums;
+
+  const __m256i limit = _mm256_set1_epi8(-64);
+  const __m256i zero = _mm256_setzero_si256();
+
+  while (i + 32 <= size) {
+    lanes = zero;
+    for (k = 0; k < 255 && i + 32 <= size; ++k, i += 32) {
+      v = _mm256_loadu_si256((const __m256i *) (data + i));
+      lanes = _mm256_sub_epi8(lanes, _mm256_cmpgt_epi8(limit, v));
+    }
+    lanes = _mm256_sad_epu8(lanes, zero);
+    sums = _mm_add_epi64(_mm256_castsi256_si128(lanes),
+                         _mm256_extracti128_si256(lanes, 1));
+    continuation += (size_t) _mm_cvtsi128_si32(sums) +
+                    (size_t) _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
   }
+  return i - continuation + itl_utf8_count_scalar(data + i, size - i);
+}
+#endif /* ITL_AVX2 */
 
-  return TL_SUCCESS;
+ITL_DEF size_t
+itl_utf8_count(const char *data, size_t size)
+{
+#if defined ITL_AVX2
+  if (ITL_CPU_HAS_AVX2()) {
+    return itl_utf8_count_avx2(data, size);
+  }
+#endif /* ITL_AVX2 */
+#if defined ITL_SSE2
+  return itl_utf8_count_sse2(data, size);
+#else  /* ITL_SSE2 */
+  return itl_utf8_count_scalar(data, size);
+#endif /* ITL_SSE2 */
 }
 
+/* Returns false on lone continuation bytes, cut off characters and UTF-16
+   surrogates */
 ITL_DEF bool
-itl_string_from_bytes(itl_string_t *str, const char *data, size_t size)
+itl_utf8_validate_scalar(const char *data, size_t size)
 {
-  size_t i, j, k;
-  uint8_t rune_width;
+  size_t i = 0, k;
+  uint8_t width;
 
-  for (i = 0, k = 0; k < size; ++i) {
-    while (str->capacity < i + 1) {
-      itl_string_extend(str);
+  while (i < size) {
+    if ((data[i] & 0x80) == 0) {
+      i += 1;
+      continue;
     }
 
-    rune_width = itl_utf8_width(data[k]);
-    if (rune_width == 0) {
-      return false; /* Something went wrong. */
+    width = itl_utf8_width(data[i]);
+    if (width == 0 || width > size - i) {
+      return false;
+    }
+    for (k = 1; k < width; ++k) {
+      if ((data[i + k] & 0xC0) != 0x80) {
+        return false;
+      }
+    }
+    if (ITL_UTF8_IS_SURROGATE((uint8_t) data[i], (uint8_t) data[i + 1])) {
+      return false;
     }
 
-    str->chars[i].size = rune_width;
+    i += width;
+  }
+
+  return true;
+}
 
-    for (j = 0; j < rune_width && k < size; ++j, ++k) {
-      str->chars[i].bytes[j] = (uint8_t) data[k];
+#if defined ITL_SSE2
+/* Returns where the last character that starts among `size` bytes at `data`
+   starts, which may go on after them. Blocks validate bytes up to there */
+ITL_DEF size_t
+itl_utf8_last_start(const char *data, size_t size)
+{
+  size_t i = size;
+  while (i > 0 && size - i < 4) {
+    i -= 1;
+    if ((data[i] & 0xC0) != 0x80) {
+      break;
     }
   }
+  return i;
+}
 
-  str->length = i;
-  itl_string_recalc_size(str);
+/* Bytes of `v` moved up by `n`, with the last `n` bytes of `prev` below */
+#define ITL_SSE2_PREV(v, prev, n)                                              \
+  _mm_or_si128(_mm_slli_si128(v, n), _mm_srli_si128(prev, 16 - (n)))
 
-  return true;
+/* Bytes are classified by comparisons into continuation bytes and leads of 2,
+   3 and 4 byte characters. Each byte should be a continuation byte exactly
+   when a lead 1 to 3 bytes before it needs one. Blocks of ASCII that follow
+   ASCII are skipped */
+ITL_DEF bool
+itl_utf8_validate_sse2(const char *data, size_t size)
+{
+  size_t i;
+  __m128i v, high, continuation, required;
+  __m128i prev = _mm_setzero_si128(), error = _mm_setzero_si128();
+  __m128i lead = error, lead3 = error, lead4 = error;
+  __m128i prev_lead = error, prev_lead3 = error, prev_lead4 = error;
+
+  /* Bytes are compared as signed, where 0x80 to 0xBF are the lowest */
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i above_continuation = _mm_set1_epi8((char) 0xBF);
+  const __m128i above_lead2 = _mm_set1_epi8((char) 0xDF);
+  const __m128i above_lead3 = _mm_set1_epi8((char) 0xEF);
+  const __m128i above_lead4 = _mm_set1_epi8((char) 0xF7);
+  const __m128i surrogate_lead = _mm_set1_epi8((char) 0xED);
+  const __m128i below_surrogate = _mm_set1_epi8((char) 0x9F);
+
+  for (i = 0; i + 16 <= size; i += 16) {
+    v = _mm_loadu_si128((const __m128i *) (data + i));
+    if (_mm_movemask_epi8(_mm_or_si128(v, prev)) == 0) {
+      continue;
+    }
+
+    high = _mm_cmplt_epi8(v, zero);
+    continuation =
+        _mm_andnot_si128(_mm_cmpgt_epi8(v, above_continuation), high);
+    lead = _mm_and_si128(_mm_cmpgt_epi8(v, above_continuation), high);
+    lead3 = _mm_and_si128(_mm_cmpgt_epi8(v, above_lead2), high);
+    lead4 = _mm_and_si128(_mm_cmpgt_epi8(v, above_lead3), high);
+
+    required = _mm_or_si128(
+        _mm_or_si128(ITL_SSE2_PREV(lead, prev_lead, 1),
+                     ITL_SSE2_PREV(lead3, prev_lead3, 2)),
+        ITL_SSE2_PREV(lead4, prev_lead4, 3));
+    error = _mm_or_si128(error, _mm_xor_si128(required, continuation));
+
+    /* Leads above 0xF7, and 0xED followed by 0xA0 to 0xBF */
+    error = _mm_or_si128(
+        error, _mm_and_si128(_mm_cmpgt_epi8(v, above_lead4), high));
+    error = _mm_or_si128(
+        error,
+        _mm_and_si128(
+            _mm_cmpeq_epi8(ITL_SSE2_PREV(v, prev, 1), surrogate_lead),
+            _mm_and_si128(_mm_cmpgt_epi8(v, below_surrogate), continuation)));
+
+    prev = v;
+    prev_lead = lead;
+    prev_lead3 = lead3;
+    prev_lead4 = lead4;
+  }
+  if (_mm_movemask_epi8(error) != 0) {
+    return false;
+  }
+
+  i = itl_utf8_last_start(data, i);
+  return itl_utf8_validate_scalar(data + i, size - i);
 }
+#endif /* ITL_SSE2 */
 
-/* Requires null-terminated string. */
-#define ITL_STRING_FROM_CSTR(str, cstr)                                        \
-  itl_string_from_bytes(str, cstr, strlen(cstr))
+#if defined ITL_AVX2
+/* Same as ITL_SSE2_PREV(), across both halves */
+#define ITL_AVX2_PREV(v, prev, n)                                              \
+  _mm256_alignr_epi8(v, _mm256_permute2x128_si256(prev, v, 0x21), 16 - (n))
 
-ITL_DEF const itl_utf8_t itl_space = {{0x20}, 1};
+ITL_TARGET_AVX2 ITL_DEF bool
+itl_utf8_validate_avx2(const char *data, size_t size)
+{
+  size_t i;
+  __m256i v, high, continuation, required;
+  __m256i prev = _mm256_setzero_si256(), error = _mm256_setzero_si256();
+  __m256i lead = error, lead3 = error, lead4 = error;
+  __m256i prev_lead = error, prev_lead3 = error, prev_lead4 = error;
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i above_continuation = _mm256_set1_epi8((char) 0xBF);
+  const __m256i above_lead2 = _mm256_set1_epi8((char) 0xDF);
+  const __m256i above_lead3 = _mm256_set1_epi8((char) 0xEF);
+  const __m256i above_lead4 = _mm256_set1_epi8((char) 0xF7);
+  const __m256i surrogate_lead = _mm256_set1_epi8((char) 0xED);
+  const __m256i below_surrogate = _mm256_set1_epi8((char) 0x9F);
+
+  for (i = 0; i + 32 <= size; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *) (data + i));
+    if (_mm256_movemask_epi8(_mm256_or_si256(v, prev)) == 0) {
+      continue;
+    }
+
+    high = _mm256_cmpgt_epi8(zero, v);
+    continuation =
+        _mm256_andnot_si256(_mm256_cmpgt_epi8(v, above_continuation), high);
+    lead = _mm256_and_si256(_mm256_cmpgt_epi8(v, above_continuation), high);
+    lead3 = _mm256_and_si256(_mm256_cmpgt_epi8(v, above_lead2), high);
+    lead4 = _mm256_and_si256(_mm256_cmpgt_epi8(v, above_lead3), high);
+
+    required = _mm256_or_si256(
+        _mm256_or_si256(ITL_AVX2_PREV(lead, prev_lead, 1),
+                        ITL_AVX2_PREV(lead3, prev_lead3, 2)),
+        ITL_AVX2_PREV(lead4, prev_lead4, 3));
+    error = _mm256_or_si256(error, _mm256_xor_si256(required, continuation));
+
+    error = _mm256_or_si256(
+        error, _mm256_and_si256(_mm256_cmpgt_epi8(v, above_lead4), high));
+    error = _mm256_or_si256(
+        error,
+        _mm256_and_si256(
+            _mm256_cmpeq_epi8(ITL_AVX2_PREV(v, prev, 1), surrogate_lead),
+            _mm256_and_si256(_mm256_cmpgt_epi8(v, below_surrogate),
+                             continuation)));
+
+    prev = v;
+    prev_lead = lead;
+    prev_lead3 = lead3;
+    prev_lead4 = lead4;
+  }
+  if (_mm256_movemask_epi8(error) != 0) {
+    return false;
+  }
 
-typedef struct itl_history_item itl_history_item_t;
+  i = itl_utf8_last_start(data, i);
+  return itl_utf8_validate_scalar(data + i, size - i);
+}
+#endif /* ITL_AVX2 */
 
-struct itl_history_item
+ITL_DEF bool
+itl_utf8_validate(const char *data, size_t size)
 {
-  itl_string_t *str;
-  itl_history_item_t *next;
-  itl_history_item_t *prev;
+#if defined ITL_AVX2
+  if (ITL_CPU_HAS_AVX2()) {
+    return itl_utf8_validate_avx2(data, size);
+  }
+#endif /* ITL_AVX2 */
+#if defined ITL_SSE2
+  return itl_utf8_validate_sse2(data, size);
+#else  /* ITL_SSE2 */
+  return itl_utf8_validate_scalar(data, size);
+#endif /* ITL_SSE2 */
+}
+
+ITL_DEF const itl_utf8_t itl_replacement_character = {
+    {0xEF, 0xBF, 0xBD},
+    3
 };
 
-ITL_DEF ITL_THREAD_LOCAL itl_history_item_t *itl_g_history_last = NULL;
-ITL_DEF ITL_THREAD_LOCAL itl_history_item_t *itl_g_history_first = NULL;
-ITL_DEF ITL_THREAD_LOCAL size_t itl_g_history_length = 0;
+#define ITL_UTF8_FREE(c) itl_free(c)
 
-ITL_DEF ITL_THREAD_LOCAL itl_string_t itl_g_line_buffer = ITL_ZERO_INIT;
+#define ITL_UTF8_IS_CONTINUATION(byte) (((byte) & 0xC0) == 0x80)
 
-typedef struct itl_le itl_le_t;
+#define ITL_STRING_INIT_SIZE                      64
+#define ITL_STRING_REALLOC_CAPACITY(old_capacity) (((old_capacity) * 3) >> 1)
 
-/* Line editor */
-struct itl_le
+typedef struct itl_string itl_string_t;
+
+/* UTF-8 bytes in a gap buffer. Bytes of the first `gap` characters are at the
+   start of `data`, and the rest are at the end of it, so that editing at the
+   cursor only moves what is between the cursor and its previous position. */
+struct itl_string
 {
-  /* Contents of the line */
-  itl_string_t *line;
-  size_t cursor_position;
+  char *data;
+  size_t length;     /* N of chars in the string */
+  size_t size;       /* N of bytes in all chars, size >= length */
+  size_t capacity;   /* N of bytes this string can store */
+  size_t gap;        /* N of chars before the gap */
+  size_t gap_offset; /* N of bytes before the gap */
+  /* Last character that was looked up, so that walking over the string does
+     not start from the beginning each time */
+  size_t hint;
+  size_t hint_offset;
+};
 
-  /* Whether unsubmitted line was already appended to history */
-  bool appended_to_history;
-  itl_history_item_t *history_selected_item;
+#define ITL_STRING_GAP_SIZE(str) ((str)->capacity - (str)->size)
 
-  char *out_buf;
-  size_t out_size;
+/* Byte at `offset`, skipping the gap */
+#define ITL_STRING_BYTE(str, offset)                                           \
+  ((uint8_t) (str)->data[((offset) < (str)->gap_offset)                        \
+                             ? (offset)                                        \
+                             : (offset) + ITL_STRING_GAP_SIZE(str)])
 
-  const char *prompt;
-  size_t prompt_size;
-};
+/* Edits before the hint invalidate it, while the gap is always valid */
+#define ITL_STRING_RESET_HINT(str)                                             \
+  do {                                                                         \
+    (str)->hint = (str)->gap;                                                  \
+    (str)->hint_offset = (str)->gap_offset;                                    \
+  } while (0)
+
+ITL_DEF void
+itl_string_init(itl_string_t *str)
+{
+  str->length = 0;
+  str->size = 0;
+  str->gap = 0;
+  str->gap_offset = 0;
+  ITL_STRING_RESET_HINT(str);
+
+  str->capacity = ITL_STRING_INIT_SIZE;
+  str->data = (char *) itl_malloc(str->capacity);
+}
+
+ITL_DEF itl_string_t *
+itl_string_alloc(void)
+{
+  itl_string_t *ptr = (itl_string_t *) itl_malloc(sizeof(itl_string_t));
+  itl_string_init(ptr);
+  return ptr;
+}
 
-ITL_DEF itl_history_item_t *
-itl_history_item_alloc(const itl_string_t *str)
+/* Returns offset of the character after the one at `offset` */
+ITL_DEF size_t
+itl_string_next(const itl_string_t *str, size_t offset)
 {
-  itl_history_item_t *item =
-      (itl_history_item_t *) itl_malloc(sizeof(itl_history_item_t));
+  TL_ASSERT(offset < str->size);
+
+  do {
+    offset += 1;
+  } while (offset < str->size &&
+           ITL_UTF8_IS_CONTINUATION(ITL_STRING_BYTE(str, offset)));
+
+  return offset;
+}
 
-  item->next = NULL;
-  item->prev = NULL;
+/* Returns offset of the character before the one at `offset` */
+ITL_DEF size_t
+itl_string_prev(const itl_string_t *str, size_t offset)
+{
+  TL_ASSERT(offset > 0);
 
-  item->str = itl_string_alloc();
-  itl_string_copy(item->str, str);
+  do {
+    offset -= 1;
+  } while (offset > 0 &&
+           ITL_UTF8_IS_CONTINUATION(ITL_STRING_BYTE(str, offset)));
 
-  return item;
+  return offset;
 }
 
-#define ITL_HISTORY_ITEM_FREE(item)                                            \
-  do {                                                                         \
-    ITL_STRING_FREE((item)->str);                                              \
-    ITL_FREE(item);                                                            \
-  } while (0)
+#define ITL_DISTANCE(i, j) (((i) > (j)) ? (i) - (j) : (j) - (i))
 
-ITL_DEF void
-itl_g_history_free(void)
+/* Returns offset of the first byte of character at `index`, skipping the gap.
+   Walks from whatever is closest: the start, the end, the gap or the hint. */
+ITL_DEF size_t
+itl_string_offset(itl_string_t *str, size_t index)
 {
-  itl_history_item_t *item, *prev_item;
+  size_t from = 0, offset = 0;
 
-  if ((item = itl_g_history_last) == NULL) {
-    return;
+  TL_ASSERT(index <= str->length);
+
+  /* Only ASCII */
+  if (str->size == str->length) {
+    return index;
+  }
+
+  if (ITL_DISTANCE(index, str->gap) < index - from) {
+    from = str->gap;
+    offset = str->gap_offset;
+  }
+  if (ITL_DISTANCE(index, str->hint) < ITL_DISTANCE(index, from)) {
+    from = str->hint;
+    offset = str->hint_offset;
+  }
+  if (str->length - index < ITL_DISTANCE(index, from)) {
+    from = str->length;
+    offset = str->size;
   }
 
-  while (item->next) {
-    item = item->next;
+  for (; from < index; ++from) {
+    offset = itl_string_next(str, offset);
   }
-  while (item) {
-    prev_item = item->prev;
-    ITL_HISTORY_ITEM_FREE(item);
-    item = prev_item;
+  for (; from > index; --from) {
+    offset = itl_string_prev(str, offset);
   }
 
-  itl_g_history_length = 0;
+  str->hint = index;
+  str->hint_offset = offset;
 
-  itl_g_history_last = NULL;
-  itl_g_history_first = NULL;
+  return offset;
 }
 
-ITL_DEF bool
-itl_g_history_append(const itl_string_t *str)
+/* Returns character at `index` */
+ITL_DEF itl_utf8_t
+itl_string_at(itl_string_t *str, size_t index)
 {
-  /* If history size was exceeded, release the last item first */
-  if (itl_g_history_length >= TL_HISTORY_MAX_SIZE) {
-    if (itl_g_history_first) {
-      itl_history_item_t *next_item = itl_g_history_first->next;
-      ITL_HISTORY_ITEM_FREE(itl_g_history_first);
-
-      itl_g_history_first = next_item;
-
-      if (itl_g_history_first) {
-        itl_g_history_first->prev = NULL;
-      }
+  size_t offset, end;
+  itl_utf8_t ch;
 
-      itl_g_history_length -= 1;
-    }
-  }
+  TL_ASSERT(index < str->length);
 
-  if (itl_g_history_last == NULL) {
-    itl_g_history_last = itl_history_item_alloc(str);
-    itl_g_history_first = itl_g_history_last;
-  } else {
-    itl_history_item_t *item;
+  offset = itl_string_offset(str, index);
+  end = itl_string_next(str, offset);
 
-    /* Do not append the same string */
-    if (itl_string_equal(itl_g_history_last->str, str)) {
-      return false;
-    }
+  TL_ASSERT(end - offset <= 4);
 
-    item = itl_history_item_alloc(str);
-    item->prev = itl_g_history_last;
-    itl_g_history_last->next = item;
-    itl_g_history_last = item;
+  for (ch.size = 0; offset < end; ++offset, ++ch.size) {
+    ch.bytes[ch.size] = ITL_STRING_BYTE(str, offset);
   }
 
-  itl_g_history_length += 1;
-
-  return true;
+  return ch;
 }
 
+/* Copies bytes between `from` and `to` offsets into `out` */
 ITL_DEF void
-itl_le_init(itl_le_t *le, itl_string_t *line_buf, char *out_buf,
-            size_t out_size, const char *prompt)
+itl_string_copy_bytes(const itl_string_t *str, size_t from, size_t to,
+                      char *out)
 {
-  /* clang-format off */
-  le->line                  = line_buf;
-  le->cursor_position       = line_buf->length;
-  le->appended_to_history   = false;
-  le->history_selected_item = NULL;
-  le->out_buf               = out_buf;
-  le->out_size              = out_size;
-  le->prompt                = prompt;
-  le->prompt_size           = (prompt != NULL) ? strlen(prompt) : 0;
-  /* clang-format on */
+  size_t before_gap;
+
+  TL_ASSERT(from <= to);
+  TL_ASSERT(to <= str->size);
+
+  if (from < str->gap_offset) {
+    before_gap = ITL_MIN(to, str->gap_offset) - from;
+    memcpy(out, &str->data[from], before_gap);
+    out += before_gap;
+    from += before_gap;
+  }
+  if (from < to) {
+    memcpy(out, &str->data[from + ITL_STRING_GAP_SIZE(str)], to - from);
+  }
 }
 
 ITL_DEF void
-itl_le_move_right(itl_le_t *le, size_t steps)
+itl_string_extend(itl_string_t *str)
 {
-  if (le->cursor_position + steps >= le->line->length) {
-    le->cursor_position = le->line->length;
-  } else {
-    le->cursor_position += steps;
-  }
+  size_t old_gap_size = ITL_STRING_GAP_SIZE(str);
+
+  str->capacity = ITL_STRING_REALLOC_CAPACITY(str->capacity);
+  str->data = (char *) itl_realloc(str->data, str->capacity);
+
+  /* Keep bytes after the gap at the end */
+  memmove(&str->data[str->gap_offset + ITL_STRING_GAP_SIZE(str)],
+          &str->data[str->gap_offset + old_gap_size],
+          str->size - str->gap_offset);
 }
 
+/* Makes sure that string can store `size` bytes */
 ITL_DEF void
-itl_le_move_left(itl_le_t *le, size_t steps)
+itl_string_reserve(itl_string_t *str, size_t size)
 {
-  if (steps <= le->cursor_position) {
-    le->cursor_position -= steps;
-  } else {
-    le->cursor_position = 0;
+  while (str->capacity < size) {
+    itl_string_extend(str);
   }
 }
 
+/* Moves the gap to `position`. Only characters between the old and the new
+   position are moved. */
 ITL_DEF void
-itl_le_erase(itl_le_t *le, size_t count, bool backwards)
+itl_string_move_gap(itl_string_t *str, size_t position)
 {
-  if (count == 0) {
-    return;
-  }
+  size_t offset, gap_size = ITL_STRING_GAP_SIZE(str);
 
-  if (backwards && le->cursor_position) {
-    itl_string_erase(le->line, le->cursor_position, count, true);
-    itl_le_move_left(le, count);
-  } else if (!backwards) {
-    itl_string_erase(le->line, le->cursor_position, count, false);
+  TL_ASSERT(position <= str->length);
+
+  offset = itl_string_offset(str, position);
+
+  if (offset < str->gap_offset) {
+    memmove(&str->data[offset + gap_size], &str->data[offset],
+            str->gap_offset - offset);
+  } else if (offset > str->gap_offset) {
+    memmove(&str->data[str->gap_offset], &str->data[str->gap_offset + gap_size],
+            offset - str->gap_offset);
   }
-}
 
-#define ITL_LE_ERASE_FORWARD(le, count)  itl_le_erase(le, count, false)
-#define ITL_LE_ERASE_BACKWARD(le, count) itl_le_erase(le, count, true)
+  str->gap = position;
+  str->gap_offset = offset;
+}
 
-/* Inserts character at cursor position */
 ITL_DEF bool
-itl_le_insert(itl_le_t *le, itl_utf8_t ch)
+itl_string_equal(const itl_string_t *str1, const itl_string_t *str2)
 {
-  ITL_TRY(le->line->size + ch.size < le->out_size, return false);
-
-  itl_string_insert(le->line, le->cursor_position, ch);
-  itl_le_move_right(le, 1);
+  size_t i;
 
+  if (str1->size != str2->size || str1->length != str2->length) {
+    return false;
+  }
+  for (i = 0; i < str1->size; ++i) {
+    if (ITL_STRING_BYTE(str1, i) != ITL_STRING_BYTE(str2, i)) {
+      return false;
+    }
+  }
   return true;
 }
 
-#define ITL_CHAR_IS_DELIM(c) (ispunct(c))
-#define ITL_CHAR_IS_SPACE(c) (isspace(c))
-
-typedef enum
+/* Compares with `size` bytes of `data` */
+ITL_DEF bool
+itl_string_equal_bytes(const itl_string_t *str, const char *data, size_t size)
 {
-  ITL_TOKEN_DELIM = 0,
-  ITL_TOKEN_WORD = 1,
-  ITL_TOKEN_SPACE = 2,
-} ITL_TOKEN_KIND;
+  if (str->size != size) {
+    return false;
+  }
+  return memcmp(str->data, data, str->gap_offset) == 0 &&
+         memcmp(&str->data[str->gap_offset + ITL_STRING_GAP_SIZE(str)],
+                data + str->gap_offset, size - str->gap_offset) == 0;
+}
 
-/* Returns amount of steps required to reach next/previos token */
-ITL_DEF size_t
-itl_string_steps_to_token(const itl_string_t *str, size_t position,
-                          bool backwards)
-{
-  uint8_t b;
-  bool should_break = false;
-  size_t i = position, steps = 0;
+ITL_DEF void
+itl_string_copy(itl_string_t *dst, const itl_string_t *src)
+{
+  TL_ASSERT(dst != NULL);
+  TL_ASSERT(src != NULL);
 
-  ITL_TOKEN_KIND token_kind;
+  dst->size = 0;
+  dst->gap_offset = 0;
+  itl_string_reserve(dst, src->size);
 
-  if (backwards && i > 0) {
-    steps += 1;
-    i -= 1;
-  }
+  /* Copy both sides of the gap, and leave the gap at the end */
+  itl_string_copy_bytes(src, 0, src->size, dst->data);
 
-  b = str->chars[i].bytes[0];
+  dst->length = src->length;
+  dst->size = src->size;
+  dst->gap = src->length;
+  dst->gap_offset = src->size;
+  ITL_STRING_RESET_HINT(dst);
+}
 
-  if (ITL_CHAR_IS_SPACE(b)) {
-    token_kind = ITL_TOKEN_SPACE;
-  } else if (ITL_CHAR_IS_DELIM(b)) {
-    token_kind = ITL_TOKEN_DELIM;
-  } else {
-    token_kind = ITL_TOKEN_WORD;
+/* Shrinks string to capacity of ITL_STRING_INIT_SIZE */
+ITL_DEF void
+itl_string_shrink(itl_string_t *str)
+{
+  /* Everything that is kept should be before the gap */
+  itl_string_move_gap(str, str->length);
+
+  if (str->size > ITL_STRING_INIT_SIZE) {
+    /* Keep only whole characters */
+    str->size = ITL_STRING_INIT_SIZE;
+    while (str->size > 0 &&
+           ITL_UTF8_IS_CONTINUATION((uint8_t) str->data[str->size]))
+    {
+      str->size -= 1;
+    }
+    str->length = itl_utf8_count(str->data, str->size);
   }
 
-  while (i < str->length) {
-    b = str->chars[i].bytes[0];
+  str->capacity = ITL_STRING_INIT_SIZE;
+  str->data = (char *) itl_realloc(str->data, str->capacity);
 
-    switch (token_kind) {
-    case ITL_TOKEN_DELIM: should_break = !ITL_CHAR_IS_DELIM(b); break;
-    case ITL_TOKEN_WORD:
-      should_break = ITL_CHAR_IS_DELIM(b) || ITL_CHAR_IS_SPACE(b);
-      break;
-    case ITL_TOKEN_SPACE: should_break = !ITL_CHAR_IS_SPACE(b); break;
-    default: ITL_UNREACHABLE();
-    }
-    if (should_break) {
-      break;
-    }
+  str->gap = str->length;
+  str->gap_offset = str->size;
+  ITL_STRING_RESET_HINT(str);
+}
 
-    steps += 1;
+ITL_DEF void
+itl_string_clear(itl_string_t *str)
+{
+  str->size = 0;
+  str->length = 0;
+  str->gap = 0;
+  str->gap_offset = 0;
+  itl_string_shrink(str);
+}
 
-    if (backwards && i > 0) {
-      i -= 1;
-    } else if (!backwards && i < str->length - 1) {
-      i += 1;
-    } else {
-      break;
-    }
-  }
+ITL_DEF void itl_string_insert(itl_string_t *str, size_t position,
+                               itl_utf8_t ch);
 
-  ITL_TRACELN("mode: %d, steps: %zu", token_kind, steps);
+/* Shifts all characters after `position`. When shifting forward, character on
+   `position` is duplicated `shift_by` times. */
+ITL_DEF void
+itl_string_shift(itl_string_t *str, size_t position, size_t shift_by,
+                 bool backwards)
+{
+  size_t i, offset;
+  itl_utf8_t ch;
 
-  return steps;
-}
+  TL_ASSERT(position <= str->length);
 
-#define ITL_LE_STEPS_TO_TOKEN(le, backwards)                                   \
-  itl_string_steps_to_token((le)->line, (le)->cursor_position, backwards)
+  if (backwards) {
+    TL_ASSERT(position >= shift_by);
+    /* Characters before `position` are swallowed by the gap */
+    itl_string_move_gap(str, position);
+    for (i = 0, offset = str->gap_offset; i < shift_by; ++i) {
+      offset = itl_string_prev(str, offset);
+    }
+    str->size -= str->gap_offset - offset;
+    str->gap_offset = offset;
+    str->gap -= shift_by;
+    str->length -= shift_by;
+    ITL_STRING_RESET_HINT(str);
+  } else if (position < str->length) {
+    ch = itl_string_at(str, position);
+    for (i = 0; i < shift_by; ++i) {
+      itl_string_insert(str, position, ch);
+    }
+  }
+}
 
-#define ITL_LE_STEPS_TO_TOKEN_FORWARD(le)                                      \
-  itl_string_steps_to_token((le)->line, (le)->cursor_position, false)
+ITL_DEF void
+itl_string_erase(itl_string_t *str, size_t position, size_t count,
+                 bool backwards)
+{
+  ITL_TRACELN("string_erase: pos: %zu, count: %zu, backwards: %d, len %zu\n",
+              position, count, backwards, str->length);
 
-#define ITL_LE_STEPS_TO_TOKEN_BACKWARD(le)                                     \
-  itl_string_steps_to_token((le)->line, (le)->cursor_position, true)
+  if (backwards) {
+    /* Deleting at the end */
+    position = ITL_MIN(position, str->length);
+    count = ITL_MIN(count, position);
+  } else {
+    if (position >= str->length) {
+      return;
+    }
+    count = ITL_MIN(count, str->length - position);
+    position += count;
+  }
 
-#define ITL_LE_CURSOR_IS_ON_SPACE(le)                                          \
-  ITL_CHAR_IS_SPACE((le)->line->chars[(le)->cursor_position].bytes[0])
+  itl_string_shift(str, position, count, true);
+}
 
 ITL_DEF void
-itl_le_clear_line(itl_le_t *le)
+itl_string_insert(itl_string_t *str, size_t position, itl_utf8_t ch)
 {
-  itl_string_clear(le->line);
-  le->cursor_position = 0;
+  TL_ASSERT(ch.size > 0);
+  TL_ASSERT(ch.size <= 4);
+  TL_ASSERT(!ITL_UTF8_IS_CONTINUATION(ch.bytes[0]));
+  TL_ASSERT(position <= str->length);
+
+  itl_string_reserve(str, str->size + ch.size);
+  itl_string_move_gap(str, position);
+
+  memcpy(&str->data[str->gap_offset], ch.bytes, ch.size);
+  str->gap += 1;
+  str->gap_offset += ch.size;
+  str->length += 1;
+  str->size += ch.size;
+  ITL_STRING_RESET_HINT(str);
 }
 
+/* Inserts all characters of `src` at once */
 ITL_DEF void
-itl_g_history_get_prev(itl_le_t *le)
+itl_string_insert_string(itl_string_t *dst, size_t position,
+                         const itl_string_t *src)
 {
-  if (itl_g_history_last == NULL) {
+  TL_ASSERT(position <= dst->length);
+  TL_ASSERT(dst != src);
+
+  if (src->length == 0) {
     return;
   }
 
-  if (le->history_selected_item) {
-    if (le->history_selected_item->prev) {
-      le->history_selected_item = le->history_selected_item->prev;
-    }
-  } else {
-    le->history_selected_item = itl_g_history_last;
-  }
+  itl_string_reserve(dst, dst->size + src->size);
+  itl_string_move_gap(dst, position);
 
-  TL_ASSERT(le->history_selected_item);
+  itl_string_copy_bytes(src, 0, src->size, &dst->data[dst->gap_offset]);
 
-  itl_le_clear_line(le);
-  itl_string_copy(le->line, le->history_selected_item->str);
-  le->cursor_position = le->line->length;
+  dst->gap += src->length;
+  dst->gap_offset += src->size;
+  dst->length += src->length;
+  dst->size += src->size;
+  ITL_STRING_RESET_HINT(dst);
 }
 
-ITL_DEF void
-itl_g_history_get_next(itl_le_t *le)
+#define ITL_STRING_FREE(str)                                                   \
+  do {                                                                         \
+    ITL_FREE((str)->data);                                                     \
+    ITL_FREE(str);                                                             \
+  } while (0)
+
+#if defined ITL_WIN32
+#define ITL_LF     "\r\n"
+#define ITL_LF_LEN 2
+#elif defined ITL_POSIX
+#define ITL_LF     "\n"
+#define ITL_LF_LEN 1
+#endif /* ITL_POSIX */
+
+ITL_DEF TL_STATUS_CODE
+itl_string_to_cstr(const itl_string_t *str, char *cstr, size_t cstr_size)
 {
-  if (le->history_selected_item && le->history_selected_item->next) {
-    le->history_selected_item = le->history_selected_item->next;
-    itl_le_clear_line(le);
-    itl_string_copy(le->line, le->history_selected_item->str);
-    le->cursor_position = le->line->length;
+  size_t size = str->size;
+
+  TL_ASSERT(cstr_size > 0);
+
+  /* Cut the string on a character boundary if it doesn't fit */
+  if (size >= cstr_size) {
+    size = cstr_size - 1;
+    while (size > 0 && ITL_UTF8_IS_CONTINUATION(ITL_STRING_BYTE(str, size))) {
+      size -= 1;
+    }
   }
-}
 
-#define ITL_CHAR_BUFFER_INIT_SIZE 32
+  itl_string_copy_bytes(str, 0, size, cstr);
+  cstr[size] = '\0';
 
-typedef struct itl_char_buf itl_char_buf_t;
+  if (size != str->size) {
+    return TL_ERROR_SIZE;
+  }
 
-struct itl_char_buf
+  return TL_SUCCESS;
+}
+
+/* Replaces contents with `size` bytes of `length` characters, which should be
+   valid UTF-8 */
+ITL_DEF void
+itl_string_assign(itl_string_t *str, const char *data, size_t size,
+                  size_t length)
 {
-  char *data;
-  size_t size;
-  size_t capacity;
-};
+  /* Fill from the start, with the gap at the end */
+  str->size = 0;
+  str->gap_offset = 0;
+  itl_string_reserve(str, size);
+  memcpy(str->data, data, size);
+
+  str->length = length;
+  str->size = size;
+  str->gap = length;
+  str->gap_offset = size;
+  ITL_STRING_RESET_HINT(str);
+}
 
+/* Makes `str` refer to `size` bytes of `length` characters, without copying
+   them. It should only be read, and not freed */
 ITL_DEF void
-itl_char_buf_init(itl_char_buf_t *cb)
+itl_string_view(itl_string_t *str, const char *data, size_t size,
+                size_t length)
 {
-  cb->size = 0;
-  cb->capacity = ITL_CHAR_BUFFER_INIT_SIZE;
-  cb->data = (char *) itl_malloc(sizeof(char) * cb->capacity);
+  str->data = (char *) data;
+  str->length = length;
+  str->size = size;
+  str->capacity = size;
+  str->gap = length;
+  str->gap_offset = size;
+  ITL_STRING_RESET_HINT(str);
 }
 
-ITL_DEF itl_char_buf_t *
-itl_char_buf_alloc(void)
+/* Returns false if `data` is not valid UTF-8 */
+ITL_DEF bool
+itl_string_from_bytes(itl_string_t *str, const char *data, size_t size)
 {
-  itl_char_buf_t *cb = (itl_char_buf_t *) itl_malloc(sizeof(itl_char_buf_t));
-  itl_char_buf_init(cb);
-  return cb;
+  if (!itl_utf8_validate(data, size)) {
+    return false; /* Something went wrong. */
+  }
+  itl_string_assign(str, data, size, itl_utf8_count(data, size));
+
+  return true;
 }
 
-#define ITL_CHAR_BUF_FREE(cb)                                                  \
-  do {                                                                         \
-    ITL_FREE(cb->data);                                                        \
-    ITL_FREE(cb);                                                              \
-  } while (0)
+/* Requires null-terminated string. */
+#define ITL_STRING_FROM_CSTR(str, cstr)                                        \
+  itl_string_from_bytes(str, cstr, strlen(cstr))
 
-#define ITL_CHAR_BUF_REALLOC_CAPACITY(old_capacity) (old_capacity * 2)
+ITL_DEF const itl_utf8_t itl_space = {{0x20}, 1};
 
-ITL_DEF void
-itl_char_buf_extend(itl_char_buf_t *cb)
+typedef struct itl_history_entry itl_history_entry_t;
+
+struct itl_history_entry
 {
-  cb->capacity = ITL_CHAR_BUF_REALLOC_CAPACITY(cb->capacity);
-  cb->data = (char *) itl_realloc(cb->data, cb->capacity);
-}
+  size_t offset; /* Where text of the entry starts in the arena */
+  size_t size;   /* N of bytes */
+  size_t length; /* N of chars, or ITL_HISTORY_ERASED */
+  uint64_t hash; /* Of the text, if duplicates are erased */
+};
 
-ITL_DEF void
-itl_char_buf_append_cstr(itl_char_buf_t *cb, const char *cstr)
+typedef struct itl_posting_list itl_posting_list_t;
+
+/* Numbers of entries that contain a trigram, oldest first. Numbers are
+   counted from the base of the index, and ones before `start` were dropped */
+struct itl_posting_list
 {
-  size_t new_size, j;
+  uint32_t *data;
+  uint32_t size;
+  uint32_t capacity;
+  uint32_t start;
+};
 
-  for (new_size = cb->size, j = 0; cstr[j] != '\0'; ++j, ++new_size) {
-    while (cb->capacity <= new_size) {
-      itl_char_buf_extend(cb);
-    }
-    cb->data[new_size] = cstr[j];
-  }
+typedef struct itl_byte_set itl_byte_set_t;
 
-  cb->size = new_size;
-}
+/* Bytes that occur in text of a group of entries, and two bits for each pair
+   of bytes that does */
+struct itl_byte_set
+{
+  uint64_t bytes[4];
+  uint64_t pairs[16];
+};
 
-ITL_DEF void
-itl_char_buf_append_size_t(itl_char_buf_t *cb, size_t n)
+#define ITL_HISTORY_BLOCK_ENTRIES 64
+#define ITL_HISTORY_DECODED_BLOCKS 4
+#define ITL_HISTORY_PLACES_BITS    10
+#define ITL_HISTORY_PLACES         (1 << ITL_HISTORY_PLACES_BITS)
+
+typedef struct itl_history_block itl_history_block_t;
+
+/* Text of records of a block, which starts with a record that doesn't refer
+   to others */
+struct itl_history_block
 {
-  size_t new_size, i;
-  size_t data_len = 0, data_copy = n;
+  size_t restart; /* Offset of the first record */
+  size_t end;     /* Offset after the last record, or 0 if it's not decoded */
+  size_t count;
+  size_t records[ITL_HISTORY_BLOCK_ENTRIES]; /* Offsets of records */
+  size_t starts[ITL_HISTORY_BLOCK_ENTRIES + 1]; /* Offsets of their text */
+  char *text;
+  size_t text_capacity;
+  size_t used; /* When it was looked up last */
+};
 
-  do {
-    data_len += 1;
-    data_copy /= 10;
-  } while (data_copy > 0);
+typedef struct itl_history itl_history_t;
+
+/* Ring of the last lines. Entries are numbered from the first line that was
+   ever appended, so that a number refers to the same line for as long as it
+   is kept. The ring grows up to the nearest power of 2 above the limit on
+   entries.
+
+   Text of all entries is kept in one arena, oldest first. Offsets in it are
+   counted from the first byte ever appended as well. Text of overwritten
+   entries stays at the start of the arena until there is more of it than of
+   the rest, and then the rest is moved over it.
+
+   When duplicates are erased, entries are found by their text through an
+   open addressing table of entry numbers. An older copy of a line is marked
+   as erased and skipped, until there are as many of those as of the rest,
+   and then the rest is packed towards the newest entry. The oldest and the
+   newest entries are never erased.
+
+   For search, trigrams of entries are hashed into lists of entry numbers.
+   These are built on the first search, and then kept up to date. Queries
+   that are too short for trigrams check sets of bytes and pairs of bytes of
+   groups of entries first, which are kept along with the lists.
+
+   For navigation by prefix, entry numbers are sorted by text, so that
+   entries with the same prefix are next to each other. This is built on the
+   first such navigation, and entries that were appended or dropped since
+   are merged in or left out when it is used again.
+
+   In compact mode, text of an entry is kept as a record, where runs of bytes
+   that are in text of records before it in the same block of up to 64
+   records, or earlier in it, are kept as copies of them. Offsets of the
+   first records of blocks are kept in order. Blocks are decoded whole when
+   text of an entry is needed, and the last few are kept decoded. Text of
+   the oldest entry is decoded from the start of its block, so bytes from
+   there on are kept. */
+struct itl_history
+{
+  itl_history_entry_t *entries;
+  size_t capacity; /* N of slots, a power of 2 */
+  size_t first;    /* Number of the oldest entry */
+  size_t length;   /* N of entries, including erased ones */
+
+  char *text;
+  size_t text_base; /* Offset of the start of the arena */
+  size_t text_end;  /* Offset of the end of the newest entry */
+  size_t text_capacity;
+
+  size_t erased;      /* N of erased entries */
+  size_t erased_size; /* N of bytes taken by them */
+
+  size_t *index; /* Entry number + 1, or 0 if the slot is empty */
+  size_t index_capacity;
+  size_t index_used; /* N of slots that are not empty */
+
+  itl_posting_list_t *trigrams;
+  size_t trigram_count; /* N of lists, a power of 2 */
+  size_t trigram_base;  /* Number that entries in lists are counted from */
+
+  itl_byte_set_t *groups;
+  size_t group_first; /* Group of the first set, counted from the base */
+  size_t group_count;
+  size_t group_capacity;
+  uint32_t *sorted; /* Entry numbers, ordered by text and then by number */
+  size_t sorted_size;
+  size_t sorted_capacity;
+  size_t sorted_base;   /* Number that entries in it are counted from */
+  size_t sorted_first;  /* Oldest entry when it was brought up to date */
+  size_t sorted_end;    /* Entries from this one on are not in order yet */
+  bool sorted_is_stale; /* Whether it has entries from `sorted_end` on */
+
+  itl_history_block_t open; /* Block that the next record goes into */
+  size_t *places; /* Last place in it of hashed 4 bytes, or 0 */
+  size_t *blocks; /* Offsets of their first records, from `blocks_first` */
+  size_t blocks_first;
+  size_t blocks_end;
+  size_t blocks_capacity;
+  itl_history_block_t decoded[ITL_HISTORY_DECODED_BLOCKS];
+  size_t decoded_clock;
+};
 
-  new_size = cb->size + data_len;
+#define ITL_HISTORY_INIT_CAPACITY  64
+#define ITL_HISTORY_TEXT_INIT_SIZE 4096
+#define ITL_HISTORY_INDEX_INIT_SIZE 64
+#define ITL_HISTORY_TRIGRAMS_MIN_COUNT 1024
+#define ITL_HISTORY_TRIGRAMS_MAX_COUNT (1 << 16)
+#define ITL_HISTORY_GROUP_SIZE 64
+
+#define ITL_HISTORY_ERASED ((size_t) -1)
+
+ITL_DEF ITL_THREAD_LOCAL itl_history_t itl_g_history = ITL_ZERO_INIT;
+
+/* Limits set by tl_history_set_limits(), no limit on bytes if 0 */
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_history_max_entries =
+    TL_HISTORY_MAX_SIZE;
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_history_max_bytes = TL_HISTORY_MAX_BYTES;
+/* Set by tl_history_set_erase_duplicates() */
+ITL_DEF ITL_THREAD_LOCAL bool itl_g_history_erase_duplicates = false;
+/* Set by tl_history_set_prefix_navigation() */
+ITL_DEF ITL_THREAD_LOCAL bool itl_g_history_prefix_navigation = false;
+/* Set by tl_history_set_compact() */
+ITL_DEF ITL_THREAD_LOCAL bool itl_g_history_is_compact = false;
+
+/* Entry with number `n` */
+#define ITL_HISTORY_AT(n)                                                      \
+  (&itl_g_history.entries[(n) & (itl_g_history.capacity - 1)])
+/* Number of the newest entry, if there are any */
+#define ITL_HISTORY_LAST() (itl_g_history.first + itl_g_history.length - 1)
+/* Text of an entry, which is not null-terminated. In compact mode, it stays
+   until a few other blocks are decoded */
+#define ITL_HISTORY_TEXT(entry)                                                \
+  (itl_g_history_is_compact                                                    \
+       ? itl_g_history_decode((entry)->offset)                                 \
+       : (const char *) itl_g_history.text +                                   \
+             ((entry)->offset - itl_g_history.text_base))
+#define ITL_HISTORY_IS_ERASED(n)                                               \
+  (ITL_HISTORY_AT(n)->length == ITL_HISTORY_ERASED)
+
+#define ITL_HISTORY_NOT_SELECTED ((size_t) -1)
 
-  while (cb->capacity < new_size) {
-    itl_char_buf_extend(cb);
-  }
+ITL_DEF ITL_THREAD_LOCAL itl_string_t itl_g_line_buffer = ITL_ZERO_INIT;
 
-  /* Digits are put in reverse order */
-  for (i = new_size - 1; i >= cb->size; --i) {
-    cb->data[i] = (char) (n % 10) + '0';
-    n /= 10;
-  }
+typedef struct itl_le itl_le_t;
 
-  cb->size = new_size;
-}
+/* Line editor */
+struct itl_le
+{
+  /* Contents of the line */
+  itl_string_t *line;
+  size_t cursor_position;
 
-ITL_DEF TL_STATUS_CODE
-itl_char_buf_append_string(itl_char_buf_t *cb, const itl_string_t *str)
+  /* Whether unsubmitted line was appended to history, and is the newest
+     entry */
+  bool appended_to_history;
+  size_t history_selected; /* Number of the entry, or not selected */
+
+  char *out_buf;
+  size_t out_size;
+
+  const char *prompt;
+  size_t prompt_size;
+};
+
+ITL_DEF void
+itl_g_history_trigrams_free(void)
 {
-  char *data;
+  size_t i;
 
-  while (cb->capacity < cb->size + str->size) {
-    itl_char_buf_extend(cb);
+  if (itl_g_history.trigrams == NULL) {
+    return;
   }
 
-  data = cb->data + (cb->size * sizeof(char));
-  ITL_TRY(itl_string_to_cstr(str, data, str->size + 1) == TL_SUCCESS,
-          return TL_ERROR_SIZE);
-  cb->size += str->size; /* Ignore null at the end */
+  for (i = 0; i < itl_g_history.trigram_count; ++i) {
+    if (itl_g_history.trigrams[i].data != NULL) {
+      ITL_FREE(itl_g_history.trigrams[i].data);
+    }
+  }
+  ITL_FREE(itl_g_history.trigrams);
+  itl_g_history.trigrams = NULL;
+  itl_g_history.trigram_count = 0;
 
-  return TL_SUCCESS;
+  if (itl_g_history.groups != NULL) {
+    ITL_FREE(itl_g_history.groups);
+  }
+  itl_g_history.groups = NULL;
+  itl_g_history.group_first = 0;
+  itl_g_history.group_count = 0;
+  itl_g_history.group_capacity = 0;
 }
 
 ITL_DEF void
-itl_char_buf_append_byte(itl_char_buf_t *cb, uint8_t data)
+itl_g_history_sorted_free(void)
 {
-  while (cb->capacity < cb->size + 1) {
-    itl_char_buf_extend(cb);
+  if (itl_g_history.sorted == NULL) {
+    return;
   }
 
-  cb->data[cb->size] = (char) data;
-  cb->size += 1;
+  ITL_FREE(itl_g_history.sorted);
+  itl_g_history.sorted = NULL;
+  itl_g_history.sorted_size = 0;
+  itl_g_history.sorted_capacity = 0;
 }
 
-#define ITL_CHAR_BUF_CLEAR(cb) (cb)->size = 0
+ITL_DEF void
+itl_g_history_blocks_free(void)
+{
+  size_t i;
 
-#define ITL_CHAR_BUF_DUMP(cb) ITL_WRITE(ITL_STDOUT, (cb)->data, (cb)->size)
+  if (itl_g_history.open.text != NULL) {
+    ITL_FREE(itl_g_history.open.text);
+  }
+  if (itl_g_history.places != NULL) {
+    ITL_FREE(itl_g_history.places);
+  }
+  if (itl_g_history.blocks != NULL) {
+    ITL_FREE(itl_g_history.blocks);
+  }
+  for (i = 0; i < ITL_HISTORY_DECODED_BLOCKS; ++i) {
+    if (itl_g_history.decoded[i].text != NULL) {
+      ITL_FREE(itl_g_history.decoded[i].text);
+    }
+  }
+}
 
-#define ITL_TTY_HIDE_CURSOR(buffer)                                            \
-  itl_char_buf_append_cstr(buffer, "\x1b[?25l")
+ITL_DEF void
+itl_g_history_free(void)
+{
+  /* Text is reserved before entries when history is loaded */
+  if (itl_g_history.entries == NULL && itl_g_history.text == NULL) {
+    return;
+  }
 
-#define ITL_TTY_SHOW_CURSOR(buffer)                                            \
-  itl_char_buf_append_cstr(buffer, "\x1b[?25h")
+  if (itl_g_history.entries != NULL) {
+    ITL_FREE(itl_g_history.entries);
+  }
+  if (itl_g_history.text != NULL) {
+    ITL_FREE(itl_g_history.text);
+  }
+  if (itl_g_history.index != NULL) {
+    ITL_FREE(itl_g_history.index);
+  }
+  itl_g_history_trigrams_free();
+  itl_g_history_sorted_free();
+  itl_g_history_blocks_free();
+  memset(&itl_g_history, 0, sizeof(itl_g_history));
+}
 
-#define ITL_TTY_MOVE_TO_COLUMN(buffer, col)                                    \
-  do {                                                                         \
-    itl_char_buf_append_cstr(buffer, "\x1b[");                                 \
-    itl_char_buf_append_size_t(buffer, (size_t) col);                          \
-    itl_char_buf_append_byte(buffer, 'G');                                     \
-  } while (0)
+/* Returns offset of text of the oldest entry */
+ITL_DEF size_t
+itl_g_history_text_start(void)
+{
+  if (itl_g_history.length == 0) {
+    return itl_g_history.text_end;
+  }
+  return ITL_HISTORY_AT(itl_g_history.first)->offset;
+}
 
-#define ITL_TTY_MOVE_FORWARD(buffer, steps)                                    \
-  do {                                                                         \
-    itl_char_buf_append_cstr(buffer, "\x1b[");                                 \
-    itl_char_buf_append_size_t(buffer, (size_t) steps);                        \
-    itl_char_buf_append_byte(buffer, 'C')                                      \
-  } while (0)
+/* Returns N of bytes taken by text of all entries that are not erased */
+ITL_DEF size_t
+itl_g_history_size(void)
+{
+  return itl_g_history.text_end - itl_g_history_text_start() -
+         itl_g_history.erased_size;
+}
 
-#define ITL_TTY_MOVE_UP(buffer, rows)                                          \
-  do {                                                                         \
-    itl_char_buf_append_cstr(buffer, "\x1b[");                                 \
-    itl_char_buf_append_size_t(buffer, (size_t) rows);                         \
-    itl_char_buf_append_byte(buffer, 'A');                                     \
-  } while (0)
+/* Returns N of bytes taken by text of entry number `n`, which is not the
+   newest */
+ITL_DEF size_t
+itl_g_history_text_size(size_t n)
+{
+  if (itl_g_history_is_compact) {
+    return ITL_HISTORY_AT(n + 1)->offset - ITL_HISTORY_AT(n)->offset;
+  }
+  return ITL_HISTORY_AT(n)->size;
+}
 
-#define ITL_TTY_MOVE_DOWN(buffer, rows)                                        \
-  do {                                                                         \
-    itl_char_buf_append_cstr(buffer, "\x1b[");                                 \
-    itl_char_buf_append_size_t(buffer, (size_t) rows);                         \
-    itl_char_buf_append_byte(buffer, 'B');                                     \
-  } while (0)
+/* Writes `value` in 7 bits per byte, lowest first. Returns N of bytes */
+ITL_DEF size_t
+itl_varint_put(char *out, size_t value)
+{
+  size_t i = 0;
 
-#define ITL_TTY_CLEAR_WHOLE_LINE(buffer)                                       \
-  itl_char_buf_append_cstr(buffer, "\r\x1b[0K")
+  while (value >= 0x80) {
+    out[i++] = (char) ((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  out[i++] = (char) value;
 
-#define ITL_TTY_CLEAR_TO_END(buffer) itl_char_buf_append_cstr(buffer, "\x1b[K")
+  return i;
+}
 
-#define ITL_TTY_GOTO_HOME(buffer) itl_char_buf_append_cstr(buffer, "\x1b[H")
+ITL_DEF size_t
+itl_varint_size(size_t value)
+{
+  size_t size = 1;
 
-#define ITL_TTY_ERASE_SCREEN(buffer) itl_char_buf_append_cstr(buffer, "\033[2J")
+  while (value >= 0x80) {
+    value >>= 7;
+    size += 1;
+  }
+  return size;
+}
 
-#define ITL_TTY_STATUS_REPORT(buffer)                                          \
-  itl_char_buf_append_cstr(buffer, "\x1b[6n")
+ITL_DEF size_t
+itl_varint_get(const char **in)
+{
+  const uint8_t *p = (const uint8_t *) *in;
+  size_t value = 0, shift = 0;
 
-/* If this is true, do not overwrite file on `history_dump_to_file()` */
-ITL_DEF ITL_THREAD_LOCAL bool itl_g_history_file_is_bad = false;
+  while (*p & 0x80) {
+    value |= (size_t) (*p & 0x7F) << shift;
+    shift += 7;
+    p += 1;
+  }
+  value |= (size_t) *p << shift;
+  *in = (const char *) (p + 1);
 
-#define ITL_HISTORY_FILE_EXPLOSION()                                           \
-  do {                                                                         \
-    itl_g_history_free();                                                      \
-    itl_g_history_file_is_bad = true;                                          \
-    ret = TL_ERROR;                                                            \
-    goto end;                                                                  \
-  } while (0)
+  return value;
+}
 
-#define ITL_HISTORY_FILE_BUFFER_SIZE (1024 * 2)
+#define ITL_VARINT_MAX_SIZE ((sizeof(size_t) * 8 + 6) / 7)
+/* Copies in a record take less than the bytes they stand for, and the rest
+   is bytes of text after one more token and the size of them */
+#define ITL_HISTORY_RECORD_MAX_SIZE(size) ((size) + 1 + ITL_VARINT_MAX_SIZE)
 
-/* Returns TL_SUCCESS, -EINVAL on invalid file, or -errno on other errors */
-ITL_DEF TL_STATUS_CODE
-itl_history_load_from_file(const char *path)
+/* Returns index of the last block that starts at or before `offset` */
+ITL_DEF size_t
+itl_g_history_block_find(size_t offset)
 {
-  ITL_FILE file;
-  bool is_eof = false;
-
-  char file_buffer[ITL_HISTORY_FILE_BUFFER_SIZE];
+  itl_history_t *h = &itl_g_history;
+  size_t low = h->blocks_first, high = h->blocks_end, middle;
 
-  itl_string_t *str = itl_string_alloc();
-  itl_char_buf_t *cb = itl_char_buf_alloc();
-
-  int read_amount = 0;
-  TL_STATUS_CODE ret = TL_SUCCESS;
-
-  size_t line = 1;
-  (void) line;
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (h->blocks[middle] <= offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  TL_ASSERT(low > h->blocks_first);
 
-  itl_g_history_free();
-  itl_g_history_file_is_bad = false;
+  return low - 1;
+}
 
-  file = ITL_FILE_OPEN_FOR_READ(path);
-  if (ITL_FILE_IS_BAD(file)) {
-    ITL_TRACELN("could not open history file for load (%s): %s\n", path,
-                strerror(errno));
-    /* Do not mark file as bad if it does not exist. `dump_to_file` will
-       create it. */
-    if (errno != ENOENT) {
-      itl_g_history_file_is_bad = true;
+ITL_DEF void
+itl_g_history_block_push(size_t offset)
+{
+  itl_history_t *h = &itl_g_history;
+
+  if (h->blocks_end == h->blocks_capacity) {
+    if (h->blocks_first > 0 && h->blocks_first * 2 >= h->blocks_end) {
+      memmove(h->blocks, h->blocks + h->blocks_first,
+              (h->blocks_end - h->blocks_first) * sizeof(size_t));
+      h->blocks_end -= h->blocks_first;
+      h->blocks_first = 0;
+    } else {
+      h->blocks_capacity = ITL_MAX(h->blocks_capacity * 2, 64);
+      h->blocks = (size_t *) itl_realloc(h->blocks,
+                                         h->blocks_capacity * sizeof(size_t));
     }
-    ret = TL_ERROR;
-    goto end;
   }
+  h->blocks[h->blocks_end] = offset;
+  h->blocks_end += 1;
+}
 
-  is_eof = false;
-
-  while (!is_eof) {
-    size_t file_buffer_pos = 0;
+/* Returns offset of the oldest text that is kept. In compact mode, it's the
+   start of the block of the oldest entry */
+ITL_DEF size_t
+itl_g_history_text_kept(void)
+{
+  size_t start = itl_g_history_text_start();
 
-    size_t pos = 0;
-    (void) pos;
+  if (itl_g_history_is_compact && start < itl_g_history.text_end) {
+    start = itl_g_history.blocks[itl_g_history_block_find(start)];
+  }
+  return start;
+}
 
-    read_amount =
-        (int) ITL_READ(file, file_buffer, ITL_HISTORY_FILE_BUFFER_SIZE);
+/* Makes room in `block` for `size` bytes of text of the record after its
+   last one, and returns where they go */
+ITL_DEF char *
+itl_history_block_reserve(itl_history_block_t *block, size_t size)
+{
+  size_t needed = block->starts[block->count] + size;
 
-    if (read_amount <= 0) {
-#if defined TL_USE_STDIO
-      is_eof = feof(file);
-#else /* TL_USE_STDIO */
-      is_eof = (read_amount == 0);
-#endif
-      if (!is_eof) {
-        ITL_HISTORY_FILE_EXPLOSION();
-      }
+  if (block->text == NULL || needed > block->text_capacity) {
+    block->text_capacity = ITL_MAX(ITL_MAX(needed, block->text_capacity * 2),
+                                   ITL_HISTORY_TEXT_INIT_SIZE);
+    block->text = (char *) itl_realloc(block->text, block->text_capacity);
+  }
+  return block->text + block->starts[block->count];
+}
 
+/* Decodes the record at `offset` in `arena`, which starts at offset `base`.
+   The record either starts a block, or follows the last one in `block`.
+   Returns offset of the next record */
+ITL_DEF size_t
+itl_history_block_decode(itl_history_block_t *block, const char *arena,
+                         size_t base, size_t offset, bool starts_block)
+{
+  const char *p = arena + (offset - base);
+  size_t i, size = 0, count, distance;
+  uint8_t token;
+  char *text;
+
+  if (starts_block) {
+    block->restart = offset;
+    block->count = 0;
+  }
+  TL_ASSERT(block->count < ITL_HISTORY_BLOCK_ENTRIES);
+
+  /* Tokens have N of bytes of text that follow in high 4 bits, and N of
+     bytes to copy from the block, less 3, in low 4 bits. It's the last token
+     if there is nothing to copy, and 15 is followed by the rest of N */
+  for (;;) {
+    token = (uint8_t) *p++;
+    count = token >> 4;
+    if (count == 15) {
+      count += itl_varint_get(&p);
+    }
+    text = itl_history_block_reserve(block, size + count);
+    memcpy(text + size, p, count);
+    p += count;
+    size += count;
+    if ((token & 0x0F) == 0) {
       break;
     }
 
-    TL_ASSERT(read_amount > 0);
-
-    while (file_buffer_pos < (size_t) read_amount) {
-      int ch = file_buffer[file_buffer_pos];
+    distance = itl_varint_get(&p);
+    count = (token & 0x0F) + 3;
+    if (count == 18) {
+      count += itl_varint_get(&p);
+    }
+    text = itl_history_block_reserve(block, size + count);
+    TL_ASSERT(distance <= block->starts[block->count] + size);
+    /* Bytes can be copied from the ones that are being written */
+    for (i = 0; i < count; ++i) {
+      text[size + i] = text[size + i - distance];
+    }
+    size += count;
+  }
 
-      if (ch == '\r') {
-        /* TODO: Multiline support for history. */
-        continue;
-      } else if (ch == '\n') {
-        /* TODO: Here long lines are silently truncated. */
-        if (!itl_string_from_bytes(str, cb->data,
-                                   ITL_MIN(cb->size, ITL_STRING_MAX_LEN)))
-        {
-          ITL_TRACELN("incorrect calculated string size in history file "
-                      "at %zu:%zu\n",
-                      line, pos);
+  block->records[block->count] = offset;
+  block->count += 1;
+  block->starts[block->count] = block->starts[block->count - 1] + size;
+  block->end = base + (size_t) (p - arena);
 
-          errno = EINVAL;
-          ITL_HISTORY_FILE_EXPLOSION();
-        }
+  return block->end;
+}
 
-        itl_g_history_append(str);
-        ITL_TRACELN("loaded history entry: %.*s\n", (int) cb->size, cb->data);
-        ITL_CHAR_BUF_CLEAR(cb);
+/* Whether the record at `offset` was decoded into `block` */
+#define ITL_HISTORY_BLOCK_HAS(block, offset)                                   \
+  ((block)->end > 0 && (block)->restart <= (offset) && (offset) < (block)->end)
 
-        pos = 0;
+/* Returns text of the record at `offset`, decoding its block if it's not
+   one of the last few that were */
+ITL_DEF const char *
+itl_g_history_decode(size_t offset)
+{
+  itl_history_t *h = &itl_g_history;
+  itl_history_block_t *block = NULL, *oldest = &h->decoded[0];
+  size_t i, next, end;
 
-        line++;
-        /* Loaded a binary file on accident? */
-      } else if (iscntrl(ch) && !isspace(ch)) {
-        ITL_TRACELN("non-text byte '%X' detected in history file at %zu:%zu\n",
-                    (uint8_t) ch, line, pos);
+  /* Text of records in the open block is kept as it is written */
+  if (h->open.count > 0 && ITL_HISTORY_BLOCK_HAS(&h->open, offset)) {
+    block = &h->open;
+  }
 
-        errno = EINVAL;
-        ITL_HISTORY_FILE_EXPLOSION();
-      } else {
-        itl_char_buf_append_byte(cb, (uint8_t) ch);
-      }
+  h->decoded_clock += 1;
+  for (i = 0; i < ITL_HISTORY_DECODED_BLOCKS && block == NULL; ++i) {
+    if (ITL_HISTORY_BLOCK_HAS(&h->decoded[i], offset)) {
+      block = &h->decoded[i];
+      break;
+    }
+    if (h->decoded[i].used < oldest->used) {
+      oldest = &h->decoded[i];
+    }
+  }
 
-      file_buffer_pos++;
-      pos++;
+  /* The whole block is decoded, since entries next to each other are often
+     needed one after another */
+  if (block == NULL) {
+    block = oldest;
+    i = itl_g_history_block_find(offset);
+    end = (i + 1 < h->blocks_end) ? h->blocks[i + 1] : h->text_end;
+    next = itl_history_block_decode(block, h->text, h->text_base,
+                                    h->blocks[i], true);
+    while (next < end) {
+      next = itl_history_block_decode(block, h->text, h->text_base, next,
+                                      false);
     }
   }
+  block->used = h->decoded_clock;
 
-end:
-  if (!ITL_FILE_IS_BAD(file)) {
-    ITL_FILE_CLOSE(file);
+  i = 0;
+  while (block->records[i] != offset) {
+    i += 1;
   }
-  ITL_CHAR_BUF_FREE(cb);
-  ITL_STRING_FREE(str);
+  TL_ASSERT(i < block->count);
 
-  return ret;
+  return block->text + block->starts[i];
 }
 
-/* Returns TL_SUCCESS, -EINVAL on invalid file, or -errno on other errors */
-ITL_DEF TL_STATUS_CODE
-itl_history_dump_to_file(const char *path)
+/* Prepares the open block for a record at the end of the arena. Records
+   from the end on are being replaced, and a new block is started if it's
+   full or text of it was dropped */
+ITL_DEF void
+itl_g_history_open_block(void)
 {
-  ITL_FILE file;
-  itl_char_buf_t *buffer = NULL;
-  itl_history_item_t *item = NULL, *next_item = NULL;
-  TL_STATUS_CODE ret = TL_SUCCESS;
-
-  TL_ASSERT(itl_g_is_active && "Dump history before calling tl_exit()!");
-
-  if (itl_g_history_file_is_bad) {
-    errno = EINVAL;
-    return TL_ERROR;
-  }
-
-  buffer = itl_char_buf_alloc();
-
-  file = ITL_FILE_OPEN_FOR_WRITE(path);
-  if (ITL_FILE_IS_BAD(file)) {
-    ITL_TRACELN("could not open history file for dump (%s): %s\n", path,
-                strerror(errno));
-    ret = TL_ERROR;
-    goto end;
-  }
+  itl_history_t *h = &itl_g_history;
+  itl_history_block_t *block = &h->open;
+  size_t i;
 
-  item = itl_g_history_first;
-  if (item == NULL) {
-    goto end;
+  while (block->count > 0 && block->records[block->count - 1] >= h->text_end)
+  {
+    block->count -= 1;
+    block->end = block->records[block->count];
   }
-
-  while (item->prev != NULL) {
-    item = item->prev;
+  while (h->blocks_end > h->blocks_first &&
+         h->blocks[h->blocks_end - 1] >= h->text_end)
+  {
+    h->blocks_end -= 1;
   }
-  while (item) {
-    next_item = item->next;
-    ITL_TRY(itl_char_buf_append_string(buffer, item->str) == TL_SUCCESS, {
-      ret = TL_ERROR_SIZE;
-      goto end;
-    });
-    if (item->str->length > 1) {
-      if (ITL_WRITE(file, buffer->data, buffer->size) == -1 ||
-          ITL_WRITE(file, "\n", 1) == -1)
-      {
-        ret = TL_ERROR;
-        goto end;
-      }
+  for (i = 0; i < ITL_HISTORY_DECODED_BLOCKS; ++i) {
+    if (h->decoded[i].end > h->text_end) {
+      h->decoded[i].end = 0;
     }
-    ITL_CHAR_BUF_CLEAR(buffer);
-    item = next_item;
   }
 
-end:
-  if (!ITL_FILE_IS_BAD(file)) {
-    ITL_FILE_CLOSE(file);
+  if (block->count == ITL_HISTORY_BLOCK_ENTRIES ||
+      block->end != h->text_end || block->restart < h->text_base)
+  {
+    block->count = 0;
   }
-  ITL_CHAR_BUF_FREE(buffer);
-
-  return ret;
 }
 
-ITL_DEF size_t
-itl_parse_size(const char *cstr, size_t *result)
+/* Writes a token for `size` bytes of `data`, which are followed by a copy
+   of `count` bytes from `distance` bytes back, if `count` is not 0 */
+ITL_DEF char *
+itl_history_put_token(char *out, const char *data, size_t size, size_t count,
+                      size_t distance)
 {
-  size_t i, number;
+  uint8_t token = (uint8_t) (ITL_MIN(size, 15) << 4);
+  char *start = out++;
 
-  for (i = 0, number = 0; i < strlen(cstr); ++i) {
-    if (!isdigit(cstr[i])) {
-      break;
+  if (size >= 15) {
+    out += itl_varint_put(out, size - 15);
+  }
+  memcpy(out, data, size);
+  out += size;
+
+  if (count > 0) {
+    token |= (uint8_t) ITL_MIN(count - 3, 15);
+    out += itl_varint_put(out, distance);
+    if (count >= 18) {
+      out += itl_varint_put(out, count - 18);
     }
-    number *= 10;
-    number += (size_t) (cstr[i] - '0');
   }
+  *start = (char) token;
 
-  ITL_PTR_ASSIGN(result, number);
-
-  return i;
+  return out;
 }
 
-#ifdef ITL_POSIX
-ITL_DEF int
-itl_esc_parse_posix(uint8_t byte)
+/* Writes a record of `size` bytes that were put after text of the open
+   block. Runs of 4 or more bytes that are already in the block are found
+   through a table of the last place of every hashed 4 bytes, and are
+   written as copies. The arena should have room for the record. Returns its
+   offset */
+ITL_DEF size_t
+itl_g_history_encode(size_t size)
 {
-  int event = 0;
-  bool read_mod = false;
-
-  if (byte == 27) { /* esc */
-    ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
-
-    if (byte != '[' && byte != 'O') {
-      switch (byte) {
-      case 'b': return TL_KEY_LEFT | TL_MOD_CTRL;
-      case 'f': return TL_KEY_RIGHT | TL_MOD_CTRL;
-
-      case 'd': return TL_KEY_DELETE | TL_MOD_CTRL;
-      case 'h': return TL_KEY_BACKSPACE | TL_MOD_CTRL;
-
-      case '.':
-      case '>': return TL_KEY_HISTORY_END;
-      case ',':
-      case '<': return TL_KEY_HISTORY_BEGINNING;
+  itl_history_t *h = &itl_g_history;
+  itl_history_block_t *block = &h->open;
+  const char *text = block->text;
+  size_t i, from, count, slot, position = block->starts[block->count],
+                                 end = position + size,
+                                 offset = h->text_end;
+  size_t run = position;
+  char *start = h->text + (offset - h->text_base), *out = start;
+  uint32_t word;
+
+  if (h->places == NULL) {
+    h->places = (size_t *) itl_malloc(ITL_HISTORY_PLACES * sizeof(size_t));
+  }
+  if (block->count == 0) {
+    memset(h->places, 0, ITL_HISTORY_PLACES * sizeof(size_t));
+    block->restart = offset;
+    itl_g_history_block_push(offset);
+  }
 
-      default: return TL_KEY_CHAR | TL_MOD_ALT;
-      }
+  while (position + 4 <= end) {
+    memcpy(&word, text + position, 4);
+    slot = (word * 2654435761u) >> (32 - ITL_HISTORY_PLACES_BITS);
+    /* Places are counted from 1, and ones past this one are left from
+       records that were replaced */
+    from = h->places[slot];
+    h->places[slot] = position + 1;
+    if (from == 0 || from > position ||
+        memcmp(text + from - 1, text + position, 4) != 0)
+    {
+      position += 1;
+      continue;
     }
 
-    ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
-
-    if (byte == '1') {
-      ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
-      if (byte != ';') {
-        return TL_KEY_UNKN;
-      }
+    from -= 1;
+    count = 4;
+    while (position + count < end &&
+           text[from + count] == text[position + count])
+    {
+      count += 1;
+    }
+    /* A copy should take less than the bytes */
+    if (1 + itl_varint_size(position - run) +
+            itl_varint_size(position - from) + itl_varint_size(count) >
+        count)
+    {
+      position += 1;
+      continue;
+    }
 
-      ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
-      switch (byte) {
-      case '2': event |= TL_MOD_SHIFT; break;
-      case '5': event |= TL_MOD_CTRL; break;
-      }
-      read_mod = true;
+    out = itl_history_put_token(out, text + run, position - run, count,
+                                position - from);
 
-      ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
+    /* Bytes in the copy can be copied later as well */
+    for (i = position + 1; i < position + count && i + 4 <= end; ++i) {
+      memcpy(&word, text + i, 4);
+      slot = (word * 2654435761u) >> (32 - ITL_HISTORY_PLACES_BITS);
+      h->places[slot] = i + 1;
     }
+    position += count;
+    run = position;
+  }
+  out = itl_history_put_token(out, text + run, end - run, 0, 0);
 
-    switch (byte) {
-    case 'A': return event | TL_KEY_UP;
-    case 'B': return event | TL_KEY_DOWN;
-    case 'C': return event | TL_KEY_RIGHT;
-    case 'D': return event | TL_KEY_LEFT;
+  block->records[block->count] = offset;
+  block->count += 1;
+  block->starts[block->count] = end;
+  h->text_end += (size_t) (out - start);
+  block->end = h->text_end;
 
-    case 'F': return event | TL_KEY_END;
-    case 'H': return event | TL_KEY_HOME;
+  return offset;
+}
 
-    case '3': event |= TL_KEY_DELETE; break;
+/* Moves text of entries that are kept to the start of the arena */
+ITL_DEF void
+itl_g_history_compact(void)
+{
+  itl_history_t *h = &itl_g_history;
+  size_t live_start = itl_g_history_text_kept();
 
-    default: event |= TL_KEY_UNKN;
-    }
-  } else {
-    ITL_TRY(!iscntrl(byte), return TL_KEY_UNKN);
-    return TL_KEY_CHAR;
+  if (live_start > h->text_base) {
+    memmove(h->text, h->text + (live_start - h->text_base),
+            h->text_end - live_start);
+    h->text_base = live_start;
   }
+  while (h->blocks_first < h->blocks_end &&
+         h->blocks[h->blocks_first] < h->text_base)
+  {
+    h->blocks_first += 1;
+  }
+}
 
-  if (!read_mod) {
-    ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
-    if (byte == ';') {
-      ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
-      switch (byte) {
-      case '3': event |= TL_MOD_SHIFT; break;
-      case '5': event |= TL_MOD_CTRL; break;
-      }
-      ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
-    }
+/* Grows the arena until `size` more bytes fit at the end of it */
+ITL_DEF void
+itl_g_history_grow(size_t size)
+{
+  itl_history_t *h = &itl_g_history;
 
-    ITL_TRY(byte == '~', return TL_KEY_UNKN);
+  /* Even empty lines allocate it, so that their text is never NULL */
+  if (h->text != NULL && h->text_end - h->text_base + size <= h->text_capacity)
+  {
+    return;
   }
 
-  return event;
+  do {
+    h->text_capacity =
+        ITL_MAX(h->text_capacity * 2, ITL_HISTORY_TEXT_INIT_SIZE);
+  } while (h->text_end - h->text_base + size > h->text_capacity);
+  h->text = (char *) itl_realloc(h->text, h->text_capacity);
 }
-#endif /* ITL_POSIX */
 
-#ifdef ITL_WIN32
-ITL_DEF int
-itl_esc_parse_win32(uint8_t byte)
+/* Makes room for `size` more bytes at the end of the arena */
+ITL_DEF void
+itl_g_history_reserve(size_t size)
 {
-  int event = 0;
+  itl_history_t *h = &itl_g_history;
 
-  /* https://learn.microsoft.com/en-us/previous-versions/visualstudio/visual-studio-6.0/aa299374(v=vs.60)
-   */
-  if (byte == 224 || byte == 0) { /* esc */
-    ITL_TRY_READ_BYTE(&byte, return TL_KEY_UNKN);
+  if (h->text != NULL && h->text_end - h->text_base + size <= h->text_capacity)
+  {
+    return;
+  }
 
-    switch (byte) {
-    case 'H': event = TL_KEY_UP; break;
-    case 'P': event = TL_KEY_DOWN; break;
-    case 'K': event = TL_KEY_LEFT; break;
-    case 'M': event = TL_KEY_RIGHT; break;
+  /* Drop text of overwritten entries, if it takes more than half */
+  if (h->text != NULL && h->text_end - h->text_base >=
+                             (h->text_end - itl_g_history_text_kept()) * 2)
+  {
+    itl_g_history_compact();
+  }
 
-    case 's': event = TL_KEY_LEFT | TL_MOD_CTRL; break;
-    case 't': event = TL_KEY_RIGHT | TL_MOD_CTRL; break;
+  itl_g_history_grow(size);
+}
 
-    case 'G': event = TL_KEY_HOME; break;
-    case 'O': event = TL_KEY_END; break;
+/* Moves entries into a ring of `capacity` slots, which should fit them */
+ITL_DEF void
+itl_g_history_resize(size_t capacity)
+{
+  itl_history_entry_t *entries;
+  size_t n;
 
-    case 147: event = TL_KEY_DELETE | TL_MOD_CTRL; break;
-    case 'S': event = TL_KEY_DELETE; break;
+  TL_ASSERT(capacity >= itl_g_history.length);
 
-    default: event = TL_KEY_UNKN;
+  /* When growing, entries only move into the new slots */
+  if (capacity > itl_g_history.capacity) {
+    entries = (itl_history_entry_t *) itl_realloc(
+        itl_g_history.entries, capacity * sizeof(itl_history_entry_t));
+    for (n = itl_g_history.first;
+         n < itl_g_history.first + itl_g_history.length; ++n)
+    {
+      if ((n & (capacity - 1)) != (n & (itl_g_history.capacity - 1))) {
+        entries[n & (capacity - 1)] =
+            entries[n & (itl_g_history.capacity - 1)];
+      }
     }
   } else {
-    ITL_TRY(!iscntrl(byte), return TL_KEY_UNKN);
-    return TL_KEY_CHAR;
+    entries = (itl_history_entry_t *) itl_malloc(capacity *
+                                                 sizeof(itl_history_entry_t));
+    for (n = itl_g_history.first;
+         n < itl_g_history.first + itl_g_history.length; ++n)
+    {
+      entries[n & (capacity - 1)] = *ITL_HISTORY_AT(n);
+    }
+    ITL_FREE(itl_g_history.entries);
   }
 
-  return event;
+  itl_g_history.entries = entries;
+  itl_g_history.capacity = capacity;
 }
-#endif /* ITL_WIN32 */
 
-ITL_DEF int
-itl_esc_parse(uint8_t byte)
+/* Returns the smallest power of 2 that is not less than `n`, or the biggest
+   one that fits */
+ITL_DEF size_t
+itl_round_up_to_power_of_2(size_t n)
 {
-  /* plain bytes */
-  switch (byte) {
-  case 1: return TL_KEY_HOME; /* ctrl a */
-  case 5: return TL_KEY_END;  /* ctrl e */
-
-  case 2: return TL_KEY_LEFT;  /* ctrl f */
-  case 6: return TL_KEY_RIGHT; /* ctrl b */
-
-  case 3: return TL_KEY_INTERRUPT; /* ctrl c */
-  case 4: return TL_KEY_EOF;       /* ctrl d */
-  case 26: return TL_KEY_SUSPEND;  /* ctrl z */
-
-  case 9: return TL_KEY_TAB;
-  case 12: return TL_KEY_CLEAR; /* ctrl l */
-
-  case 14: return TL_KEY_DOWN; /* ctrl n */
-  case 16: return TL_KEY_UP;   /* ctrl p */
+  size_t result = 1;
+  while (result < n && result <= SIZE_MAX / 2) {
+    result *= 2;
+  }
+  return result;
+}
 
-  case 13: /* cr */
-  case 10: return TL_KEY_ENTER;
+/* Drops the oldest entry, and erased entries after it */
+ITL_DEF void
+itl_g_history_drop_first(void)
+{
+  do {
+    if (ITL_HISTORY_IS_ERASED(itl_g_history.first)) {
+      itl_g_history.erased -= 1;
+      itl_g_history.erased_size -= itl_g_history_text_size(itl_g_history.first);
+    }
+    itl_g_history.first += 1;
+    itl_g_history.length -= 1;
+  } while (itl_g_history.length > 0 &&
+           ITL_HISTORY_IS_ERASED(itl_g_history.first));
+}
 
-  case 11: return TL_KEY_KILL_LINE;        /* ctrl k */
-  case 21: return TL_KEY_KILL_LINE_BEFORE; /* ctrl u */
-  case 23: return TL_KEY_BACKSPACE | TL_MOD_CTRL;
+ITL_DEF void itl_history_archive_spill(size_t n);
+ITL_DEF void itl_history_archive_flush(void);
 
-  case 8: /* old backspace */
-  case 127: return TL_KEY_BACKSPACE;
+/* Drops the oldest entries until `size` more bytes and `count` more entries
+   fit into the limits, keeping at least `keep` newest entries. They are
+   spilled to the archive, if there is one */
+ITL_DEF void
+itl_g_history_evict(size_t size, size_t count, size_t keep)
+{
+  while (itl_g_history.length - itl_g_history.erased > keep &&
+         (itl_g_history.length - itl_g_history.erased + count >
+              itl_g_history_max_entries ||
+          (itl_g_history_max_bytes > 0 &&
+           itl_g_history_size() + size > itl_g_history_max_bytes)))
+  {
+    itl_history_archive_spill(itl_g_history.first);
+    itl_g_history_drop_first();
   }
+  itl_history_archive_flush();
+}
 
-#if defined ITL_WIN32
-  return itl_esc_parse_win32(byte);
-#elif defined ITL_POSIX
-  return itl_esc_parse_posix(byte);
-#endif /* ITL_POSIX */
+/* Puts text of `str` at the end of the arena, as text of entry number `n` */
+ITL_DEF void
+itl_g_history_set(size_t n, const itl_string_t *str)
+{
+  itl_history_entry_t *entry;
+
+  itl_g_history_reserve(itl_g_history_is_compact
+                            ? ITL_HISTORY_RECORD_MAX_SIZE(str->size)
+                            : str->size);
+
+  entry = ITL_HISTORY_AT(n);
+  entry->size = str->size;
+  entry->length = str->length;
+
+  if (itl_g_history_is_compact) {
+    itl_g_history_open_block();
+    itl_string_copy_bytes(
+        str, 0, str->size,
+        itl_history_block_reserve(&itl_g_history.open, str->size));
+    entry->offset = itl_g_history_encode(str->size);
+  } else {
+    entry->offset = itl_g_history.text_end;
+    itl_string_copy_bytes(str, 0, str->size,
+                          itl_g_history.text +
+                              (entry->offset - itl_g_history.text_base));
+    itl_g_history.text_end += str->size;
+  }
 }
 
-ITL_DEF ITL_THREAD_LOCAL itl_char_buf_t itl_g_char_buffer = ITL_ZERO_INIT;
-ITL_DEF ITL_THREAD_LOCAL bool itl_g_tty_is_dumb = true;
-
-/* *le, *rows, *cols can be NULL. */
-ITL_DEF bool
-itl_tty_get_size(ITL_MAYBE_UNUSED itl_le_t *le, size_t *rows, size_t *cols)
+/* Puts `size` bytes of `data` at the end of a new arena, which is not
+   compacted. Returns their offset */
+ITL_DEF size_t
+itl_g_history_put(const char *data, size_t size)
 {
-  size_t temp_rows, temp_cols;
-  char *emacs_buf = NULL;
-#if defined ITL_VT_SIZE
-  bool correct_response;
-  size_t i, parse_diff;
-  char size_buf[32], *first;
-  itl_char_buf_t *b;
-#elif defined ITL_WIN32
-  CONSOLE_SCREEN_BUFFER_INFO buffer_info;
-#else /* ITL_WIN32 */
-  struct winsize window;
-#endif
+  size_t offset = itl_g_history.text_end;
 
-  if (itl_g_tty_is_dumb) {
-    if ((emacs_buf = getenv("COLUMNS")) == NULL) {
-      itl_g_tty_is_dumb = false;
-      goto next;
-    }
-    itl_parse_size(emacs_buf, &temp_cols);
-    if ((emacs_buf = getenv("LINES")) == NULL) {
-      itl_g_tty_is_dumb = false;
-      goto next;
-    }
-    itl_parse_size(emacs_buf, &temp_rows);
-    if (temp_cols > 0 && temp_rows > 0) {
-      ITL_PTR_ASSIGN(rows, temp_rows);
-      ITL_PTR_ASSIGN(cols, temp_cols);
-      return true;
-    }
+  if (itl_g_history_is_compact) {
+    itl_g_history_grow(ITL_HISTORY_RECORD_MAX_SIZE(size));
+    itl_g_history_open_block();
+    memcpy(itl_history_block_reserve(&itl_g_history.open, size), data, size);
+    return itl_g_history_encode(size);
   }
 
-next:
-#if defined ITL_VT_SIZE
+  itl_g_history_grow(size);
+  memcpy(itl_g_history.text + (offset - itl_g_history.text_base), data, size);
+  itl_g_history.text_end += size;
 
-  b = &itl_g_char_buffer;
-  itl_tty_move_forward(b, 999);
-  itl_tty_status_report(b);
-  itl_char_buf_dump(b);
-  itl_char_buf_clear(b);
-
-  /* There might be pasted input awaiting to be processed. Read and parse all
-     bytes until escape is encountered. */
-  first = &size_buf[0];
-  while (true) {
-    ITL_TRY_READ_BYTE((uint8_t *) first, return false);
-    if (*first == '\x1b') {
-      break;
-    }
-    /* don't print control sequences if they got pasted */
-    if (itl_esc_parse(*first) != TL_KEY_CHAR) {
+  return offset;
+}
+
+/* Writes text of entries that are not erased into a new arena, in the
+   current format. Text is read in compact format if `from_compact` */
+ITL_DEF void
+itl_g_history_rewrite(bool from_compact)
+{
+  itl_history_t *h = &itl_g_history;
+  itl_history_block_t reader = ITL_ZERO_INIT;
+  itl_history_entry_t *entry;
+  char *arena = h->text;
+  const char *text;
+  size_t *blocks = h->blocks;
+  size_t i, n, k = 0, base = h->text_base, next = 0,
+              blocks_end = h->blocks_end;
+  bool starts_block;
+
+  if (from_compact && h->length > 0) {
+    k = itl_g_history_block_find(ITL_HISTORY_AT(h->first)->offset);
+    next = blocks[k];
+  }
+
+  /* Offsets go on from the old ones, so that blocks that were decoded
+     before are not taken for new ones */
+  h->text = NULL;
+  h->text_capacity = 0;
+  h->text_base = h->text_end;
+  h->blocks = NULL;
+  h->blocks_first = h->blocks_end = h->blocks_capacity = 0;
+  h->open.count = 0;
+  for (i = 0; i < ITL_HISTORY_DECODED_BLOCKS; ++i) {
+    h->decoded[i].end = 0;
+  }
+
+  for (n = h->first; n < h->first + h->length; ++n) {
+    entry = ITL_HISTORY_AT(n);
+    if (entry->length == ITL_HISTORY_ERASED) {
       continue;
     }
-    if (le != NULL) {
-      itl_le_insert(le, itl_utf8_parse(*first));
-    }
-  }
 
-  i = 1; /* already read the escape */
-  correct_response = false;
-  while (i < sizeof(size_buf) - 2) {
-    ITL_TRY_READ_BYTE((uint8_t *) &size_buf[i], return false);
-    if (size_buf[i] == 'R') {
-      correct_response = true;
-      break;
+    if (from_compact) {
+      /* Records are in order, so each one is decoded once */
+      while (reader.count == 0 ||
+             reader.records[reader.count - 1] != entry->offset)
+      {
+        starts_block = (k < blocks_end && blocks[k] == next);
+        next = itl_history_block_decode(&reader, arena, base, next,
+                                        starts_block);
+        if (starts_block) {
+          k += 1;
+        }
+      }
+      text = reader.text + reader.starts[reader.count - 1];
+    } else {
+      text = arena + (entry->offset - base);
     }
-    i += 1;
+    entry->offset = itl_g_history_put(text, entry->size);
   }
-  size_buf[i + 1] = '\0';
 
-  ITL_TRY(correct_response, return false);
-  ITL_TRY(size_buf[0] == '\x1b' && size_buf[1] == '[', return false);
+  if (arena != NULL) {
+    ITL_FREE(arena);
+  }
+  if (blocks != NULL) {
+    ITL_FREE(blocks);
+  }
+  if (reader.text != NULL) {
+    ITL_FREE(reader.text);
+  }
+}
 
-  parse_diff = 2; /* skip first two characters */
-  parse_diff += itl_parse_size(size_buf + parse_diff, rows);
-  ITL_TRY(size_buf[parse_diff] == ';', return false);
-  itl_parse_size(size_buf + parse_diff + 1, cols);
+ITL_DEF bool
+itl_g_history_equal(size_t n, const itl_string_t *str)
+{
+  const itl_history_entry_t *entry = ITL_HISTORY_AT(n);
+  return itl_string_equal_bytes(str, ITL_HISTORY_TEXT(entry), entry->size);
+}
 
-  return true;
+/* FNV-1a */
+ITL_DEF uint64_t
+itl_hash_bytes(uint64_t hash, const char *data, size_t size)
+{
+  size_t i;
 
-#elif defined ITL_WIN32
-  (void) le;
-  ITL_TRY(
-      GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &buffer_info),
-      return false);
+  for (i = 0; i < size; ++i) {
+    hash ^= (uint8_t) data[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
 
-  ITL_PTR_ASSIGN(cols, (size_t) (buffer_info.srWindow.Right -
-                                 buffer_info.srWindow.Left + 1));
-  ITL_PTR_ASSIGN(rows, (size_t) (buffer_info.srWindow.Bottom -
-                                 buffer_info.srWindow.Top + 1));
+#define ITL_HASH_INIT 0xcbf29ce484222325
 
-  return true;
-#else
-  (void) le;
-  ITL_TRY(ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0, return false);
+ITL_DEF uint64_t
+itl_string_hash(const itl_string_t *str)
+{
+  uint64_t hash = itl_hash_bytes(ITL_HASH_INIT, str->data, str->gap_offset);
+  return itl_hash_bytes(hash,
+                        &str->data[str->gap_offset + ITL_STRING_GAP_SIZE(str)],
+                        str->size - str->gap_offset);
+}
 
-  ITL_PTR_ASSIGN(rows, (size_t) window.ws_row);
-  ITL_PTR_ASSIGN(cols, (size_t) window.ws_col);
+/* Whether slot `i` of the index refers to an entry that is kept */
+ITL_DEF bool
+itl_g_history_index_is_live(size_t i)
+{
+  size_t n = itl_g_history.index[i] - 1;
 
-  return true;
-#endif
-  return false;
+  return itl_g_history.index[i] != 0 && n >= itl_g_history.first &&
+         n - itl_g_history.first < itl_g_history.length &&
+         !ITL_HISTORY_IS_ERASED(n);
 }
 
-ITL_DEF ITL_THREAD_LOCAL bool itl_g_tty_should_refresh_text = true;
+/* Returns slot of the index that refers to an entry with text of `str`, or
+   the size of the index if there is none */
+ITL_DEF size_t
+itl_g_history_index_find(const itl_string_t *str, uint64_t hash)
+{
+  size_t i, mask = itl_g_history.index_capacity - 1;
 
-/* Line editor's contents during previous refresh() call. */
-ITL_DEF ITL_THREAD_LOCAL size_t itl_g_le_prev_rows = 1;
-ITL_DEF ITL_THREAD_LOCAL size_t itl_g_le_prev_cursor_rows = 1;
+  if (itl_g_history.index == NULL) {
+    return itl_g_history.index_capacity;
+  }
 
-ITL_DEF ITL_THREAD_LOCAL size_t itl_g_le_prev_length = 0;
+  for (i = (size_t) hash & mask; itl_g_history.index[i] != 0;
+       i = (i + 1) & mask)
+  {
+    if (itl_g_history_index_is_live(i) &&
+        ITL_HISTORY_AT(itl_g_history.index[i] - 1)->hash == hash &&
+        itl_g_history_equal(itl_g_history.index[i] - 1, str))
+    {
+      return i;
+    }
+  }
+  return itl_g_history.index_capacity;
+}
 
-/* $COLUMNS and $LINES, same as above. */
-ITL_DEF ITL_THREAD_LOCAL size_t itl_g_tty_prev_rows = 1;
-ITL_DEF ITL_THREAD_LOCAL size_t itl_g_tty_prev_cols = 1;
+ITL_DEF void itl_g_history_index_rebuild(void);
 
-/* NOTE: Hottest function in the library. */
-ITL_DEF bool
-itl_le_tty_refresh(itl_le_t *le)
+/* Adds entry number `n`, whose text is not in the index yet */
+ITL_DEF void
+itl_g_history_index_insert(size_t n)
 {
-  size_t i, j, tty_rows, tty_cols;
-  size_t current_cols, le_row_amount, dirty_lines;
-  size_t le_cursor_column, le_cursor_rows;
-  size_t extra_rows_to_delete;
-
-  /* Write everything into a buffer, then dump it all at once */
-  itl_char_buf_t *b;
+  size_t i, mask;
 
-  TL_ASSERT(le->line);
-  TL_ASSERT(le->line->chars);
-  TL_ASSERT(le->line->size >= le->line->length);
-  TL_ASSERT(le->line->length <= ITL_STRING_MAX_LEN);
+  if ((itl_g_history.index_used + 1) * 4 > itl_g_history.index_capacity * 3) {
+    itl_g_history_index_rebuild();
+  }
 
-  /* FIXME: Properly refresh on size change. */
-  extra_rows_to_delete = 0;
+  /* Slots of dropped entries are reused */
+  mask = itl_g_history.index_capacity - 1;
+  for (i = (size_t) ITL_HISTORY_AT(n)->hash & mask;
+       itl_g_history_index_is_live(i); i = (i + 1) & mask)
+  {
+  }
 
-  if (itl_g_tty_changed_size) {
-    ITL_TRY(itl_tty_get_size(le, &tty_rows, &tty_cols), {
-      /* Could not get terminal size? */
-      tty_rows = 24;
-      tty_cols = 80;
-    });
-  } else {
-    tty_rows = itl_g_tty_prev_rows;
-    tty_cols = itl_g_tty_prev_cols;
+  if (itl_g_history.index[i] == 0) {
+    itl_g_history.index_used += 1;
   }
+  itl_g_history.index[i] = n + 1;
+}
 
-  le_row_amount =
-      (le->line->length + le->prompt_size) / ITL_MAX(tty_cols, 1) + 1;
+/* Fills the index with entries that are kept, leaving room for as many */
+ITL_DEF void
+itl_g_history_index_rebuild(void)
+{
+  size_t n, capacity;
+
+  capacity = itl_round_up_to_power_of_2(
+      ITL_MAX((itl_g_history.length - itl_g_history.erased) * 2 + 1,
+              ITL_HISTORY_INDEX_INIT_SIZE));
+  if (capacity != itl_g_history.index_capacity) {
+    if (itl_g_history.index != NULL) {
+      ITL_FREE(itl_g_history.index);
+    }
+    itl_g_history.index = (size_t *) itl_malloc(capacity * sizeof(size_t));
+    itl_g_history.index_capacity = capacity;
+  }
+  memset(itl_g_history.index, 0, capacity * sizeof(size_t));
+  itl_g_history.index_used = 0;
 
-  le_cursor_column =
-      (le->cursor_position + le->prompt_size) % ITL_MAX(tty_cols, 1) + 1;
-  le_cursor_rows =
-      (le->cursor_position + le->prompt_size) / ITL_MAX(tty_cols, 1) + 1;
+  for (n = itl_g_history.first;
+       n < itl_g_history.first + itl_g_history.length; ++n)
+  {
+    if (!ITL_HISTORY_IS_ERASED(n)) {
+      itl_g_history_index_insert(n);
+    }
+  }
+}
 
-  ITL_TRACELN("sr: %d, er: %zu, wrow: %zu, prev: %zu, col: %zu, curp: %zu\n",
-              itl_g_tty_should_refresh_text, extra_rows_to_delete,
-              le_cursor_rows, itl_g_le_prev_rows, le_cursor_column,
-              le->cursor_position);
+/* Returns the list of trigram at the start of `text` */
+ITL_DEF itl_posting_list_t *
+itl_g_history_trigram_list(const char *text)
+{
+  uint32_t trigram = (uint32_t) (uint8_t) text[0] << 16 |
+                     (uint32_t) (uint8_t) text[1] << 8 | (uint8_t) text[2];
 
-  b = &itl_g_char_buffer;
-  ITL_TTY_HIDE_CURSOR(b);
+  /* Fibonacci hashing */
+  trigram *= 2654435769u;
+  return &itl_g_history
+              .trigrams[(trigram >> 16) & (itl_g_history.trigram_count - 1)];
+}
 
-  /* FIXME: Fix refreshing artifacts after killing more than one line or
-   * resizing the terminal. */
+/* One of two bits of a pair of bytes at the start of `data` */
+#define ITL_BYTE_PAIR_BIT(data, i)                                            \
+  (((uint32_t) (data)[0] << 8 | (data)[1]) * 2654435769u >> ((i) ? 22 : 12) & \
+   1023)
 
-  if (itl_g_tty_should_refresh_text) {
-    /* Move appropriate amount of lines back, while clearing previous output
-     */
-    for (i = 0; i < itl_g_le_prev_rows + extra_rows_to_delete; ++i) {
-      ITL_TTY_CLEAR_WHOLE_LINE(b);
-      if (i < itl_g_le_prev_cursor_rows + extra_rows_to_delete - 1) {
-        ITL_TTY_MOVE_UP(b, 1);
-      }
+/* Adds bytes of entry number `n` to the set of its group */
+ITL_DEF void
+itl_g_history_group_add(size_t n)
+{
+  itl_history_t *h = &itl_g_history;
+  size_t i, k, dropped, group = (n - h->trigram_base) / ITL_HISTORY_GROUP_SIZE;
+  uint32_t bit;
+  const itl_history_entry_t *entry = ITL_HISTORY_AT(n);
+  const uint8_t *text = (const uint8_t *) ITL_HISTORY_TEXT(entry);
+  itl_byte_set_t *set;
+
+  while (h->group_first + h->group_count <= group) {
+    /* Drop sets of groups that were overwritten entirely */
+    dropped = 0;
+    while (dropped < h->group_count &&
+           h->trigram_base + (h->group_first + dropped + 1) *
+                                 ITL_HISTORY_GROUP_SIZE <=
+               h->first)
+    {
+      dropped += 1;
+    }
+    if (dropped * 2 > h->group_count) {
+      memmove(h->groups, h->groups + dropped,
+              (h->group_count - dropped) * sizeof(itl_byte_set_t));
+      h->group_first += dropped;
+      h->group_count -= dropped;
     }
 
-    if (le->prompt) {
-      itl_char_buf_append_cstr(b, le->prompt);
+    if (h->group_count == h->group_capacity) {
+      h->group_capacity = ITL_MAX(h->group_capacity * 2, 16);
+      h->groups = (itl_byte_set_t *) itl_realloc(
+          h->groups, h->group_capacity * sizeof(itl_byte_set_t));
     }
+    if (h->group_count == 0) {
+      h->group_first = group;
+    }
+    memset(&h->groups[h->group_count], 0, sizeof(itl_byte_set_t));
+    h->group_count += 1;
+  }
 
-    /* Print current contents of the line editor */
-    for (i = 0; i < le->line->length; ++i) {
-      for (j = 0; j < le->line->chars[i].size; ++j) {
-        itl_char_buf_append_byte(b, le->line->chars[i].bytes[j]);
+  set = &h->groups[group - h->group_first];
+  for (i = 0; i < entry->size; ++i) {
+    set->bytes[text[i] >> 6] |= (uint64_t) 1 << (text[i] & 63);
+    if (i + 1 < entry->size) {
+      for (k = 0; k < 2; ++k) {
+        bit = ITL_BYTE_PAIR_BIT(text + i, k);
+        set->pairs[bit >> 6] |= (uint64_t) 1 << (bit & 63);
       }
+    }
+  }
+}
 
-      /* If line is full, wrap */
-      current_cols = (le->prompt_size + i) % ITL_MAX(tty_cols, 1);
-      if (current_cols == tty_cols - 1) {
-        itl_char_buf_append_cstr(b, ITL_LF);
+/* Whether all bytes of `data` and their pairs could be in `set` */
+ITL_DEF bool
+itl_byte_set_has_all(const itl_byte_set_t *set, const char *data, size_t size)
+{
+  size_t i, k;
+  uint32_t bit;
+  const uint8_t *bytes = (const uint8_t *) data;
+
+  for (i = 0; i < size; ++i) {
+    if (!(set->bytes[bytes[i] >> 6] & ((uint64_t) 1 << (bytes[i] & 63)))) {
+      return false;
+    }
+    if (i + 1 < size) {
+      for (k = 0; k < 2; ++k) {
+        bit = ITL_BYTE_PAIR_BIT(bytes + i, k);
+        if (!(set->pairs[bit >> 6] & ((uint64_t) 1 << (bit & 63)))) {
+          return false;
+        }
       }
     }
+  }
+  return true;
+}
 
-    /* If current amount of lines is less than previous amount of lines,
-       then input was cleared by kill line or such. Clear each dirty line,
-       then go back up */
-    if (le_row_amount < itl_g_le_prev_rows) {
-      dirty_lines = itl_g_le_prev_rows - le_row_amount;
-      for (i = 0; i < dirty_lines; ++i) {
-        ITL_TTY_MOVE_DOWN(b, 1);
-        ITL_TTY_CLEAR_WHOLE_LINE(b);
-      }
-      ITL_TTY_MOVE_UP(b, dirty_lines);
-    } else {
-      /* Otherwise clear to the end of line */
-      ITL_TTY_CLEAR_TO_END(b);
+/* Adds entry number `n` to lists of its trigrams */
+ITL_DEF void
+itl_g_history_trigrams_add(size_t n)
+{
+  size_t i;
+  uint32_t number = (uint32_t) (n - itl_g_history.trigram_base);
+  const itl_history_entry_t *entry = ITL_HISTORY_AT(n);
+  const char *text = ITL_HISTORY_TEXT(entry);
+  itl_posting_list_t *list;
+
+  for (i = 0; i + 3 <= entry->size; ++i) {
+    list = itl_g_history_trigram_list(text + i);
+
+    /* Drop numbers of overwritten entries */
+    while (list->start < list->size &&
+           list->data[list->start] + itl_g_history.trigram_base <
+               itl_g_history.first)
+    {
+      list->start += 1;
+    }
+    if (list->start * 2 > list->size) {
+      memmove(list->data, list->data + list->start,
+              (list->size - list->start) * sizeof(uint32_t));
+      list->size -= list->start;
+      list->start = 0;
     }
 
-    /* Move cursor to appropriate row and column. If row didn't change, stay
-       on the same line */
-    if (le_cursor_rows < le_row_amount) {
-      ITL_TTY_MOVE_UP(b, le_row_amount - le_cursor_rows);
+    /* Same trigram could be met already */
+    if (list->size > list->start && list->data[list->size - 1] == number) {
+      continue;
     }
-  } else {
-    if (le_cursor_rows < itl_g_le_prev_cursor_rows) {
-      ITL_TTY_MOVE_UP(b, itl_g_le_prev_cursor_rows - le_cursor_rows);
-    } else if (le_cursor_rows > itl_g_le_prev_cursor_rows) {
-      ITL_TTY_MOVE_DOWN(b, le_cursor_rows - itl_g_le_prev_cursor_rows);
+
+    if (list->size == list->capacity) {
+      list->capacity = ITL_MAX(list->capacity * 2, 4);
+      list->data = (uint32_t *) itl_realloc(list->data,
+                                            list->capacity * sizeof(uint32_t));
     }
+    list->data[list->size] = number;
+    list->size += 1;
   }
 
-  ITL_TTY_MOVE_TO_COLUMN(b, le_cursor_column);
+  itl_g_history_group_add(n);
+}
 
-  itl_g_le_prev_rows = le_row_amount;
-  itl_g_le_prev_cursor_rows = le_cursor_rows;
-  itl_g_le_prev_length = le->line->length + le->prompt_size;
+/* Fills trigram lists with entries that are kept */
+ITL_DEF void
+itl_g_history_trigrams_build(void)
+{
+  size_t n, count;
 
-  itl_g_tty_prev_rows = tty_rows;
-  itl_g_tty_prev_cols = tty_cols;
+  itl_g_history_trigrams_free();
+
+  count = itl_round_up_to_power_of_2(
+      (itl_g_history.length - itl_g_history.erased) / 4);
+  count = ITL_MAX(count, ITL_HISTORY_TRIGRAMS_MIN_COUNT);
+  count = ITL_MIN(count, ITL_HISTORY_TRIGRAMS_MAX_COUNT);
+
+  itl_g_history.trigrams = (itl_posting_list_t *) itl_malloc(
+      count * sizeof(itl_posting_list_t));
+  memset(itl_g_history.trigrams, 0, count * sizeof(itl_posting_list_t));
+  itl_g_history.trigram_count = count;
+  itl_g_history.trigram_base = itl_g_history.first;
+
+  for (n = itl_g_history.first;
+       n < itl_g_history.first + itl_g_history.length; ++n)
+  {
+    if (!ITL_HISTORY_IS_ERASED(n)) {
+      itl_g_history_trigrams_add(n);
+    }
+  }
+}
+
+/* Adds the newest entry to trigram lists, if they were built */
+ITL_DEF void
+itl_g_history_trigrams_add_last(void)
+{
+  if (itl_g_history.trigrams == NULL) {
+    return;
+  }
+
+  /* Rebuild if numbers stop fitting, or lists get too long */
+  if (ITL_HISTORY_LAST() - itl_g_history.trigram_base >= UINT32_MAX ||
+      (itl_g_history.trigram_count < ITL_HISTORY_TRIGRAMS_MAX_COUNT &&
+       itl_g_history.length > itl_g_history.trigram_count * 64))
+  {
+    itl_g_history_trigrams_build();
+  } else {
+    itl_g_history_trigrams_add(ITL_HISTORY_LAST());
+  }
+}
+
+/* Returns offset of `needle` in `haystack`, or `haystack_size` if it's not
+   there */
+ITL_DEF size_t
+itl_find_bytes(const char *haystack, size_t haystack_size, const char *needle,
+               size_t needle_size)
+{
+  const char *found;
+  size_t offset = 0;
+
+  if (needle_size == 0) {
+    return 0;
+  }
+
+  while (haystack_size - offset >= needle_size) {
+    found = (const char *) memchr(haystack + offset, needle[0],
+                                  haystack_size - offset - needle_size + 1);
+    if (found == NULL) {
+      break;
+    }
+    offset = (size_t) (found - haystack);
+    if (memcmp(found + 1, needle + 1, needle_size - 1) == 0) {
+      return offset;
+    }
+    offset += 1;
+  }
+  return haystack_size;
+}
+
+/* Returns offset of `query` in text of entry number `n`, or its size if it's
+   not there */
+ITL_DEF size_t
+itl_g_history_find(size_t n, const char *query, size_t size)
+{
+  const itl_history_entry_t *entry = ITL_HISTORY_AT(n);
+  return itl_find_bytes(ITL_HISTORY_TEXT(entry), entry->size, query, size);
+}
+
+/* Returns number of the newest entry before `below` that contains `query`,
+   or ITL_HISTORY_NOT_SELECTED */
+ITL_DEF size_t
+itl_g_history_search(const char *query, size_t size, size_t below)
+{
+  size_t i, n, low, high, group;
+  itl_posting_list_t *list, *shortest = NULL;
+
+  below = ITL_MIN(below, itl_g_history.first + itl_g_history.length);
+
+  /* Check only entries from the shortest list of a trigram of the query */
+  if (itl_g_history.trigrams != NULL && size >= 3) {
+    for (i = 0; i + 3 <= size; ++i) {
+      list = itl_g_history_trigram_list(query + i);
+      if (shortest == NULL ||
+          list->size - list->start < shortest->size - shortest->start)
+      {
+        shortest = list;
+      }
+    }
+
+    /* Find where entries before `below` end */
+    low = shortest->start;
+    high = shortest->size;
+    while (low < high) {
+      i = low + (high - low) / 2;
+      if (shortest->data[i] + itl_g_history.trigram_base < below) {
+        low = i + 1;
+      } else {
+        high = i;
+      }
+    }
+
+    for (i = low; i > shortest->start; --i) {
+      n = shortest->data[i - 1] + itl_g_history.trigram_base;
+      if (n < itl_g_history.first) {
+        break;
+      }
+      if (!ITL_HISTORY_IS_ERASED(n) &&
+          itl_g_history_find(n, query, size) != ITL_HISTORY_AT(n)->size)
+      {
+        return n;
+      }
+    }
+    return ITL_HISTORY_NOT_SELECTED;
+  }
+
+  /* Skip groups that don't have every byte of the query */
+  if (itl_g_history.groups != NULL && size > 0) {
+    n = below;
+    while (n > itl_g_history.first) {
+      group = (n - 1 - itl_g_history.trigram_base) / ITL_HISTORY_GROUP_SIZE;
+      low = itl_g_history.trigram_base + group * ITL_HISTORY_GROUP_SIZE;
+      low = ITL_MAX(low, itl_g_history.first);
+
+      if (group >= itl_g_history.group_first &&
+          !itl_byte_set_has_all(
+              &itl_g_history.groups[group - itl_g_history.group_first], query,
+              size))
+      {
+        n = low;
+        continue;
+      }
+      for (; n > low; --n) {
+        if (!ITL_HISTORY_IS_ERASED(n - 1) &&
+            itl_g_history_find(n - 1, query, size) !=
+                ITL_HISTORY_AT(n - 1)->size)
+        {
+          return n - 1;
+        }
+      }
+    }
+    return ITL_HISTORY_NOT_SELECTED;
+  }
+
+  for (n = below; n > itl_g_history.first; --n) {
+    if (!ITL_HISTORY_IS_ERASED(n - 1) &&
+        itl_g_history_find(n - 1, query, size) != ITL_HISTORY_AT(n - 1)->size)
+    {
+      return n - 1;
+    }
+  }
+  return ITL_HISTORY_NOT_SELECTED;
+}
+
+/* Compares text of entries number `a` and `b`, and then their numbers */
+ITL_DEF int
+itl_g_history_compare(size_t a, size_t b)
+{
+  const itl_history_entry_t *x = ITL_HISTORY_AT(a), *y = ITL_HISTORY_AT(b);
+  int result = memcmp(ITL_HISTORY_TEXT(x), ITL_HISTORY_TEXT(y),
+                      ITL_MIN(x->size, y->size));
+
+  if (result != 0) {
+    return result;
+  }
+  if (x->size != y->size) {
+    return (x->size < y->size) ? -1 : 1;
+  }
+  return (a < b) ? -1 : (a > b);
+}
+
+ITL_DEF int
+itl_g_history_sorted_compare(const void *a, const void *b)
+{
+  return itl_g_history_compare(
+      *(const uint32_t *) a + itl_g_history.sorted_base,
+      *(const uint32_t *) b + itl_g_history.sorted_base);
+}
+
+typedef struct itl_sorted_text itl_sorted_text_t;
+
+struct itl_sorted_text
+{
+  const char *text;
+  size_t size;
+  uint32_t number;
+};
+
+ITL_DEF int
+itl_sorted_text_compare(const void *a, const void *b)
+{
+  const itl_sorted_text_t *x = (const itl_sorted_text_t *) a,
+                          *y = (const itl_sorted_text_t *) b;
+  int result = memcmp(x->text, y->text, ITL_MIN(x->size, y->size));
+
+  if (result != 0) {
+    return result;
+  }
+  if (x->size != y->size) {
+    return (x->size < y->size) ? -1 : 1;
+  }
+  return (x->number < y->number) ? -1 : (x->number > y->number);
+}
+
+/* Sorts `count` entry numbers, counted from the base of sorted entries, by
+   text that is decoded once into a copy, rather than for every comparison */
+ITL_DEF void
+itl_g_history_sort_decoded(uint32_t *numbers, size_t count)
+{
+  size_t i, size = 1;
+  char *copy, *out;
+  itl_sorted_text_t *texts;
+  const itl_history_entry_t *entry;
+
+  if (count == 0) {
+    return;
+  }
+
+  for (i = 0; i < count; ++i) {
+    size += ITL_HISTORY_AT(numbers[i] + itl_g_history.sorted_base)->size;
+  }
+  copy = out = (char *) itl_malloc(size);
+  texts = (itl_sorted_text_t *) itl_malloc(count * sizeof(itl_sorted_text_t));
+
+  for (i = 0; i < count; ++i) {
+    entry = ITL_HISTORY_AT(numbers[i] + itl_g_history.sorted_base);
+    memcpy(out, ITL_HISTORY_TEXT(entry), entry->size);
+    texts[i].text = out;
+    texts[i].size = entry->size;
+    texts[i].number = numbers[i];
+    out += entry->size;
+  }
+  qsort(texts, count, sizeof(itl_sorted_text_t), itl_sorted_text_compare);
+  for (i = 0; i < count; ++i) {
+    numbers[i] = texts[i].number;
+  }
+
+  ITL_FREE(texts);
+  ITL_FREE(copy);
+}
+
+/* Compares start of text of entry number `n` with `prefix` */
+ITL_DEF int
+itl_g_history_compare_prefix(size_t n, const char *prefix, size_t size)
+{
+  const itl_history_entry_t *entry = ITL_HISTORY_AT(n);
+  int result = memcmp(ITL_HISTORY_TEXT(entry), prefix,
+                      ITL_MIN(entry->size, size));
+
+  if (result == 0 && entry->size < size) {
+    return -1;
+  }
+  return result;
+}
+
+/* Brings entries that are sorted by text up to date. Entries that were
+   dropped are left out, and entries that were appended are sorted and put in
+   their places */
+ITL_DEF void
+itl_g_history_sorted_update(void)
+{
+  itl_history_t *h = &itl_g_history;
+  size_t i, k, n, low, high, middle, end, count = 0;
+  uint32_t *added;
+
+  if (h->sorted == NULL || ITL_HISTORY_LAST() - h->sorted_base >= UINT32_MAX) {
+    itl_g_history_sorted_free();
+    h->sorted_base = h->sorted_first = h->sorted_end = h->first;
+    h->sorted_is_stale = false;
+  }
+
+  if (h->first > h->sorted_first || h->sorted_is_stale) {
+    for (i = k = 0; i < h->sorted_size; ++i) {
+      n = h->sorted[i] + h->sorted_base;
+      if (n >= h->first && n < h->sorted_end) {
+        h->sorted[k] = h->sorted[i];
+        k += 1;
+      }
+    }
+    h->sorted_size = k;
+    h->sorted_first = h->first;
+    h->sorted_is_stale = false;
+  }
+
+  h->sorted_end = ITL_MAX(h->sorted_end, h->first);
+  added = (uint32_t *) itl_malloc(
+      (h->first + h->length - h->sorted_end + 1) * sizeof(uint32_t));
+  for (n = h->sorted_end; n < h->first + h->length; ++n) {
+    if (!ITL_HISTORY_IS_ERASED(n)) {
+      added[count] = (uint32_t) (n - h->sorted_base);
+      count += 1;
+    }
+  }
+  if (itl_g_history_is_compact) {
+    itl_g_history_sort_decoded(added, count);
+  } else {
+    qsort(added, count, sizeof(uint32_t), itl_g_history_sorted_compare);
+  }
+
+  if (h->sorted_size + count > h->sorted_capacity) {
+    h->sorted_capacity =
+        ITL_MAX(h->sorted_capacity * 2, ITL_MAX(h->sorted_size + count, 64));
+    h->sorted = (uint32_t *) itl_realloc(h->sorted, h->sorted_capacity *
+                                                        sizeof(uint32_t));
+  }
+
+  /* From the biggest, so that every entry is moved only once */
+  end = h->sorted_size;
+  for (k = count; k > 0; --k) {
+    low = 0;
+    high = end;
+    while (low < high) {
+      middle = low + (high - low) / 2;
+      if (itl_g_history_sorted_compare(&h->sorted[middle], &added[k - 1]) <
+          0)
+      {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    memmove(h->sorted + low + k, h->sorted + low,
+            (end - low) * sizeof(uint32_t));
+    h->sorted[low + k - 1] = added[k - 1];
+    end = low;
+  }
+  h->sorted_size += count;
+  h->sorted_end = h->first + h->length;
+
+  ITL_FREE(added);
+}
+
+/* Returns index of the first sorted entry that starts with something bigger
+   than `prefix`, or not less than it */
+ITL_DEF size_t
+itl_g_history_sorted_bound(const char *prefix, size_t size, bool is_upper)
+{
+  size_t low = 0, high = itl_g_history.sorted_size, middle;
+  int result;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    result = itl_g_history_compare_prefix(
+        itl_g_history.sorted[middle] + itl_g_history.sorted_base, prefix,
+        size);
+    if (result < 0 || (is_upper && result == 0)) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/* Moves entries that are not erased next to each other, and their text as
+   well. The newest entry keeps its number, so that it stays selected */
+ITL_DEF void
+itl_g_history_pack(void)
+{
+  itl_history_t *h = &itl_g_history;
+  itl_history_entry_t *entry;
+  size_t n, to, offset = h->text_base;
+
+  if (h->erased == 0) {
+    return;
+  }
+
+  /* Records may refer to erased ones, so they are written anew */
+  if (itl_g_history_is_compact) {
+    itl_g_history_rewrite(true);
+  } else {
+    for (n = h->first; n < h->first + h->length; ++n) {
+      entry = ITL_HISTORY_AT(n);
+      if (entry->length != ITL_HISTORY_ERASED) {
+        memmove(h->text + (offset - h->text_base), ITL_HISTORY_TEXT(entry),
+                entry->size);
+        entry->offset = offset;
+        offset += entry->size;
+      }
+    }
+    h->text_end = offset;
+  }
+
+  for (n = to = ITL_HISTORY_LAST(); n + 1 > h->first; --n) {
+    if (!ITL_HISTORY_IS_ERASED(n)) {
+      *ITL_HISTORY_AT(to) = *ITL_HISTORY_AT(n);
+      to -= 1;
+    }
+  }
+
+  h->first = to + 1;
+  h->length -= h->erased;
+  h->erased = 0;
+  h->erased_size = 0;
+
+  if (itl_g_history_erase_duplicates) {
+    itl_g_history_index_rebuild();
+  }
+  if (itl_g_history.trigrams != NULL) {
+    itl_g_history_trigrams_build();
+  }
+  /* Numbers have changed, so entries are sorted again when needed */
+  itl_g_history_sorted_free();
+}
+
+/* Returns number of the entry that is `index` in order among entries that
+   are not erased. Erased entries are skipped from the nearer end, so that
+   numbers stay as they are for entries that are selected or found */
+ITL_DEF size_t
+itl_g_history_number(size_t index)
+{
+  const itl_history_t *h = &itl_g_history;
+  size_t n, left, kept = h->length - h->erased;
+
+  TL_ASSERT(index < kept);
+
+  if (h->erased == 0) {
+    return h->first + index;
+  }
+
+  if (index < kept / 2) {
+    for (n = h->first;; ++n) {
+      if (!ITL_HISTORY_IS_ERASED(n)) {
+        if (index == 0) {
+          return n;
+        }
+        index -= 1;
+      }
+    }
+  }
+
+  left = kept - 1 - index;
+  for (n = ITL_HISTORY_LAST();; --n) {
+    if (!ITL_HISTORY_IS_ERASED(n)) {
+      if (left == 0) {
+        return n;
+      }
+      left -= 1;
+    }
+  }
+}
+
+/* Erases entry number `n`, which is neither the oldest nor the newest */
+ITL_DEF void
+itl_g_history_erase(size_t n)
+{
+  TL_ASSERT(n > itl_g_history.first && n < ITL_HISTORY_LAST());
+
+  ITL_HISTORY_AT(n)->length = ITL_HISTORY_ERASED;
+  itl_g_history.erased += 1;
+  itl_g_history.erased_size += itl_g_history_text_size(n);
+}
+
+/* Erases entry with text of `str` other than the newest, if there is one */
+ITL_DEF void
+itl_g_history_erase_duplicate(const itl_string_t *str, uint64_t hash)
+{
+  size_t i, n;
+
+  i = itl_g_history_index_find(str, hash);
+  if (i == itl_g_history.index_capacity) {
+    return;
+  }
+
+  n = itl_g_history.index[i] - 1;
+  if (n == ITL_HISTORY_LAST()) {
+    return;
+  }
+
+  if (n == itl_g_history.first) {
+    itl_g_history_drop_first();
+  } else {
+    itl_g_history_erase(n);
+  }
+}
+
+/* Same as itl_g_history_append(), with `hash` of `str` already known if
+   duplicates are erased */
+ITL_DEF bool
+itl_g_history_append_hashed(const itl_string_t *str, uint64_t hash)
+{
+  /* Do not append the same string */
+  if (itl_g_history.length > 0 &&
+      itl_g_history_equal(ITL_HISTORY_LAST(), str))
+  {
+    return false;
+  }
+
+  /* A line that alone exceeds the budget would push out everything else */
+  if (itl_g_history_max_bytes > 0 && str->size > itl_g_history_max_bytes) {
+    return false;
+  }
+
+  if (itl_g_history_erase_duplicates) {
+    itl_g_history_erase_duplicate(str, hash);
+  }
+
+  /* If a limit was exceeded, the oldest entries are overwritten */
+  itl_g_history_evict(str->size, 1, 0);
+
+  if (itl_g_history.erased * 2 > itl_g_history.length) {
+    itl_g_history_pack();
+  }
+
+  if (itl_g_history.length == itl_g_history.capacity) {
+    itl_g_history_resize(
+        (itl_g_history.capacity > 0)
+            ? itl_g_history.capacity * 2
+            : ITL_MIN(ITL_HISTORY_INIT_CAPACITY,
+                      itl_round_up_to_power_of_2(itl_g_history_max_entries)));
+  }
+
+  itl_g_history_set(itl_g_history.first + itl_g_history.length, str);
+  itl_g_history.length += 1;
+
+  if (itl_g_history_erase_duplicates) {
+    ITL_HISTORY_AT(ITL_HISTORY_LAST())->hash = hash;
+    itl_g_history_index_insert(ITL_HISTORY_LAST());
+  }
+  itl_g_history_trigrams_add_last();
+
+  return true;
+}
+
+ITL_DEF bool
+itl_g_history_append(const itl_string_t *str)
+{
+  return itl_g_history_append_hashed(
+      str, itl_g_history_erase_duplicates ? itl_string_hash(str) : 0);
+}
+
+/* Replaces text of the newest entry */
+ITL_DEF void
+itl_g_history_replace_last(const itl_string_t *str)
+{
+  uint64_t hash = 0;
+
+  TL_ASSERT(itl_g_history.length > 0);
+
+  if (itl_g_history_erase_duplicates) {
+    hash = itl_string_hash(str);
+    itl_g_history_erase_duplicate(str, hash);
+  }
+
+  /* Its place in order by text is lost */
+  if (itl_g_history.sorted != NULL &&
+      ITL_HISTORY_LAST() < itl_g_history.sorted_end)
+  {
+    itl_g_history.sorted_end = ITL_HISTORY_LAST();
+    itl_g_history.sorted_is_stale = true;
+  }
+
+  /* It is at the end of the arena */
+  itl_g_history.text_end = ITL_HISTORY_AT(ITL_HISTORY_LAST())->offset;
+  itl_g_history_evict(str->size, 0, 1);
+  itl_g_history_set(ITL_HISTORY_LAST(), str);
+
+  if (itl_g_history_erase_duplicates) {
+    ITL_HISTORY_AT(ITL_HISTORY_LAST())->hash = hash;
+    itl_g_history_index_insert(ITL_HISTORY_LAST());
+  }
+  itl_g_history_trigrams_add_last();
+}
+
+/* Erases all but the newest copy of every line that is kept */
+ITL_DEF void
+itl_g_history_erase_all_duplicates(void)
+{
+  size_t n, capacity;
+  itl_history_entry_t *entry;
+  itl_string_t *str;
+
+  if (itl_g_history.length == 0) {
+    return;
+  }
+
+  /* Big enough for every entry, so that it is not rebuilt midway */
+  capacity = itl_round_up_to_power_of_2(
+      ITL_MAX(itl_g_history.length * 2 + 1, ITL_HISTORY_INDEX_INIT_SIZE));
+  if (itl_g_history.index != NULL) {
+    ITL_FREE(itl_g_history.index);
+  }
+  itl_g_history.index = (size_t *) itl_malloc(capacity * sizeof(size_t));
+  itl_g_history.index_capacity = capacity;
+  memset(itl_g_history.index, 0, capacity * sizeof(size_t));
+  itl_g_history.index_used = 0;
+
+  str = itl_string_alloc();
+
+  /* Newer copies are met first */
+  for (n = ITL_HISTORY_LAST(); n + 1 > itl_g_history.first; --n) {
+    if (ITL_HISTORY_IS_ERASED(n)) {
+      continue;
+    }
+
+    entry = ITL_HISTORY_AT(n);
+    itl_string_assign(str, ITL_HISTORY_TEXT(entry), entry->size,
+                      entry->length);
+    entry->hash = itl_string_hash(str);
+
+    if (itl_g_history_index_find(str, entry->hash) == capacity) {
+      itl_g_history_index_insert(n);
+    } else if (n == itl_g_history.first) {
+      itl_g_history_drop_first();
+    } else {
+      itl_g_history_erase(n);
+    }
+  }
+
+  ITL_STRING_FREE(str);
+
+  if (itl_g_history.erased * 2 > itl_g_history.length) {
+    itl_g_history_pack();
+  }
+}
+
+/* Applies new limits to entries that are already kept */
+ITL_DEF void
+itl_g_history_set_limits(size_t max_entries, size_t max_bytes)
+{
+  size_t capacity;
+
+  itl_g_history_max_entries = max_entries;
+  itl_g_history_max_bytes = max_bytes;
+
+  itl_g_history_evict(0, 0, 0);
+
+  if (itl_g_history.entries == NULL) {
+    return;
+  }
+  itl_g_history_pack();
+
+  /* Give back memory of a ring or an arena that got too big */
+  capacity = itl_round_up_to_power_of_2(max_entries);
+  if (capacity < itl_g_history.capacity) {
+    itl_g_history_resize(capacity);
+  }
+  if (max_bytes > 0 &&
+      itl_g_history.text_capacity > ITL_MAX(max_bytes * 2,
+                                            ITL_HISTORY_TEXT_INIT_SIZE))
+  {
+    itl_g_history_compact();
+    /* In compact mode, the block of the oldest entry is kept as well */
+    itl_g_history.text_capacity =
+        ITL_MAX(ITL_MAX(max_bytes * 2, ITL_HISTORY_TEXT_INIT_SIZE),
+                itl_g_history.text_end - itl_g_history.text_base);
+    itl_g_history.text =
+        (char *) itl_realloc(itl_g_history.text, itl_g_history.text_capacity);
+  }
+}
+
+ITL_DEF void
+itl_le_init(itl_le_t *le, itl_string_t *line_buf, char *out_buf,
+            size_t out_size, const char *prompt)
+{
+  /* clang-format off */
+  le->line                  = line_buf;
+  le->cursor_position       = line_buf->length;
+  le->appended_to_history   = false;
+  le->history_selected      = ITL_HISTORY_NOT_SELECTED;
+  le->out_buf               = out_buf;
+  le->out_size              = out_size;
+  le->prompt                = prompt;
+  le->prompt_size           = (prompt != NULL) ? strlen(prompt) : 0;
+  /* clang-format on */
+}
+
+ITL_DEF void
+itl_le_move_right(itl_le_t *le, size_t steps)
+{
+  if (le->cursor_position + steps >= le->line->length) {
+    le->cursor_position = le->line->length;
+  } else {
+    le->cursor_position += steps;
+  }
+}
+
+ITL_DEF void
+itl_le_move_left(itl_le_t *le, size_t steps)
+{
+  if (steps <= le->cursor_position) {
+    le->cursor_position -= steps;
+  } else {
+    le->cursor_position = 0;
+  }
+}
+
+ITL_DEF void
+itl_le_erase(itl_le_t *le, size_t count, bool backwards)
+{
+  if (count == 0) {
+    return;
+  }
+
+  if (backwards && le->cursor_position) {
+    itl_string_erase(le->line, le->cursor_position, count, true);
+    itl_le_move_left(le, count);
+  } else if (!backwards) {
+    itl_string_erase(le->line, le->cursor_position, count, false);
+  }
+}
+
+#define ITL_LE_ERASE_FORWARD(le, count)  itl_le_erase(le, count, false)
+#define ITL_LE_ERASE_BACKWARD(le, count) itl_le_erase(le, count, true)
+
+/* Inserts character at cursor position */
+ITL_DEF bool
+itl_le_insert(itl_le_t *le, itl_utf8_t ch)
+{
+  ITL_TRY(le->line->size + ch.size < le->out_size, return false);
+
+  itl_string_insert(le->line, le->cursor_position, ch);
+  itl_le_move_right(le, 1);
+
+  return true;
+}
+
+#define ITL_CHAR_IS_DELIM(c) (ispunct(c))
+#define ITL_CHAR_IS_SPACE(c) (isspace(c))
+
+typedef enum
+{
+  ITL_TOKEN_DELIM = 0,
+  ITL_TOKEN_WORD = 1,
+  ITL_TOKEN_SPACE = 2,
+} ITL_TOKEN_KIND;
+
+/* Returns amount of steps required to reach next/previos token */
+ITL_DEF size_t
+itl_string_steps_to_token(itl_string_t *str, size_t position, bool backwards)
+{
+  uint8_t b;
+  bool should_break = false;
+  size_t i = position, offset, steps = 0;
+
+  ITL_TOKEN_KIND token_kind;
+
+  if (backwards && i > 0) {
+    steps += 1;
+    i -= 1;
+  }
+
+  if (i >= str->length) {
+    return steps;
+  }
+
+  offset = itl_string_offset(str, i);
+  b = ITL_STRING_BYTE(str, offset);
+
+  if (ITL_CHAR_IS_SPACE(b)) {
+    token_kind = ITL_TOKEN_SPACE;
+  } else if (ITL_CHAR_IS_DELIM(b)) {
+    token_kind = ITL_TOKEN_DELIM;
+  } else {
+    token_kind = ITL_TOKEN_WORD;
+  }
+
+  while (i < str->length) {
+    b = ITL_STRING_BYTE(str, offset);
+
+    switch (token_kind) {
+    case ITL_TOKEN_DELIM: should_break = !ITL_CHAR_IS_DELIM(b); break;
+    case ITL_TOKEN_WORD:
+      should_break = ITL_CHAR_IS_DELIM(b) || ITL_CHAR_IS_SPACE(b);
+      break;
+    case ITL_TOKEN_SPACE: should_break = !ITL_CHAR_IS_SPACE(b); break;
+    default: ITL_UNREACHABLE();
+    }
+    if (should_break) {
+      break;
+    }
+
+    steps += 1;
+
+    if (backwards && i > 0) {
+      i -= 1;
+      offset = itl_string_prev(str, offset);
+    } else if (!backwards && i < str->length - 1) {
+      i += 1;
+      offset = itl_string_next(str, offset);
+    } else {
+      break;
+    }
+  }
+
+  ITL_TRACELN("mode: %d, steps: %zu", token_kind, steps);
+
+  return steps;
+}
+
+#define ITL_LE_STEPS_TO_TOKEN(le, backwards)                                   \
+  itl_string_steps_to_token((le)->line, (le)->cursor_position, backwards)
+
+#define ITL_LE_STEPS_TO_TOKEN_FORWARD(le)                                      \
+  itl_string_steps_to_token((le)->line, (le)->cursor_position, false)
+
+#define ITL_LE_STEPS_TO_TOKEN_BACKWARD(le)                                     \
+  itl_string_steps_to_token((le)->line, (le)->cursor_position, true)
+
+#define ITL_LE_CURSOR_IS_ON_SPACE(le)                                          \
+  ((le)->cursor_position < (le)->line->length &&                               \
+   ITL_CHAR_IS_SPACE(                                                          \
+       itl_string_at((le)->line, (le)->cursor_position).bytes[0]))
+
+ITL_DEF void
+itl_le_clear_line(itl_le_t *le)
+{
+  itl_string_clear(le->line);
+  le->cursor_position = 0;
+}
+
+/* Replaces the line with entry number `n` */
+ITL_DEF void
+itl_g_history_select(itl_le_t *le, size_t n)
+{
+  TL_ASSERT(itl_g_history.length > 0);
+
+  /* Selected entry could have been overwritten or erased */
+  n = ITL_MAX(n, itl_g_history.first);
+  n = ITL_MIN(n, ITL_HISTORY_LAST());
+  while (ITL_HISTORY_IS_ERASED(n)) {
+    n -= 1;
+  }
+
+  le->history_selected = n;
+
+  itl_le_clear_line(le);
+  itl_string_assign(le->line, ITL_HISTORY_TEXT(ITL_HISTORY_AT(n)),
+                    ITL_HISTORY_AT(n)->size, ITL_HISTORY_AT(n)->length);
+  le->cursor_position = le->line->length;
+}
+
+ITL_DEF void
+itl_g_history_get_prev(itl_le_t *le)
+{
+  if (itl_g_history.length == 0) {
+    return;
+  }
+
+  if (le->history_selected != ITL_HISTORY_NOT_SELECTED) {
+    if (le->history_selected > itl_g_history.first) {
+      itl_g_history_select(le, le->history_selected - 1);
+    } else {
+      itl_g_history_select(le, itl_g_history.first);
+    }
+  } else {
+    itl_g_history_select(le, ITL_HISTORY_LAST());
+  }
+}
+
+ITL_DEF void
+itl_g_history_get_next(itl_le_t *le)
+{
+  size_t n = le->history_selected;
+
+  if (n != ITL_HISTORY_NOT_SELECTED && itl_g_history.length > 0 &&
+      n < ITL_HISTORY_LAST())
+  {
+    do {
+      n += 1;
+    } while (ITL_HISTORY_IS_ERASED(n));
+    itl_g_history_select(le, n);
+  }
+}
+
+#define ITL_CHAR_BUFFER_INIT_SIZE 32
+
+typedef struct itl_char_buf itl_char_buf_t;
+
+struct itl_char_buf
+{
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+ITL_DEF void
+itl_char_buf_init(itl_char_buf_t *cb)
+{
+  cb->size = 0;
+  cb->capacity = ITL_CHAR_BUFFER_INIT_SIZE;
+  cb->data = (char *) itl_malloc(sizeof(char) * cb->capacity);
+}
+
+#define ITL_CHAR_BUF_REALLOC_CAPACITY(old_capacity) (old_capacity * 2)
+
+ITL_DEF void
+itl_char_buf_extend(itl_char_buf_t *cb)
+{
+  cb->capacity = ITL_CHAR_BUF_REALLOC_CAPACITY(cb->capacity);
+  cb->data = (char *) itl_realloc(cb->data, cb->capacity);
+}
+
+ITL_DEF void
+itl_char_buf_append_cstr(itl_char_buf_t *cb, const char *cstr)
+{
+  size_t new_size, j;
+
+  for (new_size = cb->size, j = 0; cstr[j] != '\0'; ++j, ++new_size) {
+    while (cb->capacity <= new_size) {
+      itl_char_buf_extend(cb);
+    }
+    cb->data[new_size] = cstr[j];
+  }
+
+  cb->size = new_size;
+}
+
+ITL_DEF void
+itl_char_buf_append_size_t(itl_char_buf_t *cb, size_t n)
+{
+  size_t new_size, i;
+  size_t data_len = 0, data_copy = n;
+
+  do {
+    data_len += 1;
+    data_copy /= 10;
+  } while (data_copy > 0);
+
+  new_size = cb->size + data_len;
+
+  while (cb->capacity < new_size) {
+    itl_char_buf_extend(cb);
+  }
+
+  /* Digits are put in reverse order */
+  for (i = new_size - 1; i >= cb->size; --i) {
+    cb->data[i] = (char) (n % 10) + '0';
+    n /= 10;
+  }
+
+  cb->size = new_size;
+}
+
+/* Appends bytes of `str` between `from` and `to` offsets */
+ITL_DEF void
+itl_char_buf_append_string_bytes(itl_char_buf_t *cb, const itl_string_t *str,
+                                 size_t from, size_t to)
+{
+  while (cb->capacity < cb->size + (to - from)) {
+    itl_char_buf_extend(cb);
+  }
+
+  itl_string_copy_bytes(str, from, to, cb->data + cb->size);
+  cb->size += to - from;
+}
+
+ITL_DEF void
+itl_char_buf_append_bytes(itl_char_buf_t *cb, const char *data, size_t size)
+{
+  while (cb->capacity < cb->size + size) {
+    itl_char_buf_extend(cb);
+  }
+
+  memcpy(cb->data + cb->size, data, size);
+  cb->size += size;
+}
+
+ITL_DEF void
+itl_char_buf_append_byte(itl_char_buf_t *cb, uint8_t data)
+{
+  while (cb->capacity < cb->size + 1) {
+    itl_char_buf_extend(cb);
+  }
+
+  cb->data[cb->size] = (char) data;
+  cb->size += 1;
+}
+
+#define ITL_CHAR_BUF_CLEAR(cb) (cb)->size = 0
+
+#define ITL_CHAR_BUF_DUMP(cb) ITL_TTY_WRITE((cb)->data, (cb)->size)
+
+#define ITL_TTY_HIDE_CURSOR(buffer)                                            \
+  itl_char_buf_append_cstr(buffer, "\x1b[?25l")
+
+#define ITL_TTY_SHOW_CURSOR(buffer)                                            \
+  itl_char_buf_append_cstr(buffer, "\x1b[?25h")
+
+#define ITL_TTY_MOVE_TO_COLUMN(buffer, col)                                    \
+  do {                                                                         \
+    itl_char_buf_append_cstr(buffer, "\x1b[");                                 \
+    itl_char_buf_append_size_t(buffer, (size_t) col);                          \
+    itl_char_buf_append_byte(buffer, 'G');                                     \
+  } while (0)
+
+#define ITL_TTY_MOVE_FORWARD(buffer, steps)                                    \
+  do {                                                                         \
+    itl_char_buf_append_cstr(buffer, "\x1b[");                                 \
+    itl_char_buf_append_size_t(buffer, (size_t) steps);                        \
+    itl_char_buf_append_byte(buffer, 'C');                                     \
+  } while (0)
+
+#define ITL_TTY_MOVE_UP(buffer, rows)                                          \
+  do {                                                                         \
+    itl_char_buf_append_cstr(buffer, "\x1b[");                                 \
+    itl_char_buf_append_size_t(buffer, (size_t) rows);                         \
+    itl_char_buf_append_byte(buffer, 'A');                                     \
+  } while (0)
+
+#define ITL_TTY_MOVE_DOWN(buffer, rows)                                        \
+  do {                                                                         \
+    itl_char_buf_append_cstr(buffer, "\x1b[");                                 \
+    itl_char_buf_append_size_t(buffer, (size_t) rows);                         \
+    itl_char_buf_append_byte(buffer, 'B');                                     \
+  } while (0)
+
+#define ITL_TTY_CLEAR_WHOLE_LINE(buffer)                                       \
+  itl_char_buf_append_cstr(buffer, "\r\x1b[0K")
+
+#define ITL_TTY_CLEAR_TO_END(buffer) itl_char_buf_append_cstr(buffer, "\x1b[K")
+
+#define ITL_TTY_CLEAR_BELOW(buffer) itl_char_buf_append_cstr(buffer, "\x1b[J")
+
+#define ITL_TTY_GOTO_HOME(buffer) itl_char_buf_append_cstr(buffer, "\x1b[H")
+
+#define ITL_TTY_ERASE_SCREEN(buffer) itl_char_buf_append_cstr(buffer, "\033[2J")
+
+#define ITL_TTY_STATUS_REPORT(buffer)                                          \
+  itl_char_buf_append_cstr(buffer, "\x1b[6n")
+
+/* If this is true, do not overwrite file on `history_dump_to_file()` */
+ITL_DEF ITL_THREAD_LOCAL bool itl_g_history_file_is_bad = false;
+
+typedef struct itl_history_file itl_history_file_t;
+
+/* File opened by tl_history_open(), which entered lines are appended to */
+struct itl_history_file
+{
+  bool is_open;
+  ITL_FILE file;
+  itl_char_buf_t path;      /* Null-terminated */
+  itl_char_buf_t temp_path; /* Where the file is compacted, null-terminated */
+  itl_char_buf_t line;      /* Line that is written, with a newline */
+  size_t size;              /* N of bytes in the file */
+  size_t kept_size;         /* N of bytes of kept lines, when last counted */
+  size_t unsynced;          /* N of lines written since the last sync */
+};
+
+ITL_DEF ITL_THREAD_LOCAL itl_history_file_t itl_g_history_file = ITL_ZERO_INIT;
+
+/* Set by tl_history_set_sync(), never synced if 0 */
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_history_sync_lines = 0;
+
+/* The file is not compacted while it is smaller */
+#define ITL_HISTORY_COMPACT_MIN_SIZE 4096
+
+#define ITL_HISTORY_FILE_EXPLOSION()                                           \
+  do {                                                                         \
+    itl_g_history_free();                                                      \
+    itl_g_history_file_is_bad = true;                                          \
+    ret = TL_ERROR;                                                            \
+    goto end;                                                                  \
+  } while (0)
+
+/* Files that can't be mapped are read in chunks of this size at first */
+#define ITL_HISTORY_FILE_BUFFER_SIZE (64 * 1024)
+
+typedef struct itl_history_archive itl_history_archive_t;
+
+/* File set by tl_history_archive(). Entries that limits drop from history
+   are appended to it, and it is searched from the end when history runs out
+   of matches. It is never loaded */
+struct itl_history_archive
+{
+  bool is_open;
+  bool is_paused;       /* Whether dropped entries are not spilled */
+  size_t spilled_count; /* Lines spilled since it was opened */
+  ITL_FILE file;        /* Where lines are appended */
+  ITL_FILE read_file;   /* Where lines are searched */
+  itl_char_buf_t lines; /* Spilled lines that were not written yet */
+};
+
+ITL_DEF ITL_THREAD_LOCAL itl_history_archive_t itl_g_history_archive =
+    ITL_ZERO_INIT;
+
+ITL_DEF void
+itl_history_archive_close(void)
+{
+  itl_history_archive_t *a = &itl_g_history_archive;
+
+  if (a->is_open) {
+    ITL_FILE_CLOSE(a->file);
+    ITL_FILE_CLOSE(a->read_file);
+    ITL_FREE(a->lines.data);
+  }
+  memset(a, 0, sizeof(*a));
+}
+
+/* Writes spilled lines in one write */
+ITL_DEF void
+itl_history_archive_flush(void)
+{
+  itl_history_archive_t *a = &itl_g_history_archive;
+
+  if (!a->is_open || a->lines.size == 0) {
+    return;
+  }
+
+  if (ITL_WRITE(a->file, a->lines.data, a->lines.size) == -1) {
+    ITL_TRACELN("could not append to history archive: %s\n", strerror(errno));
+  }
+  ITL_CHAR_BUF_CLEAR(&a->lines);
+}
+
+/* Puts text of entry number `n`, which is about to be dropped, among lines
+   that are written to the archive */
+ITL_DEF void
+itl_history_archive_spill(size_t n)
+{
+  itl_history_archive_t *a = &itl_g_history_archive;
+  const itl_history_entry_t *entry = ITL_HISTORY_AT(n);
+
+  /* Same lines as dumped ones */
+  if (!a->is_open || a->is_paused || entry->length <= 1 ||
+      entry->length == ITL_HISTORY_ERASED)
+  {
+    return;
+  }
+
+  itl_char_buf_append_bytes(&a->lines, ITL_HISTORY_TEXT(entry), entry->size);
+  itl_char_buf_append_byte(&a->lines, '\n');
+  a->spilled_count += 1;
+
+  /* Lowered limits can drop a lot at once */
+  if (a->lines.size >= ITL_HISTORY_FILE_BUFFER_SIZE) {
+    itl_history_archive_flush();
+  }
+}
+
+/* Lines that are split at once on the calling thread */
+#define ITL_HISTORY_SCAN_LINES 256
+
+/* Returns size of a line of `size` bytes as it is kept in history */
+ITL_DEF size_t
+itl_history_line_size(const char *line, size_t size)
+{
+  /* TODO: Multiline support for history. */
+  if (size > 0 && line[size - 1] == '\r') {
+    size -= 1;
+  }
+
+  /* TODO: Here long lines are silently truncated. */
+  if (size > ITL_STRING_MAX_LEN) {
+    size = ITL_STRING_MAX_LEN;
+    /* Don't cut a character in half. */
+    while (size > 0 && ITL_UTF8_IS_CONTINUATION(line[size])) {
+      size -= 1;
+    }
+  }
+
+  return size;
+}
+
+typedef struct itl_history_scan itl_history_scan_t;
+
+/* Lines of a history file that are split by itl_history_scan() */
+struct itl_history_scan
+{
+  const char *base; /* Offsets of lines are from here */
+  const char *line; /* Start of the next line */
+  const char *end;  /* After the last newline */
+  itl_history_entry_t *lines;
+  size_t line_count;
+  size_t max_lines;
+  size_t continuation; /* N of continuation bytes of the next line so far */
+};
+
+ITL_DEF void
+itl_history_scan_init(itl_history_scan_t *scan, const char *base,
+                      const char *end, itl_history_entry_t *lines,
+                      size_t max_lines)
+{
+  scan->base = base;
+  scan->line = base;
+  scan->end = end;
+  scan->lines = lines;
+  scan->line_count = 0;
+  scan->max_lines = max_lines;
+  scan->continuation = 0;
+}
+
+/* Adds the line that ends at `newline` */
+ITL_DEF void
+itl_history_scan_add(itl_history_scan_t *scan, const char *newline)
+{
+  itl_history_entry_t *entry = &scan->lines[scan->line_count];
+  size_t size = (size_t) (newline - scan->line);
+
+  entry->offset = (size_t) (scan->line - scan->base);
+  entry->size = itl_history_line_size(scan->line, size);
+  entry->hash = 0;
+
+  /* CR is not a continuation byte, so only truncated lines are counted
+     again */
+  if (entry->size == size ||
+      (entry->size + 1 == size && scan->line[entry->size] == '\r'))
+  {
+    entry->length = entry->size - scan->continuation;
+  } else {
+    entry->length = itl_utf8_count(scan->line, entry->size);
+  }
+
+  scan->line_count += 1;
+  scan->line = newline + 1;
+  scan->continuation = 0;
+}
+
+/* Bytes that are not text, though spaces are */
+#define ITL_CHAR_IS_CONTROL(c) (((c) < 0x20 && !isspace(c)) || (c) == 0x7F)
+
+/* Splits lines from `p`, which is in the next line, until lines don't fit.
+   Returns false if there is a control byte that is not a space */
+ITL_DEF bool
+itl_history_scan_scalar(itl_history_scan_t *scan, const char *p)
+{
+  uint8_t c;
+
+  for (; p < scan->end && scan->line_count < scan->max_lines; ++p) {
+    c = (uint8_t) *p;
+    if (c == '\n') {
+      itl_history_scan_add(scan, p);
+    } else if (ITL_CHAR_IS_CONTROL(c)) {
+      return false;
+    } else if (ITL_UTF8_IS_CONTINUATION(c)) {
+      scan->continuation += 1;
+    }
+  }
+  return true;
+}
+
+/* Returns false if there is a control byte that is not a space between `p`
+   and `end` */
+ITL_DEF bool
+itl_history_is_text_scalar(const char *p, const char *end)
+{
+  uint8_t c;
+
+  for (; p < end; ++p) {
+    c = (uint8_t) *p;
+    if (ITL_CHAR_IS_CONTROL(c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if defined ITL_SSE2
+ITL_DEF unsigned
+itl_count_trailing_zeros(unsigned mask)
+{
+#if defined __GNUC__ || defined __clang__
+  return (unsigned) __builtin_ctz(mask);
+#else
+  unsigned count = 0;
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    count += 1;
+  }
+  return count;
+#endif
+}
+
+/* Without POPCNT, builtins call a library function, so bits are added in
+   parallel */
+ITL_DEF unsigned
+itl_count_ones(uint32_t mask)
+{
+  mask = mask - ((mask >> 1) & 0x55555555);
+  mask = (mask & 0x33333333) + ((mask >> 2) & 0x33333333);
+  mask = (mask + (mask >> 4)) & 0x0F0F0F0F;
+  return (unsigned) ((mask * 0x01010101) >> 24);
+}
+
+/* Splits lines found in masks of a block at `p`. Returns false if lines
+   don't fit anymore */
+ITL_DEF bool
+itl_history_scan_block(itl_history_scan_t *scan, const char *p,
+                       unsigned newlines, unsigned continuations)
+{
+  unsigned i, below;
+
+  for (; newlines != 0; newlines &= newlines - 1) {
+    i = itl_count_trailing_zeros(newlines);
+    below = (1u << i) - 1;
+    scan->continuation += itl_count_ones(continuations & below);
+    continuations &= ~below;
+
+    itl_history_scan_add(scan, p + i);
+    if (scan->line_count == scan->max_lines) {
+      return false;
+    }
+  }
+  scan->continuation += itl_count_ones(continuations);
+
+  return true;
+}
+
+/* Returns bytes of `v` that are control bytes, but not spaces */
+ITL_DEF __m128i
+itl_control_bytes_sse2(__m128i v)
+{
+  const __m128i below_space = _mm_set1_epi8(0x1F);
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i spaces = _mm_set1_epi8('\r' - '\t');
+  const __m128i del = _mm_set1_epi8(0x7F);
+
+  /* Unsigned comparisons are done through the minimum */
+  const __m128i shifted = _mm_sub_epi8(v, tab);
+
+  return _mm_or_si128(
+      _mm_andnot_si128(_mm_cmpeq_epi8(_mm_min_epu8(shifted, spaces), shifted),
+                       _mm_cmpeq_epi8(_mm_min_epu8(v, below_space), v)),
+      _mm_cmpeq_epi8(v, del));
+}
+
+/* Bytes are classified 16 at a time into newlines, continuation bytes, and
+   control bytes that are not spaces */
+ITL_DEF bool
+itl_history_scan_sse2(itl_history_scan_t *scan)
+{
+  const char *p = scan->line;
+  __m128i v;
+
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i limit = _mm_set1_epi8(-64);
+
+  for (; p + 16 <= scan->end; p += 16) {
+    v = _mm_loadu_si128((const __m128i *) p);
+    if (_mm_movemask_epi8(itl_control_bytes_sse2(v)) != 0) {
+      return false;
+    }
+
+    if (!itl_history_scan_block(
+            scan, p, (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)),
+            (unsigned) _mm_movemask_epi8(_mm_cmplt_epi8(v, limit))))
+    {
+      return true;
+    }
+  }
+  return itl_history_scan_scalar(scan, p);
+}
+
+ITL_DEF bool
+itl_history_is_text_sse2(const char *p, const char *end)
+{
+  __m128i control = _mm_setzero_si128();
+
+  /* Blocks are checked all at once, since control bytes are rare */
+  for (; p + 16 <= end; p += 16) {
+    control = _mm_or_si128(
+        control, itl_control_bytes_sse2(_mm_loadu_si128((const __m128i *) p)));
+  }
+  return _mm_movemask_epi8(control) == 0 && itl_history_is_text_scalar(p, end);
+}
+#endif /* ITL_SSE2 */
+
+#if defined ITL_AVX2
+ITL_TARGET_AVX2 ITL_DEF __m256i
+itl_control_bytes_avx2(__m256i v)
+{
+  const __m256i below_space = _mm256_set1_epi8(0x1F);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i spaces = _mm256_set1_epi8('\r' - '\t');
+  const __m256i del = _mm256_set1_epi8(0x7F);
+
+  const __m256i shifted = _mm256_sub_epi8(v, tab);
+
+  return _mm256_or_si256(
+      _mm256_andnot_si256(
+          _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, spaces), shifted),
+          _mm256_cmpeq_epi8(_mm256_min_epu8(v, below_space), v)),
+      _mm256_cmpeq_epi8(v, del));
+}
+
+ITL_TARGET_AVX2 ITL_DEF bool
+itl_history_scan_avx2(itl_history_scan_t *scan)
+{
+  const char *p = scan->line;
+  __m256i v;
+
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i limit = _mm256_set1_epi8(-64);
+
+  for (; p + 32 <= scan->end; p += 32) {
+    v = _mm256_loadu_si256((const __m256i *) p);
+    if (_mm256_movemask_epi8(itl_control_bytes_avx2(v)) != 0) {
+      return false;
+    }
+
+    if (!itl_history_scan_block(
+            scan, p,
+            (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)),
+            (unsigned) _mm256_movemask_epi8(_mm256_cmpgt_epi8(limit, v))))
+    {
+      return true;
+    }
+  }
+  return itl_history_scan_scalar(scan, p);
+}
+
+ITL_TARGET_AVX2 ITL_DEF bool
+itl_history_is_text_avx2(const char *p, const char *end)
+{
+  __m256i control = _mm256_setzero_si256();
+
+  for (; p + 32 <= end; p += 32) {
+    control = _mm256_or_si256(
+        control,
+        itl_control_bytes_avx2(_mm256_loadu_si256((const __m256i *) p)));
+  }
+  return _mm256_movemask_epi8(control) == 0 &&
+         itl_history_is_text_scalar(p, end);
+}
+#endif /* ITL_AVX2 */
+
+/* Splits lines after the ones that were split before, until they don't fit
+   into `scan->lines`. Returns false if the file is not text */
+ITL_DEF bool
+itl_history_scan(itl_history_scan_t *scan)
+{
+  scan->line_count = 0;
+#if defined ITL_AVX2
+  if (ITL_CPU_HAS_AVX2()) {
+    return itl_history_scan_avx2(scan);
+  }
+#endif /* ITL_AVX2 */
+#if defined ITL_SSE2
+  return itl_history_scan_sse2(scan);
+#else  /* ITL_SSE2 */
+  return itl_history_scan_scalar(scan, scan->line);
+#endif /* ITL_SSE2 */
+}
+
+/* Returns whether bytes between `data` and `end`, which start at a line, are
+   text that could be split into lines. They are checked without being
+   split */
+ITL_DEF bool
+itl_history_is_text(const char *data, const char *end)
+{
+  if (!itl_utf8_validate(data, (size_t) (end - data))) {
+    return false;
+  }
+#if defined ITL_AVX2
+  if (ITL_CPU_HAS_AVX2()) {
+    return itl_history_is_text_avx2(data, end);
+  }
+#endif /* ITL_AVX2 */
+#if defined ITL_SSE2
+  return itl_history_is_text_sse2(data, end);
+#else  /* ITL_SSE2 */
+  return itl_history_is_text_scalar(data, end);
+#endif /* ITL_SSE2 */
+}
+
+/* Returns start of the oldest line that would be kept after appending lines
+   between `data` and `end`, going back from the end. This way lines that
+   would be dropped by limits are never read, and loading takes as long as
+   the limits allow, not as the file */
+ITL_DEF const char *
+itl_history_find_tail(const char *data, const char *end)
+{
+  const char *line, *newer = NULL;
+  size_t size, newer_size = 0, count = 0, bytes = 0;
+
+  /* Which copies are erased is only known after reading all of them, and so
+     are bytes that lines take in compact mode. Lines that are dropped are
+     read to be spilled to the archive */
+  if (itl_g_history_erase_duplicates ||
+      (itl_g_history_is_compact && itl_g_history_max_bytes > 0) ||
+      (itl_g_history_archive.is_open && !itl_g_history_archive.is_paused))
+  {
+    return data;
+  }
+
+  while (end > data) {
+    line = end - 1;
+    while (line > data && line[-1] != '\n') {
+      line -= 1;
+    }
+    size = itl_history_line_size(line, (size_t) (end - 1 - line));
+
+    /* Lines that are too big are not appended, and copies that follow each
+       other are appended once */
+    if ((itl_g_history_max_bytes == 0 || size <= itl_g_history_max_bytes) &&
+        (newer == NULL || size != newer_size ||
+         memcmp(line, newer, size) != 0))
+    {
+      if (count == itl_g_history_max_entries ||
+          (itl_g_history_max_bytes > 0 &&
+           bytes + size > itl_g_history_max_bytes))
+      {
+        break;
+      }
+      count += 1;
+      bytes += size;
+      newer = line;
+      newer_size = size;
+    }
+
+    end = line;
+  }
+
+  return end;
+}
+
+#if defined ITL_HISTORY_THREADS
+/* Big files are split into chunks of about this size, which are parsed on
+   threads */
+#define ITL_HISTORY_CHUNK_SIZE (1024 * 1024)
+/* Lines of a chunk that are parsed on a thread at most. The rest is parsed
+   when lines are appended */
+#define ITL_HISTORY_CHUNK_LINES (ITL_HISTORY_CHUNK_SIZE / 16)
+
+/* Set from TL_HISTORY_THREADS, files are parsed on one thread if 1 */
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_history_threads = TL_HISTORY_THREADS;
+
+typedef struct itl_history_chunk itl_history_chunk_t;
+
+struct itl_history_chunk
+{
+  const char *data; /* Starts at a line */
+  const char *end;  /* Ends after a newline */
+  itl_history_scan_t scan;
+  bool is_text;
+  bool is_hashed; /* Whether duplicates are erased, which is thread-local */
+  bool is_started;
+  ITL_THREAD thread;
+};
+
+/* Hashes lines that were split if duplicates are erased */
+ITL_DEF void
+itl_history_chunk_hash(itl_history_chunk_t *chunk)
+{
+  itl_history_entry_t *entry;
+  size_t i;
+
+  if (!chunk->is_hashed) {
+    return;
+  }
+  for (i = 0; i < chunk->scan.line_count; ++i) {
+    entry = &chunk->scan.lines[i];
+    entry->hash =
+        itl_hash_bytes(ITL_HASH_INIT, chunk->data + entry->offset, entry->size);
+  }
+}
+
+ITL_DEF ITL_THREAD_FN(itl_history_chunk_parse)
+{
+  itl_history_chunk_t *chunk = (itl_history_chunk_t *) arg;
+
+  /* Chunks end at newlines, so they are checked the same way as files */
+  chunk->is_text =
+      itl_utf8_validate(chunk->data, (size_t) (chunk->end - chunk->data)) &&
+      itl_history_scan(&chunk->scan);
+  if (chunk->is_text) {
+    itl_history_chunk_hash(chunk);
+  }
+
+  return ITL_THREAD_RETURN;
+}
+
+ITL_DEF void
+itl_history_chunk_join(itl_history_chunk_t *chunk)
+{
+  if (chunk->is_started) {
+    ITL_THREAD_JOIN(chunk->thread);
+    chunk->is_started = false;
+  }
+}
+
+/* Appends lines between `data` and `end` like itl_history_load_from_bytes(),
+   while next chunks are parsed on threads. Returns false if it's not text,
+   in which case some lines may already be appended */
+ITL_DEF bool
+itl_history_load_in_chunks(const char *data, const char *end)
+{
+  itl_history_chunk_t *chunks, *chunk;
+  itl_history_entry_t *entry;
+  itl_string_t view;
+  const char *next = data, *newline;
+  size_t i, first = 0, started = 0;
+  bool is_text = true;
+
+  /* Every thread has the next chunk to parse while lines are appended */
+  const size_t chunk_count = itl_g_history_threads * 2;
+
+  chunks = (itl_history_chunk_t *) itl_malloc(chunk_count *
+                                              sizeof(itl_history_chunk_t));
+  for (i = 0; i < chunk_count; ++i) {
+    chunks[i].scan.lines = (itl_history_entry_t *) itl_malloc(
+        ITL_HISTORY_CHUNK_LINES * sizeof(itl_history_entry_t));
+    chunks[i].is_started = false;
+  }
+
+  for (;;) {
+    for (; started < chunk_count && next < end; ++started) {
+      chunk = &chunks[(first + started) % chunk_count];
+      chunk->data = next;
+      chunk->end = end;
+      if ((size_t) (end - next) > ITL_HISTORY_CHUNK_SIZE) {
+        newline = (const char *) memchr(next + ITL_HISTORY_CHUNK_SIZE, '\n',
+                                        (size_t) (end - next) -
+                                            ITL_HISTORY_CHUNK_SIZE);
+        chunk->end = newline + 1;
+      }
+      chunk->is_hashed = itl_g_history_erase_duplicates;
+      itl_history_scan_init(&chunk->scan, chunk->data, chunk->end,
+                            chunk->scan.lines, ITL_HISTORY_CHUNK_LINES);
+      next = chunk->end;
+
+      chunk->is_started =
+          ITL_THREAD_START(&chunk->thread, itl_history_chunk_parse, chunk);
+      if (!chunk->is_started) {
+        itl_history_chunk_parse(chunk);
+      }
+    }
+    if (started == 0) {
+      break;
+    }
+
+    /* Lines are appended in order of chunks */
+    chunk = &chunks[first];
+    itl_history_chunk_join(chunk);
+    first = (first + 1) % chunk_count;
+    started -= 1;
+
+    while (chunk->is_text) {
+      for (i = 0; i < chunk->scan.line_count; ++i) {
+        entry = &chunk->scan.lines[i];
+        itl_string_view(&view, chunk->data + entry->offset, entry->size,
+                        entry->length);
+        itl_g_history_append_hashed(&view, entry->hash);
+      }
+      if (chunk->scan.line == chunk->end) {
+        break;
+      }
+      chunk->is_text = itl_history_scan(&chunk->scan);
+      itl_history_chunk_hash(chunk);
+    }
+    if (!chunk->is_text) {
+      is_text = false;
+      break;
+    }
+  }
+
+  for (i = 0; i < chunk_count; ++i) {
+    itl_history_chunk_join(&chunks[i]);
+    ITL_FREE(chunks[i].scan.lines);
+  }
+  ITL_FREE(chunks);
+
+  return is_text;
+}
+#endif /* ITL_HISTORY_THREADS */
+
+/* Appends lines of a history file which is read or mapped whole. Each line
+   is copied once, straight into the arena. A line that is not finished by a
+   newline is not appended. Returns TL_SUCCESS, or TL_ERROR with errno set to
+   EINVAL if the file is not text */
+ITL_DEF TL_STATUS_CODE
+itl_history_load_from_bytes(const char *data, size_t size)
+{
+  itl_history_entry_t lines[ITL_HISTORY_SCAN_LINES], *entry;
+  itl_history_scan_t scan;
+  const char *end, *tail;
+  size_t i;
+  itl_string_t view;
+
+  end = data + size;
+  while (end > data && end[-1] != '\n') {
+    end -= 1;
+  }
+
+  /* Lines that would be dropped are not split, but they should be text too */
+  tail = itl_history_find_tail(data, end);
+  if (!itl_history_is_text(data, tail)) {
+    goto not_text;
+  }
+  data = tail;
+  size = (size_t) (end - data);
+
+  /* Text of lines that are kept takes no more than that, and much less in
+     compact mode */
+  if (!itl_g_history_is_compact) {
+    itl_g_history_reserve((itl_g_history_max_bytes > 0)
+                              ? ITL_MIN(size, itl_g_history_max_bytes)
+                              : size);
+  }
+
+#if defined ITL_HISTORY_THREADS
+  /* Lines are checked and split on threads while they are appended */
+  if (itl_g_history_threads > 1 && size > 2 * ITL_HISTORY_CHUNK_SIZE) {
+    if (!itl_history_load_in_chunks(data, end)) {
+      goto not_text;
+    }
+    return TL_SUCCESS;
+  }
+#endif /* ITL_HISTORY_THREADS */
+
+  /* Newlines can't be a part of other characters, so the whole file is
+     validated at once. Loaded a binary file on accident? */
+  if (!itl_utf8_validate(data, size)) {
+    goto not_text;
+  }
+
+  itl_history_scan_init(&scan, data, end, lines, ITL_HISTORY_SCAN_LINES);
+  while (scan.line < end) {
+    if (!itl_history_scan(&scan)) {
+      goto not_text;
+    }
+    for (i = 0; i < scan.line_count; ++i) {
+      entry = &lines[i];
+      itl_string_view(&view, data + entry->offset, entry->size,
+                      entry->length);
+      itl_g_history_append(&view);
+    }
+  }
+
+  return TL_SUCCESS;
+
+not_text:
+  ITL_TRACELN("history file is not UTF-8 text\n");
+  errno = EINVAL;
+  return TL_ERROR;
+}
+
+/* Returns TL_SUCCESS, -EINVAL on invalid file, or -errno on other errors */
+ITL_DEF TL_STATUS_CODE
+itl_history_load_from_file(const char *path)
+{
+  ITL_FILE file;
+  char *data = NULL;
+  size_t size = 0;
+  TL_STATUS_CODE ret = TL_SUCCESS;
+
+#if defined ITL_MMAP
+  struct stat file_stat;
+#else  /* ITL_MMAP */
+  size_t capacity = 0, read_amount;
+#endif /* ITL_MMAP */
+
+  itl_g_history_free();
+  itl_g_history_file_is_bad = false;
+
+  file = ITL_FILE_OPEN_FOR_READ(path);
+  if (ITL_FILE_IS_BAD(file)) {
+    ITL_TRACELN("could not open history file for load (%s): %s\n", path,
+                strerror(errno));
+    /* Do not mark file as bad if it does not exist. `dump_to_file` will
+       create it. */
+    if (errno != ENOENT) {
+      itl_g_history_file_is_bad = true;
+    }
+    return TL_ERROR;
+  }
+
+#if defined ITL_MMAP
+  /* Lines are split right in the page cache, so that loading takes as long
+     as faulting pages in */
+  if (fstat(file, &file_stat) != 0) {
+    ITL_HISTORY_FILE_EXPLOSION();
+  }
+  size = (size_t) file_stat.st_size;
+  if (size > 0) {
+    data = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED) {
+      data = NULL;
+      ITL_HISTORY_FILE_EXPLOSION();
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+#else /* ITL_MMAP */
+  /* Otherwise read the whole file */
+  do {
+    if (size == capacity) {
+      capacity = ITL_MAX(capacity * 2, ITL_HISTORY_FILE_BUFFER_SIZE);
+      data = (char *) itl_realloc(data, capacity);
+    }
+#if defined TL_USE_STDIO
+    read_amount = fread(data + size, 1, capacity - size, file);
+    if (read_amount == 0 && ferror(file)) {
+      ITL_HISTORY_FILE_EXPLOSION();
+    }
+#else  /* TL_USE_STDIO */
+    {
+      int result = (int) ITL_READ(file, data + size,
+                                  ITL_MIN(capacity - size, (size_t) 1 << 30));
+      if (result < 0) {
+        ITL_HISTORY_FILE_EXPLOSION();
+      }
+      read_amount = (size_t) result;
+    }
+#endif /* TL_USE_STDIO */
+    size += read_amount;
+  } while (read_amount > 0);
+#endif /* ITL_MMAP */
+
+  ret = itl_history_load_from_bytes(data, size);
+  if (ret != TL_SUCCESS) {
+    ITL_HISTORY_FILE_EXPLOSION();
+  }
+  itl_g_history_file.size = size;
+
+end:
+  if (data != NULL) {
+#if defined ITL_MMAP
+    munmap(data, size);
+#else  /* ITL_MMAP */
+    ITL_FREE(data);
+#endif /* ITL_MMAP */
+  }
+  ITL_FILE_CLOSE(file);
+
+  return ret;
+}
+
+/* Writes lines that are kept to `file` in big blocks, and counts bytes
+   into `size`. Returns false on errors */
+ITL_DEF bool
+itl_history_write_lines(ITL_FILE file, size_t *size)
+{
+  const itl_history_entry_t *entry;
+  itl_char_buf_t block;
+  size_t n;
+  bool is_written = true;
+
+  *size = 0;
+  itl_char_buf_init(&block);
+
+  for (n = itl_g_history.first;
+       n < itl_g_history.first + itl_g_history.length; ++n)
+  {
+    entry = ITL_HISTORY_AT(n);
+    if (entry->length > 1 && entry->length != ITL_HISTORY_ERASED) {
+      itl_char_buf_append_bytes(&block, ITL_HISTORY_TEXT(entry), entry->size);
+      itl_char_buf_append_byte(&block, '\n');
+    }
+
+    if (block.size >= ITL_HISTORY_FILE_BUFFER_SIZE ||
+        (n == ITL_HISTORY_LAST() && block.size > 0))
+    {
+      if (ITL_WRITE(file, block.data, block.size) == -1) {
+        is_written = false;
+        break;
+      }
+      *size += block.size;
+      ITL_CHAR_BUF_CLEAR(&block);
+    }
+  }
+
+  ITL_FREE(block.data);
+
+  return is_written;
+}
+
+/* Returns TL_SUCCESS, -EINVAL on invalid file, or -errno on other errors */
+ITL_DEF TL_STATUS_CODE
+itl_history_dump_to_file(const char *path)
+{
+  ITL_FILE file;
+  size_t size;
+  TL_STATUS_CODE ret = TL_SUCCESS;
+
+  TL_ASSERT(itl_g_is_active && "Dump history before calling tl_exit()!");
+
+  if (itl_g_history_file_is_bad) {
+    errno = EINVAL;
+    return TL_ERROR;
+  }
+
+  file = ITL_FILE_OPEN_FOR_WRITE(path);
+  if (ITL_FILE_IS_BAD(file)) {
+    ITL_TRACELN("could not open history file for dump (%s): %s\n", path,
+                strerror(errno));
+    return TL_ERROR;
+  }
+
+  if (!itl_history_write_lines(file, &size)) {
+    ret = TL_ERROR;
+  }
+
+  ITL_FILE_CLOSE(file);
+
+  return ret;
+}
+
+ITL_DEF void
+itl_history_file_close(void)
+{
+  itl_history_file_t *f = &itl_g_history_file;
+
+  if (f->is_open) {
+    if (itl_g_history_sync_lines > 0 && f->unsynced > 0) {
+      ITL_FILE_SYNC(f->file);
+    }
+    ITL_FILE_CLOSE(f->file);
+  }
+  if (f->path.data != NULL) {
+    ITL_FREE(f->path.data);
+    ITL_FREE(f->temp_path.data);
+    ITL_FREE(f->line.data);
+  }
+  memset(f, 0, sizeof(*f));
+}
+
+/* Rewrites the file with lines that are kept. They are written to another
+   file first, which then replaces it, so that it is never left half written
+   if the process dies */
+ITL_DEF TL_STATUS_CODE
+itl_history_file_compact(void)
+{
+  itl_history_file_t *f = &itl_g_history_file;
+  ITL_FILE temp;
+  size_t size;
+  bool is_written;
+
+  temp = ITL_FILE_OPEN_FOR_WRITE(f->temp_path.data);
+  if (ITL_FILE_IS_BAD(temp)) {
+    return TL_ERROR;
+  }
+  is_written = itl_history_write_lines(temp, &size) &&
+               (itl_g_history_sync_lines == 0 || ITL_FILE_SYNC(temp) == 0);
+  ITL_FILE_CLOSE(temp);
+  if (!is_written) {
+    return TL_ERROR;
+  }
+
+  /* Files that are open can't be replaced on Windows */
+  ITL_FILE_CLOSE(f->file);
+  if (ITL_FILE_REPLACE(f->temp_path.data, f->path.data) == 0) {
+    f->size = size;
+    f->kept_size = size;
+    f->unsynced = 0;
+  }
+
+  f->file = ITL_FILE_OPEN_FOR_APPEND(f->path.data);
+  if (ITL_FILE_IS_BAD(f->file)) {
+    ITL_TRACELN("could not reopen history file (%s): %s\n", f->path.data,
+                strerror(errno));
+    f->is_open = false;
+    itl_history_file_close();
+    return TL_ERROR;
+  }
+
+  return TL_SUCCESS;
+}
+
+/* Returns N of bytes that lines which are kept would take in the file. In
+   compact mode, their text in memory is smaller or bigger than that */
+ITL_DEF size_t
+itl_history_file_kept_size(void)
+{
+  const itl_history_entry_t *entry;
+  size_t n, size = 0;
+
+  for (n = itl_g_history.first;
+       n < itl_g_history.first + itl_g_history.length; ++n)
+  {
+    entry = ITL_HISTORY_AT(n);
+    if (entry->length > 1 && entry->length != ITL_HISTORY_ERASED) {
+      size += entry->size + 1;
+    }
+  }
+
+  return size;
+}
+
+/* Compacts the file once dropped lines take more of it than kept ones. Kept
+   lines are counted again only when the file has grown to twice their size
+   since the last count, so that appending a line takes constant time on
+   average */
+ITL_DEF void
+itl_history_file_compact_if_needed(void)
+{
+  itl_history_file_t *f = &itl_g_history_file;
+
+  if (f->size <= ITL_HISTORY_COMPACT_MIN_SIZE || f->size <= f->kept_size * 2) {
+    return;
+  }
+
+  f->kept_size = itl_history_file_kept_size();
+  if (f->size > f->kept_size * 2) {
+    itl_history_file_compact();
+  }
+}
+
+/* Appends an entered line to the file in one write */
+ITL_DEF void
+itl_history_file_append(const itl_string_t *line)
+{
+  itl_history_file_t *f = &itl_g_history_file;
+
+  /* Same lines as dumped ones */
+  if (!f->is_open || line->length <= 1) {
+    return;
+  }
+
+  ITL_CHAR_BUF_CLEAR(&f->line);
+  itl_char_buf_append_string_bytes(&f->line, line, 0, line->size);
+  itl_char_buf_append_byte(&f->line, '\n');
+  if (ITL_WRITE(f->file, f->line.data, f->line.size) == -1) {
+    ITL_TRACELN("could not append to history file (%s): %s\n", f->path.data,
+                strerror(errno));
+    return;
+  }
+  f->size += f->line.size;
+
+  f->unsynced += 1;
+  if (itl_g_history_sync_lines > 0 &&
+      f->unsynced >= itl_g_history_sync_lines)
+  {
+    ITL_FILE_SYNC(f->file);
+    f->unsynced = 0;
+  }
+
+  itl_history_file_compact_if_needed();
+}
+
+/* Loads history from the file at `path`, and keeps it open to append
+   entered lines to */
+ITL_DEF TL_STATUS_CODE
+itl_history_file_open(const char *path)
+{
+  itl_history_file_t *f = &itl_g_history_file;
+  size_t spilled_count = itl_g_history_archive.spilled_count;
+
+  itl_history_file_close();
+
+  if (itl_history_load_from_file(path) != TL_SUCCESS &&
+      itl_g_history_file_is_bad)
+  {
+    return TL_ERROR;
+  }
+
+  f->file = ITL_FILE_OPEN_FOR_APPEND(path);
+  if (ITL_FILE_IS_BAD(f->file)) {
+    ITL_TRACELN("could not open history file for append (%s): %s\n", path,
+                strerror(errno));
+    return TL_ERROR;
+  }
+  f->is_open = true;
+
+  itl_char_buf_init(&f->path);
+  itl_char_buf_init(&f->temp_path);
+  itl_char_buf_init(&f->line);
+  itl_char_buf_append_cstr(&f->path, path);
+  itl_char_buf_append_byte(&f->path, '\0');
+  itl_char_buf_append_cstr(&f->temp_path, path);
+  itl_char_buf_append_cstr(&f->temp_path, ".tmp");
+  itl_char_buf_append_byte(&f->temp_path, '\0');
+
+  /* Lines that didn't fit were spilled to the archive, and are left only
+     there, so that they are not spilled again next time */
+  if (itl_g_history_archive.spilled_count != spilled_count) {
+    itl_history_file_compact();
+  } else {
+    itl_history_file_compact_if_needed();
+  }
+
+  return TL_SUCCESS;
+}
+
+ITL_DEF TL_STATUS_CODE
+itl_history_archive_open(const char *path)
+{
+  itl_history_archive_t *a = &itl_g_history_archive;
+
+  itl_history_archive_close();
+
+  a->file = ITL_FILE_OPEN_FOR_APPEND(path);
+  if (ITL_FILE_IS_BAD(a->file)) {
+    ITL_TRACELN("could not open history archive for append (%s): %s\n", path,
+                strerror(errno));
+    return TL_ERROR;
+  }
+  a->read_file = ITL_FILE_OPEN_FOR_READ(path);
+  if (ITL_FILE_IS_BAD(a->read_file)) {
+    ITL_TRACELN("could not open history archive for read (%s): %s\n", path,
+                strerror(errno));
+    ITL_FILE_CLOSE(a->file);
+    return TL_ERROR;
+  }
+  a->is_open = true;
+
+  itl_char_buf_init(&a->lines);
+
+  return TL_SUCCESS;
+}
+
+/* Returns the first occurrence of `needle` in `haystack`, or NULL */
+ITL_DEF const char *
+itl_memmem(const char *haystack, size_t haystack_size, const char *needle,
+           size_t needle_size)
+{
+#if defined ITL_MEMMEM
+  return (const char *) memmem(haystack, haystack_size, needle, needle_size);
+#else  /* ITL_MEMMEM */
+  size_t offset = itl_find_bytes(haystack, haystack_size, needle, needle_size);
+  return (offset < haystack_size || needle_size == 0) ? haystack + offset
+                                                      : NULL;
+#endif /* ITL_MEMMEM */
+}
+
+typedef struct itl_archived itl_archived_t;
+
+/* Lines of the archive that match a query. The archive is read in blocks
+   from the end, where the newest lines are, so that a search that is
+   satisfied early reads little of it */
+struct itl_archived
+{
+  itl_history_entry_t *lines; /* Newest first, offsets are into `text` */
+  size_t count;
+  size_t capacity;
+  itl_char_buf_t text;
+  itl_char_buf_t block; /* A newline, and bytes that were read after it */
+  size_t frontier;      /* Bytes from this offset on were searched */
+};
+
+ITL_DEF void
+itl_archived_free(itl_archived_t *a)
+{
+  if (a->text.data == NULL) {
+    return;
+  }
+
+  ITL_FREE(a->text.data);
+  ITL_FREE(a->block.data);
+  if (a->lines != NULL) {
+    ITL_FREE(a->lines);
+  }
+  memset(a, 0, sizeof(*a));
+}
+
+/* Forgets matches, so that they are searched from the end of the archive */
+ITL_DEF void
+itl_archived_reset(itl_archived_t *a)
+{
+  int64_t size;
+
+  a->count = 0;
+  a->frontier = 0;
+  if (!itl_g_history_archive.is_open) {
+    return;
+  }
+
+  if (a->text.data == NULL) {
+    itl_char_buf_init(&a->text);
+    itl_char_buf_init(&a->block);
+  }
+  ITL_CHAR_BUF_CLEAR(&a->text);
+
+  size = (int64_t) ITL_FILE_SIZE(itl_g_history_archive.read_file);
+  if (size > 0) {
+    a->frontier = (size_t) size;
+  }
+}
+
+/* Adds a line of `size` bytes, unless it's not text */
+ITL_DEF void
+itl_archived_add(itl_archived_t *a, const char *line, size_t size)
+{
+  itl_history_entry_t *entry;
+
+  size = itl_history_line_size(line, size);
+  if (!itl_utf8_validate(line, size)) {
+    return;
+  }
+
+  if (a->count == a->capacity) {
+    a->capacity = ITL_MAX(a->capacity * 2, 16);
+    a->lines = (itl_history_entry_t *) itl_realloc(
+        a->lines, a->capacity * sizeof(itl_history_entry_t));
+  }
+  entry = &a->lines[a->count];
+  entry->offset = a->text.size;
+  entry->size = size;
+  entry->length = itl_utf8_count(line, size);
+  entry->hash = 0;
+  a->count += 1;
+
+  itl_char_buf_append_bytes(&a->text, line, size);
+}
+
+/* Searches the block of whole lines before the frontier, and adds lines
+   that contain `query`, or start with it if `is_prefix`. Returns false if
+   the whole archive was searched */
+ITL_DEF bool
+itl_archived_fill(itl_archived_t *a, const char *query, size_t size,
+                  bool is_prefix)
+{
+  size_t block_size = ITL_HISTORY_FILE_BUFFER_SIZE, start, first, i;
+  int64_t read_amount;
+  const char *data, *end, *found, *line, *line_end;
+  itl_history_entry_t entry;
+
+  if (a->frontier == 0) {
+    return false;
+  }
+
+  /* The block grows until it has a whole line */
+  for (;;) {
+    start = (a->frontier > block_size) ? a->frontier - block_size : 0;
+    while (a->block.capacity < a->frontier - start + 1) {
+      itl_char_buf_extend(&a->block);
+    }
+    read_amount =
+        (int64_t) ITL_FILE_READ_AT(itl_g_history_archive.read_file,
+                                   a->block.data + 1, a->frontier - start,
+                                   start);
+    if (read_amount != (int64_t) (a->frontier - start)) {
+      ITL_TRACELN("could not read history archive: %s\n", strerror(errno));
+      a->frontier = 0;
+      return false;
+    }
+
+    /* Every line is after a newline, even the first one */
+    a->block.data[0] = '\n';
+    data = a->block.data + 1;
+    end = data + (a->frontier - start);
+    if (start == 0) {
+      break;
+    }
+
+    /* A line that starts before the block is left for the next one */
+    found = (const char *) memchr(data, '\n', (size_t) (end - data) - 1);
+    if (found != NULL) {
+      data = found + 1;
+      break;
+    }
+    block_size *= 2;
+  }
+  a->frontier = start + (size_t) (data - (a->block.data + 1));
+
+  first = a->count;
+  while (data < end) {
+    found = itl_memmem(data, (size_t) (end - data), query, size);
+    if (found == NULL) {
+      break;
+    }
+
+    line = found;
+    while (line[-1] != '\n') {
+      line -= 1;
+    }
+    line_end = (const char *) memchr(found, '\n', (size_t) (end - found));
+    if (line_end == NULL) {
+      line_end = end;
+    }
+
+    if (!is_prefix || line == found) {
+      itl_archived_add(a, line, (size_t) (line_end - line));
+    }
+    if (line_end == end) {
+      break;
+    }
+    data = line_end + 1;
+  }
+
+  /* Lines of the block were added oldest first */
+  for (i = 0; i < (a->count - first) / 2; ++i) {
+    entry = a->lines[first + i];
+    a->lines[first + i] = a->lines[a->count - 1 - i];
+    a->lines[a->count - 1 - i] = entry;
+  }
+
+  return true;
+}
+
+#if defined ITL_SHARED_HISTORY
+/* Shared history is a ring of slots in a file that every process maps. A
+   process reserves slots for a line by adding to the head, writes the line
+   into them, and then stamps them with their numbers. Other processes read
+   slots up to the head from where they stopped, and skip lines that were
+   overwritten while they were being read, like a seqlock. */
+
+#define ITL_SHARED_MAGIC      0x31676e6972746cULL /* "tlring1" */
+#define ITL_SHARED_SLOT_COUNT 8192                /* Must be a power of 2 */
+#define ITL_SHARED_SLOT_DATA  112
+
+/* Stamp of a slot that is being written */
+#define ITL_SHARED_BUSY UINT64_MAX
+/* Size of slots that continue a line */
+#define ITL_SHARED_CONTINUATION UINT32_MAX
+
+typedef struct itl_shared_slot itl_shared_slot_t;
+
+struct itl_shared_slot
+{
+  uint64_t stamp;   /* Number of the slot + 1, 0 if it's empty, or busy */
+  uint32_t session; /* Who wrote it */
+  uint32_t size;    /* N of bytes of the line, or continuation */
+  char data[ITL_SHARED_SLOT_DATA];
+};
+
+typedef struct itl_shared_header itl_shared_header_t;
+
+struct itl_shared_header
+{
+  uint64_t magic;
+  uint64_t head; /* Number of the next slot to reserve */
+  char padding[48];
+};
+
+typedef struct itl_shared itl_shared_t;
+
+struct itl_shared
+{
+  bool is_active;
+  itl_shared_header_t *header;
+  itl_shared_slot_t *slots;
+  uint64_t tail;     /* Number of the next slot to read */
+  uint64_t stuck_at; /* Slot that was not written yet on the last read */
+  uint32_t session;
+  itl_char_buf_t line;
+};
+
+ITL_DEF ITL_THREAD_LOCAL itl_shared_t itl_g_shared = ITL_ZERO_INIT;
+
+#define ITL_SHARED_FILE_SIZE                                                   \
+  (sizeof(itl_shared_header_t) +                                               \
+   ITL_SHARED_SLOT_COUNT * sizeof(itl_shared_slot_t))
+
+#define ITL_SHARED_SLOT(n)                                                     \
+  (&itl_g_shared.slots[(n) & (ITL_SHARED_SLOT_COUNT - 1)])
+
+/* N of slots taken by a line of `size` bytes */
+#define ITL_SHARED_SLOTS_FOR(size)                                             \
+  (ITL_MAX(((size) + ITL_SHARED_SLOT_DATA - 1) / ITL_SHARED_SLOT_DATA, 1))
+
+ITL_DEF void
+itl_shared_close(void)
+{
+  if (!itl_g_shared.is_active) {
+    return;
+  }
+
+  munmap(itl_g_shared.header, ITL_SHARED_FILE_SIZE);
+  ITL_FREE(itl_g_shared.line.data);
+  memset(&itl_g_shared, 0, sizeof(itl_g_shared));
+}
+
+/* Whether slots of the line at `n`, which take `count` slots, still have
+   their stamps */
+ITL_DEF bool
+itl_shared_line_is_intact(uint64_t n, size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; ++i) {
+    if (__atomic_load_n(&ITL_SHARED_SLOT(n + i)->stamp, __ATOMIC_RELAXED) !=
+        n + i + 1)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Puts an entered line into the ring */
+ITL_DEF void
+itl_shared_append(const itl_string_t *line)
+{
+  itl_shared_t *sh = &itl_g_shared;
+  itl_shared_slot_t *slot;
+  size_t i, count, offset;
+  uint64_t n;
+
+  /* Same lines as dumped ones */
+  if (!sh->is_active || line->length <= 1) {
+    return;
+  }
+
+  count = ITL_SHARED_SLOTS_FOR(line->size);
+  if (count > ITL_SHARED_SLOT_COUNT / 4) {
+    return;
+  }
+
+  n = __atomic_fetch_add(&sh->header->head, (uint64_t) count,
+                         __ATOMIC_RELAXED);
+
+  /* Readers that are in the middle of these slots will see them changed */
+  for (i = 0; i < count; ++i) {
+    __atomic_store_n(&ITL_SHARED_SLOT(n + i)->stamp, ITL_SHARED_BUSY,
+                     __ATOMIC_RELAXED);
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  for (i = 0, offset = 0; i < count; ++i, offset += ITL_SHARED_SLOT_DATA) {
+    slot = ITL_SHARED_SLOT(n + i);
+    slot->session = sh->session;
+    slot->size = (i == 0) ? (uint32_t) line->size : ITL_SHARED_CONTINUATION;
+    itl_string_copy_bytes(line, offset,
+                          ITL_MIN(offset + ITL_SHARED_SLOT_DATA, line->size),
+                          slot->data);
+  }
+
+  for (i = 0; i < count; ++i) {
+    __atomic_store_n(&ITL_SHARED_SLOT(n + i)->stamp, n + i + 1,
+                     __ATOMIC_RELEASE);
+  }
+}
+
+/* Appends lines that other processes put into the ring since the last call.
+   Lines that were overwritten before they were read are lost */
+ITL_DEF void
+itl_shared_pick_up(void)
+{
+  itl_shared_t *sh = &itl_g_shared;
+  itl_shared_slot_t *slot;
+  itl_string_t view;
+  uint64_t head, stamp;
+  size_t i, count, size, offset;
+  uint32_t session;
+
+  head = __atomic_load_n(&sh->header->head, __ATOMIC_ACQUIRE);
+  if (head - sh->tail > ITL_SHARED_SLOT_COUNT) {
+    sh->tail = head - ITL_SHARED_SLOT_COUNT;
+  }
+
+  while (sh->tail < head) {
+    slot = ITL_SHARED_SLOT(sh->tail);
+    stamp = __atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE);
+
+    /* A line that is still being written is waited for once, in case the
+       process that writes it died */
+    if (stamp == ITL_SHARED_BUSY || stamp < sh->tail + 1) {
+      if (sh->stuck_at != sh->tail + 1) {
+        sh->stuck_at = sh->tail + 1;
+        break;
+      }
+      sh->tail += 1;
+      continue;
+    }
+    /* Overwritten, or the middle of a line */
+    if (stamp > sh->tail + 1 || slot->size == ITL_SHARED_CONTINUATION) {
+      sh->tail += 1;
+      continue;
+    }
+
+    size = slot->size;
+    session = slot->session;
+    count = ITL_SHARED_SLOTS_FOR(size);
+    if (count > ITL_SHARED_SLOT_COUNT / 4 || sh->tail + count > head) {
+      sh->tail += 1;
+      continue;
+    }
+
+    ITL_CHAR_BUF_CLEAR(&sh->line);
+    for (i = 0, offset = 0; i < count; ++i, offset += ITL_SHARED_SLOT_DATA) {
+      itl_char_buf_append_bytes(&sh->line, ITL_SHARED_SLOT(sh->tail + i)->data,
+                                ITL_MIN(size - offset, ITL_SHARED_SLOT_DATA));
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (!itl_shared_line_is_intact(sh->tail, count)) {
+      sh->tail += 1;
+      continue;
+    }
+    sh->tail += count;
+
+    /* Lines of this process are already there */
+    if (session != sh->session &&
+        itl_utf8_validate(sh->line.data, sh->line.size))
+    {
+      itl_string_view(&view, sh->line.data, sh->line.size,
+                      itl_utf8_count(sh->line.data, sh->line.size));
+      itl_g_history_append(&view);
+    }
+  }
+}
+
+/* Maps the ring at `path`, creating it if needed, and appends lines that
+   are in it */
+ITL_DEF TL_STATUS_CODE
+itl_shared_open(const char *path)
+{
+  itl_shared_t *sh = &itl_g_shared;
+  struct stat file_stat;
+  uint64_t magic = 0;
+  void *data;
+  int file;
+
+  itl_shared_close();
+
+  file = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (file < 0) {
+    return TL_ERROR;
+  }
+
+  /* Processes that create it at the same time extend it to the same size */
+  if (fstat(file, &file_stat) != 0 ||
+      (file_stat.st_size == 0 &&
+       ftruncate(file, (off_t) ITL_SHARED_FILE_SIZE) != 0))
+  {
+    close(file);
+    return TL_ERROR;
+  }
+  if (file_stat.st_size != 0 &&
+      (size_t) file_stat.st_size != ITL_SHARED_FILE_SIZE)
+  {
+    close(file);
+    errno = EINVAL;
+    return TL_ERROR;
+  }
+
+  data = mmap(NULL, ITL_SHARED_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+              file, 0);
+  close(file);
+  if (data == MAP_FAILED) {
+    return TL_ERROR;
+  }
+
+  sh->header = (itl_shared_header_t *) data;
+  sh->slots = (itl_shared_slot_t *) (sh->header + 1);
+
+  /* A new file is zeroed, which is an empty ring */
+  if (!__atomic_compare_exchange_n(&sh->header->magic, &magic,
+                                   ITL_SHARED_MAGIC, false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE) &&
+      magic != ITL_SHARED_MAGIC)
+  {
+    munmap(data, ITL_SHARED_FILE_SIZE);
+    errno = EINVAL;
+    return TL_ERROR;
+  }
+
+  sh->is_active = true;
+  sh->tail = 0;
+  sh->stuck_at = 0;
+  sh->session = (uint32_t) getpid() * 2654435761u ^
+                (uint32_t) (uintptr_t) &itl_g_shared;
+  itl_char_buf_init(&sh->line);
+
+  itl_shared_pick_up();
+
+  return TL_SUCCESS;
+}
+#endif /* ITL_SHARED_HISTORY */
+
+ITL_DEF size_t
+itl_parse_size(const char *cstr, size_t *result)
+{
+  size_t i, number;
+
+  for (i = 0, number = 0; i < strlen(cstr); ++i) {
+    if (!isdigit(cstr[i])) {
+      break;
+    }
+    number *= 10;
+    number += (size_t) (cstr[i] - '0');
+  }
+
+  ITL_PTR_ASSIGN(result, number);
+
+  return i;
+}
+
+/* Escape sequence decoder. It is a state machine driven by the transition
+   table below, which takes one byte at a time and never blocks. That way
+   incomplete sequences, like a lone Esc press, can be flushed after a
+   timeout, and unknown sequences are skipped as a whole. */
+
+#define ITL_DECODER_MAX_PARAMS 4
+#define ITL_DECODER_MAX_PARAM  9999
+#define ITL_DECODER_MAX_EVENTS 4
+
+/* Max amount of bytes of a paste which are kept */
+#define ITL_PASTE_MAX_SIZE (ITL_STRING_MAX_LEN * 4)
+
+#define ITL_PASTE_END     "\x1b[201~"
+#define ITL_PASTE_END_LEN 6
+
+/* Internal key which is decoded from a response to `ITL_TTY_STATUS_REPORT` */
+#define ITL_KEY_CURSOR_REPORT TL_MASK_KEY
+
+#if !defined TL_ESC_TIMEOUT
+#define TL_ESC_TIMEOUT 100
+#endif /* !TL_ESC_TIMEOUT */
+
+typedef enum
+{
+  ITL_DECODER_GROUND = 0,
+  ITL_DECODER_UTF8,
+  ITL_DECODER_ESC,
+  ITL_DECODER_CSI,
+  ITL_DECODER_SS3,
+  ITL_DECODER_IGNORE, /* Unknown sequence, skipped up to its final byte */
+  ITL_DECODER_PASTE,
+  ITL_DECODER_WIN32, /* After 0 or 224 from `_getch()` */
+  ITL_DECODER_STATE_COUNT
+} ITL_DECODER_STATE;
+
+typedef enum
+{
+  ITL_BYTE_CONTROL = 0, /* C0 controls and DEL */
+  ITL_BYTE_ESC,
+  ITL_BYTE_DIGIT,
+  ITL_BYTE_SEMICOLON,
+  ITL_BYTE_PRIVATE,      /* One of ":<=>?" */
+  ITL_BYTE_INTERMEDIATE, /* Space to '/' */
+  ITL_BYTE_CSI,          /* '[' */
+  ITL_BYTE_SS3,          /* 'O' */
+  ITL_BYTE_FINAL,        /* Other bytes up to '~' */
+  ITL_BYTE_UTF8_LEAD,
+  ITL_BYTE_UTF8_CONT,
+  ITL_BYTE_INVALID,
+  ITL_BYTE_WIN32_PREFIX,
+  ITL_BYTE_CLASS_COUNT
+} ITL_BYTE_CLASS;
+
+typedef enum
+{
+  ITL_ACTION_NONE = 0,
+  ITL_ACTION_PRINT,      /* Emit an ASCII character */
+  ITL_ACTION_CONTROL,    /* Emit a control key */
+  ITL_ACTION_UTF8_LEAD,  /* Start a multibyte character */
+  ITL_ACTION_UTF8_CONT,  /* Continue a multibyte character */
+  ITL_ACTION_INVALID,    /* Emit a replacement character */
+  ITL_ACTION_CLEAR,      /* Start a new sequence */
+  ITL_ACTION_ALT,        /* Emit a key with Alt */
+  ITL_ACTION_PARAM,      /* Accumulate a digit of a parameter */
+  ITL_ACTION_NEXT_PARAM, /* Start next parameter */
+  ITL_ACTION_CSI_DISPATCH,
+  ITL_ACTION_SS3_DISPATCH,
+  ITL_ACTION_WIN32_DISPATCH,
+  ITL_ACTION_UNKNOWN, /* Emit unknown key */
+  ITL_ACTION_CANCEL,  /* Flush unfinished sequence, process byte again */
+  ITL_ACTION_PASTE    /* Accumulate a pasted byte */
+} ITL_DECODER_ACTION;
+
+typedef struct itl_transition itl_transition_t;
+
+struct itl_transition
+{
+  uint8_t state;
+  uint8_t action;
+};
+
+#define ITL_T(state, action)                                                   \
+  {                                                                            \
+    ITL_DECODER_##state, ITL_ACTION_##action                                   \
+  }
+
+/* clang-format off */
+ITL_DEF const itl_transition_t
+itl_decoder_transitions[ITL_DECODER_STATE_COUNT][ITL_BYTE_CLASS_COUNT] = {
+  /* CONTROL, ESC, DIGIT, SEMICOLON, PRIVATE, INTERMEDIATE, CSI, SS3, FINAL,
+     UTF8_LEAD, UTF8_CONT, INVALID, WIN32_PREFIX */
+  /* GROUND */ {
+    ITL_T(GROUND, CONTROL), ITL_T(ESC, CLEAR), ITL_T(GROUND, PRINT),
+    ITL_T(GROUND, PRINT), ITL_T(GROUND, PRINT), ITL_T(GROUND, PRINT),
+    ITL_T(GROUND, PRINT), ITL_T(GROUND, PRINT), ITL_T(GROUND, PRINT),
+    ITL_T(UTF8, UTF8_LEAD), ITL_T(GROUND, INVALID), ITL_T(GROUND, INVALID),
+    ITL_T(WIN32, NONE)
+  },
+  /* UTF8 */ {
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL),
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL),
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL),
+    ITL_T(GROUND, CANCEL), ITL_T(UTF8, UTF8_CONT), ITL_T(GROUND, CANCEL),
+    ITL_T(GROUND, CANCEL)
+  },
+  /* ESC */ {
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(GROUND, ALT),
+    ITL_T(GROUND, ALT), ITL_T(GROUND, ALT), ITL_T(GROUND, ALT),
+    ITL_T(CSI, NONE), ITL_T(SS3, NONE), ITL_T(GROUND, ALT),
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL),
+    ITL_T(GROUND, CANCEL)
+  },
+  /* CSI */ {
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(CSI, PARAM),
+    ITL_T(CSI, NEXT_PARAM), ITL_T(IGNORE, NONE), ITL_T(IGNORE, NONE),
+    ITL_T(IGNORE, NONE), ITL_T(GROUND, CSI_DISPATCH),
+    ITL_T(GROUND, CSI_DISPATCH), ITL_T(GROUND, CANCEL),
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL)
+  },
+  /* SS3 */ {
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(SS3, PARAM),
+    ITL_T(SS3, NEXT_PARAM), ITL_T(IGNORE, NONE), ITL_T(IGNORE, NONE),
+    ITL_T(GROUND, SS3_DISPATCH), ITL_T(GROUND, SS3_DISPATCH),
+    ITL_T(GROUND, SS3_DISPATCH), ITL_T(GROUND, CANCEL),
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL)
+  },
+  /* IGNORE */ {
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(IGNORE, NONE),
+    ITL_T(IGNORE, NONE), ITL_T(IGNORE, NONE), ITL_T(IGNORE, NONE),
+    ITL_T(GROUND, UNKNOWN), ITL_T(GROUND, UNKNOWN), ITL_T(GROUND, UNKNOWN),
+    ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL), ITL_T(GROUND, CANCEL),
+    ITL_T(GROUND, CANCEL)
+  },
+  /* PASTE */ {
+    ITL_T(PASTE, PASTE), ITL_T(PASTE, PASTE), ITL_T(PASTE, PASTE),
+    ITL_T(PASTE, PASTE), ITL_T(PASTE, PASTE), ITL_T(PASTE, PASTE),
+    ITL_T(PASTE, PASTE), ITL_T(PASTE, PASTE), ITL_T(PASTE, PASTE),
+    ITL_T(PASTE, PASTE), ITL_T(PASTE, PASTE), ITL_T(PASTE, PASTE),
+    ITL_T(PASTE, PASTE)
+  },
+  /* WIN32 */ {
+    ITL_T(GROUND, WIN32_DISPATCH), ITL_T(GROUND, WIN32_DISPATCH),
+    ITL_T(GROUND, WIN32_DISPATCH), ITL_T(GROUND, WIN32_DISPATCH),
+    ITL_T(GROUND, WIN32_DISPATCH), ITL_T(GROUND, WIN32_DISPATCH),
+    ITL_T(GROUND, WIN32_DISPATCH), ITL_T(GROUND, WIN32_DISPATCH),
+    ITL_T(GROUND, WIN32_DISPATCH), ITL_T(GROUND, WIN32_DISPATCH),
+    ITL_T(GROUND, WIN32_DISPATCH), ITL_T(GROUND, WIN32_DISPATCH),
+    ITL_T(GROUND, WIN32_DISPATCH)
+  }
+};
+
+/* Keys for plain control bytes, DEL is handled separately */
+ITL_DEF const int itl_decoder_control_keys[32] = {
+  TL_KEY_UNKN,             TL_KEY_HOME,        /* ctrl a */
+  TL_KEY_LEFT,             TL_KEY_INTERRUPT,   /* ctrl b, ctrl c */
+  TL_KEY_EOF,              TL_KEY_END,         /* ctrl d, ctrl e */
+  TL_KEY_RIGHT,            TL_KEY_UNKN,        /* ctrl f */
+  TL_KEY_BACKSPACE,        TL_KEY_TAB,         /* old backspace */
+  TL_KEY_ENTER,            TL_KEY_KILL_LINE,   /* lf, ctrl k */
+  TL_KEY_CLEAR,            TL_KEY_ENTER,       /* ctrl l, cr */
+  TL_KEY_DOWN,             TL_KEY_UNKN,        /* ctrl n */
+  TL_KEY_UP,               TL_KEY_UNKN,        /* ctrl p */
+  TL_KEY_SEARCH_BACKWARD,  TL_KEY_SEARCH_FORWARD, /* ctrl r, ctrl s */
+  TL_KEY_FUZZY_FIND,       TL_KEY_KILL_LINE_BEFORE, /* ctrl t, ctrl u */
+  TL_KEY_UNKN,             TL_KEY_BACKSPACE | TL_MOD_CTRL, /* ctrl w */
+  TL_KEY_UNKN,             TL_KEY_UNKN,
+  TL_KEY_SUSPEND,          TL_KEY_UNKN,        /* ctrl z, esc */
+  TL_KEY_UNKN,             TL_KEY_UNKN,
+  TL_KEY_UNKN,             TL_KEY_UNKN
+};
+/* clang-format on */
+
+typedef struct itl_final_key itl_final_key_t;
+
+struct itl_final_key
+{
+  uint8_t byte;
+  int key;
+};
+
+/* Final bytes of CSI and SS3 sequences, e.g ESC [ 1 ; 5 C */
+ITL_DEF const itl_final_key_t itl_decoder_final_keys[] = {
+    {'A', TL_KEY_UP  },
+    {'B', TL_KEY_DOWN},
+    {'C', TL_KEY_RIGHT},
+    {'D', TL_KEY_LEFT},
+    {'F', TL_KEY_END },
+    {'H', TL_KEY_HOME},
+    {'M', TL_KEY_ENTER}, /* keypad enter */
+    {'Z', TL_KEY_TAB | TL_MOD_SHIFT},
+};
+
+/* First parameters of sequences ending with a tilde, e.g ESC [ 3 ; 5 ~ */
+ITL_DEF const int itl_decoder_tilde_keys[] = {
+    TL_KEY_UNKN, TL_KEY_HOME, TL_KEY_UNKN, TL_KEY_DELETE, TL_KEY_END,
+    TL_KEY_UNKN, TL_KEY_UNKN, TL_KEY_HOME, TL_KEY_END,
+};
+
+/* Bytes after Esc, e.g Alt-b */
+ITL_DEF const itl_final_key_t itl_decoder_alt_keys[] = {
+    {'b', TL_KEY_LEFT | TL_MOD_CTRL     },
+    {'f', TL_KEY_RIGHT | TL_MOD_CTRL    },
+    {'d', TL_KEY_DELETE | TL_MOD_CTRL   },
+    {'h', TL_KEY_BACKSPACE | TL_MOD_CTRL},
+    {127, TL_KEY_BACKSPACE | TL_MOD_CTRL}, /* del */
+    {8,   TL_KEY_BACKSPACE | TL_MOD_CTRL}, /* old backspace */
+    {'.', TL_KEY_HISTORY_END            },
+    {'>', TL_KEY_HISTORY_END            },
+    {',', TL_KEY_HISTORY_BEGINNING      },
+    {'<', TL_KEY_HISTORY_BEGINNING      },
+};
+
+/* <https://learn.microsoft.com/en-us/previous-versions/visualstudio/visual-studio-6.0/aa299374(v=vs.60)>
+ */
+ITL_DEF const itl_final_key_t itl_decoder_win32_keys[] = {
+    {'H', TL_KEY_UP                  },
+    {'P', TL_KEY_DOWN                },
+    {'K', TL_KEY_LEFT                },
+    {'M', TL_KEY_RIGHT               },
+    {'s', TL_KEY_LEFT | TL_MOD_CTRL  },
+    {'t', TL_KEY_RIGHT | TL_MOD_CTRL },
+    {'G', TL_KEY_HOME                },
+    {'O', TL_KEY_END                 },
+    {147, TL_KEY_DELETE | TL_MOD_CTRL},
+    {'S', TL_KEY_DELETE              },
+};
+
+typedef struct itl_key itl_key_t;
+
+/* Decoded key, `ch` is set for `TL_KEY_CHAR` */
+struct itl_key
+{
+  int key;
+  itl_utf8_t ch;
+};
+
+typedef struct itl_decoder itl_decoder_t;
+
+struct itl_decoder
+{
+  ITL_DECODER_STATE state;
+
+  /* Parameters of the current sequence */
+  size_t params[ITL_DECODER_MAX_PARAMS];
+  size_t param_count;
+
+  /* Unfinished multibyte character */
+  itl_utf8_t ch;
+  uint8_t ch_width;
+
+  /* Text of the last bracketed paste, and how much of the terminator was
+     matched */
+  itl_char_buf_t paste;
+  size_t paste_matched;
+
+  /* Last response to `ITL_TTY_STATUS_REPORT` */
+  size_t report_rows;
+  size_t report_cols;
+
+  /* Decoded keys that were not consumed yet */
+  itl_key_t events[ITL_DECODER_MAX_EVENTS];
+  size_t event_start;
+  size_t event_count;
+};
+
+ITL_DEF ITL_THREAD_LOCAL itl_decoder_t itl_g_decoder = ITL_ZERO_INIT;
+
+/* Milliseconds to wait for the rest of a sequence, below 0 to wait forever */
+ITL_DEF ITL_THREAD_LOCAL int itl_g_esc_timeout = TL_ESC_TIMEOUT;
+
+ITL_DEF ITL_BYTE_CLASS
+itl_decoder_classify(uint8_t byte)
+{
+#if defined ITL_WIN32
+  if (byte == 0 || byte == 224) {
+    return ITL_BYTE_WIN32_PREFIX;
+  }
+#endif /* ITL_WIN32 */
+  if (byte == 0x1B) {
+    return ITL_BYTE_ESC;
+  } else if (byte < 0x20 || byte == 0x7F) {
+    return ITL_BYTE_CONTROL;
+  } else if (byte >= '0' && byte <= '9') {
+    return ITL_BYTE_DIGIT;
+  } else if (byte == ';') {
+    return ITL_BYTE_SEMICOLON;
+  } else if (byte == ':' || (byte >= '<' && byte <= '?')) {
+    return ITL_BYTE_PRIVATE;
+  } else if (byte < 0x30) {
+    return ITL_BYTE_INTERMEDIATE;
+  } else if (byte == '[') {
+    return ITL_BYTE_CSI;
+  } else if (byte == 'O') {
+    return ITL_BYTE_SS3;
+  } else if (byte < 0x80) {
+    return ITL_BYTE_FINAL;
+  } else if (byte < 0xC0) {
+    return ITL_BYTE_UTF8_CONT;
+  } else if (byte >= 0xC2 && byte <= 0xF4) {
+    return ITL_BYTE_UTF8_LEAD;
+  }
+  return ITL_BYTE_INVALID; /* overlong or out of range */
+}
+
+ITL_DEF void
+itl_decoder_emit(itl_decoder_t *d, int key, itl_utf8_t ch)
+{
+  itl_key_t *event;
+
+  TL_ASSERT(d->event_count < ITL_DECODER_MAX_EVENTS);
+
+  event = &d->events[(d->event_start + d->event_count) %
+                     ITL_DECODER_MAX_EVENTS];
+  event->key = key;
+  event->ch = ch;
+
+  d->event_count += 1;
+}
+
+#define ITL_DECODER_EMIT_KEY(d, key) itl_decoder_emit(d, key, itl_space)
+
+ITL_DEF bool
+itl_decoder_pop(itl_decoder_t *d, itl_key_t *key)
+{
+  if (d->event_count == 0) {
+    return false;
+  }
+
+  *key = d->events[d->event_start];
+  d->event_start = (d->event_start + 1) % ITL_DECODER_MAX_EVENTS;
+  d->event_count -= 1;
+
+  return true;
+}
+
+/* Whether a sequence was started, but not finished. Pastes are not counted,
+   since they should not be flushed. */
+#define ITL_DECODER_IS_WAITING(d)                                              \
+  ((d)->state != ITL_DECODER_GROUND && (d)->state != ITL_DECODER_PASTE)
+
+ITL_DEF int
+itl_decoder_find_key(const itl_final_key_t *keys, size_t key_count,
+                     uint8_t byte)
+{
+  size_t i;
+  for (i = 0; i < key_count; ++i) {
+    if (keys[i].byte == byte) {
+      return keys[i].key;
+    }
+  }
+  return TL_KEY_UNKN;
+}
+
+#define ITL_DECODER_FIND_KEY(keys, byte)                                       \
+  itl_decoder_find_key(keys, sizeof(keys) / sizeof((keys)[0]), byte)
+
+/* xterm encodes modifiers as 1 + bitmask of shift, alt and ctrl */
+ITL_DEF int
+itl_decoder_modifiers(size_t param)
+{
+  int mods = 0;
+
+  if (param < 2) {
+    return 0;
+  }
+  param -= 1;
+
+  if (param & 1) {
+    mods |= TL_MOD_SHIFT;
+  }
+  if (param & 2) {
+    mods |= TL_MOD_ALT;
+  }
+  if (param & 4) {
+    mods |= TL_MOD_CTRL;
+  }
+
+  return mods;
+}
+
+ITL_DEF void
+itl_decoder_csi_dispatch(itl_decoder_t *d, uint8_t byte)
+{
+  size_t first = d->params[0];
+  int key;
+
+  if (byte == '~') {
+    if (first == 200) {
+      d->state = ITL_DECODER_PASTE;
+      d->paste_matched = 0;
+      if (d->paste.data == NULL) {
+        itl_char_buf_init(&d->paste);
+      }
+      ITL_CHAR_BUF_CLEAR(&d->paste);
+      return;
+    }
+    key = (first < sizeof(itl_decoder_tilde_keys) / sizeof(int))
+              ? itl_decoder_tilde_keys[first]
+              : TL_KEY_UNKN;
+  } else if (byte == 'R' && d->param_count == 2) {
+    d->report_rows = d->params[0];
+    d->report_cols = d->params[1];
+    ITL_DECODER_EMIT_KEY(d, ITL_KEY_CURSOR_REPORT);
+    return;
+  } else {
+    key = ITL_DECODER_FIND_KEY(itl_decoder_final_keys, byte);
+  }
+
+  if (key != TL_KEY_UNKN && d->param_count > 1) {
+    key |= itl_decoder_modifiers(d->params[1]);
+  }
+
+  ITL_DECODER_EMIT_KEY(d, key);
+}
+
+/* Matches the terminator of a paste, everything else is pasted text */
+ITL_DEF void
+itl_decoder_paste(itl_decoder_t *d, uint8_t byte)
+{
+  itl_char_buf_t *cb = &d->paste;
+
+  if (byte == (uint8_t) ITL_PASTE_END[d->paste_matched]) {
+    d->paste_matched += 1;
+    if (d->paste_matched == ITL_PASTE_END_LEN) {
+      d->state = ITL_DECODER_GROUND;
+      ITL_DECODER_EMIT_KEY(d, TL_KEY_PASTE);
+    }
+    return;
+  }
+
+  /* Partial match of the terminator was text. Only its first byte is an
+     escape, so the match can only restart on escape. Text that does not fit
+     is discarded. */
+  if (cb->size + d->paste_matched + 1 <= ITL_PASTE_MAX_SIZE) {
+    while (cb->capacity < cb->size + d->paste_matched + 1) {
+      itl_char_buf_extend(cb);
+    }
+    memcpy(cb->data + cb->size, ITL_PASTE_END, d->paste_matched);
+    cb->size += d->paste_matched;
+    if (byte != '\x1b') {
+      cb->data[cb->size] = (char) byte;
+      cb->size += 1;
+    }
+  }
+
+  d->paste_matched = (byte == '\x1b') ? 1 : 0;
+}
+
+/* Finishes an unfinished sequence as is, e.g lone Esc becomes
+   `TL_KEY_ESCAPE`. */
+ITL_DEF void
+itl_decoder_flush(itl_decoder_t *d)
+{
+  switch (d->state) {
+  case ITL_DECODER_GROUND:
+  case ITL_DECODER_PASTE: return;
+
+  case ITL_DECODER_UTF8:
+    itl_decoder_emit(d, TL_KEY_CHAR, itl_replacement_character);
+    break;
+  case ITL_DECODER_ESC: ITL_DECODER_EMIT_KEY(d, TL_KEY_ESCAPE); break;
+
+  case ITL_DECODER_CSI:
+  case ITL_DECODER_SS3:
+  case ITL_DECODER_IGNORE:
+  case ITL_DECODER_WIN32: ITL_DECODER_EMIT_KEY(d, TL_KEY_UNKN); break;
+
+  default: ITL_UNREACHABLE();
+  }
+
+  d->state = ITL_DECODER_GROUND;
+}
+
+ITL_DEF void
+itl_decoder_feed(itl_decoder_t *d, uint8_t byte)
+{
+  const itl_transition_t *t;
+  ITL_DECODER_STATE previous_state = d->state;
+  size_t *param;
+  int key;
+
+  t = &itl_decoder_transitions[d->state][itl_decoder_classify(byte)];
+  d->state = (ITL_DECODER_STATE) t->state;
+
+  switch ((ITL_DECODER_ACTION) t->action) {
+  case ITL_ACTION_NONE: break;
+
+  case ITL_ACTION_PRINT:
+    itl_decoder_emit(d, TL_KEY_CHAR, itl_utf8_new(&byte, 1));
+    break;
+
+  case ITL_ACTION_CONTROL:
+    ITL_DECODER_EMIT_KEY(d, (byte == 0x7F) ? TL_KEY_BACKSPACE
+                                           : itl_decoder_control_keys[byte]);
+    break;
+
+  case ITL_ACTION_UTF8_LEAD:
+    d->ch.bytes[0] = byte;
+    d->ch.size = 1;
+    d->ch_width = itl_utf8_width(byte);
+    break;
+
+  case ITL_ACTION_UTF8_CONT:
+    /* Codepoints U+D800 to U+DFFF (known as UTF-16 surrogates) are
+       invalid. */
+    if (d->ch.size == 1 && ITL_UTF8_IS_SURROGATE(d->ch.bytes[0], byte)) {
+      d->state = ITL_DECODER_GROUND;
+      itl_decoder_emit(d, TL_KEY_CHAR, itl_replacement_character);
+      break;
+    }
+    d->ch.bytes[d->ch.size] = byte;
+    d->ch.size += 1;
+    if (d->ch.size == d->ch_width) {
+      d->state = ITL_DECODER_GROUND;
+      itl_decoder_emit(d, TL_KEY_CHAR, d->ch);
+    }
+    break;
+
+  case ITL_ACTION_INVALID:
+    itl_decoder_emit(d, TL_KEY_CHAR, itl_replacement_character);
+    break;
+
+  case ITL_ACTION_CLEAR:
+    memset(d->params, 0, sizeof(d->params));
+    d->param_count = 0;
+    break;
+
+  case ITL_ACTION_ALT:
+    key = ITL_DECODER_FIND_KEY(itl_decoder_alt_keys, byte);
+    if (key == TL_KEY_UNKN) {
+      itl_decoder_emit(d, TL_KEY_CHAR | TL_MOD_ALT, itl_utf8_new(&byte, 1));
+    } else {
+      ITL_DECODER_EMIT_KEY(d, key);
+    }
+    break;
+
+  case ITL_ACTION_PARAM:
+    if (d->param_count == 0) {
+      d->param_count = 1;
+    }
+    param = &d->params[d->param_count - 1];
+    if (*param <= ITL_DECODER_MAX_PARAM) {
+      *param = *param * 10 + (size_t) (byte - '0');
+    }
+    break;
+
+  case ITL_ACTION_NEXT_PARAM:
+    if (d->param_count == 0) {
+      d->param_count = 1;
+    }
+    if (d->param_count < ITL_DECODER_MAX_PARAMS) {
+      d->param_count += 1;
+    }
+    break;
+
+  case ITL_ACTION_CSI_DISPATCH: itl_decoder_csi_dispatch(d, byte); break;
+
+  case ITL_ACTION_SS3_DISPATCH:
+    key = ITL_DECODER_FIND_KEY(itl_decoder_final_keys, byte);
+    /* Modifier is the only parameter, e.g ESC O 5 C */
+    if (key != TL_KEY_UNKN && d->param_count > 0) {
+      key |= itl_decoder_modifiers(d->params[d->param_count - 1]);
+    }
+    ITL_DECODER_EMIT_KEY(d, key);
+    break;
+
+  case ITL_ACTION_WIN32_DISPATCH:
+    ITL_DECODER_EMIT_KEY(d, ITL_DECODER_FIND_KEY(itl_decoder_win32_keys, byte));
+    break;
+
+  case ITL_ACTION_UNKNOWN: ITL_DECODER_EMIT_KEY(d, TL_KEY_UNKN); break;
+
+  case ITL_ACTION_CANCEL:
+    /* Control bytes after Esc are Alt keys only when known, e.g Alt-Backspace
+       sends ESC DEL */
+    if (previous_state == ITL_DECODER_ESC &&
+        (key = ITL_DECODER_FIND_KEY(itl_decoder_alt_keys, byte)) != TL_KEY_UNKN)
+    {
+      ITL_DECODER_EMIT_KEY(d, key);
+      break;
+    }
+    /* Flush previous state, then process this byte from the ground. Ground
+       never cancels, so this recurses only once. */
+    d->state = previous_state;
+    itl_decoder_flush(d);
+    itl_decoder_feed(d, byte);
+    break;
+
+  case ITL_ACTION_PASTE: itl_decoder_paste(d, byte); break;
+
+  default: ITL_UNREACHABLE();
+  }
+}
+
+/* Waits until more input can be read, or `timeout` milliseconds pass. Waits
+   forever if `timeout` is below 0. */
+ITL_DEF bool
+itl_input_wait(int timeout)
+{
+  if (ITL_INPUT_BUF_PENDING(&itl_g_input_buf) > 0) {
+    return true;
+  }
+
+  return ITL_BACKEND_CALL(wait, timeout) != 0;
+}
+
+#if defined ITL_RENDER_COALESCING
+/* Whether more keys can be decoded right away */
+ITL_DEF bool
+itl_input_is_pending(void)
+{
+  return itl_g_decoder.event_count > 0 || itl_input_wait(0);
+}
+#endif /* ITL_RENDER_COALESCING */
+
+/* Reads bytes until a key is decoded. Unfinished sequences are flushed if
+   nothing arrives in `itl_g_esc_timeout` milliseconds. */
+ITL_DEF bool
+itl_read_key(itl_key_t *key)
+{
+  uint8_t byte;
+  itl_decoder_t *d = &itl_g_decoder;
+
+  while (!itl_decoder_pop(d, key)) {
+    if (ITL_DECODER_IS_WAITING(d) && itl_g_esc_timeout >= 0 &&
+        !itl_input_wait(itl_g_esc_timeout))
+    {
+      itl_decoder_flush(d);
+      continue;
+    }
+    ITL_TRY_READ_BYTE(&byte, return false);
+    itl_decoder_feed(d, byte);
+  }
+
+  return true;
+}
+
+/* Converts pasted bytes to characters. Line breaks and tabs become spaces, and
+   other control characters are dropped, so a paste can't submit the line.
+   Stops before `max_size` bytes would be exceeded. */
+ITL_DEF void
+itl_string_from_paste(itl_string_t *str, const char *data, size_t size,
+                      size_t max_size)
+{
+  size_t i, k;
+  uint8_t width, byte;
+  itl_utf8_t ch;
+
+  str->length = 0;
+  str->size = 0;
+  str->gap = 0;
+  str->gap_offset = 0;
+
+  for (k = 0; k < size; k += width) {
+    byte = (uint8_t) data[k];
+    width = 1;
+
+    if (byte == '\r' || byte == '\n' || byte == '\t') {
+      /* Treat CRLF as a single line break */
+      if (byte == '\n' && k > 0 && data[k - 1] == '\r') {
+        continue;
+      }
+      ch = itl_space;
+    } else if (byte < 0x80) {
+      if (iscntrl(byte)) {
+        continue;
+      }
+      ch = itl_utf8_new(&byte, 1);
+    } else {
+      width = itl_utf8_width(byte);
+      for (i = 1; i < width && k + i < size; ++i) {
+        if ((data[k + i] & 0xC0) != 0x80) {
+          break;
+        }
+      }
+      if (width == 0 || i != width ||
+          ITL_UTF8_IS_SURROGATE(byte, (uint8_t) data[k + 1]))
+      {
+        ch = itl_replacement_character;
+        width = 1;
+      } else {
+        ch = itl_utf8_new((const uint8_t *) data + k, width);
+      }
+    }
+
+    if (str->size + ch.size > max_size) {
+      break;
+    }
+    /* The gap stays at the end */
+    itl_string_reserve(str, str->size + ch.size);
+    memcpy(&str->data[str->size], ch.bytes, ch.size);
+    str->length += 1;
+    str->size += ch.size;
+    str->gap = str->length;
+    str->gap_offset = str->size;
+  }
+
+  ITL_STRING_RESET_HINT(str);
+}
+
+/* Inserts pasted text at cursor position with one string operation. Text that
+   does not fit into the output buffer is discarded. */
+ITL_DEF void
+itl_le_paste(itl_le_t *le, const char *data, size_t size)
+{
+  itl_string_t *pasted = itl_string_alloc();
+
+  TL_ASSERT(le->out_size > le->line->size);
+
+  itl_string_from_paste(pasted, data, size, le->out_size - le->line->size - 1);
+  itl_string_insert_string(le->line, le->cursor_position, pasted);
+  le->cursor_position += pasted->length;
+
+  ITL_STRING_FREE(pasted);
+}
+
+ITL_DEF ITL_THREAD_LOCAL itl_char_buf_t itl_g_char_buffer = ITL_ZERO_INIT;
+ITL_DEF ITL_THREAD_LOCAL bool itl_g_tty_is_dumb = true;
+
+/* *le, *rows, *cols can be NULL. */
+ITL_DEF bool
+itl_tty_get_size(ITL_MAYBE_UNUSED itl_le_t *le, size_t *rows, size_t *cols)
+{
+  size_t temp_rows, temp_cols;
+  char *emacs_buf = NULL;
+#if defined ITL_VT_SIZE
+  itl_key_t key;
+  itl_char_buf_t *b;
+#endif /* ITL_VT_SIZE */
+
+  /* Environment and escapes are only for the real terminal */
+  if (itl_g_backend != &itl_terminal_backend) {
+    return ITL_BACKEND_CALL(get_size, rows, cols) == TL_SUCCESS;
+  }
+
+  if (itl_g_tty_is_dumb) {
+    if ((emacs_buf = getenv("COLUMNS")) == NULL) {
+      itl_g_tty_is_dumb = false;
+      goto next;
+    }
+    itl_parse_size(emacs_buf, &temp_cols);
+    if ((emacs_buf = getenv("LINES")) == NULL) {
+      itl_g_tty_is_dumb = false;
+      goto next;
+    }
+    itl_parse_size(emacs_buf, &temp_rows);
+    if (temp_cols > 0 && temp_rows > 0) {
+      ITL_PTR_ASSIGN(rows, temp_rows);
+      ITL_PTR_ASSIGN(cols, temp_cols);
+      return true;
+    }
+  }
+
+next:
+#if defined ITL_VT_SIZE
+
+  b = &itl_g_char_buffer;
+  ITL_TTY_MOVE_FORWARD(b, 999);
+  ITL_TTY_STATUS_REPORT(b);
+  ITL_CHAR_BUF_DUMP(b);
+  ITL_CHAR_BUF_CLEAR(b);
+
+  /* There might be pasted input awaiting to be processed. Decode all keys
+     until the response, and insert characters. Don't process control
+     sequences if they got pasted. */
+  while (true) {
+    ITL_TRY(itl_read_key(&key), return false);
+    if (key.key == ITL_KEY_CURSOR_REPORT) {
+      break;
+    }
+    if (key.key == TL_KEY_CHAR && le != NULL) {
+      itl_le_insert(le, key.ch);
+    }
+  }
+
+  ITL_PTR_ASSIGN(rows, itl_g_decoder.report_rows);
+  ITL_PTR_ASSIGN(cols, itl_g_decoder.report_cols);
+
+  return true;
+#else /* ITL_VT_SIZE */
+  (void) le;
+  return ITL_BACKEND_CALL(get_size, rows, cols) == TL_SUCCESS;
+#endif
+}
+
+ITL_DEF ITL_THREAD_LOCAL bool itl_g_tty_should_refresh_text = true;
+
+/* Line editor's contents during previous refresh() call. */
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_le_prev_rows = 1;
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_le_prev_cursor_rows = 1;
+
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_le_prev_length = 0;
+
+/* $COLUMNS and $LINES, same as above. */
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_tty_prev_rows = 1;
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_tty_prev_cols = 1;
+
+/* Rows that were drawn below the line by the fuzzy finder. */
+ITL_DEF ITL_THREAD_LOCAL size_t itl_g_le_prev_list_rows = 0;
+
+ITL_DEF size_t
+itl_fuzzy_render(itl_char_buf_t *b, size_t rows, size_t cols);
+
+/* NOTE: Hottest function in the library. */
+ITL_DEF bool
+itl_le_tty_refresh(itl_le_t *le)
+{
+  size_t i, tty_rows, tty_cols;
+  size_t row_end, offset, row_offset;
+  size_t le_row_amount, dirty_lines, list_rows;
+  size_t le_cursor_column, le_cursor_rows;
+  size_t extra_rows_to_delete;
+
+  /* Write everything into a buffer, then dump it all at once */
+  itl_char_buf_t *b;
+
+  TL_ASSERT(le->line);
+  TL_ASSERT(le->line->data);
+  TL_ASSERT(le->line->size >= le->line->length);
+  TL_ASSERT(le->line->length <= ITL_STRING_MAX_LEN);
+
+  /* FIXME: Properly refresh on size change. */
+  extra_rows_to_delete = 0;
+
+  if (itl_g_tty_changed_size) {
+    ITL_TRY(itl_tty_get_size(le, &tty_rows, &tty_cols), {
+      /* Could not get terminal size? */
+      tty_rows = 24;
+      tty_cols = 80;
+    });
+  } else {
+    tty_rows = itl_g_tty_prev_rows;
+    tty_cols = itl_g_tty_prev_cols;
+  }
+
+  le_row_amount =
+      (le->line->length + le->prompt_size) / ITL_MAX(tty_cols, 1) + 1;
+
+  le_cursor_column =
+      (le->cursor_position + le->prompt_size) % ITL_MAX(tty_cols, 1) + 1;
+  le_cursor_rows =
+      (le->cursor_position + le->prompt_size) / ITL_MAX(tty_cols, 1) + 1;
+
+  ITL_TRACELN("sr: %d, er: %zu, wrow: %zu, prev: %zu, col: %zu, curp: %zu\n",
+              itl_g_tty_should_refresh_text, extra_rows_to_delete,
+              le_cursor_rows, itl_g_le_prev_rows, le_cursor_column,
+              le->cursor_position);
+
+  b = &itl_g_char_buffer;
+  ITL_TTY_HIDE_CURSOR(b);
+
+  /* FIXME: Fix refreshing artifacts after killing more than one line or
+   * resizing the terminal. */
+
+  if (itl_g_tty_should_refresh_text) {
+    /* Move appropriate amount of lines back, while clearing previous output
+     */
+    for (i = 0; i < itl_g_le_prev_rows + extra_rows_to_delete; ++i) {
+      ITL_TTY_CLEAR_WHOLE_LINE(b);
+      if (i < itl_g_le_prev_cursor_rows + extra_rows_to_delete - 1) {
+        ITL_TTY_MOVE_UP(b, 1);
+      }
+    }
+
+    if (le->prompt) {
+      itl_char_buf_append_cstr(b, le->prompt);
+    }
+
+    /* Print current contents of the line editor, one row at a time */
+    for (i = 0, offset = 0; i < le->line->length; i = row_end) {
+      row_end = le->line->length;
+      if (tty_cols > 0) {
+        row_end = ITL_MIN(row_end, ((le->prompt_size + i) / tty_cols + 1) *
+                                           tty_cols -
+                                       le->prompt_size);
+      }
+
+      row_offset = itl_string_offset(le->line, row_end);
+      itl_char_buf_append_string_bytes(b, le->line, offset, row_offset);
+      offset = row_offset;
+
+      /* If line is full, wrap */
+      if (tty_cols > 0 && (le->prompt_size + row_end) % tty_cols == 0) {
+        itl_char_buf_append_cstr(b, ITL_LF);
+      }
+    }
+
+    /* If current amount of lines is less than previous amount of lines,
+       then input was cleared by kill line or such. Clear each dirty line,
+       then go back up */
+    if (le_row_amount < itl_g_le_prev_rows) {
+      dirty_lines = itl_g_le_prev_rows - le_row_amount;
+      for (i = 0; i < dirty_lines; ++i) {
+        ITL_TTY_MOVE_DOWN(b, 1);
+        ITL_TTY_CLEAR_WHOLE_LINE(b);
+      }
+      ITL_TTY_MOVE_UP(b, dirty_lines);
+    } else {
+      /* Otherwise clear to the end of line */
+      ITL_TTY_CLEAR_TO_END(b);
+    }
+
+    /* Results of the fuzzy finder go below the line */
+    list_rows = itl_fuzzy_render(b, ITL_MAX(tty_rows, le_row_amount) -
+                                        le_row_amount,
+                                 tty_cols);
+    if (list_rows == 0 && itl_g_le_prev_list_rows > 0) {
+      ITL_TTY_CLEAR_BELOW(b);
+    }
+    itl_g_le_prev_list_rows = list_rows;
+
+    /* Move cursor to appropriate row and column. If row didn't change, stay
+       on the same line */
+    if (le_cursor_rows < le_row_amount) {
+      ITL_TTY_MOVE_UP(b, le_row_amount - le_cursor_rows);
+    }
+  } else {
+    if (le_cursor_rows < itl_g_le_prev_cursor_rows) {
+      ITL_TTY_MOVE_UP(b, itl_g_le_prev_cursor_rows - le_cursor_rows);
+    } else if (le_cursor_rows > itl_g_le_prev_cursor_rows) {
+      ITL_TTY_MOVE_DOWN(b, le_cursor_rows - itl_g_le_prev_cursor_rows);
+    }
+  }
+
+  ITL_TTY_MOVE_TO_COLUMN(b, le_cursor_column);
+
+  itl_g_le_prev_rows = le_row_amount;
+  itl_g_le_prev_cursor_rows = le_cursor_rows;
+  itl_g_le_prev_length = le->line->length + le->prompt_size;
+
+  itl_g_tty_prev_rows = tty_rows;
+  itl_g_tty_prev_cols = tty_cols;
+
+#if defined ITL_POSIX
+  itl_g_tty_changed_size = false;
+#else
+  /* Windows does not present anything useful and is a bad OS. */
+  itl_g_tty_changed_size = true;
+#endif
+  ITL_TTY_SHOW_CURSOR(b);
+
+  ITL_CHAR_BUF_DUMP(b);
+  ITL_CHAR_BUF_CLEAR(b);
+
+  return true;
+}
+
+ITL_DEF ITL_THREAD_LOCAL itl_le_t itl_g_le = ITL_ZERO_INIT;
+
+#if defined ITL_POSIX
+ITL_DEF void
+itl_handle_sigwinch(int signal_number)
+{
+  if (signal_number != SIGWINCH) {
+    return;
+  }
+  itl_g_tty_changed_size = true;
+  itl_g_tty_should_refresh_text = true;
+}
+#endif
+
+ITL_DEF ITL_THREAD_LOCAL int itl_g_last_control = TL_KEY_UNKN;
+
+TL_DEF int
+tl_last_control_sequence(void)
+{
+  return itl_g_last_control;
+}
+
+typedef struct itl_search itl_search_t;
+
+/* Incremental search through history. Matches are found from the newest
+   entry as they are needed, and kept. When the query grows, they are
+   narrowed down, and entries that were already passed are not searched
+   again. Once history runs out, matches are looked for in the archive. */
+struct itl_search
+{
+  bool is_active;
+  bool is_forward; /* Whether the last search was towards newer entries */
+  bool is_failed;  /* Whether the last search didn't find anything */
+
+  itl_char_buf_t query;
+  itl_char_buf_t prompt; /* Null-terminated, replaces the prompt */
+
+  /* What to bring back if search is cancelled */
+  itl_string_t line;
+  const char *saved_prompt;
+  size_t saved_prompt_size;
+
+  size_t *matches; /* Entry numbers, newest first */
+  size_t match_count;
+  size_t match_capacity;
+  itl_archived_t archived; /* Matches after the ones in history */
+  size_t selected;         /* Index of the shown match, among both */
+  size_t frontier;         /* Entries from this one on were searched */
+};
+
+ITL_DEF ITL_THREAD_LOCAL itl_search_t itl_g_search = ITL_ZERO_INIT;
+
+ITL_DEF void
+itl_search_free(void)
+{
+  if (itl_g_search.query.data == NULL) {
+    return;
+  }
+
+  ITL_FREE(itl_g_search.query.data);
+  ITL_FREE(itl_g_search.prompt.data);
+  ITL_FREE(itl_g_search.line.data);
+  if (itl_g_search.matches != NULL) {
+    ITL_FREE(itl_g_search.matches);
+  }
+  itl_archived_free(&itl_g_search.archived);
+  memset(&itl_g_search, 0, sizeof(itl_g_search));
+}
+
+/* Forgets matches, so that they are searched from the newest entry */
+ITL_DEF void
+itl_search_reset(void)
+{
+  itl_g_search.match_count = 0;
+  itl_g_search.selected = 0;
+  itl_g_search.frontier = itl_g_history.first + itl_g_history.length;
+  itl_archived_reset(&itl_g_search.archived);
+}
+
+#define ITL_SEARCH_MATCH_COUNT()                                               \
+  (itl_g_search.match_count + itl_g_search.archived.count)
+
+/* Returns text of match `i`, and puts its entry into `entry` */
+ITL_DEF const char *
+itl_search_match(size_t i, const itl_history_entry_t **entry)
+{
+  itl_search_t *s = &itl_g_search;
+
+  if (i < s->match_count) {
+    *entry = ITL_HISTORY_AT(s->matches[i]);
+    return ITL_HISTORY_TEXT(*entry);
+  }
+  *entry = &s->archived.lines[i - s->match_count];
+  return s->archived.text.data + (*entry)->offset;
+}
+
+/* Finds matches until there are more than `index`. Returns false if there
+   are not enough of them */
+ITL_DEF bool
+itl_search_fill(size_t index)
+{
+  itl_search_t *s = &itl_g_search;
+  size_t n;
+
+  while (s->match_count <= index && s->frontier > itl_g_history.first) {
+    n = itl_g_history_search(s->query.data, s->query.size, s->frontier);
+    if (n == ITL_HISTORY_NOT_SELECTED) {
+      s->frontier = itl_g_history.first;
+      break;
+    }
+
+    if (s->match_count == s->match_capacity) {
+      s->match_capacity = ITL_MAX(s->match_capacity * 2, 16);
+      s->matches = (size_t *) itl_realloc(s->matches,
+                                          s->match_capacity * sizeof(size_t));
+    }
+    s->matches[s->match_count] = n;
+    s->match_count += 1;
+    s->frontier = n;
+  }
+
+  /* The archive has only lines that are older than every entry */
+  while (ITL_SEARCH_MATCH_COUNT() <= index &&
+         itl_archived_fill(&s->archived, s->query.data, s->query.size, false))
+  {
+  }
+
+  return ITL_SEARCH_MATCH_COUNT() > index;
+}
+
+/* Keeps only matches that contain the query, which has grown */
+ITL_DEF void
+itl_search_narrow(void)
+{
+  itl_search_t *s = &itl_g_search;
+  const itl_history_entry_t *entry;
+  const char *text;
+  size_t i, count = 0, archived_count = 0, selected = 0;
+
+  for (i = 0; i < ITL_SEARCH_MATCH_COUNT(); ++i) {
+    text = itl_search_match(i, &entry);
+    if (itl_find_bytes(text, entry->size, s->query.data, s->query.size) !=
+        entry->size)
+    {
+      if (i < s->match_count) {
+        s->matches[count] = s->matches[i];
+        count += 1;
+      } else {
+        s->archived.lines[archived_count] = *entry;
+        archived_count += 1;
+      }
+    }
+    /* Stay at the shown match, or the next older one that is kept */
+    if (i + 1 == s->selected) {
+      selected = count + archived_count;
+    }
+  }
+
+  s->match_count = count;
+  s->archived.count = archived_count;
+  s->selected = selected;
+}
+
+/* Shows the selected match and the query instead of the prompt */
+ITL_DEF void
+itl_search_show(itl_le_t *le)
+{
+  itl_search_t *s = &itl_g_search;
+  const itl_history_entry_t *entry;
+  const char *text;
+  size_t offset;
+
+  if (s->query.size == 0) {
+    itl_string_copy(le->line, &s->line);
+    le->cursor_position = le->line->length;
+    s->is_failed = false;
+  } else if (!s->is_failed) {
+    text = itl_search_match(s->selected, &entry);
+    offset = itl_find_bytes(text, entry->size, s->query.data, s->query.size);
+
+    itl_string_assign(le->line, text, entry->size, entry->length);
+    le->cursor_position = itl_utf8_count(text, offset);
+  }
+
+  ITL_CHAR_BUF_CLEAR(&s->prompt);
+  if (s->is_failed) {
+    itl_char_buf_append_cstr(&s->prompt, "(failed ");
+  } else {
+    itl_char_buf_append_byte(&s->prompt, '(');
+  }
+  itl_char_buf_append_cstr(&s->prompt, s->is_forward ? "i-search)`"
+                                                     : "reverse-i-search)`");
+  itl_char_buf_append_bytes(&s->prompt, s->query.data, s->query.size);
+  itl_char_buf_append_cstr(&s->prompt, "': ");
+  itl_char_buf_append_byte(&s->prompt, '\0');
+
+  le->prompt = s->prompt.data;
+  le->prompt_size = itl_utf8_count(s->prompt.data, s->prompt.size - 1);
+}
+
+/* Selects the next match in the direction of search */
+ITL_DEF void
+itl_search_next(itl_le_t *le, bool is_forward)
+{
+  itl_search_t *s = &itl_g_search;
+  size_t target;
+
+  s->is_forward = is_forward;
+
+  if (s->query.size == 0) {
+    return;
+  }
+
+  if (is_forward) {
+    /* Newer matches were all found already */
+    target = ITL_MIN(s->selected, ITL_SEARCH_MATCH_COUNT());
+    s->is_failed = (target == 0);
+    if (!s->is_failed) {
+      s->selected = target - 1;
+    }
+  } else {
+    /* Search could have failed before reaching the selected match */
+    target = (s->selected < ITL_SEARCH_MATCH_COUNT()) ? s->selected + 1
+                                                      : s->selected;
+    s->is_failed = !itl_search_fill(target);
+    if (!s->is_failed) {
+      s->selected = target;
+    }
+  }
+
+  itl_search_show(le);
+}
+
+ITL_DEF void
+itl_search_begin(itl_le_t *le, bool is_forward)
+{
+  itl_search_t *s = &itl_g_search;
+
+  if (s->query.data == NULL) {
+    itl_char_buf_init(&s->query);
+    itl_char_buf_init(&s->prompt);
+    itl_string_init(&s->line);
+  }
+
+  /* Index is built for the first search */
+  if (itl_g_history.trigrams == NULL && itl_g_history.length > 0) {
+    itl_g_history_trigrams_build();
+  }
+
+  s->is_active = true;
+  s->is_forward = is_forward;
+  s->is_failed = false;
+  ITL_CHAR_BUF_CLEAR(&s->query);
+  itl_string_copy(&s->line, le->line);
+  s->saved_prompt = le->prompt;
+  s->saved_prompt_size = le->prompt_size;
+  itl_search_reset();
+
+  itl_search_show(le);
+}
+
+/* Leaves the shown match on the line, or brings back the line that was
+   there before search */
+ITL_DEF void
+itl_search_end(itl_le_t *le, bool keep_match)
+{
+  itl_search_t *s = &itl_g_search;
+
+  if (!keep_match) {
+    itl_string_copy(le->line, &s->line);
+    le->cursor_position = le->line->length;
+  }
+  le->prompt = s->saved_prompt;
+  le->prompt_size = s->saved_prompt_size;
+  s->is_active = false;
+}
+
+/* Returns false if search has ended, and the key should be handled as
+   usual */
+ITL_DEF bool
+itl_search_key(itl_le_t *le, const itl_key_t *key)
+{
+  itl_search_t *s = &itl_g_search;
+
+  itl_g_tty_should_refresh_text = true;
+
+  switch (key->key) {
+  case TL_KEY_CHAR: {
+    itl_char_buf_append_bytes(&s->query, (const char *) key->ch.bytes,
+                              key->ch.size);
+
+    if (s->query.size == key->ch.size) {
+      itl_search_reset();
+    } else {
+      itl_search_narrow();
+    }
+    s->is_failed = !itl_search_fill(s->selected);
+    itl_search_show(le);
+  } break;
+
+  case TL_KEY_BACKSPACE: {
+    /* Remove the last character */
+    while (s->query.size > 0) {
+      s->query.size -= 1;
+      if (!ITL_UTF8_IS_CONTINUATION((uint8_t) s->query.data[s->query.size])) {
+        break;
+      }
+    }
+    itl_search_reset();
+    s->is_failed = (s->query.size > 0 && !itl_search_fill(0));
+    itl_search_show(le);
+  } break;
+
+  case TL_KEY_SEARCH_BACKWARD: {
+    itl_search_next(le, false);
+  } break;
+  case TL_KEY_SEARCH_FORWARD: {
+    itl_search_next(le, true);
+  } break;
+
+  case TL_KEY_ESCAPE: {
+    itl_search_end(le, false);
+  } break;
+
+  default: {
+    itl_search_end(le, true);
+    return false;
+  }
+  }
+
+  return true;
+}
+
+typedef struct itl_prefix itl_prefix_t;
+
+/* Navigation through entries that start with the line that was typed.
+   Entries with the prefix are taken from ones sorted by text, and are given
+   out newest first by a heap. Entries that were shown are kept, so that Down
+   goes back through them. Once the heap is empty, lines are taken from the
+   archive. */
+struct itl_prefix
+{
+  bool is_active;
+
+  itl_char_buf_t prefix;
+
+  size_t *heap; /* Entry numbers that were not shown yet, the newest on top */
+  size_t heap_size;
+  size_t heap_capacity;
+
+  size_t *shown; /* Entry numbers, the first is the line that was typed */
+  size_t shown_count;
+  size_t shown_capacity;
+  size_t selected; /* Index of the shown entry */
+
+  itl_archived_t archived; /* Lines of the archive with the prefix */
+  size_t archived_next;    /* Index of the next one to show */
+};
+
+/* Shown entries with this bit are indexes of lines of the archive */
+#define ITL_PREFIX_ARCHIVED (((size_t) -1) ^ (((size_t) -1) >> 1))
+
+ITL_DEF ITL_THREAD_LOCAL itl_prefix_t itl_g_prefix = ITL_ZERO_INIT;
+
+ITL_DEF void
+itl_prefix_free(void)
+{
+  if (itl_g_prefix.prefix.data == NULL) {
+    return;
+  }
+
+  ITL_FREE(itl_g_prefix.prefix.data);
+  if (itl_g_prefix.heap != NULL) {
+    ITL_FREE(itl_g_prefix.heap);
+  }
+  ITL_FREE(itl_g_prefix.shown);
+  itl_archived_free(&itl_g_prefix.archived);
+  memset(&itl_g_prefix, 0, sizeof(itl_g_prefix));
+}
+
+/* Moves entry at `i` down the heap until both of its children are older */
+ITL_DEF void
+itl_prefix_sift_down(size_t i)
+{
+  size_t *heap = itl_g_prefix.heap;
+  size_t child, n = heap[i];
+
+  while ((child = i * 2 + 1) < itl_g_prefix.heap_size) {
+    if (child + 1 < itl_g_prefix.heap_size && heap[child + 1] > heap[child]) {
+      child += 1;
+    }
+    if (heap[child] <= n) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = n;
+}
+
+/* Whether the shown entry is still the one that was selected last */
+ITL_DEF bool
+itl_prefix_is_current(const itl_le_t *le)
+{
+  const itl_prefix_t *p = &itl_g_prefix;
+  const itl_history_entry_t *entry;
+  size_t n;
+
+  if (!p->is_active) {
+    return false;
+  }
+  n = p->shown[p->selected];
+  if (n & ITL_PREFIX_ARCHIVED) {
+    entry = &p->archived.lines[n & ~ITL_PREFIX_ARCHIVED];
+    return le->history_selected == ITL_HISTORY_NOT_SELECTED &&
+           itl_string_equal_bytes(le->line,
+                                  p->archived.text.data + entry->offset,
+                                  entry->size);
+  }
+  return le->history_selected == n && n >= itl_g_history.first &&
+         n <= ITL_HISTORY_LAST() && !ITL_HISTORY_IS_ERASED(n) &&
+         itl_g_history_equal(n, le->line);
+}
+
+/* Starts navigation by the typed line if there is one, and it's not an
+   entry that is being browsed. The line is kept as the newest entry */
+ITL_DEF bool
+itl_prefix_begin(itl_le_t *le)
+{
+  itl_prefix_t *p = &itl_g_prefix;
+  size_t i, low, high, n;
+
+  p->is_active = false;
+  if (le->line->size == 0 ||
+      (le->history_selected != ITL_HISTORY_NOT_SELECTED &&
+       (le->history_selected != ITL_HISTORY_LAST() ||
+        itl_g_history_equal(le->history_selected, le->line))))
+  {
+    return false;
+  }
+
+  /* The newest entry is replaced only if it's the line appended before */
+  if (le->appended_to_history) {
+    itl_g_history_replace_last(le->line);
+  } else {
+    le->appended_to_history = itl_g_history_append(le->line);
+  }
+  /* A line over the byte budget is not appended, and can't stand for the
+     newest entry */
+  if (itl_g_history.length == 0 ||
+      (!le->appended_to_history &&
+       !itl_g_history_equal(ITL_HISTORY_LAST(), le->line)))
+  {
+    return false;
+  }
+
+  if (p->prefix.data == NULL) {
+    itl_char_buf_init(&p->prefix);
+    p->shown_capacity = 16;
+    p->shown = (size_t *) itl_malloc(p->shown_capacity * sizeof(size_t));
+  }
+  ITL_CHAR_BUF_CLEAR(&p->prefix);
+  itl_char_buf_append_string_bytes(&p->prefix, le->line, 0, le->line->size);
+
+  itl_g_history_sorted_update();
+  low = itl_g_history_sorted_bound(p->prefix.data, p->prefix.size, false);
+  high = itl_g_history_sorted_bound(p->prefix.data, p->prefix.size, true);
+
+  if (high - low > p->heap_capacity) {
+    p->heap_capacity = ITL_MAX(high - low, p->heap_capacity * 2);
+    if (p->heap != NULL) {
+      ITL_FREE(p->heap);
+    }
+    p->heap = (size_t *) itl_malloc(p->heap_capacity * sizeof(size_t));
+  }
+  p->heap_size = 0;
+  for (i = low; i < high; ++i) {
+    n = itl_g_history.sorted[i] + itl_g_history.sorted_base;
+    if (n < ITL_HISTORY_LAST()) {
+      p->heap[p->heap_size] = n;
+      p->heap_size += 1;
+    }
+  }
+  for (i = p->heap_size / 2; i > 0; --i) {
+    itl_prefix_sift_down(i - 1);
+  }
+
+  itl_archived_reset(&p->archived);
+  p->archived_next = 0;
+
+  p->shown[0] = ITL_HISTORY_LAST();
+  p->shown_count = 1;
+  p->selected = 0;
+  p->is_active = true;
+  le->history_selected = ITL_HISTORY_LAST();
+
+  return true;
+}
+
+/* Replaces the line with shown entry `n` */
+ITL_DEF void
+itl_prefix_select(itl_le_t *le, size_t n)
+{
+  const itl_history_entry_t *entry;
+
+  if (!(n & ITL_PREFIX_ARCHIVED)) {
+    itl_g_history_select(le, n);
+    return;
+  }
+
+  /* Lines of the archive are not in history */
+  entry = &itl_g_prefix.archived.lines[n & ~ITL_PREFIX_ARCHIVED];
+  le->history_selected = ITL_HISTORY_NOT_SELECTED;
+  itl_le_clear_line(le);
+  itl_string_assign(le->line, itl_g_prefix.archived.text.data + entry->offset,
+                    entry->size, entry->length);
+  le->cursor_position = le->line->length;
+}
+
+/* Adds entry `n` to shown ones, and selects it */
+ITL_DEF void
+itl_prefix_show(itl_le_t *le, size_t n)
+{
+  itl_prefix_t *p = &itl_g_prefix;
+
+  if (p->shown_count == p->shown_capacity) {
+    p->shown_capacity *= 2;
+    p->shown =
+        (size_t *) itl_realloc(p->shown, p->shown_capacity * sizeof(size_t));
+  }
+  p->shown[p->shown_count] = n;
+  p->shown_count += 1;
+  p->selected += 1;
+  itl_prefix_select(le, n);
+}
+
+/* Selects the next older entry with the prefix, if there is one */
+ITL_DEF void
+itl_prefix_get_prev(itl_le_t *le)
+{
+  itl_prefix_t *p = &itl_g_prefix;
+  const itl_history_entry_t *entry;
+  size_t n;
+
+  if (p->selected + 1 < p->shown_count) {
+    p->selected += 1;
+    itl_prefix_select(le, p->shown[p->selected]);
+    return;
+  }
+
+  while (p->heap_size > 0) {
+    n = p->heap[0];
+    p->heap_size -= 1;
+    p->heap[0] = p->heap[p->heap_size];
+    itl_prefix_sift_down(0);
+
+    /* Entries could have been dropped, and copies of the shown line are
+       skipped */
+    if (n < itl_g_history.first || n >= p->shown[p->shown_count - 1] ||
+        ITL_HISTORY_IS_ERASED(n) ||
+        itl_g_history_compare_prefix(n, p->prefix.data, p->prefix.size) != 0 ||
+        itl_g_history_equal(n, le->line))
+    {
+      continue;
+    }
+
+    itl_prefix_show(le, n);
+    return;
+  }
+
+  /* History ran out, so lines are taken from the archive */
+  for (;;) {
+    if (p->archived_next == p->archived.count) {
+      if (!itl_archived_fill(&p->archived, p->prefix.data, p->prefix.size,
+                             true))
+      {
+        return;
+      }
+      continue;
+    }
+
+    n = p->archived_next;
+    p->archived_next += 1;
+
+    entry = &p->archived.lines[n];
+    if (!itl_string_equal_bytes(le->line,
+                                p->archived.text.data + entry->offset,
+                                entry->size))
+    {
+      itl_prefix_show(le, n | ITL_PREFIX_ARCHIVED);
+      return;
+    }
+  }
+}
+
+/* Selects the next newer entry that was shown */
+ITL_DEF void
+itl_prefix_get_next(itl_le_t *le)
+{
+  itl_prefix_t *p = &itl_g_prefix;
+
+  if (p->selected > 0) {
+    p->selected -= 1;
+    itl_prefix_select(le, p->shown[p->selected]);
+  }
+}
+
+#define ITL_FUZZY_RESULTS 10
+
+/* Scores of a fuzzy match */
+#define ITL_FUZZY_SCORE_MATCH       16
+#define ITL_FUZZY_SCORE_BOUNDARY    8 /* At the start of a word */
+#define ITL_FUZZY_SCORE_CONSECUTIVE 4 /* Right after the previous character */
+#define ITL_FUZZY_PENALTY_GAP_START 3
+#define ITL_FUZZY_PENALTY_GAP       1
+
+#define ITL_FUZZY_TO_UPPER(c) (((c) >= 'a' && (c) <= 'z') ? (c) - 32 : (c))
+#define ITL_FUZZY_TO_LOWER(c) (((c) >= 'A' && (c) <= 'Z') ? (c) + 32 : (c))
+#define ITL_FUZZY_IS_BOUNDARY(c)                                               \
+  ((c) < 0x80 && !isalnum(c))
+
+typedef struct itl_fuzzy_result itl_fuzzy_result_t;
+
+struct itl_fuzzy_result
+{
+  size_t n;
+  int score;
+};
+
+typedef struct itl_fuzzy itl_fuzzy_t;
+
+/* Fuzzy finder through history. Every entry that has characters of the
+   query in order is scored, and the best ones are kept by a heap and listed
+   below the line. When the query grows, only entries that matched are
+   scored again. */
+struct itl_fuzzy
+{
+  bool is_active;
+
+  itl_char_buf_t query;
+  itl_char_buf_t prompt; /* Null-terminated, replaces the prompt */
+
+  /* What to bring back if nothing is picked */
+  itl_string_t line;
+  const char *saved_prompt;
+  size_t saved_prompt_size;
+
+  size_t *candidates; /* Entries that matched the query, newest first */
+  size_t candidate_count;
+  size_t candidate_capacity;
+  bool has_candidates; /* Whether they are kept for the current query */
+
+  itl_fuzzy_result_t results[ITL_FUZZY_RESULTS]; /* The best first */
+  size_t result_count;
+  size_t match_count;
+  size_t selected; /* Index of the picked result */
+};
+
+ITL_DEF ITL_THREAD_LOCAL itl_fuzzy_t itl_g_fuzzy = ITL_ZERO_INIT;
+
+ITL_DEF void
+itl_fuzzy_free(void)
+{
+  if (itl_g_fuzzy.query.data == NULL) {
+    return;
+  }
+
+  ITL_FREE(itl_g_fuzzy.query.data);
+  ITL_FREE(itl_g_fuzzy.prompt.data);
+  ITL_FREE(itl_g_fuzzy.line.data);
+  if (itl_g_fuzzy.candidates != NULL) {
+    ITL_FREE(itl_g_fuzzy.candidates);
+  }
+  memset(&itl_g_fuzzy, 0, sizeof(itl_g_fuzzy));
+}
+
+/* Returns offset of the first byte that is `a` or `b`, or `size` */
+ITL_DEF size_t
+itl_find_either_byte(const char *data, size_t size, char a, char b)
+{
+  size_t i = 0;
+  while (i < size && data[i] != a && data[i] != b) {
+    i += 1;
+  }
+  return i;
+}
+
+/* Whether character of `width` bytes at the start of `query` is at offset
+   `i` of `text`. Single bytes are compared by their lower case */
+ITL_DEF bool
+itl_fuzzy_char_is_at(const char *text, size_t size, size_t i,
+                     const char *query, size_t width, bool ignore_case)
+{
+  if (i + width > size) {
+    return false;
+  }
+  if (width == 1 && ignore_case) {
+    return ITL_FUZZY_TO_LOWER(text[i]) == query[0];
+  }
+  return memcmp(text + i, query, width) == 0;
+}
+
+ITL_DEF size_t
+itl_fuzzy_char_width(const char *query, size_t offset)
+{
+  return ITL_MAX(itl_utf8_width((uint8_t) query[offset]), 1);
+}
+
+/* Scores how well characters of `query` match `text` in order. Returns false
+   if they don't. If `ignore_case` is true, `query` should be in lower case */
+ITL_DEF bool
+itl_fuzzy_score(const char *text, size_t size, const char *query,
+                size_t query_size, bool ignore_case, int *score)
+{
+  size_t i = 0, k, j, width, previous_end = 0, gap;
+  char c;
+
+  /* Find where the earliest match ends, looking for first bytes of
+     characters */
+  for (k = 0; k < query_size; k += width) {
+    width = itl_fuzzy_char_width(query, k);
+    c = query[k];
+    while (true) {
+      i += itl_find_either_byte(text + i, size - i, c,
+                                ignore_case ? ITL_FUZZY_TO_UPPER(c) : c);
+      if (i == size) {
+        return false;
+      }
+      if (itl_fuzzy_char_is_at(text, size, i, query + k, width, ignore_case)) {
+        break;
+      }
+      i += 1;
+    }
+    i += width;
+  }
+
+  /* Walk back to where the shortest match that ends there starts */
+  for (k = query_size; k > 0; k = j) {
+    j = k - 1;
+    while (j > 0 && ITL_UTF8_IS_CONTINUATION((uint8_t) query[j])) {
+      j -= 1;
+    }
+    i -= k - j;
+    while (!itl_fuzzy_char_is_at(text, size, i, query + j, k - j,
+                                 ignore_case))
+    {
+      i -= 1;
+    }
+  }
+
+  /* Score the match from there */
+  *score = 0;
+  for (k = 0; k < query_size; k += width) {
+    width = itl_fuzzy_char_width(query, k);
+    while (!itl_fuzzy_char_is_at(text, size, i, query + k, width,
+                                 ignore_case))
+    {
+      i += 1;
+    }
+
+    *score += ITL_FUZZY_SCORE_MATCH;
+    if (i == 0 || ITL_FUZZY_IS_BOUNDARY((uint8_t) text[i - 1])) {
+      *score += ITL_FUZZY_SCORE_BOUNDARY;
+    }
+    if (k > 0) {
+      if (i == previous_end) {
+        *score += ITL_FUZZY_SCORE_CONSECUTIVE;
+      } else {
+        gap = ITL_MIN(i - previous_end, 64);
+        *score -= ITL_FUZZY_PENALTY_GAP_START +
+                  (int) (gap - 1) * ITL_FUZZY_PENALTY_GAP;
+      }
+    }
+    previous_end = i + width;
+    i += width;
+  }
+
+  return true;
+}
+
+/* Whether `a` should be listed after `b` */
+ITL_DEF bool
+itl_fuzzy_result_is_worse(const itl_fuzzy_result_t *a,
+                          const itl_fuzzy_result_t *b)
+{
+  return a->score < b->score || (a->score == b->score && a->n < b->n);
+}
+
+/* Keeps entry number `n` if it's among the best, and its text is not
+   there already. Results are a heap with the worst one on top */
+ITL_DEF void
+itl_fuzzy_keep(size_t n, int score)
+{
+  itl_fuzzy_t *f = &itl_g_fuzzy;
+  itl_fuzzy_result_t result, temp;
+  const itl_history_entry_t *entry = ITL_HISTORY_AT(n);
+  size_t i, child;
+
+  result.n = n;
+  result.score = score;
+
+  if (f->result_count == ITL_FUZZY_RESULTS &&
+      !itl_fuzzy_result_is_worse(&f->results[0], &result))
+  {
+    return;
+  }
+
+  /* Entries come newest first, so a kept copy is at least as good */
+  for (i = 0; i < f->result_count; ++i) {
+    if (ITL_HISTORY_AT(f->results[i].n)->size == entry->size &&
+        memcmp(ITL_HISTORY_TEXT(ITL_HISTORY_AT(f->results[i].n)),
+               ITL_HISTORY_TEXT(entry), entry->size) == 0)
+    {
+      return;
+    }
+  }
+
+  if (f->result_count < ITL_FUZZY_RESULTS) {
+    i = f->result_count;
+    f->result_count += 1;
+    while (i > 0 &&
+           itl_fuzzy_result_is_worse(&result, &f->results[(i - 1) / 2]))
+    {
+      f->results[i] = f->results[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    f->results[i] = result;
+    return;
+  }
+
+  i = 0;
+  while ((child = i * 2 + 1) < f->result_count) {
+    if (child + 1 < f->result_count &&
+        itl_fuzzy_result_is_worse(&f->results[child + 1], &f->results[child]))
+    {
+      child += 1;
+    }
+    if (!itl_fuzzy_result_is_worse(&f->results[child], &result)) {
+      break;
+    }
+    temp = f->results[child];
+    f->results[i] = temp;
+    i = child;
+  }
+  f->results[i] = result;
+}
+
+/* Scores entries for the query. If `narrow` is true, only entries that
+   matched the shorter query are scored */
+ITL_DEF void
+itl_fuzzy_update(bool narrow)
+{
+  itl_fuzzy_t *f = &itl_g_fuzzy;
+  const itl_history_entry_t *entry;
+  itl_fuzzy_result_t temp;
+  size_t i, k, n, count = 0;
+  bool ignore_case = true;
+  int score;
+
+  for (i = 0; i < f->query.size; ++i) {
+    if (f->query.data[i] >= 'A' && f->query.data[i] <= 'Z') {
+      ignore_case = false;
+    }
+  }
+
+  f->result_count = 0;
+  f->match_count = 0;
+  f->selected = 0;
+
+  if (!narrow || !f->has_candidates) {
+    f->candidate_count = 0;
+    for (n = itl_g_history.first + itl_g_history.length;
+         n > itl_g_history.first; --n)
+    {
+      if (ITL_HISTORY_IS_ERASED(n - 1)) {
+        continue;
+      }
+      entry = ITL_HISTORY_AT(n - 1);
+      if (!itl_fuzzy_score(ITL_HISTORY_TEXT(entry), entry->size,
+                           f->query.data, f->query.size, ignore_case, &score))
+      {
+        continue;
+      }
+
+      f->match_count += 1;
+      itl_fuzzy_keep(n - 1, score);
+
+      /* Every entry matches an empty query */
+      if (f->query.size == 0) {
+        continue;
+      }
+      if (f->candidate_count == f->candidate_capacity) {
+        f->candidate_capacity = ITL_MAX(f->candidate_capacity * 2, 64);
+        f->candidates = (size_t *) itl_realloc(
+            f->candidates, f->candidate_capacity * sizeof(size_t));
+      }
+      f->candidates[f->candidate_count] = n - 1;
+      f->candidate_count += 1;
+    }
+  } else {
+    for (i = 0; i < f->candidate_count; ++i) {
+      n = f->candidates[i];
+      if (n < itl_g_history.first || n > ITL_HISTORY_LAST() ||
+          ITL_HISTORY_IS_ERASED(n))
+      {
+        continue;
+      }
+      entry = ITL_HISTORY_AT(n);
+      if (itl_fuzzy_score(ITL_HISTORY_TEXT(entry), entry->size,
+                          f->query.data, f->query.size, ignore_case, &score))
+      {
+        f->match_count += 1;
+        itl_fuzzy_keep(n, score);
+        f->candidates[count] = n;
+        count += 1;
+      }
+    }
+    f->candidate_count = count;
+  }
+  f->has_candidates = (f->query.size > 0);
+
+  /* Put the best first */
+  for (i = 1; i < f->result_count; ++i) {
+    temp = f->results[i];
+    for (k = i; k > 0 && itl_fuzzy_result_is_worse(&f->results[k - 1], &temp);
+         --k)
+    {
+      f->results[k] = f->results[k - 1];
+    }
+    f->results[k] = temp;
+  }
+}
+
+/* Shows the query instead of the prompt */
+ITL_DEF void
+itl_fuzzy_show(itl_le_t *le)
+{
+  itl_fuzzy_t *f = &itl_g_fuzzy;
+
+  ITL_CHAR_BUF_CLEAR(&f->prompt);
+  itl_char_buf_append_cstr(&f->prompt, "> ");
+  itl_char_buf_append_bytes(&f->prompt, f->query.data, f->query.size);
+  itl_char_buf_append_byte(&f->prompt, '\0');
+
+  le->prompt = f->prompt.data;
+  le->prompt_size = itl_utf8_count(f->prompt.data, f->prompt.size - 1);
+  itl_g_tty_should_refresh_text = true;
+}
+
+/* Draws the number of matches and the best ones in at most `rows` rows
+   below the line, and goes back. Returns N of drawn rows */
+ITL_DEF size_t
+itl_fuzzy_render(itl_char_buf_t *b, size_t rows, size_t cols)
+{
+  itl_fuzzy_t *f = &itl_g_fuzzy;
+  const itl_history_entry_t *entry;
+  const char *text;
+  size_t row, i, chars;
+  uint8_t c;
+
+  if (!f->is_active) {
+    return 0;
+  }
+
+  rows = ITL_MIN(rows, f->result_count + 1);
+  for (row = 0; row < rows; ++row) {
+    itl_char_buf_append_cstr(b, ITL_LF);
+    ITL_TTY_CLEAR_WHOLE_LINE(b);
+
+    if (row == 0) {
+      itl_char_buf_append_cstr(b, "  ");
+      itl_char_buf_append_size_t(b, f->match_count);
+      itl_char_buf_append_byte(b, '/');
+      itl_char_buf_append_size_t(b,
+                                 itl_g_history.length - itl_g_history.erased);
+      continue;
+    }
+
+    itl_char_buf_append_cstr(b, (row - 1 == f->selected) ? "> " : "  ");
+
+    /* Cut to the width, without breaking characters or the layout */
+    entry = ITL_HISTORY_AT(f->results[row - 1].n);
+    text = ITL_HISTORY_TEXT(entry);
+    for (i = 0, chars = 0; i < entry->size; ++i) {
+      c = (uint8_t) text[i];
+      if (!ITL_UTF8_IS_CONTINUATION(c)) {
+        if (chars + 3 >= cols) {
+          break;
+        }
+        chars += 1;
+      }
+      itl_char_buf_append_byte(b, (c < 0x20 || c == 0x7F) ? ' ' : c);
+    }
+  }
+
+  ITL_TTY_CLEAR_BELOW(b);
+  if (rows > 0) {
+    ITL_TTY_MOVE_UP(b, rows);
+  }
+
+  return rows;
+}
+
+ITL_DEF void
+itl_fuzzy_begin(itl_le_t *le)
+{
+  itl_fuzzy_t *f = &itl_g_fuzzy;
+
+  if (f->query.data == NULL) {
+    itl_char_buf_init(&f->query);
+    itl_char_buf_init(&f->prompt);
+    itl_string_init(&f->line);
+  }
+
+  f->is_active = true;
+  ITL_CHAR_BUF_CLEAR(&f->query);
+  itl_string_copy(&f->line, le->line);
+  f->saved_prompt = le->prompt;
+  f->saved_prompt_size = le->prompt_size;
+  itl_le_clear_line(le);
+
+  itl_fuzzy_update(false);
+  itl_fuzzy_show(le);
+}
+
+/* Puts the picked entry on the line, or brings back the line */
+ITL_DEF void
+itl_fuzzy_end(itl_le_t *le, bool pick)
+{
+  itl_fuzzy_t *f = &itl_g_fuzzy;
+  const itl_history_entry_t *entry;
+
+  if (pick && f->result_count > 0) {
+    entry = ITL_HISTORY_AT(f->results[f->selected].n);
+    itl_string_assign(le->line, ITL_HISTORY_TEXT(entry), entry->size,
+                      entry->length);
+  } else {
+    itl_string_copy(le->line, &f->line);
+  }
+  le->cursor_position = le->line->length;
+  le->prompt = f->saved_prompt;
+  le->prompt_size = f->saved_prompt_size;
+  f->is_active = false;
+  itl_g_tty_should_refresh_text = true;
+}
+
+/* Handles a key while the fuzzy finder is open. Returns false if the key
+   should be handled as usual */
+ITL_DEF bool
+itl_fuzzy_key(itl_le_t *le, const itl_key_t *key)
+{
+  itl_fuzzy_t *f = &itl_g_fuzzy;
+
+  switch (key->key) {
+  case TL_KEY_CHAR: {
+    itl_char_buf_append_bytes(&f->query, (const char *) key->ch.bytes,
+                              key->ch.size);
+    itl_fuzzy_update(true);
+    itl_fuzzy_show(le);
+  } break;
+
+  case TL_KEY_BACKSPACE: {
+    /* Remove the last character */
+    while (f->query.size > 0) {
+      f->query.size -= 1;
+      if (!ITL_UTF8_IS_CONTINUATION((uint8_t) f->query.data[f->query.size])) {
+        break;
+      }
+    }
+    itl_fuzzy_update(false);
+    itl_fuzzy_show(le);
+  } break;
+
+  case TL_KEY_UP: {
+    if (f->selected > 0) {
+      f->selected -= 1;
+    }
+    itl_g_tty_should_refresh_text = true;
+  } break;
+  case TL_KEY_DOWN:
+  case TL_KEY_FUZZY_FIND: {
+    if (f->selected + 1 < f->result_count) {
+      f->selected += 1;
+    }
+    itl_g_tty_should_refresh_text = true;
+  } break;
 
-#if defined ITL_POSIX
-  itl_g_tty_changed_size = false;
-#else
-  /* Windows does not present anything useful and is a bad OS. */
-  itl_g_tty_changed_size = true;
-#endif
-  ITL_TTY_SHOW_CURSOR(b);
+  case TL_KEY_ENTER:
+  case TL_KEY_TAB: {
+    itl_fuzzy_end(le, true);
+  } break;
 
-  ITL_CHAR_BUF_DUMP(b);
-  ITL_CHAR_BUF_CLEAR(b);
+  case TL_KEY_ESCAPE: {
+    itl_fuzzy_end(le, false);
+  } break;
+
+  default: {
+    /* The list is cleared before the key could end input */
+    itl_fuzzy_end(le, false);
+    itl_le_tty_refresh(le);
+    return false;
+  }
+  }
 
   return true;
 }
 
-ITL_DEF ITL_THREAD_LOCAL itl_le_t itl_g_le = ITL_ZERO_INIT;
+ITL_DEF TL_STATUS_CODE
+itl_le_key_handle(itl_le_t *le, int esc);
 
-#if defined ITL_POSIX
-ITL_DEF void
-itl_handle_sigwinch(int signal_number)
+/* Inserts a character or handles a control sequence. Returns `TL_SUCCESS`
+   while the line is still being edited. */
+ITL_DEF TL_STATUS_CODE
+itl_le_key_apply(itl_le_t *le, const itl_key_t *key)
 {
-  if (signal_number != SIGWINCH) {
-    return;
+  if (itl_g_search.is_active && itl_search_key(le, key)) {
+    return TL_SUCCESS;
+  }
+  if (itl_g_fuzzy.is_active && itl_fuzzy_key(le, key)) {
+    return TL_SUCCESS;
   }
-  itl_g_tty_changed_size = true;
-  itl_g_tty_should_refresh_text = true;
-}
-#endif
 
-ITL_DEF ITL_THREAD_LOCAL int itl_g_last_control = TL_KEY_UNKN;
+  if (key->key != TL_KEY_CHAR) {
+    return itl_le_key_handle(le, key->key);
+  }
 
-TL_DEF int
-tl_last_control_sequence(void)
-{
-  return itl_g_last_control;
+  itl_le_insert(le, key->ch);
+  itl_g_tty_should_refresh_text = true;
+
+  return TL_SUCCESS;
 }
 
 ITL_DEF TL_STATUS_CODE
@@ -2225,6 +8038,17 @@ itl_le_key_handle(itl_le_t *le, int esc)
   /* Refresh text by default, avoid if we are only moving the cursor. */
   itl_g_tty_should_refresh_text = true;
 
+#if defined ITL_SHARED_HISTORY
+  /* Lines of other processes are picked up before history is browsed */
+  if (itl_g_shared.is_active &&
+      le->history_selected == ITL_HISTORY_NOT_SELECTED &&
+      !le->appended_to_history && !itl_g_search.is_active &&
+      !itl_g_fuzzy.is_active)
+  {
+    itl_shared_pick_up();
+  }
+#endif /* ITL_SHARED_HISTORY */
+
   switch (esc & TL_MASK_KEY) {
   case TL_KEY_TAB: {
     ITL_TRY(itl_string_to_cstr(le->line, le->out_buf, le->out_size) ==
@@ -2236,21 +8060,26 @@ itl_le_key_handle(itl_le_t *le, int esc)
   case TL_KEY_UP: {
     itl_string_t *prev_line;
 
-    if (!le->appended_to_history) {
+    if (itl_prefix_is_current(le) ||
+        (itl_g_history_prefix_navigation && itl_prefix_begin(le)))
+    {
+      itl_prefix_get_prev(le);
+    } else if (!le->appended_to_history &&
+               le->history_selected == ITL_HISTORY_NOT_SELECTED)
+    {
       prev_line = itl_string_alloc();
       itl_string_copy(prev_line, le->line);
       itl_g_history_get_prev(le);
       /* Avoid appending same strings or empty strings */
       if (!itl_string_equal(le->line, prev_line) && prev_line->length > 0) {
-        itl_g_history_append(prev_line);
+        le->appended_to_history = itl_g_history_append(prev_line);
       }
       ITL_STRING_FREE(prev_line);
-      le->appended_to_history = true;
-    } else if (itl_g_history_last != NULL &&
-               itl_g_history_last == le->history_selected_item)
+    } else if (le->appended_to_history && itl_g_history.length > 0 &&
+               le->history_selected == ITL_HISTORY_LAST())
     {
       /* If some string was already appended, just update it */
-      itl_string_copy(itl_g_history_last->str, le->line);
+      itl_g_history_replace_last(le->line);
       itl_g_history_get_prev(le);
     } else {
       itl_g_history_get_prev(le);
@@ -2258,7 +8087,22 @@ itl_le_key_handle(itl_le_t *le, int esc)
   } break;
 
   case TL_KEY_DOWN: {
-    itl_g_history_get_next(le);
+    if (itl_prefix_is_current(le)) {
+      itl_prefix_get_next(le);
+    } else {
+      itl_g_history_get_next(le);
+    }
+  } break;
+
+  case TL_KEY_SEARCH_BACKWARD: {
+    itl_search_begin(le, false);
+  } break;
+  case TL_KEY_SEARCH_FORWARD: {
+    itl_search_begin(le, true);
+  } break;
+
+  case TL_KEY_FUZZY_FIND: {
+    itl_fuzzy_begin(le);
   } break;
 
   case TL_KEY_RIGHT: {
@@ -2311,6 +8155,10 @@ itl_le_key_handle(itl_le_t *le, int esc)
                 TL_SUCCESS,
             return TL_ERROR_SIZE);
     itl_g_history_append(le->line);
+    itl_history_file_append(le->line);
+#if defined ITL_SHARED_HISTORY
+    itl_shared_append(le->line);
+#endif /* ITL_SHARED_HISTORY */
     return TL_PRESSED_ENTER;
   } break;
 
@@ -2383,19 +8231,29 @@ itl_le_key_handle(itl_le_t *le, int esc)
   } break;
 
   case TL_KEY_HISTORY_END: {
-    size_t i;
-    for (i = 0; i < itl_g_history_length; ++i) {
-      itl_g_history_get_next(le);
+    /* While browsing, the newest entry is the line that was being edited */
+    if (itl_g_history.length > 0) {
+      if (le->history_selected != ITL_HISTORY_NOT_SELECTED &&
+          ITL_HISTORY_LAST() > itl_g_history.first)
+      {
+        itl_g_history_select(le, ITL_HISTORY_LAST() - 1);
+      } else {
+        itl_g_history_select(le, ITL_HISTORY_LAST());
+      }
     }
-    itl_g_history_get_prev(le);
   } break;
 
   case TL_KEY_HISTORY_BEGINNING: {
-    size_t i;
-    for (i = 0; i < itl_g_history_length; ++i) {
-      itl_g_history_get_prev(le);
+    if (itl_g_history.length > 0) {
+      itl_g_history_select(le, itl_g_history.first);
     }
   } break;
+
+  case TL_KEY_PASTE: {
+    itl_decoder_t *d = &itl_g_decoder;
+    itl_le_paste(le, d->paste.data, d->paste.size);
+    ITL_CHAR_BUF_CLEAR(&d->paste);
+  } break;
   }
 
   return TL_SUCCESS;
@@ -2404,9 +8262,7 @@ itl_le_key_handle(itl_le_t *le, int esc)
 TL_DEF TL_STATUS_CODE
 tl_init(void)
 {
-  TL_ASSERT(!(TL_HISTORY_MAX_SIZE & (TL_HISTORY_MAX_SIZE - 1)) &&
-            "History size must be a power of 2");
-  TL_ASSERT(TL_HISTORY_MAX_SIZE >= 0 && "History size must be positive");
+  TL_ASSERT(TL_HISTORY_MAX_SIZE > 0 && "History size must be positive");
 
   if (itl_g_is_active) {
     return TL_SUCCESS;
@@ -2417,7 +8273,6 @@ tl_init(void)
 #endif
 
   if (!itl_g_entered_raw_mode) {
-    ITL_TRY(ITL_TTY_IS_TTY(), return TL_ERROR);
     ITL_TRY(tl_enter_raw_mode() == TL_SUCCESS, return TL_ERROR);
   }
 
@@ -2429,14 +8284,35 @@ tl_init(void)
   return TL_SUCCESS;
 }
 
+/* Set by tl_begin_input() while a line is read in the background. */
+ITL_DEF ITL_THREAD_LOCAL tl_line_callback itl_g_on_line = NULL;
+/* Allocated on first use, since lines may be large. */
+ITL_DEF ITL_THREAD_LOCAL char *itl_g_on_line_buffer = NULL;
+
 TL_DEF TL_STATUS_CODE
 tl_exit(void)
 {
   TL_ASSERT(itl_g_is_active && "tl_init() should be called");
 
+  itl_history_file_close();
+#if defined ITL_SHARED_HISTORY
+  itl_shared_close();
+#endif /* ITL_SHARED_HISTORY */
+  itl_history_archive_close();
   itl_g_history_free();
-  ITL_FREE(itl_g_line_buffer.chars);
+  itl_search_free();
+  itl_prefix_free();
+  itl_fuzzy_free();
+  ITL_FREE(itl_g_line_buffer.data);
   ITL_FREE(itl_g_char_buffer.data);
+  if (itl_g_decoder.paste.data != NULL) {
+    ITL_FREE(itl_g_decoder.paste.data);
+    itl_g_decoder.paste.data = NULL;
+  }
+  if (itl_g_on_line_buffer != NULL) {
+    ITL_FREE(itl_g_on_line_buffer);
+    itl_g_on_line_buffer = NULL;
+  }
 
   ITL_TRACELN("Exited, alloc count: %zu\n", itl_g_alloc_count);
   TL_ASSERT(itl_g_alloc_count == 0);
@@ -2450,12 +8326,37 @@ tl_exit(void)
   return TL_SUCCESS;
 }
 
+ITL_DEF void
+itl_le_begin(itl_le_t *le, char *buffer, size_t buffer_size,
+             const char *prompt)
+{
+  itl_le_init(le, &itl_g_line_buffer, buffer, buffer_size, prompt);
+  itl_g_search.is_active = false;
+  itl_g_prefix.is_active = false;
+  itl_g_fuzzy.is_active = false;
+
+#if defined ITL_SHARED_HISTORY
+  if (itl_g_shared.is_active) {
+    itl_shared_pick_up();
+  }
+#endif /* ITL_SHARED_HISTORY */
+
+  /* Avoid clearing lines that don't belong to us. */
+  itl_g_le_prev_rows = 1;
+  itl_g_le_prev_cursor_rows = 1;
+  itl_le_tty_refresh(le);
+}
+
 TL_DEF TL_STATUS_CODE
 tl_get_input(char *buffer, size_t buffer_size, const char *prompt)
 {
   itl_le_t *le = &itl_g_le;
+  itl_key_t key;
+#if defined TL_SEE_BYTES
   uint8_t input_byte;
-  int input_type;
+#endif /* TL_SEE_BYTES */
+  /* Whether something changed since the last drawn frame */
+  bool frame_is_skipped = false, text_is_dirty = false;
 
   TL_STATUS_CODE code;
 
@@ -2468,24 +8369,14 @@ tl_get_input(char *buffer, size_t buffer_size, const char *prompt)
       "Size should be less than platform's allowed maximum string length");
   TL_ASSERT(buffer != NULL);
 
-  itl_le_init(le, &itl_g_line_buffer, buffer, buffer_size, prompt);
+  TL_ASSERT(itl_g_on_line == NULL &&
+            "tl_get_input() can't be used while tl_begin_input() is reading");
 
-  /* Avoid clearing lines that don't belong to us. */
-  itl_g_le_prev_rows = 1;
-  itl_g_le_prev_cursor_rows = 1;
-  itl_le_tty_refresh(le);
+  itl_le_begin(le, buffer, buffer_size, prompt);
 
   while (true) {
-    ITL_TRY_READ_BYTE(&input_byte, return TL_ERROR);
-
-#if defined ITL_POSIX
-    /* A refresh may be pending due to SIGWINCH. */
-    if (itl_g_tty_changed_size) {
-      itl_le_tty_refresh(le);
-    }
-#endif /* ITL_POSIX */
-
 #if defined TL_SEE_BYTES
+    ITL_TRY_READ_BYTE(&input_byte, return TL_ERROR);
     if (input_byte == 3) return -69; /* ctrl c */
     if (iscntrl((char) input_byte) || input_byte > 127) {
       printf("cntrl seq -> ");
@@ -2497,26 +8388,196 @@ tl_get_input(char *buffer, size_t buffer_size, const char *prompt)
     continue;
 #endif /* TL_SEE_BYTES */
 
-    input_type = itl_esc_parse(input_byte);
-    if (input_type != TL_KEY_CHAR) {
-      code = itl_le_key_handle(le, input_type);
-      if (code != TL_SUCCESS) {
-        itl_le_clear_line(le);
-        return code;
+    ITL_TRY(itl_read_key(&key), return TL_ERROR);
+
+#if defined ITL_POSIX
+    /* A refresh may be pending due to SIGWINCH. */
+    if (itl_g_tty_changed_size) {
+      itl_le_tty_refresh(le);
+    }
+#endif /* ITL_POSIX */
+
+    code = itl_le_key_apply(le, &key);
+    if (code != TL_SUCCESS) {
+      /* Draw the frames that were skipped */
+      if (frame_is_skipped) {
+        itl_g_tty_should_refresh_text = text_is_dirty;
+        itl_le_tty_refresh(le);
       }
-    } else {
-      itl_le_insert(le, itl_utf8_parse(input_byte));
-      itl_g_tty_should_refresh_text = true;
+      itl_le_clear_line(le);
+      return code;
     }
 
     ITL_TRACELN("strlen: %zu, hist: %zu\n", le->line->length,
-                (size_t) le->history_selected_item);
+                le->history_selected);
+
+    text_is_dirty = text_is_dirty || itl_g_tty_should_refresh_text;
+#if defined ITL_RENDER_COALESCING
+    if (itl_input_is_pending()) {
+      frame_is_skipped = true;
+      continue;
+    }
+#endif /* ITL_RENDER_COALESCING */
+    itl_g_tty_should_refresh_text = text_is_dirty;
     itl_le_tty_refresh(le);
+    frame_is_skipped = false;
+    text_is_dirty = false;
   }
 
   ITL_UNREACHABLE();
 }
 
+/* Decodes buffered input into the line started by tl_begin_input(), until
+   either runs out. Unfinished sequences are flushed when `flush` is set and
+   there is nothing else to decode. The line is redrawn once at the end. */
+ITL_DEF void
+itl_on_line_dispatch(bool flush)
+{
+  itl_le_t *le = &itl_g_le;
+  itl_decoder_t *d = &itl_g_decoder;
+  itl_key_t key;
+  uint8_t byte = 0;
+  tl_line_callback on_line;
+  bool frame_is_skipped = false, text_is_dirty = false;
+
+  TL_STATUS_CODE code;
+
+#if defined ITL_POSIX
+  /* A refresh may be pending due to SIGWINCH. */
+  if (itl_g_on_line != NULL && itl_g_tty_changed_size) {
+    itl_le_tty_refresh(le);
+  }
+#endif /* ITL_POSIX */
+
+  while (itl_g_on_line != NULL) {
+    if (!itl_decoder_pop(d, &key)) {
+      if (itl_input_buf_pop(&itl_g_input_buf, &byte)) {
+        itl_decoder_feed(d, byte);
+      } else if (flush && ITL_DECODER_IS_WAITING(d)) {
+        itl_decoder_flush(d);
+      } else {
+        break;
+      }
+      continue;
+    }
+
+    code = itl_le_key_apply(le, &key);
+    text_is_dirty = text_is_dirty || itl_g_tty_should_refresh_text;
+    frame_is_skipped = true;
+
+    if (code != TL_SUCCESS) {
+      itl_g_tty_should_refresh_text = text_is_dirty;
+      itl_le_tty_refresh(le);
+      itl_le_clear_line(le);
+      frame_is_skipped = false;
+      text_is_dirty = false;
+
+      /* Callback is free to begin the next line */
+      on_line = itl_g_on_line;
+      itl_g_on_line = NULL;
+      on_line(code, itl_g_on_line_buffer);
+    }
+  }
+
+  if (frame_is_skipped) {
+    itl_g_tty_should_refresh_text = text_is_dirty;
+    itl_le_tty_refresh(le);
+  }
+}
+
+TL_DEF void
+tl_begin_input(const char *prompt, tl_line_callback on_line)
+{
+  TL_ASSERT(itl_g_is_active && "tl_init() should be called");
+  TL_ASSERT(on_line != NULL);
+
+  if (itl_g_on_line_buffer == NULL) {
+    itl_g_on_line_buffer = (char *) itl_malloc(ITL_STRING_MAX_LEN);
+  }
+
+  itl_g_on_line = on_line;
+  itl_g_on_line_buffer[0] = '\0';
+  itl_le_begin(&itl_g_le, itl_g_on_line_buffer, ITL_STRING_MAX_LEN, prompt);
+}
+
+TL_DEF void
+tl_end_input(void)
+{
+  if (itl_g_on_line != NULL) {
+    itl_le_clear_line(&itl_g_le);
+    itl_g_on_line = NULL;
+  }
+}
+
+TL_DEF TL_STATUS_CODE
+tl_on_readable(void)
+{
+  itl_input_buf_t *ib = &itl_g_input_buf;
+
+  /* Never block, even if woken up for nothing */
+  if (ITL_INPUT_BUF_PENDING(ib) == 0 && itl_input_wait(0)) {
+    ITL_TRY(itl_input_buf_fill(ib) > 0, {
+      tl_end_input();
+      return TL_ERROR;
+    });
+  }
+
+  itl_on_line_dispatch(false);
+
+  return TL_SUCCESS;
+}
+
+TL_DEF TL_STATUS_CODE
+tl_feed_bytes(const char *bytes, size_t size)
+{
+  size_t pushed;
+
+  TL_ASSERT(bytes != NULL || size == 0);
+
+  while (size > 0) {
+    pushed = itl_input_buf_push(&itl_g_input_buf, (const uint8_t *) bytes,
+                                size);
+    /* No line is read, and there is no more space to save the rest */
+    ITL_TRY(pushed > 0, return TL_ERROR_SIZE);
+    bytes += pushed;
+    size -= pushed;
+
+    itl_on_line_dispatch(false);
+  }
+
+  return TL_SUCCESS;
+}
+
+TL_DEF int
+tl_input_timeout(void)
+{
+  if (itl_g_on_line == NULL) {
+    return -1;
+  }
+  if (itl_g_decoder.event_count > 0 ||
+      ITL_INPUT_BUF_PENDING(&itl_g_input_buf) > 0)
+  {
+    return 0;
+  }
+  if (ITL_DECODER_IS_WAITING(&itl_g_decoder)) {
+    return itl_g_esc_timeout;
+  }
+
+  return -1;
+}
+
+TL_DEF void
+tl_on_timeout(void)
+{
+  itl_on_line_dispatch(true);
+}
+
+TL_DEF int
+tl_input_fd(void)
+{
+  return (itl_g_backend == &itl_terminal_backend) ? STDIN_FILENO : -1;
+}
+
 TL_DEF void
 tl_set_predefined_input(const char *str)
 {
@@ -2529,8 +8590,7 @@ TL_DEF TL_STATUS_CODE
 tl_get_character(char *char_buffer, size_t char_buffer_size, const char *prompt)
 {
   itl_le_t *le = &itl_g_le;
-  uint8_t input_byte = 0;
-  int input_type = TL_KEY_UNKN;
+  itl_key_t key;
 
   TL_ASSERT(itl_g_is_active && "tl_init() should be called");
   TL_ASSERT(
@@ -2549,15 +8609,14 @@ tl_get_character(char *char_buffer, size_t char_buffer_size, const char *prompt)
   }
 
   itl_le_tty_refresh(le);
-  ITL_TRY_READ_BYTE(&input_byte, return TL_ERROR);
+  ITL_TRY(itl_read_key(&key), return TL_ERROR);
 
-  input_type = itl_esc_parse(input_byte);
-  if (input_type != TL_KEY_CHAR) {
-    itl_g_last_control = input_type;
+  if (key.key != TL_KEY_CHAR) {
+    itl_g_last_control = key.key;
     return TL_PRESSED_CONTROL_SEQUENCE;
   }
 
-  itl_le_insert(le, itl_utf8_parse(input_byte));
+  itl_le_insert(le, key.ch);
   itl_g_tty_should_refresh_text = true;
   itl_le_tty_refresh(le);
   ITL_TRY(itl_string_to_cstr(le->line, char_buffer, char_buffer_size) ==
@@ -2568,10 +8627,111 @@ tl_get_character(char *char_buffer, size_t char_buffer_size, const char *prompt)
   return TL_SUCCESS;
 }
 
+TL_DEF void
+tl_set_escape_timeout(int milliseconds)
+{
+  itl_g_esc_timeout = milliseconds;
+}
+
 TL_DEF TL_STATUS_CODE
 tl_history_load(const char *file_path)
 {
-  return itl_history_load_from_file(file_path);
+  TL_STATUS_CODE ret;
+
+  /* Lines that don't fit stay in the file, so they are not archived */
+  itl_g_history_archive.is_paused = true;
+  ret = itl_history_load_from_file(file_path);
+  itl_g_history_archive.is_paused = false;
+
+  return ret;
+}
+
+TL_DEF size_t
+tl_history_length(void)
+{
+  return itl_g_history.length - itl_g_history.erased;
+}
+
+TL_DEF TL_STATUS_CODE
+tl_history_get(size_t index, char *buffer, size_t buffer_size)
+{
+  const itl_history_entry_t *entry;
+  const char *text;
+  size_t size;
+
+  TL_ASSERT(buffer != NULL && buffer_size > 0);
+
+  if (index >= tl_history_length()) {
+    buffer[0] = '\0';
+    return TL_ERROR;
+  }
+
+  entry = ITL_HISTORY_AT(itl_g_history_number(index));
+  text = ITL_HISTORY_TEXT(entry);
+  size = entry->size;
+
+  /* Cut the line on a character boundary if it doesn't fit */
+  if (size >= buffer_size) {
+    size = buffer_size - 1;
+    while (size > 0 && ITL_UTF8_IS_CONTINUATION((uint8_t) text[size])) {
+      size -= 1;
+    }
+  }
+
+  memcpy(buffer, text, size);
+  buffer[size] = '\0';
+
+  if (size != entry->size) {
+    return TL_ERROR_SIZE;
+  }
+
+  return TL_SUCCESS;
+}
+
+TL_DEF TL_STATUS_CODE
+tl_history_set_limits(size_t max_entries, size_t max_bytes)
+{
+  if (max_entries == 0) {
+    return TL_ERROR;
+  }
+
+  itl_g_history_set_limits(max_entries, max_bytes);
+
+  return TL_SUCCESS;
+}
+
+TL_DEF void
+tl_history_set_erase_duplicates(int erase_duplicates)
+{
+  itl_g_history_erase_duplicates = (erase_duplicates != 0);
+  if (itl_g_history_erase_duplicates) {
+    itl_g_history_erase_all_duplicates();
+  }
+}
+
+TL_DEF void
+tl_history_set_prefix_navigation(int prefix_navigation)
+{
+  itl_g_history_prefix_navigation = (prefix_navigation != 0);
+}
+
+TL_DEF void
+tl_history_set_compact(int compact)
+{
+  if ((compact != 0) == itl_g_history_is_compact) {
+    return;
+  }
+
+  if (itl_g_history.entries != NULL) {
+    itl_g_history_pack();
+    itl_g_history_is_compact = (compact != 0);
+    itl_g_history_rewrite(!itl_g_history_is_compact);
+    /* The limit on bytes counts them in the new format, which can take
+       more of them */
+    itl_g_history_set_limits(itl_g_history_max_entries,
+                             itl_g_history_max_bytes);
+  }
+  itl_g_history_is_compact = (compact != 0);
 }
 
 TL_DEF TL_STATUS_CODE
@@ -2580,30 +8740,50 @@ tl_history_dump(const char *file_path)
   return itl_history_dump_to_file(file_path);
 }
 
+TL_DEF TL_STATUS_CODE
+tl_history_open(const char *file_path)
+{
+  return itl_history_file_open(file_path);
+}
+
+TL_DEF void
+tl_history_set_sync(size_t lines)
+{
+  itl_g_history_sync_lines = lines;
+}
+
+TL_DEF TL_STATUS_CODE
+tl_history_share(const char *file_path)
+{
+#if defined ITL_SHARED_HISTORY
+  return itl_shared_open(file_path);
+#else  /* ITL_SHARED_HISTORY */
+  (void) file_path;
+  errno = ENOSYS;
+  return TL_ERROR;
+#endif /* ITL_SHARED_HISTORY */
+}
+
+TL_DEF TL_STATUS_CODE
+tl_history_archive(const char *file_path)
+{
+  return itl_history_archive_open(file_path);
+}
+
 TL_DEF size_t
 tl_utf8_strlen(const char *utf8_str)
 {
-  size_t len = 0;
-  while (*utf8_str != '\0') {
-    if ((*utf8_str & 0xC0) != 0x80) {
-      len += 1;
-    }
-    utf8_str += 1;
-  }
-  return len;
+  return itl_utf8_count(utf8_str, strlen(utf8_str));
 }
 
 TL_DEF size_t
 tl_utf8_strnlen(const char *utf8_str, size_t byte_count)
 {
-  size_t len = 0;
-  while (*utf8_str != '\0' && byte_count-- > 0) {
-    if ((*utf8_str & 0xC0) != 0x80) {
-      len += 1;
-    }
-    utf8_str += 1;
+  const char *end = (const char *) memchr(utf8_str, '\0', byte_count);
+  if (end != NULL) {
+    byte_count = (size_t) (end - utf8_str);
   }
-  return len;
+  return itl_utf8_count(utf8_str, byte_count);
 }
 
 TL_DEF TL_STATUS_CODE
@@ -2614,10 +8794,11 @@ tl_emit_newlines(const char *char_buffer)
   ITL_TRY(itl_tty_get_size(NULL, NULL, &cols), return TL_ERROR);
 
   newlines_to_emit =
-      (tl_utf8_strlen(char_buffer) / cols + 1) - itl_g_le_prev_cursor_rows + 1;
+      (tl_utf8_strlen(char_buffer) / ITL_MAX(cols, 1) + 1) -
+      itl_g_le_prev_cursor_rows + 1;
 
   for (i = 0; i < newlines_to_emit; ++i) {
-    ITL_TRY(ITL_WRITE(ITL_STDOUT, "\n", 1) != -1, return TL_ERROR);
+    ITL_TRY(ITL_TTY_WRITE("\n", 1) != -1, return TL_ERROR);
   }
 
   return TL_SUCCESS;
@@ -2626,10 +8807,10 @@ tl_emit_newlines(const char *char_buffer)
 TL_DEF TL_STATUS_CODE
 tl_set_title(const char *title)
 {
-  if (ITL_ISATTY(ITL_STDOUT)) {
-    ITL_TRY(ITL_WRITE(ITL_STDOUT, "\x1b]0;", 4) != -1, return TL_ERROR);
-    ITL_TRY(ITL_WRITE(ITL_STDOUT, title, strlen(title)) != -1, return TL_ERROR);
-    ITL_TRY(ITL_WRITE(ITL_STDOUT, "\x07", 1) != -1, return TL_ERROR);
+  if (itl_g_backend != &itl_terminal_backend || ITL_ISATTY(ITL_STDOUT)) {
+    ITL_TRY(ITL_TTY_WRITE("\x1b]0;", 4) != -1, return TL_ERROR);
+    ITL_TRY(ITL_TTY_WRITE(title, strlen(title)) != -1, return TL_ERROR);
+    ITL_TRY(ITL_TTY_WRITE("\x07", 1) != -1, return TL_ERROR);
     return TL_SUCCESS;
   }
   return TL_ERROR;
@@ -2647,7 +8828,6 @@ tl_set_title(const char *title)
 
 /*
  * TODO (not soon):
- *  - History search.
  *  - Replace macros with enums.
  *  - Support multiple lines simultaneously.
  *  - Use Windows' console API instead of terminal sequences on Windows.